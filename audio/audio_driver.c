@@ -41,6 +41,7 @@
 #include "../retroarch.h"
 #include "../runloop.h"
 #include "../performance_counters.h"
+#include "../performance_trace.h"
 #include "../verbosity.h"
 #include "../list_special.h"
 
@@ -557,9 +558,11 @@ static bool audio_driver_flush(const int16_t *data, size_t samples)
       dsp_data.input_frames          = samples >> 1;
 
       performance_counter_init(audio_dsp, "audio_dsp");
+      performance_trace_begin("audio_dsp");
       performance_counter_start_plus(is_perfcnt_enable, audio_dsp);
       retro_dsp_filter_process(audio_driver_dsp, &dsp_data);
       performance_counter_stop_plus(is_perfcnt_enable, audio_dsp);
+      performance_trace_end("audio_dsp");
 
       if (dsp_data.output)
       {
@@ -604,10 +607,12 @@ static bool audio_driver_flush(const int16_t *data, size_t samples)
       src_data.ratio *= settings->slowmotion_ratio;
 
    performance_counter_init(resampler_proc, "resampler_proc");
+   performance_trace_begin("audio_resampler");
    performance_counter_start_plus(is_perfcnt_enable, resampler_proc);
 
    audio_driver_resampler->process(audio_driver_resampler_data, &src_data);
    performance_counter_stop_plus(is_perfcnt_enable, resampler_proc);
+   performance_trace_end("audio_resampler");
 
    output_data   = audio_driver_output_samples_buf;
    output_frames = src_data.output_frames;
@@ -626,13 +631,16 @@ static bool audio_driver_flush(const int16_t *data, size_t samples)
       output_size = sizeof(int16_t);
    }
 
+   performance_trace_begin("audio_write");
    if (current_audio->write(audio_driver_context_audio_data,
             output_data, output_frames * output_size * 2,
             is_perfcnt_enable) < 0)
    {
+      performance_trace_end("audio_write");
       audio_driver_active = false;
       return false;
    }
+   performance_trace_end("audio_write");
 
    return true;
 }
@@ -652,8 +660,10 @@ void audio_driver_sample(int16_t left, int16_t right)
    if (audio_driver_data_ptr < audio_driver_chunk_size)
       return;
 
+   performance_trace_begin("audio_flush");
    audio_driver_flush(audio_driver_output_samples_conv_buf, 
          audio_driver_data_ptr);
+   performance_trace_end("audio_flush");
 
    audio_driver_data_ptr = 0;
 }
@@ -673,7 +683,9 @@ size_t audio_driver_sample_batch(const int16_t *data, size_t frames)
    if (frames > (AUDIO_CHUNK_SIZE_NONBLOCKING >> 1))
       frames = AUDIO_CHUNK_SIZE_NONBLOCKING >> 1;
 
+   performance_trace_begin("audio_flush");
    audio_driver_flush(data, frames << 1);
+   performance_trace_end("audio_flush");
 
    return frames;
 }
@@ -1003,9 +1015,11 @@ bool audio_driver_alive(void)
 void audio_driver_frame_is_reverse(void)
 {
    /* We just rewound. Flush rewind audio buffer. */
+   performance_trace_begin("audio_flush");
    audio_driver_flush(
          audio_driver_rewind_buf + audio_driver_rewind_ptr,
          audio_driver_rewind_size - audio_driver_rewind_ptr);
+   performance_trace_end("audio_flush");
 }
 
 void audio_driver_destroy_data(void)
@@ -0,0 +1,310 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2017 - The RetroArch team
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include <compat/strl.h>
+#include <features/features_cpu.h>
+#include <retro_miscellaneous.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "benchmark.h"
+
+#include "configuration.h"
+#include "core.h"
+#include "paths.h"
+#include "performance_counters.h"
+#include "runloop.h"
+#include "verbosity.h"
+
+typedef struct benchmark
+{
+   bool enabled;
+   char path[PATH_MAX_LENGTH];
+
+   retro_time_t start;
+   retro_time_t first_frame;
+   retro_time_t last_frame;
+
+   /* Time between one frame and the next */
+   retro_time_t *frame_times;
+   unsigned frame_times_count;
+   unsigned frame_times_capacity;
+   unsigned frames;
+} benchmark_t;
+
+static benchmark_t benchmark;
+
+void benchmark_init(const char *path)
+{
+   benchmark_deinit();
+
+   strlcpy(benchmark.path, path, sizeof(benchmark.path));
+   benchmark.start   = cpu_features_get_time_usec();
+   benchmark.enabled = true;
+}
+
+bool benchmark_is_enabled(void)
+{
+   return benchmark.enabled;
+}
+
+void benchmark_override_settings(void)
+{
+   settings_t *settings = config_get_ptr();
+
+   if (!benchmark.enabled)
+      return;
+
+   strlcpy(settings->video.driver, "null", sizeof(settings->video.driver));
+   strlcpy(settings->audio.driver, "null", sizeof(settings->audio.driver));
+   strlcpy(settings->input.driver, "null", sizeof(settings->input.driver));
+
+   /* Run as fast as the core can go. */
+   settings->fastforward_ratio         = 0.0f;
+   settings->frame_limiter_precise     = false;
+   settings->video.vsync               = false;
+   settings->video.threaded            = false;
+   settings->video.frame_delay         = 0;
+   settings->video.frame_delay_auto    = false;
+   settings->audio.sync                = false;
+   settings->pause_nonactive           = false;
+
+   /* Keep runs comparable, and leave the user's files alone. */
+   settings->auto_overrides_enable     = false;
+   settings->config_save_on_exit       = false;
+   settings->history_list_enable       = false;
+
+   runloop_ctl(RUNLOOP_CTL_SET_PERFCNT_ENABLE, NULL);
+}
+
+void benchmark_frame(void)
+{
+   retro_time_t now;
+
+   if (!benchmark.enabled)
+      return;
+
+   now = cpu_features_get_time_usec();
+
+   if (!benchmark.frames++)
+      benchmark.first_frame = now;
+   else
+   {
+      if (benchmark.frame_times_count == benchmark.frame_times_capacity)
+      {
+         unsigned capacity     = benchmark.frame_times_capacity
+            ? benchmark.frame_times_capacity * 2 : 4096;
+         retro_time_t *times   = (retro_time_t*)realloc(
+               benchmark.frame_times, capacity * sizeof(*times));
+
+         if (!times)
+            return;
+
+         benchmark.frame_times          = times;
+         benchmark.frame_times_capacity = capacity;
+      }
+
+      benchmark.frame_times[benchmark.frame_times_count++] =
+         now - benchmark.last_frame;
+   }
+
+   benchmark.last_frame = now;
+}
+
+static int benchmark_time_compare(const void *a, const void *b)
+{
+   retro_time_t x = *(const retro_time_t*)a;
+   retro_time_t y = *(const retro_time_t*)b;
+
+   return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted times. */
+static retro_time_t benchmark_percentile(const retro_time_t *times,
+      unsigned count, unsigned percent)
+{
+   unsigned rank;
+
+   if (!count)
+      return 0;
+
+   rank = (count * percent + 99) / 100;
+   return times[rank ? rank - 1 : 0];
+}
+
+static long benchmark_peak_rss_kb(void)
+{
+#if !defined(_WIN32)
+   struct rusage usage;
+
+   if (getrusage(RUSAGE_SELF, &usage) == 0)
+   {
+#if defined(__APPLE__)
+      return (long)(usage.ru_maxrss / 1024);
+#else
+      return (long)usage.ru_maxrss;
+#endif
+   }
+#endif
+   return -1;
+}
+
+static void benchmark_write_string(FILE *file, const char *str)
+{
+   fputc('"', file);
+
+   for (; str && *str; str++)
+   {
+      unsigned char c = (unsigned char)*str;
+
+      if (c == '"' || c == '\\')
+         fprintf(file, "\\%c", c);
+      else if (c < 0x20)
+         fprintf(file, "\\u%04x", c);
+      else
+         fputc(c, file);
+   }
+
+   fputc('"', file);
+}
+
+static void benchmark_write_counters(FILE *file, const char *name,
+      struct retro_perf_counter **counters, unsigned count)
+{
+   unsigned i;
+   bool first = true;
+
+   fprintf(file, "  \"%s\": [", name);
+
+   for (i = 0; i < count; i++)
+   {
+      if (!counters[i] || !counters[i]->call_cnt)
+         continue;
+
+      fprintf(file, "%s\n    {\"ident\": ", first ? "" : ",");
+      benchmark_write_string(file, counters[i]->ident);
+      fprintf(file, ", \"calls\": %llu, \"total_ticks\": %llu, "
+            "\"avg_ticks\": %llu}",
+            (unsigned long long)counters[i]->call_cnt,
+            (unsigned long long)counters[i]->total,
+            (unsigned long long)(counters[i]->total / counters[i]->call_cnt));
+      first = false;
+   }
+
+   fprintf(file, "%s]", first ? "" : "\n  ");
+}
+
+bool benchmark_report(void)
+{
+   double fps                  = 0.0;
+   double frame_time_avg       = 0.0;
+   retro_time_t run_time       = 0;
+   retro_time_t *sorted        = NULL;
+   unsigned count              = benchmark.frame_times_count;
+   rarch_system_info_t *system = NULL;
+   FILE *file                  = NULL;
+
+   if (!benchmark.enabled)
+      return false;
+
+   if (!benchmark.frames)
+   {
+      RARCH_ERR("[Benchmark]: No frames were run, not writing a report.\n");
+      return false;
+   }
+
+   file = fopen(benchmark.path, "w");
+   if (!file)
+   {
+      RARCH_ERR("[Benchmark]: Failed to open \"%s\" for writing.\n",
+            benchmark.path);
+      return false;
+   }
+
+   if (count)
+   {
+      sorted = (retro_time_t*)malloc(count * sizeof(*sorted));
+      if (sorted)
+      {
+         memcpy(sorted, benchmark.frame_times, count * sizeof(*sorted));
+         qsort(sorted, count, sizeof(*sorted), benchmark_time_compare);
+      }
+
+      run_time       = benchmark.last_frame - benchmark.first_frame;
+      frame_time_avg = (double)run_time / count;
+      if (run_time > 0)
+         fps         = count * 1000000.0 / run_time;
+   }
+
+   runloop_ctl(RUNLOOP_CTL_SYSTEM_INFO_GET, &system);
+
+   fputs("{\n  \"core\": ", file);
+   benchmark_write_string(file, system ? system->info.library_name : NULL);
+   fputs(",\n  \"core_version\": ", file);
+   benchmark_write_string(file, system ? system->info.library_version : NULL);
+   fputs(",\n  \"content\": ", file);
+   benchmark_write_string(file, path_get(RARCH_PATH_CONTENT));
+   fprintf(file, ",\n  \"frames\": %u,\n", benchmark.frames);
+   fprintf(file, "  \"run_time_usec\": %lld,\n", (long long)run_time);
+   fprintf(file, "  \"fps\": %.3f,\n", fps);
+   fprintf(file, "  \"time_to_first_frame_usec\": %lld,\n",
+         (long long)(benchmark.first_frame - benchmark.start));
+   fprintf(file, "  \"frame_time_usec\": {\"avg\": %.1f, \"min\": %lld, "
+         "\"p50\": %lld, \"p95\": %lld, \"p99\": %lld, \"max\": %lld},\n",
+         frame_time_avg,
+         (long long)(sorted ? sorted[0] : 0),
+         (long long)benchmark_percentile(sorted, sorted ? count : 0, 50),
+         (long long)benchmark_percentile(sorted, sorted ? count : 0, 95),
+         (long long)benchmark_percentile(sorted, sorted ? count : 0, 99),
+         (long long)(sorted ? sorted[count - 1] : 0));
+   fprintf(file, "  \"peak_rss_kb\": %ld,\n", benchmark_peak_rss_kb());
+
+   benchmark_write_counters(file, "frontend_counters",
+         retro_get_perf_counter_rarch(), retro_get_perf_count_rarch());
+   fputs(",\n", file);
+   benchmark_write_counters(file, "core_counters",
+         retro_get_perf_counter_libretro(), retro_get_perf_count_libretro());
+   fputs("\n}\n", file);
+
+   fclose(file);
+
+   RARCH_LOG("[Benchmark]: %u frames at %.2f fps, frame time p50/p95/p99: "
+         "%lld/%lld/%lld usec.\n",
+         benchmark.frames, fps,
+         (long long)benchmark_percentile(sorted, sorted ? count : 0, 50),
+         (long long)benchmark_percentile(sorted, sorted ? count : 0, 95),
+         (long long)benchmark_percentile(sorted, sorted ? count : 0, 99));
+   RARCH_LOG("[Benchmark]: Wrote report to \"%s\".\n", benchmark.path);
+
+   free(sorted);
+   return true;
+}
+
+void benchmark_deinit(void)
+{
+   free(benchmark.frame_times);
+   memset(&benchmark, 0, sizeof(benchmark));
+}
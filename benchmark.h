@@ -0,0 +1,67 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2017 - The RetroArch team
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RARCH_BENCHMARK_H
+#define __RARCH_BENCHMARK_H
+
+#include <boolean.h>
+#include <retro_common_api.h>
+
+RETRO_BEGIN_DECLS
+
+/* Frames to run when --max-frames isn't given. */
+#define BENCHMARK_DEFAULT_FRAMES 3600
+
+/**
+ * benchmark_init:
+ * @path               : where to write the report.
+ *
+ * Starts benchmark mode. Time to first frame counts from here.
+ **/
+void benchmark_init(const char *path);
+
+bool benchmark_is_enabled(void);
+
+/**
+ * benchmark_override_settings:
+ *
+ * Forces the null video, audio and input drivers, runs uncapped,
+ * and keeps the run from saving anything to the configuration.
+ * Called once the configuration has been loaded.
+ **/
+void benchmark_override_settings(void);
+
+/**
+ * benchmark_frame:
+ *
+ * Called each time the core has run a frame.
+ **/
+void benchmark_frame(void);
+
+/**
+ * benchmark_report:
+ *
+ * Writes the JSON report. Must be called while the core is still
+ * loaded, since its performance counters live in the core.
+ *
+ * Returns: true on success, otherwise false.
+ **/
+bool benchmark_report(void);
+
+void benchmark_deinit(void);
+
+RETRO_END_DECLS
+
+#endif
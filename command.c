@@ -71,6 +71,7 @@
 #include "core_info.h"
 #include "core_type.h"
 #include "performance_counters.h"
+#include "performance_trace.h"
 #include "dynamic.h"
 #include "content.h"
 #include "dirs.h"
@@ -80,6 +81,10 @@
 #include "retroarch.h"
 #include "managers/cheat_manager.h"
 #include "managers/state_manager.h"
+#include "managers/runahead.h"
+#ifdef HAVE_THREADS
+#include "managers/core_thread.h"
+#endif
 #include "ui/ui_companion_driver.h"
 #include "tasks/tasks_internal.h"
 #include "list_special.h"
@@ -195,6 +200,40 @@ static bool command_set_shader(const char *arg)
    return video_driver_set_shader(type, arg);
 }
 
+static bool command_rewind_seek(const char *arg)
+{
+   unsigned entries = strtoul(arg, NULL, 10);
+
+   if (!entries)
+      return false;
+
+   return state_manager_rewind_seek(entries);
+}
+
+/* Network commands may come from anywhere, so the trace can only go
+ * next to perf_trace_path, under a plain file name. */
+static bool command_trace_dump(const char *arg)
+{
+   char dir[PATH_MAX_LENGTH]  = {0};
+   char path[PATH_MAX_LENGTH] = {0};
+   settings_t *settings       = config_get_ptr();
+
+   if (string_is_empty(arg) || string_is_empty(settings->path.perf_trace))
+      return false;
+
+   if (strchr(arg, '/') || strchr(arg, '\\') || strchr(arg, ':') ||
+         string_is_equal(arg, ".") || string_is_equal(arg, ".."))
+   {
+      RARCH_ERR("[TRACE]: TRACE_DUMP takes a file name, not a path.\n");
+      return false;
+   }
+
+   fill_pathname_basedir(dir, settings->path.perf_trace, sizeof(dir));
+   fill_pathname_join(path, dir, arg, sizeof(path));
+
+   return performance_trace_dump(path);
+}
+
 
 #ifdef HAVE_CHEEVOS
 static bool command_read_ram(const char *arg)
@@ -259,6 +298,8 @@ static bool command_write_ram(const char *arg)
 
 static const struct cmd_action_map action_map[] = {
    { "SET_SHADER", command_set_shader, "<shader path>" },
+   { "REWIND_SEEK", command_rewind_seek, "<number of rewind steps>" },
+   { "TRACE_DUMP", command_trace_dump, "<trace file name>" },
 #ifdef HAVE_CHEEVOS
    { "READ_CORE_RAM", command_read_ram, "<address> <number of bytes>" },
    { "WRITE_CORE_RAM", command_write_ram, "<address> <byte1> <byte2> ..." },
@@ -1198,6 +1239,10 @@ static void command_event_deinit_core(bool reinit)
    cheevos_unload();
 #endif
 
+#ifdef HAVE_THREADS
+   core_thread_deinit();
+#endif
+   runahead_deinit();
    core_unload_game();
    core_unload();
    core_uninit_symbols();
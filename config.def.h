@@ -515,6 +515,12 @@ static const unsigned hard_sync_frames = 0;
  */
 static const unsigned frame_delay = 0;
 
+/* Choose the frame delay automatically, as the largest that the time the
+ * core and video driver took over recent frames leaves room for. Backs
+ * off when frames are missed. frame_delay, if set, is the most it uses.
+ */
+static const bool frame_delay_auto = false;
+
 /* Inserts a black frame inbetween frames.
  * Useful for 120 Hz monitors who want to play 60 Hz material with eliminated
  * ghosting. video_refresh_rate should still be configured as if it
@@ -804,6 +810,46 @@ static const unsigned rewind_buffer_size = 20 << 20; /* 20MiB */
 /* How many frames to rewind at a time. */
 static const unsigned rewind_granularity = 1;
 
+/* Compute rewind deltas on a worker thread. The main thread only
+ * serializes the core; captures are dropped from the history
+ * instead of stalling the core when the worker falls behind. */
+static const bool rewind_threaded = false;
+
+/* Store a full state every N rewind steps, so seeking back in
+ * the history replays at most N patches. 0 disables keyframes. */
+static const unsigned rewind_keyframe_interval = 0;
+
+/* Back the rewind buffer with a file next to the savestates and
+ * only keep its newest part in memory. Allows for rewind buffers
+ * far larger than the available RAM. */
+static const bool rewind_disk_buffer_enable = false;
+
+/* Ignore rewind_granularity and capture as often as the budgets
+ * below allow, based on the measured cost of each capture. */
+static const bool rewind_granularity_auto = false;
+
+/* Average main thread time rewind may take per frame,
+ * in microseconds. 0 means no limit. */
+static const unsigned rewind_frame_budget = 1000;
+
+/* How fast rewind may fill its buffer, in KiB per second.
+ * 0 means no limit. */
+static const unsigned rewind_memory_budget = 0;
+
+/* Run the core this many frames ahead of what is shown and roll it
+ * back every frame, hiding the game's own input lag. Needs a core
+ * that can save state. 0 disables run-ahead. */
+static const unsigned run_ahead_frames = 0;
+
+/* Run the frames ahead on a second instance of the core, which only
+ * has to catch up when the input changes, instead of saving and
+ * loading state every frame. */
+static const bool run_ahead_secondary_instance = false;
+
+/* Run the core on its own thread, one frame ahead of what is shown,
+ * so running a frame overlaps showing the one before it. */
+static const bool core_threaded = false;
+
 /* Pause gameplay when gameplay loses focus. */
 #ifdef EMSCRIPTEN
 static const bool pause_nonactive = false;
@@ -824,10 +870,49 @@ static const bool netplay_client_swap_input = true;
 
 static const bool netplay_nat_traversal = false;
 
+/* Also send netplay input over UDP, with each packet repeating
+ * the most recent unacknowledged frames. */
+static const bool netplay_udp_input = false;
+
+/* When connecting as a client, also accept spectators and pass
+ * the host's stream on to them. */
+static const bool netplay_relay = false;
+
+/* Port a relay listens on for its spectators, or 0 for
+ * the port it connects to. */
+static const unsigned netplay_relay_port = 0;
+
+/* Do netplay's socket I/O on a thread of its own, so that a
+ * slow peer or a large savestate doesn't hold up frames. */
+static const bool netplay_io_thread = false;
+
 static const unsigned netplay_delay_frames = 16;
 
 static const int netplay_check_frames = 30;
 
+/* Capture the core's state for netplay rollback every this many
+ * frames, as well as where input prediction starts. 1 captures
+ * every frame; 0 captures only where prediction starts. */
+static const unsigned netplay_state_interval = 1;
+
+/* How netplay guesses input it hasn't received yet.
+ * 0 holds the last input, 1 holds directions but releases
+ * buttons, 2 learns from each player's input. */
+static const unsigned netplay_input_predictor = 0;
+
+/* When hosting, hash only one block in every this many of each
+ * state for netplay CRC checks. 0 hashes the whole state. */
+static const unsigned netplay_hash_sample = 0;
+
+/* Simulate a poor network on everything netplay sends, for
+ * testing: one-way delay and jitter in milliseconds, and
+ * percentage of packets lost. These are only read from the
+ * config, never written to it, so they can't end up in a
+ * user's saved config; tools/netplay-soak.sh sets them. */
+static const unsigned netplay_sim_delay = 0;
+static const unsigned netplay_sim_jitter = 0;
+static const unsigned netplay_sim_loss = 0;
+
 /* On save state load, block SRAM from being overwritten.
  * This could potentially lead to buggy games. */
 static const bool block_sram_overwrite = false;
@@ -847,12 +932,28 @@ static const bool savestate_auto_load = false;
 
 static const bool savestate_thumbnail_enable = false;
 
+/* Write savestates as a small header followed by a
+ * zlib-compressed payload. Raw savestates can still be loaded. */
+static const bool savestate_file_compression = false;
+
 /* Slowmotion ratio. */
 static const float slowmotion_ratio = 3.0;
 
 /* Maximum fast forward ratio. */
 static const float fastforward_ratio = 0.0;
 
+/* When fast forwarding, only show some frames, and don't process the
+ * audio or video of the others at all. */
+static const bool fastforward_frameskip = false;
+
+/* Show every Nth frame when fast forwarding with frameskip.
+ * 0 shows as many as the display's refresh rate allows. */
+static const unsigned fastforward_frameskip_interval = 0;
+
+/* Have the frame limiter sleep until an exact deadline and spin for
+ * the last stretch, rather than sleep in whole milliseconds. */
+static const bool frame_limiter_precise = false;
+
 /* Enable stdin/network command interface. */
 static const bool network_cmd_enable = false;
 static const uint16_t network_cmd_port = 55355;
@@ -0,0 +1,197 @@
+CC = /usr/bin/gcc
+CFLAGS = 
+WINDRES = 
+ASFLAGS = 
+LDFLAGS = 
+INCLUDE_DIRS =  -I./decompress/7zip/
+LIBRARY_DIRS =  -L/usr/lib64
+PACKAGE_NAME = retroarch
+PREFIX = /usr/local
+HAVE_7ZIP = 1
+HAVE_AL = 0
+AL_CFLAGS = 
+AL_LIBS = 
+HAVE_ALSA = 0
+ALSA_CFLAGS = 
+ALSA_LIBS = 
+HAVE_AVCODEC = 0
+AVCODEC_CFLAGS = 
+AVCODEC_LIBS = 
+HAVE_AVDEVICE = 0
+AVDEVICE_CFLAGS = 
+AVDEVICE_LIBS = 
+HAVE_AVFORMAT = 0
+AVFORMAT_CFLAGS = 
+AVFORMAT_LIBS = 
+HAVE_AVRESAMPLE = 0
+AVRESAMPLE_CFLAGS = 
+AVRESAMPLE_LIBS = 
+HAVE_AVUTIL = 0
+AVUTIL_CFLAGS = 
+AVUTIL_LIBS = 
+HAVE_AV_CHANNEL_LAYOUT = 0
+HAVE_BUILTINZLIB = 0
+HAVE_C99 = 1
+HAVE_CACA = 0
+HAVE_CG = 0
+CG_CFLAGS = 
+CG_LIBS = 
+HAVE_CHEEVOS = 1
+HAVE_COMMAND = 1
+HAVE_D3D9 = 0
+HAVE_DBUS = 0
+DBUS_CFLAGS = 
+DBUS_LIBS = 
+HAVE_DISPMANX = 0
+HAVE_DRM = 0
+DRM_CFLAGS = 
+DRM_LIBS = 
+HAVE_DYLIB = 1
+HAVE_DYNAMIC = 1
+HAVE_EGL = 0
+HAVE_EXYNOS = 0
+HAVE_FBO = 1
+HAVE_FFMPEG = 0
+HAVE_FLOATHARD = 0
+HAVE_FLOATSOFTFP = 0
+HAVE_FREETYPE = 1
+FREETYPE_CFLAGS = -I/usr/include/freetype2 -I/usr/include/libpng16
+FREETYPE_LIBS = -lfreetype
+HAVE_GBM = 0
+GBM_CFLAGS = 
+GBM_LIBS = 
+HAVE_GETADDRINFO = 1
+HAVE_GETOPT_LONG = 1
+HAVE_HID = 1
+HAVE_IMAGEVIEWER = 1
+HAVE_JACK = 0
+JACK_CFLAGS = 
+JACK_LIBS = 
+HAVE_KMS = 0
+HAVE_LANGEXTRA = 1
+HAVE_LIBRETRODB = 1
+HAVE_LIBUSB = 0
+LIBUSB_CFLAGS = 
+LIBUSB_LIBS = 
+HAVE_LIBXML2 = 1
+LIBXML2_CFLAGS = -I/usr/include/libxml2
+LIBXML2_LIBS = -lxml2
+HAVE_MALI_FBDEV = 0
+HAVE_MINIUPNPC = 0
+HAVE_MMAP = 1
+HAVE_NEON = 0
+ifneq ($(C89_BUILD),1)
+HAVE_NETWORKGAMEPAD = 1
+endif
+HAVE_NETWORKING = 1
+HAVE_NETWORK_CMD = 1
+HAVE_NOUNUSED = 1
+HAVE_NOUNUSED_VARIABLE = 1
+HAVE_NO_EGL = 1
+HAVE_NUKLEAR = 0
+HAVE_OMAP = 0
+HAVE_OPENDINGUX_FBDEV = 0
+HAVE_OPENGL = 1
+HAVE_OPENGLES = 0
+HAVE_OPENGLES3 = 0
+HAVE_OSMESA = 0
+HAVE_OSS = 1
+HAVE_OSS_BSD = 0
+HAVE_OSS_LIB = 0
+HAVE_PARPORT = 1
+HAVE_PLAIN_DRM = 0
+HAVE_PRESERVE_DYLIB = 0
+HAVE_PULSE = 0
+PULSE_CFLAGS = 
+PULSE_LIBS = 
+HAVE_PYTHON = 0
+HAVE_QT = 0
+HAVE_QT_WRAPPER = 0
+HAVE_RBMP = 1
+HAVE_RGUI = 1
+HAVE_RJPEG = 1
+HAVE_ROAR = 0
+ROAR_CFLAGS = 
+ROAR_LIBS = 
+HAVE_RPNG = 1
+HAVE_RSOUND = 0
+RSOUND_CFLAGS = 
+RSOUND_LIBS = 
+HAVE_RTGA = 1
+HAVE_SDL = 0
+SDL_CFLAGS = 
+SDL_LIBS = 
+HAVE_SDL2 = 0
+SDL2_CFLAGS = 
+SDL2_LIBS = 
+ifneq ($(C89_BUILD),1)
+HAVE_SHADERPIPELINE = 1
+endif
+HAVE_SOCKET_LEGACY = 0
+HAVE_SSA = 0
+HAVE_SSE = 0
+HAVE_STB_FONT = 1
+HAVE_STB_IMAGE = 1
+HAVE_STDIN_CMD = 1
+HAVE_STRCASESTR = 1
+HAVE_STRL = 0
+HAVE_SUNXI = 0
+HAVE_SWRESAMPLE = 0
+SWRESAMPLE_CFLAGS = 
+SWRESAMPLE_LIBS = 
+HAVE_SWSCALE = 0
+SWSCALE_CFLAGS = 
+SWSCALE_LIBS = 
+HAVE_SYSTEMD = 0
+HAVE_THREADS = 1
+HAVE_THREAD_STORAGE = 1
+HAVE_UDEV = 0
+UDEV_CFLAGS = 
+UDEV_LIBS = 
+HAVE_UPDATE_ASSETS = 1
+HAVE_V4L2 = 0
+V4L2_CFLAGS = 
+V4L2_LIBS = 
+HAVE_VG = 0
+HAVE_VIDEOCORE = 0
+HAVE_VIVANTE_FBDEV = 0
+HAVE_VULKAN = 0
+HAVE_VULKAN_DISPLAY = 1
+HAVE_WAYLAND = 0
+WAYLAND_CFLAGS = 
+WAYLAND_LIBS = 
+HAVE_WAYLAND_CURSOR = 0
+WAYLAND_CURSOR_CFLAGS = 
+WAYLAND_CURSOR_LIBS = 
+HAVE_X11 = 0
+X11_CFLAGS = 
+X11_LIBS = -lX11
+HAVE_XCB = 1
+XCB_CFLAGS = 
+XCB_LIBS = -lxcb
+HAVE_XEXT = 1
+XEXT_CFLAGS = 
+XEXT_LIBS = -lXext
+HAVE_XF86VM = 0
+XF86VM_CFLAGS = 
+XF86VM_LIBS = 
+HAVE_XINERAMA = 0
+XINERAMA_CFLAGS = 
+XINERAMA_LIBS = 
+HAVE_XKBCOMMON = 0
+XKBCOMMON_CFLAGS = 
+XKBCOMMON_LIBS = 
+HAVE_XSHM = 0
+HAVE_XVIDEO = 0
+HAVE_ZARCH = 0
+HAVE_ZLIB = 1
+ZLIB_CFLAGS = 
+ZLIB_LIBS = -lz
+NOUNUSED = yes
+NOUNUSED_VARIABLE = yes
+DYLIB_LIB = -ldl
+ASSETS_DIR = /usr/local/share
+BIN_DIR = /usr/local/bin
+MAN_DIR = /usr/local/share/man
+OS = Linux
+GLOBAL_CONFIG_DIR = 
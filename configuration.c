@@ -630,6 +630,8 @@ static struct config_path_setting *populate_settings_path(settings_t *settings,
          settings->path.content_database, false, NULL, true);
    SETTING_PATH("cheat_database_path",
          settings->path.cheat_database, false, NULL, true);
+   SETTING_PATH("perf_trace_path",
+         settings->path.perf_trace, false, NULL, true);
 #ifdef HAVE_MENU
    SETTING_PATH("menu_wallpaper", 
          settings->path.menu_wallpaper, false, NULL, true);
@@ -730,6 +732,9 @@ static struct config_bool_setting *populate_settings_bool(settings_t *settings,
 #ifdef HAVE_NETWORKING
    SETTING_BOOL("netplay_stateless_mode",        &settings->netplay.stateless_mode, false, netplay_stateless_mode, false);
    SETTING_BOOL("netplay_client_swap_input",     &settings->netplay.swap_input, true, netplay_client_swap_input, false);
+   SETTING_BOOL("netplay_udp_input",             &settings->netplay.udp_input, true, netplay_udp_input, false);
+   SETTING_BOOL("netplay_relay",                 &settings->netplay.relay, true, netplay_relay, false);
+   SETTING_BOOL("netplay_io_thread",             &settings->netplay.io_thread, true, netplay_io_thread, false);
 #endif
    SETTING_BOOL("input_descriptor_label_show",   &settings->input.input_descriptor_label_show, true, input_descriptor_label_show, false);
    SETTING_BOOL("input_descriptor_hide_unbound", &settings->input.input_descriptor_hide_unbound, true, input_descriptor_hide_unbound, false);
@@ -741,6 +746,11 @@ static struct config_bool_setting *populate_settings_bool(settings_t *settings,
    SETTING_BOOL("ui_menubar_enable",             &settings->ui.menubar_enable, true, true, false);
    SETTING_BOOL("suspend_screensaver_enable",    &settings->ui.suspend_screensaver_enable, true, true, false);
    SETTING_BOOL("rewind_enable",                 &settings->rewind_enable, true, rewind_enable, false);
+   SETTING_BOOL("rewind_threaded",               &settings->rewind_threaded, true, rewind_threaded, false);
+   SETTING_BOOL("rewind_disk_buffer_enable",     &settings->rewind_disk_buffer_enable, true, rewind_disk_buffer_enable, false);
+   SETTING_BOOL("rewind_granularity_auto",       &settings->rewind_granularity_auto, true, rewind_granularity_auto, false);
+   SETTING_BOOL("run_ahead_secondary_instance",  &settings->run_ahead_secondary_instance, true, run_ahead_secondary_instance, false);
+   SETTING_BOOL("core_threaded",                 &settings->core_threaded, true, core_threaded, false);
    SETTING_BOOL("audio_sync",                    &settings->audio.sync, true, audio_sync, false);
    SETTING_BOOL("video_shader_enable",           &settings->video.shader_enable, true, shader_enable, false);
 
@@ -761,9 +771,12 @@ static struct config_bool_setting *populate_settings_bool(settings_t *settings,
    SETTING_BOOL("bundle_assets_extract_enable",  &settings->bundle_assets_extract_enable, true, bundle_assets_extract_enable, false);
    SETTING_BOOL("video_vsync",                   &settings->video.vsync, true, vsync, false);
    SETTING_BOOL("video_hard_sync",               &settings->video.hard_sync, true, hard_sync, false);
+   SETTING_BOOL("video_frame_delay_auto",        &settings->video.frame_delay_auto, true, frame_delay_auto, false);
    SETTING_BOOL("video_black_frame_insertion",   &settings->video.black_frame_insertion, true, black_frame_insertion, false);
    SETTING_BOOL("video_disable_composition",     &settings->video.disable_composition, true, disable_composition, false);
    SETTING_BOOL("pause_nonactive",               &settings->pause_nonactive, true, pause_nonactive, false);
+   SETTING_BOOL("fastforward_frameskip",         &settings->fastforward_frameskip, true, fastforward_frameskip, false);
+   SETTING_BOOL("frame_limiter_precise",         &settings->frame_limiter_precise, true, frame_limiter_precise, false);
    SETTING_BOOL("video_gpu_screenshot",          &settings->video.gpu_screenshot, true, gpu_screenshot, false);
    SETTING_BOOL("video_post_filter_record",      &settings->video.post_filter_record, true, post_filter_record, false);
    SETTING_BOOL("keyboard_gamepad_enable",       &settings->input.keyboard_gamepad_enable, true, true, false);
@@ -845,6 +858,7 @@ static struct config_bool_setting *populate_settings_bool(settings_t *settings,
    SETTING_BOOL("savestate_auto_save",          &settings->savestate_auto_save, true, savestate_auto_save, false);
    SETTING_BOOL("savestate_auto_load",          &settings->savestate_auto_load, true, savestate_auto_load, false);
    SETTING_BOOL("savestate_thumbnail_enable",   &settings->savestate_thumbnail_enable, true, savestate_thumbnail_enable, false);
+   SETTING_BOOL("savestate_file_compression",   &settings->savestate_file_compression, true, savestate_file_compression, false);
    SETTING_BOOL("history_list_enable",          &settings->history_list_enable, true, def_history_list_enable, false);
    SETTING_BOOL("playlist_entry_remove",        &settings->playlist_entry_remove, true, def_playlist_entry_remove, false);
    SETTING_BOOL("game_specific_options",        &settings->game_specific_options, true, default_game_specific_options, false);
@@ -913,6 +927,11 @@ static struct config_int_setting *populate_settings_int(settings_t *settings, in
    SETTING_INT("audio_latency",                &settings->audio.latency, false, 0 /* TODO */, false);
    SETTING_INT("audio_block_frames",           &settings->audio.block_frames, true, 0, false);
    SETTING_INT("rewind_granularity",           &settings->rewind_granularity, true, rewind_granularity, false);
+   SETTING_INT("rewind_keyframe_interval",     &settings->rewind_keyframe_interval, true, rewind_keyframe_interval, false);
+   SETTING_INT("rewind_frame_budget",          &settings->rewind_frame_budget, true, rewind_frame_budget, false);
+   SETTING_INT("rewind_memory_budget",         &settings->rewind_memory_budget, true, rewind_memory_budget, false);
+   SETTING_INT("fastforward_frameskip_interval", &settings->fastforward_frameskip_interval, true, fastforward_frameskip_interval, false);
+   SETTING_INT("run_ahead_frames",             &settings->run_ahead_frames, true, run_ahead_frames, false);
    SETTING_INT("autosave_interval",            &settings->autosave_interval,  true, autosave_interval, false);
    SETTING_INT("libretro_log_level",           &settings->libretro_log_level, true, libretro_log_level, false);
    SETTING_INT("keyboard_gamepad_mapping_type",&settings->input.keyboard_gamepad_mapping_type, true, 1, false);
@@ -963,7 +982,11 @@ static struct config_int_setting *populate_settings_int(settings_t *settings, in
    SETTING_INT("state_slot",                   (unsigned*)&settings->state_slot, false, 0 /* TODO */, false);
 #ifdef HAVE_NETWORKING
    SETTING_INT("netplay_ip_port",              &settings->netplay.port,         true, RARCH_DEFAULT_PORT, false);
+   SETTING_INT("netplay_relay_port",           &settings->netplay.relay_port,   true, netplay_relay_port, false);
    SETTING_INT("netplay_check_frames",         (unsigned*)&settings->netplay.check_frames, true, netplay_check_frames, false);
+   SETTING_INT("netplay_state_interval",       &settings->netplay.state_interval, true, netplay_state_interval, false);
+   SETTING_INT("netplay_input_predictor",      &settings->netplay.input_predictor, true, netplay_input_predictor, false);
+   SETTING_INT("netplay_hash_sample",          &settings->netplay.hash_sample, true, netplay_hash_sample, false);
    SETTING_INT("netplay_input_latency_frames_min",&settings->netplay.input_latency_frames_min, true, 0, false);
    SETTING_INT("netplay_input_latency_frames_range",&settings->netplay.input_latency_frames_range, true, 0, false);
 #endif
@@ -1045,6 +1068,13 @@ static void config_set_defaults(void)
       free(float_settings);
    }
 
+#ifdef HAVE_NETWORKING
+   /* Testing only, so never saved with the others */
+   settings->netplay.sim_delay  = netplay_sim_delay;
+   settings->netplay.sim_jitter = netplay_sim_jitter;
+   settings->netplay.sim_loss   = netplay_sim_loss;
+#endif
+
    if (def_camera)
       strlcpy(settings->camera.driver,
             def_camera, sizeof(settings->camera.driver));
@@ -1242,6 +1272,7 @@ static void config_set_defaults(void)
    *settings->path.content_video_history   = '\0';
    *settings->path.cheat_settings    = '\0';
    *settings->path.shader            = '\0';
+   *settings->path.perf_trace        = '\0';
 #ifndef IOS
    *settings->path.bundle_assets_src = '\0';
    *settings->path.bundle_assets_dst = '\0';
@@ -1895,6 +1926,9 @@ static bool config_load_file(const char *path, bool set_defaults,
       CONFIG_GET_INT_BASE(conf, settings, netplay.check_frames, "netplay_check_frames");
    if (!retroarch_override_setting_is_set(RARCH_OVERRIDE_SETTING_NETPLAY_IP_PORT, NULL))
       CONFIG_GET_INT_BASE(conf, settings, netplay.port, "netplay_ip_port");
+   CONFIG_GET_INT_BASE(conf, settings, netplay.sim_delay,  "netplay_sim_delay");
+   CONFIG_GET_INT_BASE(conf, settings, netplay.sim_jitter, "netplay_sim_jitter");
+   CONFIG_GET_INT_BASE(conf, settings, netplay.sim_loss,   "netplay_sim_loss");
 #endif
    for (i = 0; i < MAX_USERS; i++)
    {
@@ -68,6 +68,7 @@ typedef struct settings
       unsigned swap_interval;
       unsigned hard_sync_frames;
       unsigned frame_delay;
+      bool frame_delay_auto;
 #ifdef GEKKO
       unsigned viwidth;
       bool vfilter;
@@ -374,6 +375,7 @@ typedef struct settings
       char bundle_assets_dst_subdir[PATH_MAX_LENGTH];
       char shader[PATH_MAX_LENGTH];
       char font[PATH_MAX_LENGTH];
+      char perf_trace[PATH_MAX_LENGTH];
    } path;
 
    struct
@@ -405,12 +407,22 @@ typedef struct settings
    {
       char server[255];
       unsigned port;
+      unsigned relay_port;
       bool stateless_mode;
       int check_frames;
+      unsigned state_interval;
+      unsigned input_predictor;
+      unsigned hash_sample;
+      unsigned sim_delay;
+      unsigned sim_jitter;
+      unsigned sim_loss;
       unsigned input_latency_frames_min;
       unsigned input_latency_frames_range;
       bool swap_input;
       bool nat_traversal;
+      bool udp_input;
+      bool relay;
+      bool io_thread;
       char password[128];
       char spectate_password[128];
    } netplay;
@@ -427,9 +439,22 @@ typedef struct settings
    bool rewind_enable;
    size_t rewind_buffer_size;
    unsigned rewind_granularity;
+   bool rewind_threaded;
+   unsigned rewind_keyframe_interval;
+   bool rewind_disk_buffer_enable;
+   bool rewind_granularity_auto;
+   unsigned rewind_frame_budget;
+   unsigned rewind_memory_budget;
+
+   unsigned run_ahead_frames;
+   bool run_ahead_secondary_instance;
+   bool core_threaded;
 
    float slowmotion_ratio;
    float fastforward_ratio;
+   bool fastforward_frameskip;
+   unsigned fastforward_frameskip_interval;
+   bool frame_limiter_precise;
 
    bool pause_nonactive;
    unsigned autosave_interval;
@@ -439,6 +464,7 @@ typedef struct settings
    bool savestate_auto_save;
    bool savestate_auto_load;
    bool savestate_thumbnail_enable;
+   bool savestate_file_compression;
 
    bool network_cmd_enable;
    unsigned network_cmd_port;
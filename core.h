@@ -166,6 +166,14 @@ bool core_set_default_callbacks(void *data);
 
 bool core_set_rewind_callbacks(void);
 
+bool core_set_output_callbacks(bool video, bool audio);
+
+bool core_set_callbacks(const struct retro_callbacks *cbs);
+
+/* The input state callback normally given to the core. */
+int16_t core_input_state_poll(unsigned port,
+      unsigned device, unsigned idx, unsigned id);
+
 #ifdef HAVE_NETWORKING
 bool core_set_netplay_callbacks(void);
 
@@ -177,6 +185,8 @@ bool core_set_poll_type(unsigned *type);
 /* Runs the core for one frame. */
 bool core_run(void);
 
+bool core_run_nopoll(void);
+
 bool core_init(void);
 
 bool core_deinit(void *data);
@@ -40,7 +40,12 @@
 #include "dynamic.h"
 #include "msg_hash.h"
 #include "managers/state_manager.h"
+#include "managers/runahead.h"
+#ifdef HAVE_THREADS
+#include "managers/core_thread.h"
+#endif
 #include "verbosity.h"
+#include "performance_trace.h"
 #include "gfx/video_driver.h"
 #include "audio/audio_driver.h"
 
@@ -54,17 +59,23 @@ static uint64_t            core_serialization_quirks_v    = 0;
 
 static struct              retro_callbacks retro_ctx;
 static struct              retro_core_t core;
+static retro_environment_t core_environ_cb                = NULL;
+/* The callbacks the core has, or gets back from its thread */
+static struct              retro_callbacks core_cbs;
+static bool                core_cbs_lent                  = false;
+/* Set while the core runs a frame on input that's already been polled */
+static bool                core_input_held                = false;
 
 static void core_input_state_poll_maybe(void)
 {
-   if (core_poll_type == POLL_TYPE_NORMAL)
+   if (core_poll_type == POLL_TYPE_NORMAL && !core_input_held)
       input_poll();
 }
 
-static int16_t core_input_state_poll(unsigned port,
+int16_t core_input_state_poll(unsigned port,
       unsigned device, unsigned idx, unsigned id)
 {
-   if (core_poll_type == POLL_TYPE_LATE)
+   if (core_poll_type == POLL_TYPE_LATE && !core_input_held)
    {
       if (!core_input_polled)
          input_poll();
@@ -74,9 +85,43 @@ static int16_t core_input_state_poll(unsigned port,
    return input_state(port, device, idx, id);
 }
 
+static void core_give_callbacks(const struct retro_callbacks *cbs)
+{
+   core.retro_set_video_refresh(cbs->frame_cb);
+   core.retro_set_audio_sample(cbs->sample_cb);
+   core.retro_set_audio_sample_batch(cbs->sample_batch_cb);
+   core.retro_set_input_state(cbs->state_cb);
+   core.retro_set_input_poll(cbs->poll_cb);
+}
+
+/* Gives the core @cbs, unless they're what it has already. While the
+ * core's thread has the core, what it has are core_cbs, which the
+ * thread gives back; so only a real change takes the core back from
+ * the thread, and the thread gives back the new ones. */
+static void core_update_callbacks(const struct retro_callbacks *cbs)
+{
+   if (!memcmp(cbs, &core_cbs, sizeof(*cbs)))
+      return;
+
+   core_cbs = *cbs;
+
+#ifdef HAVE_THREADS
+   if (core_cbs_lent)
+   {
+      core_thread_flush();
+      return;
+   }
+#endif
+
+   core_give_callbacks(&core_cbs);
+}
+
 void core_set_input_state(retro_ctx_input_state_info_t *info)
 {
-   core.retro_set_input_state(info->cb);
+   struct retro_callbacks cbs = core_cbs;
+
+   cbs.state_cb = info->cb;
+   core_update_callbacks(&cbs);
 }
 
 /**
@@ -93,11 +138,13 @@ static bool core_init_libretro_cbs(void *data)
    if (!cbs)
       return false;
 
-   core.retro_set_video_refresh(video_driver_frame);
-   core.retro_set_audio_sample(audio_driver_sample);
-   core.retro_set_audio_sample_batch(audio_driver_sample_batch);
-   core.retro_set_input_state(core_input_state_poll);
-   core.retro_set_input_poll(core_input_state_poll_maybe);
+   core_cbs.frame_cb        = video_driver_frame;
+   core_cbs.sample_cb       = audio_driver_sample;
+   core_cbs.sample_batch_cb = audio_driver_sample_batch;
+   core_cbs.state_cb        = core_input_state_poll;
+   core_cbs.poll_cb         = core_input_state_poll_maybe;
+   core_cbs_lent            = false;
+   core_give_callbacks(&core_cbs);
 
    core_set_default_callbacks(cbs);
 
@@ -163,18 +210,81 @@ bool core_uninit_libretro_callbacks(void)
  * Sets the audio sampling callbacks based on whether or not
  * rewinding is currently activated.
  **/
-bool core_set_rewind_callbacks(void)
+static void core_rewind_audio_callbacks(struct retro_callbacks *cbs)
 {
    if (state_manager_frame_is_reversed())
    {
-      core.retro_set_audio_sample(audio_driver_sample_rewind);
-      core.retro_set_audio_sample_batch(audio_driver_sample_batch_rewind);
+      cbs->sample_cb       = audio_driver_sample_rewind;
+      cbs->sample_batch_cb = audio_driver_sample_batch_rewind;
    }
    else
    {
-      core.retro_set_audio_sample(audio_driver_sample);
-      core.retro_set_audio_sample_batch(audio_driver_sample_batch);
+      cbs->sample_cb       = audio_driver_sample;
+      cbs->sample_batch_cb = audio_driver_sample_batch;
+   }
+}
+
+bool core_set_rewind_callbacks(void)
+{
+   struct retro_callbacks cbs = core_cbs;
+
+   core_rewind_audio_callbacks(&cbs);
+   core_update_callbacks(&cbs);
+   return true;
+}
+
+static void core_video_refresh_null(const void *data,
+      unsigned width, unsigned height, size_t pitch)
+{
+}
+
+static void core_audio_sample_null(int16_t left, int16_t right)
+{
+}
+
+static size_t core_audio_sample_batch_null(const int16_t *data,
+      size_t frames)
+{
+   return frames;
+}
+
+/**
+ * core_set_output_callbacks:
+ * @video          : pass the core's video on to the video driver?
+ * @audio          : pass the core's audio on to the audio driver?
+ *
+ * Lets the core run frames that are never seen or heard,
+ * as run-ahead does.
+ **/
+bool core_set_output_callbacks(bool video, bool audio)
+{
+   struct retro_callbacks cbs = core_cbs;
+
+   cbs.frame_cb = video ? video_driver_frame : core_video_refresh_null;
+   if (audio)
+      core_rewind_audio_callbacks(&cbs);
+   else
+   {
+      cbs.sample_cb       = core_audio_sample_null;
+      cbs.sample_batch_cb = core_audio_sample_batch_null;
    }
+   core_update_callbacks(&cbs);
+   return true;
+}
+
+/**
+ * core_set_callbacks:
+ * @cbs            : callbacks to give the core, or NULL to give it
+ *                   the usual ones back.
+ *
+ * Hands all of the core's video, audio and input to someone else,
+ * as running the core on its own thread does. What the core had is
+ * kept, and kept up to date by the setters above, to give it back.
+ **/
+bool core_set_callbacks(const struct retro_callbacks *cbs)
+{
+   core_cbs_lent = cbs != NULL;
+   core_give_callbacks(cbs ? cbs : &core_cbs);
    return true;
 }
 
@@ -187,14 +297,17 @@ bool core_set_rewind_callbacks(void)
  **/
 bool core_set_netplay_callbacks(void)
 {
+   struct retro_callbacks cbs = core_cbs;
+
    /* Force normal poll type for netplay. */
    core_poll_type = POLL_TYPE_NORMAL;
 
    /* And use netplay's interceding callbacks */
-   core.retro_set_video_refresh(video_frame_net);
-   core.retro_set_audio_sample(audio_sample_net);
-   core.retro_set_audio_sample_batch(audio_sample_batch_net);
-   core.retro_set_input_state(input_state_net);
+   cbs.frame_cb        = video_frame_net;
+   cbs.sample_cb       = audio_sample_net;
+   cbs.sample_batch_cb = audio_sample_batch_net;
+   cbs.state_cb        = input_state_net;
+   core_update_callbacks(&cbs);
 
    return true;
 }
@@ -208,13 +321,15 @@ bool core_set_netplay_callbacks(void)
 bool core_unset_netplay_callbacks(void)
 {
    struct retro_callbacks cbs;
+   struct retro_callbacks core_cbs_new = core_cbs;
    if (!core_set_default_callbacks(&cbs))
       return false;
 
-   core.retro_set_video_refresh(cbs.frame_cb);
-   core.retro_set_audio_sample(cbs.sample_cb);
-   core.retro_set_audio_sample_batch(cbs.sample_batch_cb);
-   core.retro_set_input_state(cbs.state_cb);
+   core_cbs_new.frame_cb        = cbs.frame_cb;
+   core_cbs_new.sample_cb       = cbs.sample_cb;
+   core_cbs_new.sample_batch_cb = cbs.sample_batch_cb;
+   core_cbs_new.state_cb        = cbs.state_cb;
+   core_update_callbacks(&core_cbs_new);
 
    return true;
 }
@@ -223,12 +338,14 @@ bool core_unset_netplay_callbacks(void)
 bool core_set_cheat(retro_ctx_cheat_info_t *info)
 {
    core.retro_cheat_set(info->index, info->enabled, info->code);
+   runahead_invalidate();
    return true;
 }
 
 bool core_reset_cheat(void)
 {
    core.retro_cheat_reset();
+   runahead_invalidate();
    return true;
 }
 
@@ -287,12 +404,21 @@ bool core_load_game(retro_ctx_load_content_info_t *load_info)
    content_get_status(&contentless, &is_inited);
 
    if (load_info && load_info->special)
+   {
       core_game_loaded = core.retro_load_game_special(
             load_info->special->id, load_info->info, load_info->content->size);
+      runahead_set_content(NULL, false);
+   }
    else if (load_info && !string_is_empty(load_info->content->elems[0].data))
+   {
       core_game_loaded = core.retro_load_game(load_info->info);
+      runahead_set_content(load_info->info, true);
+   }
    else if (contentless)
+   {
       core_game_loaded = core.retro_load_game(NULL);
+      runahead_set_content(NULL, true);
+   }
    else
       core_game_loaded = false;
 
@@ -309,11 +435,19 @@ bool core_get_system_info(struct retro_system_info *system)
 
 bool core_unserialize(retro_ctx_serialize_info_t *info)
 {
+   bool ret;
+
    if (!info)
       return false;
-   if (!core.retro_unserialize(info->data_const, info->size))
+
+   performance_trace_begin("core_unserialize");
+   ret = core.retro_unserialize(info->data_const, info->size);
+   performance_trace_end("core_unserialize");
+   if (!ret)
       return false;
 
+   runahead_invalidate();
+
 #if HAVE_NETWORKING
    netplay_driver_ctl(RARCH_NETPLAY_CTL_LOAD_SAVESTATE, info);
 #endif
@@ -323,11 +457,15 @@ bool core_unserialize(retro_ctx_serialize_info_t *info)
 
 bool core_serialize(retro_ctx_serialize_info_t *info)
 {
+   bool ret;
+
    if (!info)
       return false;
-   if (!core.retro_serialize(info->data, info->size))
-      return false;
-   return true;
+
+   performance_trace_begin("core_serialize");
+   ret = core.retro_serialize(info->data, info->size);
+   performance_trace_end("core_serialize");
+   return ret;
 }
 
 bool core_serialize_size(retro_ctx_size_info_t *info)
@@ -363,11 +501,23 @@ bool core_poll(void)
    return true;
 }
 
+/* The core keeps this for good, so it has to be able to tell
+ * which thread the core is calling from. */
+static bool core_environment(unsigned cmd, void *data)
+{
+#ifdef HAVE_THREADS
+   if (core_thread_is_self())
+      return core_thread_environment(core_environ_cb, cmd, data);
+#endif
+   return core_environ_cb(cmd, data);
+}
+
 bool core_set_environment(retro_ctx_environ_info_t *info)
 {
    if (!info)
       return false;
-   core.retro_set_environment(info->env);
+   core_environ_cb = info->env;
+   core.retro_set_environment(core_environment);
    return true;
 }
 
@@ -382,6 +532,7 @@ bool core_get_system_av_info(struct retro_system_av_info *av_info)
 bool core_reset(void)
 {
    core.retro_reset();
+   runahead_invalidate();
    return true;
 }
 
@@ -421,6 +572,8 @@ bool core_run(void)
    }
 #endif
 
+   performance_trace_begin("core_run");
+
    switch (core_poll_type)
    {
       case POLL_TYPE_EARLY:
@@ -438,6 +591,8 @@ bool core_run(void)
    if (core_poll_type == POLL_TYPE_LATE && !core_input_polled)
       input_poll();
 
+   performance_trace_end("core_run");
+
 #ifdef HAVE_NETWORKING
    netplay_driver_ctl(RARCH_NETPLAY_CTL_POST_FRAME, NULL);
 #endif
@@ -445,6 +600,23 @@ bool core_run(void)
    return true;
 }
 
+/**
+ * core_run_nopoll:
+ *
+ * Runs the core for one frame on the input polled last, whatever the
+ * poll type, leaving netplay out of it.
+ **/
+bool core_run_nopoll(void)
+{
+   performance_trace_begin("core_run");
+   core_input_held = true;
+   if (core.retro_run)
+      core.retro_run();
+   core_input_held = false;
+   performance_trace_end("core_run");
+   return true;
+}
+
 bool core_load(unsigned poll_type_behavior)
 {
    core_poll_type = poll_type_behavior;
@@ -680,6 +680,100 @@ bool init_libretro_sym(enum rarch_core_type type, struct retro_core_t *current_c
    return true;
 }
 
+#ifdef HAVE_DYNAMIC
+#define SYMBOL_INSTANCE(x) do { \
+   function_t func = dylib_proc(handle, #x); \
+   memcpy(&current_core->x, &func, sizeof(func)); \
+   if (current_core->x == NULL) { RARCH_ERR("Failed to load symbol: \"%s\"\n", #x); goto error; } \
+} while (0)
+#endif
+
+/**
+ * libretro_load_instance:
+ * @path                        : Path to a copy of the core library.
+ * @current_core                : Symbols of the new instance.
+ *
+ * Loads another, independent instance of a core from its own copy
+ * of the library, as used by run-ahead. The dynamic loader would
+ * hand back the running instance for the library itself.
+ *
+ * Returns: handle to pass to libretro_unload_instance(), or NULL
+ * if the core could not be loaded or is statically linked.
+ **/
+void *libretro_load_instance(const char *path,
+      struct retro_core_t *current_core)
+{
+#ifdef HAVE_DYNAMIC
+   dylib_t handle = dylib_load(path);
+
+   if (!handle)
+   {
+      RARCH_ERR("Failed to open libretro core: \"%s\"\n", path);
+      RARCH_ERR("Error(s): %s\n", dylib_error());
+      return NULL;
+   }
+
+   SYMBOL_INSTANCE(retro_init);
+   SYMBOL_INSTANCE(retro_deinit);
+
+   SYMBOL_INSTANCE(retro_api_version);
+   SYMBOL_INSTANCE(retro_get_system_info);
+   SYMBOL_INSTANCE(retro_get_system_av_info);
+
+   SYMBOL_INSTANCE(retro_set_environment);
+   SYMBOL_INSTANCE(retro_set_video_refresh);
+   SYMBOL_INSTANCE(retro_set_audio_sample);
+   SYMBOL_INSTANCE(retro_set_audio_sample_batch);
+   SYMBOL_INSTANCE(retro_set_input_poll);
+   SYMBOL_INSTANCE(retro_set_input_state);
+
+   SYMBOL_INSTANCE(retro_set_controller_port_device);
+
+   SYMBOL_INSTANCE(retro_reset);
+   SYMBOL_INSTANCE(retro_run);
+
+   SYMBOL_INSTANCE(retro_serialize_size);
+   SYMBOL_INSTANCE(retro_serialize);
+   SYMBOL_INSTANCE(retro_unserialize);
+
+   SYMBOL_INSTANCE(retro_cheat_reset);
+   SYMBOL_INSTANCE(retro_cheat_set);
+
+   SYMBOL_INSTANCE(retro_load_game);
+   SYMBOL_INSTANCE(retro_load_game_special);
+
+   SYMBOL_INSTANCE(retro_unload_game);
+   SYMBOL_INSTANCE(retro_get_region);
+   SYMBOL_INSTANCE(retro_get_memory_data);
+   SYMBOL_INSTANCE(retro_get_memory_size);
+
+   return handle;
+
+error:
+   dylib_close(handle);
+   memset(current_core, 0, sizeof(struct retro_core_t));
+#endif
+   return NULL;
+}
+
+/**
+ * libretro_unload_instance:
+ * @handle                      : Handle from libretro_load_instance().
+ * @current_core                : Symbols of the instance.
+ *
+ * Unloads an instance loaded with libretro_load_instance().
+ * The core must already be deinitialized.
+ **/
+void libretro_unload_instance(void *handle,
+      struct retro_core_t *current_core)
+{
+#ifdef HAVE_DYNAMIC
+   if (handle)
+      dylib_close((dylib_t)handle);
+#endif
+   memset(current_core, 0, sizeof(struct retro_core_t));
+}
+
 /**
  * uninit_libretro_sym:
  *
@@ -162,6 +162,30 @@ bool init_libretro_sym(enum rarch_core_type type,
  **/
 void uninit_libretro_sym(struct retro_core_t *core);
 
+/**
+ * libretro_load_instance:
+ * @path                        : Path to a copy of the core library.
+ * @core                        : Symbols of the new instance.
+ *
+ * Loads another, independent instance of a core from its own copy
+ * of the library.
+ *
+ * Returns: handle to pass to libretro_unload_instance(), or NULL
+ * if the core could not be loaded or is statically linked.
+ **/
+void *libretro_load_instance(const char *path,
+      struct retro_core_t *core);
+
+/**
+ * libretro_unload_instance:
+ * @handle                      : Handle from libretro_load_instance().
+ * @core                        : Symbols of the instance.
+ *
+ * Unloads an instance loaded with libretro_load_instance().
+ **/
+void libretro_unload_instance(void *handle,
+      struct retro_core_t *core);
+
 RETRO_END_DECLS
 
 #endif
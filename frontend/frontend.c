@@ -28,11 +28,13 @@
 
 #include "frontend.h"
 #include "../configuration.h"
+#include "../benchmark.h"
 #include "../ui/ui_companion_driver.h"
 #include "../tasks/tasks_internal.h"
 
 #include "../driver.h"
 #include "../paths.h"
+#include "../performance_trace.h"
 #include "../retroarch.h"
 
 #ifndef HAVE_MAIN
@@ -51,6 +53,10 @@ void main_exit(void *args)
 {
    settings_t *settings = config_get_ptr();
 
+   /* While the core and its performance counters are still there. */
+   benchmark_report();
+   benchmark_deinit();
+
    if (settings->config_save_on_exit)
       command_event(CMD_EVENT_MENU_SAVE_CURRENT_CONFIG, NULL);
 
@@ -61,6 +67,7 @@ void main_exit(void *args)
    rarch_ctl(RARCH_CTL_MAIN_DEINIT, NULL);
 
    command_event(CMD_EVENT_PERFCNT_REPORT_FRONTEND_LOG, NULL);
+   performance_trace_deinit();
 
 #if defined(HAVE_LOGGER) && !defined(ANDROID)
    logger_shutdown();
@@ -127,11 +134,22 @@ int rarch_main(int argc, char *argv[], void *data)
    do
    {
       unsigned sleep_ms = 0;
-      int           ret = runloop_iterate(&sleep_ms);
+      int           ret;
+
+      performance_trace_begin("runloop_iterate");
+      ret = runloop_iterate(&sleep_ms);
+      performance_trace_end("runloop_iterate");
 
       if (ret == 1 && sleep_ms > 0)
+      {
+         performance_trace_begin("sleep");
          retro_sleep(sleep_ms);
+         performance_trace_end("sleep");
+      }
+
+      performance_trace_begin("task_queue_check");
       task_queue_ctl(TASK_QUEUE_CTL_CHECK, NULL);
+      performance_trace_end("task_queue_check");
       if (ret == -1)
          break;
    }while(1);
@@ -54,6 +54,7 @@
 #include "../retroarch.h"
 #include "../runloop.h"
 #include "../performance_counters.h"
+#include "../performance_trace.h"
 #include "../list_special.h"
 #include "../core.h"
 #include "../command.h"
@@ -144,6 +145,8 @@ static bool video_driver_window_title_update             = true;
 static retro_time_t video_driver_frame_time_samples[MEASURE_FRAME_TIME_SAMPLES_COUNT];
 static uint64_t video_driver_frame_time_count            = 0;
 static uint64_t video_driver_frame_count                 = 0;
+static retro_time_t video_driver_frame_start             = 0;
+static retro_time_t video_driver_frame_end               = 0;
 
 void *video_driver_data                                  = NULL;
 video_driver_t *current_video                            = NULL;
@@ -1102,11 +1105,13 @@ static bool video_driver_frame_filter(
 
    *output_pitch = (*output_width) * video_driver_state_out_bpp;
 
+   performance_trace_begin("video_filter");
    performance_counter_start_plus(video_info->is_perfcnt_enable, softfilter_process);
    rarch_softfilter_process(video_driver_state_filter,
          video_driver_state_buffer, *output_pitch,
          data, width, height, pitch);
    performance_counter_stop_plus(video_info->is_perfcnt_enable, softfilter_process);
+   performance_trace_end("video_filter");
 
    if (video_info->post_filter_record && recording_data)
       recording_dump_frame(video_driver_state_buffer,
@@ -2046,6 +2051,10 @@ void video_driver_frame(const void *data, unsigned width,
    if (!video_driver_active)
       return;
 
+   performance_trace_begin("video_frame");
+
+   video_driver_frame_start = new_time;
+
    if (video_driver_scaler_ptr && data &&
          (video_driver_pix_fmt == RETRO_PIXEL_FORMAT_0RGB1555) &&
          (data != RETRO_HW_FRAME_BUFFER_VALID))
@@ -2122,6 +2131,9 @@ void video_driver_frame(const void *data, unsigned width,
       }
 
       if (video_info.fps_show)
+      {
+         unsigned delay, misses;
+
          snprintf(
                video_info.fps_text,
                sizeof(video_info.fps_text),
@@ -2129,6 +2141,16 @@ void video_driver_frame(const void *data, unsigned width,
                last_fps,
                msg_hash_to_str(MSG_FRAMES),
                (unsigned long long)video_info.frame_count);
+
+         if (runloop_get_frame_delay(&delay, &misses))
+         {
+            char delay_text[64];
+            snprintf(delay_text, sizeof(delay_text),
+                  " || Delay: %u ms (%u missed)", delay, misses);
+            strlcat(video_info.fps_text, delay_text,
+                  sizeof(video_info.fps_text));
+         }
+      }
    }
    else
    {
@@ -2178,14 +2200,33 @@ void video_driver_frame(const void *data, unsigned width,
          && msg)
       strlcpy(video_driver_msg, msg, sizeof(video_driver_msg));
 
+   performance_trace_begin("video_driver_frame");
    if (!current_video || !current_video->frame(
             video_driver_data, data, width, height,
             video_info.frame_count,
             pitch, video_driver_msg, &video_info))
       video_driver_active = false;
+   performance_trace_end("video_driver_frame");
+
+   video_driver_frame_end = cpu_features_get_time_usec();
 
    if (video_info.fps_show)
       runloop_msg_queue_push(video_info.fps_text, 1, 1, false);
+
+   performance_trace_end("video_frame");
+}
+
+/**
+ * video_driver_get_frame_times:
+ * @start                : when the last frame was handed to the
+ *                         video driver.
+ * @end                  : when the video driver was done with it,
+ *                         including any wait for VSync.
+ **/
+void video_driver_get_frame_times(retro_time_t *start, retro_time_t *end)
+{
+   *start = video_driver_frame_start;
+   *end   = video_driver_frame_end;
 }
 
 void video_driver_display_type_set(enum rarch_display_type type)
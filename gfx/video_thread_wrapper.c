@@ -27,6 +27,7 @@
 #include "video_shader_driver.h"
 
 #include "../performance_counters.h"
+#include "../performance_trace.h"
 #include "../runloop.h"
 #include "../verbosity.h"
 
@@ -574,6 +575,8 @@ static void video_thread_loop(void *data)
 {
    thread_video_t *thr = (thread_video_t*)data;
 
+   performance_trace_thread_name("video");
+
    for (;;)
    {
       thread_packet_t pkt;
@@ -609,6 +612,7 @@ static void video_thread_loop(void *data)
          vp.full_width            = 0;
          vp.full_height           = 0;
 
+         performance_trace_begin("video_thread_frame");
          slock_lock(thr->frame.lock);
 
          thread_update_driver_state(thr);
@@ -647,6 +651,7 @@ static void video_thread_loop(void *data)
          thr->vp            = vp;
          scond_signal(thr->cond_cmd);
          slock_unlock(thr->lock);
+         performance_trace_end("video_thread_frame");
       }
    }
 }
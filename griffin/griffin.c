@@ -83,6 +83,8 @@ PERFORMANCE
 ============================================================ */
 #include "../libretro-common/features/features_cpu.c"
 #include "../performance_counters.c"
+#include "../performance_trace.c"
+#include "../benchmark.c"
 
 /*============================================================
 COMPATIBILITY
@@ -759,6 +761,8 @@ CONFIGURATION
 STATE MANAGER
 ============================================================ */
 #include "../managers/state_manager.c"
+#include "../managers/state_delta.c"
+#include "../managers/runahead.c"
 
 /*============================================================
 FRONTEND
@@ -887,6 +891,7 @@ THREAD
 #include "../libretro-common/rthreads/rsemaphore.c"
 #include "../gfx/video_thread_wrapper.c"
 #include "../audio/audio_thread_wrapper.c"
+#include "../managers/core_thread.c"
 #endif
 
 
@@ -902,6 +907,15 @@ NETPLAY
 #include "../network/netplay/netplay_sync.c"
 #include "../network/netplay/netplay_discovery.c"
 #include "../network/netplay/netplay_buf.c"
+#include "../network/netplay/netplay_udp.c"
+#include "../network/netplay/netplay_poller.c"
+#include "../network/netplay/netplay_relay.c"
+#include "../network/netplay/netplay_predict.c"
+#include "../network/netplay/netplay_record.c"
+#include "../network/netplay/netplay_bisect.c"
+#include "../network/netplay/netplay_sim.c"
+#include "../network/netplay/netplay_iothread.c"
+#include "../network/netplay/netplay_transfer.c"
 #include "../libretro-common/net/net_compat.c"
 #include "../libretro-common/net/net_socket.c"
 #include "../libretro-common/net/net_http.c"
@@ -40,6 +40,7 @@
 #include "../list_special.h"
 #include "../verbosity.h"
 #include "../command.h"
+#include "../performance_trace.h"
 
 static const input_driver_t *input_drivers[] = {
 #ifdef __CELLOS_LV2__
@@ -270,7 +271,9 @@ void input_poll(void)
    size_t i;
    settings_t *settings           = config_get_ptr();
    unsigned max_users             = settings->input.max_users;
-   
+
+   performance_trace_begin("input_poll");
+
    current_input->poll(current_input_data);
 
    input_driver_turbo_btns.count++;
@@ -319,6 +322,8 @@ void input_poll(void)
                settings->input.max_users);
 #endif
    }
+
+   performance_trace_end("input_poll");
 }
 
 /**
@@ -106,6 +106,14 @@ MSG_HASH(
       MSG_NETPLAY_CHANGED_NICK,
       "Your nickname changed to \"%s\""
       )
+MSG_HASH(
+      MSG_NETPLAY_SENDING_SAVESTATE,
+      "Sending savestate to \"%s\": %u%%"
+      )
+MSG_HASH(
+      MSG_NETPLAY_RECEIVING_SAVESTATE,
+      "Receiving savestate from \"%s\": %u%%"
+      )
 MSG_HASH(
       MENU_ENUM_SUBLABEL_VIDEO_SHARED_CONTEXT,
       "Give hardware-rendered cores their own private context. Avoids having to assume hardware state changes inbetween frames."
@@ -2122,6 +2130,10 @@ MSG_HASH(MSG_REWIND_INIT_FAILED_THREADED_AUDIO,
       "Implementation uses threaded audio. Cannot use rewind.")
 MSG_HASH(MSG_REWIND_REACHED_END,
       "Reached end of rewind buffer.")
+MSG_HASH(MSG_RUN_AHEAD_CORE_DOES_NOT_SUPPORT_SAVESTATES,
+      "Run-ahead has been disabled because this core does not support save states.")
+MSG_HASH(MSG_RUN_AHEAD_TOO_SLOW,
+      "Run-ahead takes longer than a frame. Try running fewer frames ahead.")
 MSG_HASH(MSG_SAVED_NEW_CONFIG_TO,
       "Saved new config to")
 MSG_HASH(MSG_SAVED_STATE_TO_SLOT,
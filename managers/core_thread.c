@@ -0,0 +1,763 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2017 - The RetroArch team
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Threaded core. The core runs on its own thread, one frame at a time,
+ * into a frame of video and audio kept aside. While it runs frame N+1,
+ * the main thread shows frame N, which the core ran the time before.
+ *
+ * The handoff is at the frame boundary: the main thread polls input and
+ * hands a snapshot of it over just before the core starts a frame (the
+ * core never reads the input driver itself), then waits for the core to
+ * finish that frame before doing anything else. The core is
+ * thus idle whenever the rest of RetroArch might touch it (savestates,
+ * rewind, cheats, achievements, the menu, autosave), and what's shown
+ * is always exactly one frame behind the core. That boundary is fixed:
+ * there is no setting to hand over at another point or to let the core
+ * run further ahead, which would need a deeper queue of frames.
+ *
+ * Environment calls the core makes meanwhile are run on the main thread
+ * while it waits, except those that only read settings. Core options
+ * are answered from what the main thread last fetched for the core. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <features/features_cpu.h>
+#include <rthreads/rthreads.h>
+#include <string/stdstring.h>
+
+#ifdef HAVE_CONFIG_H
+#include "../config.h"
+#endif
+
+#ifdef HAVE_NETWORKING
+#include "../network/netplay/netplay.h"
+#endif
+
+#include "core_thread.h"
+#include "state_manager.h"
+#include "../configuration.h"
+#include "../core.h"
+#include "../movie.h"
+#include "../performance_trace.h"
+#include "../runloop.h"
+#include "../verbosity.h"
+#include "../audio/audio_driver.h"
+#include "../gfx/video_driver.h"
+#include "../input/input_driver.h"
+
+/* How often to log how the work is split between the threads */
+#define CORE_THREAD_REPORT_USEC 10000000
+
+/* Joypad buttons handed to the core each frame */
+#define CORE_THREAD_JOYPAD_IDS  (RETRO_DEVICE_ID_JOYPAD_R3 + 1)
+
+/* Other input the core has read (keys, mice, light guns, pointers...),
+ * which is handed over too from then on */
+#define CORE_THREAD_INPUTS      512
+
+/* Core options the core has read since they last changed */
+#define CORE_THREAD_VARIABLES   128
+
+typedef struct core_thread_input
+{
+   unsigned port;
+   unsigned device;
+   unsigned idx;
+   unsigned id;
+   int16_t value;
+} core_thread_input_t;
+
+typedef struct core_thread_variable
+{
+   char *key;
+   char *value;
+   bool ret;
+} core_thread_variable_t;
+
+/* What the core did in one frame */
+typedef struct core_thread_frame
+{
+   bool has_video;
+   const void *video;
+   void *video_buf;
+   size_t video_buf_size;
+   unsigned width;
+   unsigned height;
+   size_t pitch;
+
+   int16_t *audio;
+   size_t audio_frames;
+   size_t audio_capacity;
+} core_thread_frame_t;
+
+typedef struct core_thread
+{
+   sthread_t *thread;
+   slock_t *lock;
+   /* The core's thread waits on cond, the main thread on main_cond */
+   scond_t *cond;
+   scond_t *main_cond;
+   bool run;
+   bool done;
+   bool quit;
+
+   /* An environment call for the main thread to make */
+   bool env_pending;
+   bool env_ret;
+   unsigned env_cmd;
+   void *env_data;
+   retro_environment_t env;
+
+   /* Core options, kept by the core's thread and checked for changes
+    * by the main thread at the handoff */
+   retro_environment_t variables_env;
+   core_thread_variable_t variables[CORE_THREAD_VARIABLES];
+   unsigned variables_count;
+   bool variables_updated;
+
+   /* Given to the core when the frame starts */
+   unsigned users;
+   int16_t joypad[MAX_USERS][CORE_THREAD_JOYPAD_IDS];
+   int16_t analog[MAX_USERS][2][2];
+   core_thread_input_t inputs[CORE_THREAD_INPUTS];
+   unsigned inputs_count;
+
+   /* The core fills frames[write]; the other is shown meanwhile */
+   core_thread_frame_t frames[2];
+   unsigned write;
+   bool pending;
+   bool active;
+   /* The core is running a frame, and the main thread waiting on it */
+   bool busy;
+   /* Asked to stop while busy, so it stops once the frame is done */
+   bool flush_pending;
+
+   /* Since the last report */
+   retro_time_t report_time;
+   retro_time_t core_time;
+   retro_time_t present_time;
+   retro_time_t wait_time;
+   unsigned report_frames;
+   unsigned report_restarts;
+} core_thread_t;
+
+static core_thread_t *core_thread_st = NULL;
+
+bool core_thread_is_self(void)
+{
+   return core_thread_st && core_thread_st->thread &&
+      sthread_isself(core_thread_st->thread);
+}
+
+static void core_thread_video_refresh(const void *data,
+      unsigned width, unsigned height, size_t pitch)
+{
+   core_thread_frame_t *frame = &core_thread_st->frames[core_thread_st->write];
+   size_t size;
+
+   frame->has_video = true;
+   frame->width     = width;
+   frame->height    = height;
+   frame->pitch     = pitch;
+   frame->video     = NULL;
+
+   /* A dupe; the video driver shows what it has */
+   if (!data || !height)
+      return;
+
+   /* The last line needn't be a whole pitch long */
+   size = (height - 1) * pitch + width *
+      (video_driver_get_pixel_format() == RETRO_PIXEL_FORMAT_XRGB8888
+       ? sizeof(uint32_t) : sizeof(uint16_t));
+
+   if (size > frame->video_buf_size)
+   {
+      void *buf = realloc(frame->video_buf, size);
+      if (!buf)
+      {
+         frame->has_video = false;
+         return;
+      }
+      frame->video_buf      = buf;
+      frame->video_buf_size = size;
+   }
+
+   memcpy(frame->video_buf, data, size);
+   frame->video = frame->video_buf;
+}
+
+static size_t core_thread_audio_sample_batch(const int16_t *data,
+      size_t frames)
+{
+   core_thread_frame_t *frame = &core_thread_st->frames[core_thread_st->write];
+
+   if (frame->audio_frames + frames > frame->audio_capacity)
+   {
+      size_t capacity = (frame->audio_frames + frames) * 2;
+      int16_t *audio  = (int16_t*)realloc(frame->audio,
+            capacity * 2 * sizeof(int16_t));
+      if (!audio)
+         return frames;
+      frame->audio          = audio;
+      frame->audio_capacity = capacity;
+   }
+
+   memcpy(frame->audio + frame->audio_frames * 2, data,
+         frames * 2 * sizeof(int16_t));
+   frame->audio_frames += frames;
+   return frames;
+}
+
+static void core_thread_audio_sample(int16_t left, int16_t right)
+{
+   int16_t sample[2];
+
+   sample[0] = left;
+   sample[1] = right;
+   core_thread_audio_sample_batch(sample, 1);
+}
+
+/* The main thread polls before the frame starts */
+static void core_thread_input_poll(void)
+{
+}
+
+static int16_t core_thread_input_state(unsigned port,
+      unsigned device, unsigned idx, unsigned id)
+{
+   unsigned i;
+   core_thread_t *thr = core_thread_st;
+
+   if (port < thr->users)
+   {
+      switch (device & RETRO_DEVICE_MASK)
+      {
+         case RETRO_DEVICE_JOYPAD:
+            if (id < CORE_THREAD_JOYPAD_IDS)
+               return thr->joypad[port][id];
+            break;
+         case RETRO_DEVICE_ANALOG:
+            if (idx < 2 && id < 2)
+               return thr->analog[port][idx][id];
+            break;
+         default:
+            break;
+      }
+   }
+
+   for (i = 0; i < thr->inputs_count; i++)
+   {
+      core_thread_input_t *input = &thr->inputs[i];
+
+      if (  input->port   == port
+         && input->device == device
+         && input->idx    == idx
+         && input->id     == id)
+         return input->value;
+   }
+
+   /* The input driver belongs to the main thread, so input the core
+    * hasn't read before reads as nothing for this one frame. */
+   if (thr->inputs_count < CORE_THREAD_INPUTS)
+   {
+      core_thread_input_t *input = &thr->inputs[thr->inputs_count++];
+
+      input->port   = port;
+      input->device = device;
+      input->idx    = idx;
+      input->id     = id;
+      input->value  = 0;
+   }
+   return 0;
+}
+
+static void core_thread_variables_free(core_thread_t *thr)
+{
+   unsigned i;
+
+   for (i = 0; i < thr->variables_count; i++)
+   {
+      free(thr->variables[i].key);
+      free(thr->variables[i].value);
+   }
+   thr->variables_count = 0;
+}
+
+/* At the handoff. Fetching a core option is what clears the frontend's
+ * updated flag, so until the core does, it's only looked at here. */
+static void core_thread_variables_update(core_thread_t *thr)
+{
+   bool updated = false;
+
+   if (!thr->variables_env)
+      return;
+
+   thr->variables_env(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated);
+   thr->variables_updated = updated;
+   if (updated)
+      core_thread_variables_free(thr);
+}
+
+static void core_thread_input_update(core_thread_t *thr)
+{
+   unsigned i, port, idx, id;
+   settings_t *settings = config_get_ptr();
+
+   input_poll();
+   core_thread_variables_update(thr);
+
+   thr->users = settings->input.max_users;
+   if (thr->users > MAX_USERS)
+      thr->users = MAX_USERS;
+
+   for (port = 0; port < thr->users; port++)
+   {
+      for (id = 0; id < CORE_THREAD_JOYPAD_IDS; id++)
+         thr->joypad[port][id] = input_state(port,
+               RETRO_DEVICE_JOYPAD, 0, id);
+      for (idx = 0; idx < 2; idx++)
+         for (id = 0; id < 2; id++)
+            thr->analog[port][idx][id] = input_state(port,
+                  RETRO_DEVICE_ANALOG, idx, id);
+   }
+
+   for (i = 0; i < thr->inputs_count; i++)
+   {
+      core_thread_input_t *input = &thr->inputs[i];
+      input->value = input_state(input->port,
+            input->device, input->idx, input->id);
+   }
+}
+
+static bool core_thread_environment_is_safe(unsigned cmd)
+{
+   switch (cmd)
+   {
+      case RETRO_ENVIRONMENT_GET_CAN_DUPE:
+      case RETRO_ENVIRONMENT_GET_OVERSCAN:
+      case RETRO_ENVIRONMENT_GET_LOG_INTERFACE:
+      case RETRO_ENVIRONMENT_GET_PERF_INTERFACE:
+      case RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY:
+      case RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY:
+      case RETRO_ENVIRONMENT_GET_CORE_ASSETS_DIRECTORY:
+      case RETRO_ENVIRONMENT_GET_LIBRETRO_PATH:
+      case RETRO_ENVIRONMENT_GET_USERNAME:
+      case RETRO_ENVIRONMENT_GET_LANGUAGE:
+      case RETRO_ENVIRONMENT_GET_INPUT_DEVICE_CAPABILITIES:
+      case RETRO_ENVIRONMENT_SET_MESSAGE:
+         return true;
+      default:
+         break;
+   }
+   return false;
+}
+
+/* Has the main thread make an environment call, and waits for it */
+static bool core_thread_environment_proxy(core_thread_t *thr,
+      retro_environment_t env, unsigned cmd, void *data)
+{
+   bool ret;
+
+   slock_lock(thr->lock);
+   thr->env         = env;
+   thr->env_cmd     = cmd;
+   thr->env_data    = data;
+   thr->env_pending = true;
+   scond_signal(thr->main_cond);
+   while (thr->env_pending)
+      scond_wait(thr->cond, thr->lock);
+   ret = thr->env_ret;
+   slock_unlock(thr->lock);
+
+   return ret;
+}
+
+static bool core_thread_get_variable(core_thread_t *thr,
+      retro_environment_t env, struct retro_variable *var)
+{
+   unsigned i;
+   bool ret;
+
+   thr->variables_updated = false;
+
+   for (i = 0; i < thr->variables_count; i++)
+   {
+      core_thread_variable_t *variable = &thr->variables[i];
+
+      if (string_is_equal(variable->key, var->key))
+      {
+         var->value = variable->value;
+         return variable->ret;
+      }
+   }
+
+   ret = core_thread_environment_proxy(thr, env,
+         RETRO_ENVIRONMENT_GET_VARIABLE, var);
+
+   if (thr->variables_count < CORE_THREAD_VARIABLES)
+   {
+      core_thread_variable_t *variable = &thr->variables[thr->variables_count];
+
+      variable->key   = strdup(var->key);
+      variable->value = var->value ? strdup(var->value) : NULL;
+      variable->ret   = ret;
+
+      if (variable->key && (variable->value || !var->value))
+      {
+         var->value = variable->value;
+         thr->variables_count++;
+      }
+      else
+      {
+         free(variable->key);
+         free(variable->value);
+      }
+   }
+
+   return ret;
+}
+
+bool core_thread_environment(retro_environment_t env,
+      unsigned cmd, void *data)
+{
+   bool ret;
+   core_thread_t *thr = core_thread_st;
+
+   if (core_thread_environment_is_safe(cmd))
+      return env(cmd, data);
+
+   switch (cmd)
+   {
+      case RETRO_ENVIRONMENT_GET_VARIABLE:
+         thr->variables_env = env;
+         if (data && ((struct retro_variable*)data)->key)
+            return core_thread_get_variable(thr, env,
+                  (struct retro_variable*)data);
+         break;
+      case RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE:
+         /* Until the main thread has looked, it has to be asked */
+         if (!thr->variables_env)
+         {
+            thr->variables_env = env;
+            break;
+         }
+         *(bool*)data = thr->variables_updated;
+         return true;
+      default:
+         break;
+   }
+
+   ret = core_thread_environment_proxy(thr, env, cmd, data);
+
+   /* Anything else might have changed the core options */
+   if (cmd != RETRO_ENVIRONMENT_GET_VARIABLE &&
+         cmd != RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE)
+      core_thread_variables_free(thr);
+
+   return ret;
+}
+
+static void core_thread_loop(void *data)
+{
+   core_thread_t *thr = (core_thread_t*)data;
+
+   performance_trace_thread_name("core");
+
+   for (;;)
+   {
+      retro_time_t start;
+
+      slock_lock(thr->lock);
+      while (!thr->run && !thr->quit)
+         scond_wait(thr->cond, thr->lock);
+      if (thr->quit)
+      {
+         slock_unlock(thr->lock);
+         break;
+      }
+      thr->run = false;
+      slock_unlock(thr->lock);
+
+      start = cpu_features_get_time_usec();
+      core_run_nopoll();
+      thr->core_time += cpu_features_get_time_usec() - start;
+
+      slock_lock(thr->lock);
+      thr->done = true;
+      scond_signal(thr->main_cond);
+      slock_unlock(thr->lock);
+   }
+}
+
+/* Waits for the core's frame, making any environment calls it needs
+ * made on this thread meanwhile. */
+static void core_thread_wait(core_thread_t *thr)
+{
+   slock_lock(thr->lock);
+   while (!thr->done)
+   {
+      if (thr->env_pending)
+      {
+         bool ret;
+
+         slock_unlock(thr->lock);
+         ret = thr->env(thr->env_cmd, thr->env_data);
+         slock_lock(thr->lock);
+
+         thr->env_ret     = ret;
+         thr->env_pending = false;
+         scond_signal(thr->cond);
+         continue;
+      }
+      scond_wait(thr->main_cond, thr->lock);
+   }
+   slock_unlock(thr->lock);
+}
+
+static void core_thread_present(core_thread_frame_t *frame)
+{
+   size_t i;
+
+   if (frame->has_video)
+      video_driver_frame(frame->video,
+            frame->width, frame->height, frame->pitch);
+
+   for (i = 0; i < frame->audio_frames; )
+      i += audio_driver_sample_batch(frame->audio + i * 2,
+            frame->audio_frames - i);
+}
+
+static void core_thread_report(core_thread_t *thr, retro_time_t now)
+{
+   unsigned frames = thr->report_frames;
+
+   if (!thr->report_time)
+      thr->report_time = now;
+   if (!frames || now - thr->report_time < CORE_THREAD_REPORT_USEC)
+      return;
+
+   /* Each stop shows a frame without running the next alongside */
+   RARCH_LOG("[Core thread]: Per frame: core %u usec, presenting %u usec "
+         "alongside it, then waiting %u usec for the core. "
+         "Stopped %u times in %u frames.\n",
+         (unsigned)(thr->core_time / frames),
+         (unsigned)(thr->present_time / frames),
+         (unsigned)(thr->wait_time / frames),
+         thr->report_restarts, frames);
+
+   thr->report_time     = now;
+   thr->report_frames   = 0;
+   thr->report_restarts = 0;
+   thr->core_time     = 0;
+   thr->present_time  = 0;
+   thr->wait_time     = 0;
+}
+
+static bool core_thread_init(void)
+{
+   core_thread_t *thr = (core_thread_t*)calloc(1, sizeof(*thr));
+
+   if (!thr)
+      return false;
+
+   thr->lock      = slock_new();
+   thr->cond      = scond_new();
+   thr->main_cond = scond_new();
+   if (!thr->lock || !thr->cond || !thr->main_cond)
+      goto error;
+
+   core_thread_st = thr;
+
+   thr->thread    = sthread_create(core_thread_loop, thr);
+   if (!thr->thread)
+      goto error;
+
+   RARCH_LOG("[Core thread]: Running the core on its own thread.\n");
+   return true;
+
+error:
+   RARCH_ERR("[Core thread]: Failed to start the core's thread.\n");
+   if (thr->lock)
+      slock_free(thr->lock);
+   if (thr->cond)
+      scond_free(thr->cond);
+   if (thr->main_cond)
+      scond_free(thr->main_cond);
+   free(thr);
+   core_thread_st = NULL;
+   return false;
+}
+
+/* Things the core's thread can't be used with, for now */
+static bool core_thread_is_allowed(settings_t *settings)
+{
+#ifdef HAVE_NETWORKING
+   if (netplay_driver_ctl(RARCH_NETPLAY_CTL_IS_DATA_INITED, NULL))
+      return false;
+#endif
+   /* Run-ahead runs the core several times a frame itself */
+   if (settings->run_ahead_frames)
+      return false;
+   /* The core renders with a context that belongs to the main thread */
+   if (video_driver_is_hw_context())
+      return false;
+   if (bsv_movie_ctl(BSV_MOVIE_CTL_IS_INITED, NULL))
+      return false;
+   /* Rewound audio goes elsewhere */
+   return !state_manager_frame_is_reversed();
+}
+
+bool core_thread_run(void)
+{
+   retro_time_t start, presented, now;
+   core_thread_frame_t *frame = NULL;
+   core_thread_t *thr         = core_thread_st;
+   settings_t *settings       = config_get_ptr();
+
+   if (!settings->core_threaded || !core_thread_is_allowed(settings))
+   {
+      core_thread_flush();
+      return false;
+   }
+
+   if (!thr)
+   {
+      if (!core_thread_init())
+         return false;
+      thr = core_thread_st;
+   }
+
+   if (!thr->active)
+   {
+      struct retro_callbacks cbs;
+
+      cbs.frame_cb        = core_thread_video_refresh;
+      cbs.sample_cb       = core_thread_audio_sample;
+      cbs.sample_batch_cb = core_thread_audio_sample_batch;
+      cbs.state_cb        = core_thread_input_state;
+      cbs.poll_cb         = core_thread_input_poll;
+
+      core_set_callbacks(&cbs);
+      thr->active  = true;
+      thr->pending = false;
+   }
+
+   core_thread_input_update(thr);
+
+   frame               = &thr->frames[thr->write];
+   frame->has_video    = false;
+   frame->audio_frames = 0;
+
+   start = cpu_features_get_time_usec();
+
+   thr->busy = true;
+
+   slock_lock(thr->lock);
+   thr->done = false;
+   thr->run  = true;
+   scond_signal(thr->cond);
+   slock_unlock(thr->lock);
+
+   /* Show the last frame while the core works on the next one */
+   if (thr->pending)
+   {
+      performance_trace_begin("core_thread_present");
+      core_thread_present(&thr->frames[thr->write ^ 1]);
+      performance_trace_end("core_thread_present");
+   }
+   presented = cpu_features_get_time_usec();
+
+   performance_trace_begin("core_thread_wait");
+   core_thread_wait(thr);
+   performance_trace_end("core_thread_wait");
+   now = cpu_features_get_time_usec();
+
+   thr->busy    = false;
+   thr->write  ^= 1;
+   thr->pending = true;
+
+   thr->present_time += presented - start;
+   thr->wait_time    += now - presented;
+   thr->report_frames++;
+   core_thread_report(thr, now);
+
+   if (thr->flush_pending)
+      core_thread_flush();
+
+   return true;
+}
+
+void core_thread_flush(void)
+{
+   core_thread_t *thr = core_thread_st;
+
+   if (!thr || !thr->active)
+      return;
+
+   /* Asked by an environment call the core is waiting on, so the
+    * core's still running its frame */
+   if (thr->busy)
+   {
+      thr->flush_pending = true;
+      return;
+   }
+
+   thr->flush_pending = false;
+   thr->active        = false;
+   thr->report_restarts++;
+   core_set_callbacks(NULL);
+
+   /* The core's next frame follows this one */
+   if (thr->pending)
+   {
+      performance_trace_begin("core_thread_present");
+      core_thread_present(&thr->frames[thr->write ^ 1]);
+      performance_trace_end("core_thread_present");
+   }
+   thr->pending = false;
+}
+
+void core_thread_deinit(void)
+{
+   unsigned i;
+   core_thread_t *thr = core_thread_st;
+
+   if (!thr)
+      return;
+
+   /* The content is going, so its last frame needn't be shown */
+   thr->pending = false;
+   core_thread_flush();
+
+   slock_lock(thr->lock);
+   thr->quit = true;
+   scond_signal(thr->cond);
+   slock_unlock(thr->lock);
+   sthread_join(thr->thread);
+
+   for (i = 0; i < 2; i++)
+   {
+      free(thr->frames[i].video_buf);
+      free(thr->frames[i].audio);
+   }
+   core_thread_variables_free(thr);
+
+   slock_free(thr->lock);
+   scond_free(thr->cond);
+   scond_free(thr->main_cond);
+   free(thr);
+   core_thread_st = NULL;
+}
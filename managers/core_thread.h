@@ -0,0 +1,77 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2017 - The RetroArch team
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CORE_THREAD_H
+#define __CORE_THREAD_H
+
+#include <boolean.h>
+#include <retro_common_api.h>
+#include <libretro.h>
+
+RETRO_BEGIN_DECLS
+
+/**
+ * core_thread_run:
+ *
+ * With core_threaded enabled, hands the core a frame to run on its own
+ * thread, and shows the frame it ran last time while it does. The
+ * core's thread is done with the new frame when this returns.
+ *
+ * Returns: true if the core was run, false if it has to be run the
+ * usual way.
+ **/
+bool core_thread_run(void);
+
+/**
+ * core_thread_flush:
+ *
+ * Gives the core its usual callbacks back, and shows the frame that
+ * has yet to be shown. The thread is kept for later.
+ **/
+void core_thread_flush(void);
+
+/**
+ * core_thread_deinit:
+ *
+ * Stops the core's thread. Called before the core's content is
+ * unloaded.
+ **/
+void core_thread_deinit(void);
+
+/**
+ * core_thread_is_self:
+ *
+ * Returns: true if called from the core's thread.
+ **/
+bool core_thread_is_self(void);
+
+/**
+ * core_thread_environment:
+ * @env                : the frontend's environment callback.
+ * @cmd                : environment command.
+ * @data               : environment data.
+ *
+ * Environment callback for the core's thread. Calls that only read
+ * settings are answered right away; the rest are run on the main
+ * thread once it's done showing the previous frame.
+ *
+ * Returns: what @env returned.
+ **/
+bool core_thread_environment(retro_environment_t env,
+      unsigned cmd, void *data);
+
+RETRO_END_DECLS
+
+#endif
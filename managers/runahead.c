@@ -0,0 +1,647 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2017 - The RetroArch team
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Run-ahead. Each frame, the core runs the real frame, whose audio is
+ * played, and then keeps going for run_ahead_frames more frames with the
+ * same input. Only the last of those is shown, and the core is then put
+ * back to where the real frame left it. A game that takes a few frames to
+ * react to input thus reacts that many frames sooner on screen.
+ *
+ * Putting the core back costs a savestate and a load every frame. With
+ * run_ahead_secondary_instance, the frames ahead run on a second instance
+ * of the core instead. While the input stays the same, that instance
+ * simply runs one frame further each frame; only when it changes does it
+ * have to load the real state and run all the frames ahead again. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <compat/strl.h>
+#include <file/file_path.h>
+#include <streams/file_stream.h>
+#include <string/stdstring.h>
+#include <features/features_cpu.h>
+
+#ifdef HAVE_CONFIG_H
+#include "../config.h"
+#endif
+
+#ifdef HAVE_NETWORKING
+#include "../network/netplay/netplay.h"
+#endif
+
+#include "runahead.h"
+#include "state_manager.h"
+#include "../configuration.h"
+#include "../core.h"
+#include "../dirs.h"
+#include "../dynamic.h"
+#include "../movie.h"
+#include "../msg_hash.h"
+#include "../paths.h"
+#include "../runloop.h"
+#include "../verbosity.h"
+#include "../gfx/video_driver.h"
+#include "../input/input_driver.h"
+
+/* How often to log what run-ahead costs */
+#define RUNAHEAD_REPORT_USEC 10000000
+
+typedef struct runahead_state
+{
+   bool inited;
+   /* Set when the core can't do it; cleared when it's unloaded */
+   bool failed;
+   unsigned frames_ahead;
+
+   void *state;
+   size_t state_size;
+
+   /* The second instance */
+   bool secondary;
+   bool secondary_synced;
+   unsigned secondary_frames;
+   void *secondary_handle;
+   struct retro_core_t secondary_core;
+   char secondary_path[PATH_MAX_LENGTH];
+   uint32_t input_hash;
+   uint32_t last_input_hash;
+
+   /* What it costs, since the last report */
+   retro_time_t save_time;
+   retro_time_t load_time;
+   retro_time_t run_time;
+   unsigned saves;
+   unsigned frames;
+   retro_time_t report_time;
+   bool warned_slow;
+} runahead_state_t;
+
+typedef struct runahead_content
+{
+   bool loadable;
+   bool empty;
+   char *path;
+   void *data;
+   size_t size;
+   char *meta;
+} runahead_content_t;
+
+static runahead_state_t runahead_st;
+static runahead_content_t runahead_content;
+
+static void runahead_video_refresh_null(const void *data,
+      unsigned width, unsigned height, size_t pitch)
+{
+}
+
+static void runahead_audio_sample_null(int16_t left, int16_t right)
+{
+}
+
+static size_t runahead_audio_sample_batch_null(const int16_t *data,
+      size_t frames)
+{
+   return frames;
+}
+
+static void runahead_input_poll_null(void)
+{
+}
+
+/* The second instance reads the input the real frame polled */
+static int16_t runahead_secondary_input_state(unsigned port,
+      unsigned device, unsigned idx, unsigned id)
+{
+   return input_state(port, device, idx, id);
+}
+
+/* Input state callback of the real core with the second instance.
+ * Everything it reads goes into a hash, to spot when it changes. */
+static int16_t runahead_input_state(unsigned port,
+      unsigned device, unsigned idx, unsigned id)
+{
+   int16_t state = core_input_state_poll(port, device, idx, id);
+   uint32_t key  = (port << 24) ^ (device << 16) ^ (idx << 8) ^ id;
+
+   runahead_st.input_hash = (runahead_st.input_hash ^ key) * 0x01000193;
+   runahead_st.input_hash = (runahead_st.input_hash ^ (uint16_t)state)
+      * 0x01000193;
+   return state;
+}
+
+/* The real core has already told the frontend everything it needs to
+ * know, so the second instance may only ask. */
+static bool runahead_secondary_environment(unsigned cmd, void *data)
+{
+   switch (cmd)
+   {
+      case RETRO_ENVIRONMENT_SET_HW_RENDER:
+      case RETRO_ENVIRONMENT_SET_HW_RENDER | RETRO_ENVIRONMENT_EXPERIMENTAL:
+      case RETRO_ENVIRONMENT_SET_HW_RENDER_CONTEXT_NEGOTIATION_INTERFACE:
+      case RETRO_ENVIRONMENT_GET_CURRENT_SOFTWARE_FRAMEBUFFER:
+      case RETRO_ENVIRONMENT_SET_AUDIO_CALLBACK:
+      case RETRO_ENVIRONMENT_SET_FRAME_TIME_CALLBACK:
+      case RETRO_ENVIRONMENT_SET_KEYBOARD_CALLBACK:
+      case RETRO_ENVIRONMENT_SHUTDOWN:
+         return false;
+
+      case RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE:
+         /* The real core picks up any change */
+         if (data)
+            *(bool*)data = false;
+         return true;
+
+      case RETRO_ENVIRONMENT_SET_ROTATION:
+      case RETRO_ENVIRONMENT_SET_MESSAGE:
+      case RETRO_ENVIRONMENT_SET_PERFORMANCE_LEVEL:
+      case RETRO_ENVIRONMENT_SET_PIXEL_FORMAT:
+      case RETRO_ENVIRONMENT_SET_INPUT_DESCRIPTORS:
+      case RETRO_ENVIRONMENT_SET_DISK_CONTROL_INTERFACE:
+      case RETRO_ENVIRONMENT_SET_VARIABLES:
+      case RETRO_ENVIRONMENT_SET_SUPPORT_NO_GAME:
+      case RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO:
+      case RETRO_ENVIRONMENT_SET_PROC_ADDRESS_CALLBACK:
+      case RETRO_ENVIRONMENT_SET_SUBSYSTEM_INFO:
+      case RETRO_ENVIRONMENT_SET_CONTROLLER_INFO:
+      case RETRO_ENVIRONMENT_SET_MEMORY_MAPS:
+      case RETRO_ENVIRONMENT_SET_GEOMETRY:
+      case RETRO_ENVIRONMENT_SET_SUPPORT_ACHIEVEMENTS:
+      case RETRO_ENVIRONMENT_SET_SERIALIZATION_QUIRKS:
+         return true;
+
+      default:
+         break;
+   }
+
+   return rarch_environment_cb(cmd, data);
+}
+
+static void runahead_secondary_deinit(void)
+{
+   if (runahead_st.secondary_handle)
+   {
+      runahead_st.secondary_core.retro_unload_game();
+      runahead_st.secondary_core.retro_deinit();
+      libretro_unload_instance(runahead_st.secondary_handle,
+            &runahead_st.secondary_core);
+   }
+
+   if (!string_is_empty(runahead_st.secondary_path))
+      remove(runahead_st.secondary_path);
+
+#ifdef HAVE_NETWORKING
+   /* Netplay has its own input callback in place by now */
+   if (runahead_st.secondary &&
+         !netplay_driver_ctl(RARCH_NETPLAY_CTL_IS_DATA_INITED, NULL))
+#else
+   if (runahead_st.secondary)
+#endif
+   {
+      retro_ctx_input_state_info_t input_info;
+      input_info.cb = core_input_state_poll;
+      core_set_input_state(&input_info);
+   }
+
+   runahead_st.secondary         = false;
+   runahead_st.secondary_synced  = false;
+   runahead_st.secondary_handle  = NULL;
+   runahead_st.secondary_path[0] = '\0';
+}
+
+/* Load another instance of the core, with the same content, from a copy
+ * of the core library. */
+static bool runahead_secondary_init(void)
+{
+   struct retro_game_info info;
+   retro_ctx_input_state_info_t input_info;
+   settings_t *settings  = config_get_ptr();
+   const char *core_path = path_get(RARCH_PATH_CORE);
+   const char *dir       = settings->directory.cache;
+   void *buf             = NULL;
+   ssize_t len           = 0;
+   char name[PATH_MAX_LENGTH];
+   struct retro_core_t *core = &runahead_st.secondary_core;
+
+   if (!runahead_content.loadable)
+   {
+      RARCH_WARN("Run-ahead: this content can't be loaded a second time.\n");
+      return false;
+   }
+
+   if (video_driver_is_hw_context())
+   {
+      RARCH_WARN("Run-ahead: a second instance of a hardware rendered core isn't possible.\n");
+      return false;
+   }
+
+   if (string_is_empty(dir))
+      dir = dir_get(RARCH_DIR_SAVESTATE);
+   if (string_is_empty(core_path) || string_is_empty(dir))
+      return false;
+
+   snprintf(name, sizeof(name), "runahead-%s", path_basename(core_path));
+   fill_pathname_join(runahead_st.secondary_path, dir, name,
+         sizeof(runahead_st.secondary_path));
+
+   if (!filestream_read_file(core_path, &buf, &len))
+   {
+      runahead_st.secondary_path[0] = '\0';
+      return false;
+   }
+   if (!filestream_write_file(runahead_st.secondary_path, buf, len))
+   {
+      RARCH_WARN("Run-ahead: could not copy the core to \"%s\".\n",
+            runahead_st.secondary_path);
+      free(buf);
+      runahead_st.secondary_path[0] = '\0';
+      return false;
+   }
+   free(buf);
+
+   runahead_st.secondary_handle = libretro_load_instance(
+         runahead_st.secondary_path, core);
+   if (!runahead_st.secondary_handle)
+      goto error;
+
+   if (core->retro_api_version() != RETRO_API_VERSION)
+      goto error;
+
+   core->retro_set_environment(runahead_secondary_environment);
+   core->retro_init();
+
+   core->retro_set_video_refresh(runahead_video_refresh_null);
+   core->retro_set_audio_sample(runahead_audio_sample_null);
+   core->retro_set_audio_sample_batch(runahead_audio_sample_batch_null);
+   core->retro_set_input_poll(runahead_input_poll_null);
+   core->retro_set_input_state(runahead_secondary_input_state);
+
+   info.path = runahead_content.path;
+   info.data = runahead_content.data;
+   info.size = runahead_content.size;
+   info.meta = runahead_content.meta;
+
+   if (!core->retro_load_game(runahead_content.empty ? NULL : &info))
+   {
+      core->retro_deinit();
+      libretro_unload_instance(runahead_st.secondary_handle, core);
+      runahead_st.secondary_handle = NULL;
+      goto error;
+   }
+
+   if (core->retro_serialize_size() != runahead_st.state_size)
+   {
+      RARCH_WARN("Run-ahead: the second instance has a different state size.\n");
+      runahead_secondary_deinit();
+      return false;
+   }
+
+   /* Watch what the real core reads */
+   input_info.cb = runahead_input_state;
+   core_set_input_state(&input_info);
+
+   runahead_st.secondary        = true;
+   runahead_st.secondary_synced = false;
+   return true;
+
+error:
+   RARCH_WARN("Run-ahead: could not load a second instance of the core.\n");
+   if (runahead_st.secondary_handle)
+      libretro_unload_instance(runahead_st.secondary_handle, core);
+   runahead_st.secondary_handle = NULL;
+   remove(runahead_st.secondary_path);
+   runahead_st.secondary_path[0] = '\0';
+   return false;
+}
+
+/* Log what run-ahead costs every so often, and warn once on screen if
+ * it doesn't fit in a frame. */
+static void runahead_report(bool force)
+{
+   unsigned save, load, run;
+   retro_time_t now    = cpu_features_get_time_usec();
+   unsigned frames     = runahead_st.frames;
+   const struct retro_system_av_info *av_info =
+      video_viewport_get_system_av_info();
+
+   if (!runahead_st.report_time)
+      runahead_st.report_time = now;
+   if (!frames ||
+         (!force && now - runahead_st.report_time < RUNAHEAD_REPORT_USEC))
+      return;
+
+   save = (unsigned)(runahead_st.save_time / frames);
+   load = (unsigned)(runahead_st.load_time / frames);
+   run  = (unsigned)(runahead_st.run_time  / frames);
+
+   RARCH_LOG("Run-ahead: %u frames ahead, per frame: save %u usec, "
+         "load %u usec, hidden frames %u usec (state saved on %u%% of frames).\n",
+         runahead_st.frames_ahead, save, load, run,
+         runahead_st.saves * 100 / frames);
+
+   if (!runahead_st.warned_slow && av_info && av_info->timing.fps > 0.0 &&
+         save + load + run > 1000000.0 / av_info->timing.fps)
+   {
+      runloop_msg_queue_push(msg_hash_to_str(MSG_RUN_AHEAD_TOO_SLOW),
+            1, 180, true);
+      RARCH_WARN("%s\n", msg_hash_to_str(MSG_RUN_AHEAD_TOO_SLOW));
+      runahead_st.warned_slow = true;
+   }
+
+   runahead_st.save_time   = 0;
+   runahead_st.load_time   = 0;
+   runahead_st.run_time    = 0;
+   runahead_st.saves       = 0;
+   runahead_st.frames      = 0;
+   runahead_st.report_time = now;
+}
+
+static void runahead_free_state(void)
+{
+   if (runahead_st.inited)
+      runahead_report(true);
+   runahead_secondary_deinit();
+   free(runahead_st.state);
+   memset(&runahead_st, 0, sizeof(runahead_st));
+}
+
+static bool runahead_init(void)
+{
+   retro_ctx_size_info_t info;
+   settings_t *settings = config_get_ptr();
+
+   core_serialize_size(&info);
+   if (!info.size)
+   {
+      runloop_msg_queue_push(
+            msg_hash_to_str(MSG_RUN_AHEAD_CORE_DOES_NOT_SUPPORT_SAVESTATES),
+            1, 180, true);
+      RARCH_WARN("%s\n",
+            msg_hash_to_str(MSG_RUN_AHEAD_CORE_DOES_NOT_SUPPORT_SAVESTATES));
+      runahead_st.failed = true;
+      return false;
+   }
+
+   runahead_st.state = malloc(info.size);
+   if (!runahead_st.state)
+   {
+      runahead_st.failed = true;
+      return false;
+   }
+   runahead_st.state_size = info.size;
+   runahead_st.inited     = true;
+
+   if (settings->run_ahead_secondary_instance)
+      runahead_secondary_init();
+
+   RARCH_LOG("Run-ahead: running %u frames ahead%s.\n",
+         settings->run_ahead_frames,
+         runahead_st.secondary ? " on a second instance of the core" : "");
+   return true;
+}
+
+/* The core couldn't save or load its state after all. The real frame
+ * has run, but nothing was shown, so show the last frame again. */
+static bool runahead_fail(void)
+{
+   RARCH_WARN("%s\n",
+         msg_hash_to_str(MSG_RUN_AHEAD_CORE_DOES_NOT_SUPPORT_SAVESTATES));
+   runloop_msg_queue_push(
+         msg_hash_to_str(MSG_RUN_AHEAD_CORE_DOES_NOT_SUPPORT_SAVESTATES),
+         1, 180, true);
+   core_set_output_callbacks(true, true);
+   runahead_free_state();
+   runahead_st.failed = true;
+   video_driver_cached_frame();
+   return true;
+}
+
+static bool runahead_run_single(unsigned frames_ahead)
+{
+   unsigned i;
+   retro_time_t start;
+   retro_ctx_serialize_info_t info;
+
+   info.data       = runahead_st.state;
+   info.data_const = runahead_st.state;
+   info.size       = runahead_st.state_size;
+
+   /* The real frame. It's heard, but what's seen comes later. */
+   core_set_output_callbacks(false, true);
+   core_run();
+
+   start = cpu_features_get_time_usec();
+   if (!core_serialize(&info))
+      return runahead_fail();
+   runahead_st.save_time += cpu_features_get_time_usec() - start;
+   runahead_st.saves++;
+
+   /* The frames ahead go on with the input the real frame got */
+   start = cpu_features_get_time_usec();
+   core_set_output_callbacks(false, false);
+   for (i = 1; i < frames_ahead; i++)
+      core_run_nopoll();
+   runahead_st.run_time += cpu_features_get_time_usec() - start;
+
+   core_set_output_callbacks(true, false);
+   core_run_nopoll();
+   core_set_output_callbacks(true, true);
+
+   start = cpu_features_get_time_usec();
+   if (!core_unserialize(&info))
+      return runahead_fail();
+   runahead_st.load_time += cpu_features_get_time_usec() - start;
+
+   return true;
+}
+
+static bool runahead_run_secondary(unsigned frames_ahead)
+{
+   unsigned i;
+   retro_time_t start;
+   retro_ctx_serialize_info_t info;
+   struct retro_core_t *core = &runahead_st.secondary_core;
+
+   info.data       = runahead_st.state;
+   info.data_const = runahead_st.state;
+   info.size       = runahead_st.state_size;
+
+   /* The real frame, on the core everything else sees */
+   runahead_st.input_hash = 0x811c9dc5;
+   core_set_output_callbacks(false, true);
+   core_run();
+   core_set_output_callbacks(true, true);
+
+   /* Unless the second instance went on with the same input the real
+    * frame just got, it has to start over from it */
+   if (!runahead_st.secondary_synced ||
+         runahead_st.secondary_frames != frames_ahead ||
+         runahead_st.input_hash != runahead_st.last_input_hash)
+   {
+      start = cpu_features_get_time_usec();
+      if (!core_serialize(&info))
+         return runahead_fail();
+      runahead_st.save_time += cpu_features_get_time_usec() - start;
+      runahead_st.saves++;
+
+      start = cpu_features_get_time_usec();
+      if (!core->retro_unserialize(info.data_const, info.size))
+         return runahead_fail();
+      runahead_st.load_time += cpu_features_get_time_usec() - start;
+
+      start = cpu_features_get_time_usec();
+      for (i = 1; i < frames_ahead; i++)
+         core->retro_run();
+      runahead_st.run_time += cpu_features_get_time_usec() - start;
+
+      runahead_st.secondary_synced = true;
+      runahead_st.secondary_frames = frames_ahead;
+   }
+   runahead_st.last_input_hash = runahead_st.input_hash;
+
+   core->retro_set_video_refresh(video_driver_frame);
+   core->retro_run();
+   core->retro_set_video_refresh(runahead_video_refresh_null);
+
+   return true;
+}
+
+/* Things run-ahead can't be used with, for now */
+static bool runahead_is_allowed(void)
+{
+#ifdef HAVE_NETWORKING
+   if (netplay_driver_ctl(RARCH_NETPLAY_CTL_IS_DATA_INITED, NULL))
+      return false;
+#endif
+   if (bsv_movie_ctl(BSV_MOVIE_CTL_IS_INITED, NULL))
+      return false;
+   return !runahead_st.failed;
+}
+
+/**
+ * runahead_run:
+ *
+ * Runs the core for one frame, like core_run(). With run-ahead
+ * enabled, what is shown comes from run_ahead_frames frames later,
+ * as if the current input had been held until then.
+ *
+ * Returns: true on success, otherwise false.
+ **/
+bool runahead_run(void)
+{
+   settings_t *settings  = config_get_ptr();
+   unsigned frames_ahead = settings->run_ahead_frames;
+   bool ret;
+
+   if (!frames_ahead || !runahead_is_allowed())
+   {
+      if (runahead_st.inited)
+         runahead_free_state();
+      return core_run();
+   }
+
+   if (!runahead_st.inited && !runahead_init())
+      return core_run();
+
+   /* Rewinding moves the core around by itself */
+   if (state_manager_frame_is_reversed())
+   {
+      runahead_st.secondary_synced = false;
+      return core_run();
+   }
+
+   if (runahead_st.secondary)
+      ret = runahead_run_secondary(frames_ahead);
+   else
+      ret = runahead_run_single(frames_ahead);
+
+   if (runahead_st.inited)
+   {
+      runahead_st.frames_ahead = frames_ahead;
+      runahead_st.frames++;
+      runahead_report(false);
+   }
+   return ret;
+}
+
+/**
+ * runahead_set_content:
+ * @info                 : content the core was given, or NULL.
+ * @loadable             : can another instance load it with
+ *                         retro_load_game(@info)?
+ *
+ * Remembers the loaded content for a second instance of the core.
+ **/
+void runahead_set_content(const struct retro_game_info *info,
+      bool loadable)
+{
+   settings_t *settings = config_get_ptr();
+
+   free(runahead_content.path);
+   free(runahead_content.data);
+   free(runahead_content.meta);
+   memset(&runahead_content, 0, sizeof(runahead_content));
+
+   /* Only keep a copy if it's going to be used */
+   if (!loadable || !settings ||
+         !settings->run_ahead_frames ||
+         !settings->run_ahead_secondary_instance)
+      return;
+
+   runahead_content.loadable = true;
+   runahead_content.empty    = !info;
+   if (!info)
+      return;
+
+   if (info->path)
+      runahead_content.path = strdup(info->path);
+   if (info->meta)
+      runahead_content.meta = strdup(info->meta);
+   if (info->data && info->size)
+   {
+      runahead_content.data = malloc(info->size);
+      if (!runahead_content.data)
+      {
+         runahead_content.loadable = false;
+         return;
+      }
+      memcpy(runahead_content.data, info->data, info->size);
+      runahead_content.size = info->size;
+   }
+}
+
+/**
+ * runahead_invalidate:
+ *
+ * The core's state changed other than by running a frame, so a
+ * second instance has to catch up with it again.
+ **/
+void runahead_invalidate(void)
+{
+   runahead_st.secondary_synced = false;
+}
+
+/**
+ * runahead_deinit:
+ *
+ * Frees run-ahead, including any second instance of the core.
+ * Called before the core's content is unloaded.
+ **/
+void runahead_deinit(void)
+{
+   runahead_free_state();
+   runahead_set_content(NULL, false);
+}
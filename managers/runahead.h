@@ -0,0 +1,65 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2017 - The RetroArch team
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RUNAHEAD_H
+#define __RUNAHEAD_H
+
+#include <boolean.h>
+#include <retro_common_api.h>
+#include <libretro.h>
+
+RETRO_BEGIN_DECLS
+
+/**
+ * runahead_run:
+ *
+ * Runs the core for one frame, like core_run(). With run-ahead
+ * enabled, what is shown comes from run_ahead_frames frames later,
+ * as if the current input had been held until then.
+ *
+ * Returns: true on success, otherwise false.
+ **/
+bool runahead_run(void);
+
+/**
+ * runahead_set_content:
+ * @info                 : content the core was given, or NULL.
+ * @loadable             : can another instance load it with
+ *                         retro_load_game(@info)?
+ *
+ * Remembers the loaded content for a second instance of the core.
+ **/
+void runahead_set_content(const struct retro_game_info *info,
+      bool loadable);
+
+/**
+ * runahead_invalidate:
+ *
+ * The core's state changed other than by running a frame, so a
+ * second instance has to catch up with it again.
+ **/
+void runahead_invalidate(void);
+
+/**
+ * runahead_deinit:
+ *
+ * Frees run-ahead, including any second instance of the core.
+ * Called before the core's content is unloaded.
+ **/
+void runahead_deinit(void);
+
+RETRO_END_DECLS
+
+#endif
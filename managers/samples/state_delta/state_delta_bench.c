@@ -0,0 +1,136 @@
+/* Measures how fast state_manager_raw_compress() diffs two savestates,
+ * with the generic scanners and with the widest ones this CPU has,
+ * and checks both produce the same patch.
+ *
+ * Usage: state_delta_bench [state size in KiB] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <features/features_cpu.h>
+
+#include "../../state_manager.h"
+
+/* Each case runs for at least this long. */
+#define BENCH_MIN_USEC 500000
+
+/* Changed bytes, in parts per million. */
+static const unsigned bench_densities[] = { 100, 1000, 10000, 100000 };
+
+static uint32_t bench_rand_state = 0x12345678;
+
+static uint32_t bench_rand(void)
+{
+   /* xorshift32, so every run diffs the same states. */
+   bench_rand_state ^= bench_rand_state << 13;
+   bench_rand_state ^= bench_rand_state >> 17;
+   bench_rand_state ^= bench_rand_state << 5;
+   return bench_rand_state;
+}
+
+static double bench_compress(const void *src, const void *dst,
+      size_t len, void *patch, size_t *patch_len)
+{
+   unsigned runs      = 0;
+   retro_time_t start = cpu_features_get_time_usec();
+   retro_time_t now   = start;
+
+   do
+   {
+      *patch_len = state_manager_raw_compress(src, dst, len, patch);
+      runs++;
+      now        = cpu_features_get_time_usec();
+   } while (now - start < BENCH_MIN_USEC);
+
+   /* GB/s of savestate scanned */
+   return (double)len * runs / (now - start) / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+   unsigned i;
+   size_t j;
+   size_t len        = 4096 * 1024;
+   uint8_t *src      = NULL;
+   uint8_t *dst      = NULL;
+   uint8_t *check    = NULL;
+   uint8_t *patch    = NULL;
+   uint8_t *patch2   = NULL;
+   uint64_t cpu      = cpu_features_get();
+   int ret           = 0;
+
+   if (argc > 1)
+      len = strtoul(argv[1], NULL, 0) * 1024;
+   if (!len)
+   {
+      fprintf(stderr, "Usage: %s [state size in KiB]\n", argv[0]);
+      return 1;
+   }
+
+   src    = (uint8_t*)state_manager_raw_alloc(len, 0);
+   dst    = (uint8_t*)state_manager_raw_alloc(len, 1);
+   check  = (uint8_t*)state_manager_raw_alloc(len, 0);
+   patch  = (uint8_t*)malloc(state_manager_raw_maxsize(len));
+   patch2 = (uint8_t*)malloc(state_manager_raw_maxsize(len));
+   if (!src || !dst || !check || !patch || !patch2)
+   {
+      fprintf(stderr, "Out of memory.\n");
+      return 1;
+   }
+
+   for (j = 0; j < len; j++)
+      src[j] = (uint8_t)bench_rand();
+
+   printf("%u KiB states\n", (unsigned)(len / 1024));
+   printf("%10s %12s %12s %12s\n",
+         "changed", "generic", "best", "patch");
+
+   for (i = 0; i < sizeof(bench_densities) / sizeof(*bench_densities); i++)
+   {
+      double generic, best;
+      size_t patch_len, patch2_len;
+      size_t changes = (size_t)((double)len * bench_densities[i] / 1000000);
+
+      memcpy(dst, src, len);
+      for (j = 0; j < changes; j++)
+         dst[bench_rand() % len] ^= 1 + (bench_rand() % 255);
+
+      state_manager_raw_init(0);
+      generic = bench_compress(src, dst, len, patch, &patch_len);
+
+      state_manager_raw_init(cpu);
+      best    = bench_compress(src, dst, len, patch2, &patch2_len);
+
+      if (patch_len != patch2_len || memcmp(patch, patch2, patch_len))
+      {
+         printf("%9.2f%%: the scanners made different patches\n",
+               bench_densities[i] / 10000.0);
+         ret = 1;
+         continue;
+      }
+
+      /* The patch holds the old data, so it takes 'dst' back to 'src',
+       * as rewinding does. */
+      memcpy(check, dst, len);
+      state_manager_raw_decompress(patch, patch_len, check, len);
+      if (memcmp(check, src, len))
+      {
+         printf("%9.2f%%: the patch doesn't recreate the state\n",
+               bench_densities[i] / 10000.0);
+         ret = 1;
+         continue;
+      }
+
+      printf("%9.2f%% %7.2f GB/s %7.2f GB/s %9u KiB\n",
+            bench_densities[i] / 10000.0, generic, best,
+            (unsigned)(patch_len / 1024));
+   }
+
+   free(src);
+   free(dst);
+   free(check);
+   free(patch);
+   free(patch2);
+   return ret;
+}
@@ -0,0 +1,535 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2010-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2011-2017 - Daniel De Matteis
+ *  Copyright (C) 2014-2017 - Alfred Agrell
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define __STDC_LIMIT_MACROS
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <retro_inline.h>
+#include <compat/intrinsics.h>
+#include <features/features_cpu.h>
+
+#include "state_manager.h"
+
+#ifndef UINT16_MAX
+#define UINT16_MAX 0xffff
+#endif
+
+#ifndef UINT32_MAX
+#define UINT32_MAX 0xffffffffu
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(__i486__) || defined(__i686__)
+#define CPU_X86
+#endif
+
+/* Other arches SIGBUS (usually) on unaligned accesses. */
+#ifndef CPU_X86
+#define NO_UNALIGNED_MEM
+#endif
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* AVX2 kernels are built with a per-function target attribute, 
+ * so generic x86 builds can still pick them at runtime. */
+#if defined(CPU_X86) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define STATE_MANAGER_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define STATE_MANAGER_NEON
+#include <arm_neon.h>
+#endif
+
+/* Widest load any of the scanners below does. Every block handed 
+ * to them must have this much padding behind its terminator. */
+#define STATE_MANAGER_SCAN_WIDTH 32
+
+typedef size_t (*state_manager_scan_t)(const uint16_t *a, const uint16_t *b);
+
+/* There's no equivalent in libc, you'd think so ...
+ * std::mismatch exists, but it's not optimized at all. */
+static size_t find_change_generic(const uint16_t *a, const uint16_t *b)
+{
+#if __SSE2__
+   const __m128i *a128 = (const __m128i*)a;
+   const __m128i *b128 = (const __m128i*)b;
+   
+   for (;;)
+   {
+      __m128i v0    = _mm_loadu_si128(a128);
+      __m128i v1    = _mm_loadu_si128(b128);
+      __m128i c     = _mm_cmpeq_epi32(v0, v1);
+      uint32_t mask = _mm_movemask_epi8(c);
+
+      if (mask != 0xffff) /* Something has changed, figure out where. */
+      {
+         size_t ret = (((uint8_t*)a128 - (uint8_t*)a) |
+               (compat_ctz(~mask))) >> 1;
+         return ret | (a[ret] == b[ret]);
+      }
+
+      a128++;
+      b128++;
+   }
+#else
+   const uint16_t *a_org = a;
+#ifdef NO_UNALIGNED_MEM
+   while (((uintptr_t)a & (sizeof(size_t) - 1)) && *a == *b)
+   {
+      a++;
+      b++;
+   }
+   if (*a == *b)
+#endif
+   {
+      const size_t *a_big = (const size_t*)a;
+      const size_t *b_big = (const size_t*)b;
+      
+      while (*a_big == *b_big)
+      {
+         a_big++;
+         b_big++;
+      }
+      a = (const uint16_t*)a_big;
+      b = (const uint16_t*)b_big;
+      
+      while (*a == *b)
+      {
+         a++;
+         b++;
+      }
+   }
+   return a - a_org;
+#endif
+}
+
+static size_t find_same_generic(const uint16_t *a, const uint16_t *b)
+{
+   const uint16_t *a_org = a;
+#if __SSE2__
+   const __m128i *a128 = (const __m128i*)a;
+   const __m128i *b128 = (const __m128i*)b;
+
+   for (;;)
+   {
+      __m128i v0    = _mm_loadu_si128(a128);
+      __m128i v1    = _mm_loadu_si128(b128);
+      __m128i c     = _mm_cmpeq_epi32(v0, v1);
+      uint32_t mask = _mm_movemask_epi8(c);
+
+      if (mask) /* Found an unchanged word. */
+      {
+         a += (((uint8_t*)a128 - (uint8_t*)a_org) |
+               (compat_ctz(mask))) >> 1;
+         b += a - a_org;
+         break;
+      }
+
+      a128++;
+      b128++;
+   }
+
+   if (a != a_org && a[-1] == b[-1])
+      a--;
+#else
+#ifdef NO_UNALIGNED_MEM
+   if (((uintptr_t)a & (sizeof(uint32_t) - 1)) && *a != *b)
+   {
+      a++;
+      b++;
+   }
+   if (*a != *b)
+#endif
+   {
+      /* With this, it's random whether two consecutive identical
+       * words are caught.
+       *
+       * Luckily, compression rate is the same for both cases, and 
+       * three is always caught.
+       *
+       * (We prefer to miss two-word blocks, anyways; fewer iterations 
+       * of the outer loop, as well as in the decompressor.) */
+      const uint32_t *a_big = (const uint32_t*)a;
+      const uint32_t *b_big = (const uint32_t*)b;
+      
+      while (*a_big != *b_big)
+      {
+         a_big++;
+         b_big++;
+      }
+      a = (const uint16_t*)a_big;
+      b = (const uint16_t*)b_big;
+      
+      if (a != a_org && a[-1] == b[-1])
+      {
+         a--;
+         b--;
+      }
+   }
+#endif
+   return a - a_org;
+}
+
+/* The wide scanners below compare in 32-bit lanes relative to 'a', 
+ * like the x86 generic ones, and find the same spans. */
+
+#ifdef STATE_MANAGER_AVX2
+__attribute__((target("avx2")))
+static size_t find_change_avx2(const uint16_t *a, const uint16_t *b)
+{
+   const __m256i *a256 = (const __m256i*)a;
+   const __m256i *b256 = (const __m256i*)b;
+
+   for (;;)
+   {
+      __m256i v0    = _mm256_loadu_si256(a256);
+      __m256i v1    = _mm256_loadu_si256(b256);
+      __m256i c     = _mm256_cmpeq_epi32(v0, v1);
+      uint32_t mask = (uint32_t)_mm256_movemask_epi8(c);
+
+      if (mask != 0xffffffffu)
+      {
+         size_t ret = (((uint8_t*)a256 - (uint8_t*)a) |
+               (__builtin_ctz(~mask))) >> 1;
+         return ret | (a[ret] == b[ret]);
+      }
+
+      a256++;
+      b256++;
+   }
+}
+
+__attribute__((target("avx2")))
+static size_t find_same_avx2(const uint16_t *a, const uint16_t *b)
+{
+   size_t ret;
+   const __m256i *a256 = (const __m256i*)a;
+   const __m256i *b256 = (const __m256i*)b;
+
+   for (;;)
+   {
+      __m256i v0    = _mm256_loadu_si256(a256);
+      __m256i v1    = _mm256_loadu_si256(b256);
+      __m256i c     = _mm256_cmpeq_epi32(v0, v1);
+      uint32_t mask = (uint32_t)_mm256_movemask_epi8(c);
+
+      if (mask)
+      {
+         ret = (((uint8_t*)a256 - (uint8_t*)a) |
+               (__builtin_ctz(mask))) >> 1;
+         break;
+      }
+
+      a256++;
+      b256++;
+   }
+
+   if (ret && a[ret - 1] == b[ret - 1])
+      ret--;
+   return ret;
+}
+#endif
+
+#ifdef STATE_MANAGER_NEON
+/* Returns one byte per 32-bit lane of a 32 byte block, 
+ * 0xff where the lanes of 'a' and 'b' are equal. */
+static INLINE uint64_t state_manager_neon_eqmask(
+      const uint16_t *a, const uint16_t *b)
+{
+   uint32x4_t c0 = vceqq_u32(
+         vreinterpretq_u32_u16(vld1q_u16(a)),
+         vreinterpretq_u32_u16(vld1q_u16(b)));
+   uint32x4_t c1 = vceqq_u32(
+         vreinterpretq_u32_u16(vld1q_u16(a + 8)),
+         vreinterpretq_u32_u16(vld1q_u16(b + 8)));
+   uint8x8_t  c  = vmovn_u16(vcombine_u16(vmovn_u32(c0), vmovn_u32(c1)));
+
+   return vget_lane_u64(vreinterpret_u64_u8(c), 0);
+}
+
+static size_t find_change_neon(const uint16_t *a, const uint16_t *b)
+{
+   size_t ret = 0;
+
+   while (state_manager_neon_eqmask(a + ret, b + ret) == ~UINT64_C(0))
+      ret += 16;
+
+   /* Something has changed in this block, figure out where. */
+   while (a[ret] == b[ret])
+      ret++;
+   return ret;
+}
+
+static size_t find_same_neon(const uint16_t *a, const uint16_t *b)
+{
+   size_t ret = 0;
+
+   while (!state_manager_neon_eqmask(a + ret, b + ret))
+      ret += 16;
+
+   while (a[ret] != b[ret] || a[ret + 1] != b[ret + 1])
+      ret += 2;
+
+   if (ret && a[ret - 1] == b[ret - 1])
+      ret--;
+   return ret;
+}
+#endif
+
+static state_manager_scan_t find_change = find_change_generic;
+static state_manager_scan_t find_same   = find_same_generic;
+
+void state_manager_raw_init(uint64_t cpu)
+{
+   find_change = find_change_generic;
+   find_same   = find_same_generic;
+
+#ifdef STATE_MANAGER_AVX2
+   /* AVX2 is reported from CPUID alone, AVX also means 
+    * the OS preserves the upper YMM halves. */
+   if ((cpu & RETRO_SIMD_AVX2) && (cpu & RETRO_SIMD_AVX))
+   {
+      find_change = find_change_avx2;
+      find_same   = find_same_avx2;
+   }
+#endif
+
+#ifdef STATE_MANAGER_NEON
+   if (cpu & RETRO_SIMD_NEON)
+   {
+      find_change = find_change_neon;
+      find_same   = find_same_neon;
+   }
+#endif
+}
+
+/* Returns the maximum compressed size of a savestate. 
+ * It is very likely to compress to far less. */
+size_t state_manager_raw_maxsize(size_t uncomp)
+{
+   /* uncompressed size, rounded to 16 bits */
+   size_t uncomp16 = (uncomp + sizeof(uint16_t) - 1) & -sizeof(uint16_t);
+   size_t num16s   = uncomp16 / sizeof(uint16_t);
+   /* At worst every other u16 changes, and each change gets a record of
+    * its own with two u16 of header. Runs longer than a record can hold
+    * are split. */
+   size_t maxruns  = (num16s + 1) / 2 + num16s / UINT16_MAX + 1;
+   /* skips too long for a record header take three u16 of their own */
+   size_t maxskips = num16s / ((size_t)UINT16_MAX + 1) + 1;
+   return uncomp16 + (maxruns * 2 + maxskips * 3 + 3 /* three u16 to end it */)
+      * sizeof(uint16_t);
+}
+
+/*
+ * See state_manager_raw_compress for information about this.
+ * When you're done with it, send it to free().
+ */
+void *state_manager_raw_alloc(size_t len, uint16_t uniq)
+{
+   size_t  len16 = (len + sizeof(uint16_t) - 1) & -sizeof(uint16_t);
+   uint16_t *ret = (uint16_t*)calloc(len16 + sizeof(uint16_t) * 4 
+         + STATE_MANAGER_SCAN_WIDTH, 1);
+
+   /* Force in a different byte at the end, so we don't need to check 
+    * bounds in the innermost loop (it's expensive).
+    *
+    * There is also a large amount of data that's the same, to stop 
+    * the other scan.
+    *
+    * There is also some padding at the end. This is so we don't 
+    * read outside the buffer end if we're reading in large blocks;
+    *
+    * It doesn't make any difference to us, but sacrificing a few bytes to get 
+    * Valgrind happy is worth it. */
+   ret[len16/sizeof(uint16_t) + 3] = uniq;
+
+   return ret;
+}
+
+/*
+ * Takes two savestates and creates a patch that turns 'src' into 'dst'.
+ * Both 'src' and 'dst' must be returned from state_manager_raw_alloc(), 
+ * with the same 'len', and different 'uniq'.
+ *
+ * 'patch' must be size 'state_manager_raw_maxsize(len)' or more.
+ * Returns the number of bytes actually written to 'patch'.
+ */
+size_t state_manager_raw_compress(const void *src,
+      const void *dst, size_t len, void *patch)
+{
+   const uint16_t  *old16 = (const uint16_t*)src;
+   const uint16_t  *new16 = (const uint16_t*)dst;
+   uint16_t *compressed16 = (uint16_t*)patch;
+   size_t          num16s = (len + sizeof(uint16_t) - 1) 
+      / sizeof(uint16_t);
+   
+   while (num16s)
+   {
+      size_t i, changed;
+      size_t skip = find_change(old16, new16);
+   
+      if (skip >= num16s)
+         break;
+   
+      old16  += skip;
+      new16  += skip;
+      num16s -= skip;
+   
+      if (skip > UINT16_MAX)
+      {
+         if (skip > UINT32_MAX)
+         {
+            /* This will make it scan the entire thing again, 
+             * but it only hits on 8GB unchanged data anyways,
+             * and if you're doing that, you've got bigger problems. */
+            skip = UINT32_MAX;
+         }
+         *compressed16++ = 0;
+         *compressed16++ = skip;
+         *compressed16++ = skip >> 16;
+         continue;
+      }
+   
+      changed = find_same(old16, new16);
+      if (changed > UINT16_MAX)
+         changed = UINT16_MAX;
+   
+      *compressed16++ = changed;
+      *compressed16++ = skip;
+   
+      for (i = 0; i < changed; i++)
+         compressed16[i] = old16[i];
+   
+      old16 += changed;
+      new16 += changed;
+      num16s -= changed;
+      compressed16 += changed;
+   }
+   
+   compressed16[0] = 0;
+   compressed16[1] = 0;
+   compressed16[2] = 0;
+   
+   return (uint8_t*)(compressed16+3) - (uint8_t*)patch;
+}
+
+/*
+ * Takes 'patch' from a previous call to 'state_manager_raw_compress' 
+ * and applies it to 'data' ('src' from that call), 
+ * yielding 'dst' in that call.
+ *
+ * If the given arguments do not match a previous call to 
+ * state_manager_raw_compress(), anything at all can happen.
+ */
+void state_manager_raw_decompress(const void *patch,
+      size_t patchlen, void *data, size_t datalen)
+{
+   uint16_t         *out16 = (uint16_t*)data;
+   const uint16_t *patch16 = (const uint16_t*)patch;
+   
+   (void)patchlen;
+   (void)datalen;
+   
+   for (;;)
+   {
+      uint16_t numchanged = *(patch16++);
+
+      if (numchanged)
+      {
+         uint16_t i;
+
+         out16 += *patch16++;
+
+         /* We could do memcpy, but it seems that memcpy has a 
+          * constant-per-call overhead that actually shows up.
+          *
+          * Our average size in here seems to be 8 or something.
+          * Therefore, we do something with lower overhead. */
+         for (i = 0; i < numchanged; i++)
+            out16[i] = patch16[i];
+
+         patch16 += numchanged;
+         out16 += numchanged;
+      }
+      else
+      {
+         uint32_t numunchanged = patch16[0] | (patch16[1] << 16);
+
+         if (!numunchanged)
+            break;
+         patch16 += 2;
+         out16 += numunchanged;
+      }
+   }
+}
+
+/*
+ * Checks that 'patch' is well formed and that applying it with
+ * state_manager_raw_decompress() stays inside a 'datalen' buffer from
+ * state_manager_raw_alloc(). Only needed for patches from elsewhere,
+ * such as netplay peers.
+ */
+bool state_manager_raw_patch_valid(const void *patch,
+      size_t patchlen, size_t datalen)
+{
+   const uint16_t *patch16 = (const uint16_t*)patch;
+   size_t           num16s = patchlen / sizeof(uint16_t);
+   size_t          max16s  = (datalen + sizeof(uint16_t) - 1)
+      / sizeof(uint16_t);
+   size_t              pos = 0;
+   size_t              out = 0;
+
+   for (;;)
+   {
+      uint16_t numchanged;
+
+      if (pos >= num16s)
+         return false;
+      numchanged = patch16[pos++];
+
+      if (numchanged)
+      {
+         if (pos >= num16s)
+            return false;
+         out += patch16[pos++];
+         if (num16s - pos < numchanged)
+            return false;
+         pos += numchanged;
+         out += numchanged;
+      }
+      else
+      {
+         uint32_t numunchanged;
+
+         if (num16s - pos < 2)
+            return false;
+         numunchanged = patch16[pos] | (patch16[pos + 1] << 16);
+         if (!numunchanged)
+            return true;
+         pos += 2;
+         out += numunchanged;
+      }
+
+      if (out > max16s)
+         return false;
+   }
+}
@@ -20,139 +20,44 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_CONFIG_H
+#include "../config.h"
+#endif
+
+/* Disk-backed rewind needs a shared file mapping we can 
+ * drop from our address space with madvise(). */
+#if defined(HAVE_MMAP) && !defined(_WIN32)
+#define STATE_MANAGER_DISK
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
 #include <retro_inline.h>
 #include <compat/strl.h>
-#include <compat/intrinsics.h>
+#include <string/stdstring.h>
+#include <retro_miscellaneous.h>
+#include <features/features_cpu.h>
+
+#ifdef HAVE_THREADS
+#include <rthreads/rthreads.h>
+#endif
 
 #include "state_manager.h"
+#include "../configuration.h"
 #include "../msg_hash.h"
 #include "../movie.h"
+#include "../runloop.h"
 #include "../core.h"
 #include "../verbosity.h"
+#include "../performance_counters.h"
 #include "../audio/audio_driver.h"
+#include "../gfx/video_driver.h"
 
 /* This makes Valgrind throw errors if a core overflows its savestate size. */
 /* Keep it off unless you're chasing a core bug, it slows things down. */
 #define STRICT_BUF_SIZE 0
 
-#ifndef UINT16_MAX
-#define UINT16_MAX 0xffff
-#endif
-
-#ifndef UINT32_MAX
-#define UINT32_MAX 0xffffffffu
-#endif
-
-#if defined(__x86_64__) || defined(__i386__) || defined(__i486__) || defined(__i686__)
-#define CPU_X86
-#endif
-
-/* Other arches SIGBUS (usually) on unaligned accesses. */
-#ifndef CPU_X86
-#define NO_UNALIGNED_MEM
-#endif
-
-#if __SSE2__
-#include <emmintrin.h>
-#endif
-
-/* There's no equivalent in libc, you'd think so ...
- * std::mismatch exists, but it's not optimized at all. */
-static size_t find_change(const uint16_t *a, const uint16_t *b)
-{
-#if __SSE2__
-   const __m128i *a128 = (const __m128i*)a;
-   const __m128i *b128 = (const __m128i*)b;
-   
-   for (;;)
-   {
-      __m128i v0    = _mm_loadu_si128(a128);
-      __m128i v1    = _mm_loadu_si128(b128);
-      __m128i c     = _mm_cmpeq_epi32(v0, v1);
-      uint32_t mask = _mm_movemask_epi8(c);
-
-      if (mask != 0xffff) /* Something has changed, figure out where. */
-      {
-         size_t ret = (((uint8_t*)a128 - (uint8_t*)a) |
-               (compat_ctz(~mask))) >> 1;
-         return ret | (a[ret] == b[ret]);
-      }
-
-      a128++;
-      b128++;
-   }
-#else
-   const uint16_t *a_org = a;
-#ifdef NO_UNALIGNED_MEM
-   while (((uintptr_t)a & (sizeof(size_t) - 1)) && *a == *b)
-   {
-      a++;
-      b++;
-   }
-   if (*a == *b)
-#endif
-   {
-      const size_t *a_big = (const size_t*)a;
-      const size_t *b_big = (const size_t*)b;
-      
-      while (*a_big == *b_big)
-      {
-         a_big++;
-         b_big++;
-      }
-      a = (const uint16_t*)a_big;
-      b = (const uint16_t*)b_big;
-      
-      while (*a == *b)
-      {
-         a++;
-         b++;
-      }
-   }
-   return a - a_org;
-#endif
-}
-
-static size_t find_same(const uint16_t *a, const uint16_t *b)
-{
-   const uint16_t *a_org = a;
-#ifdef NO_UNALIGNED_MEM
-   if (((uintptr_t)a & (sizeof(uint32_t) - 1)) && *a != *b)
-   {
-      a++;
-      b++;
-   }
-   if (*a != *b)
-#endif
-   {
-      /* With this, it's random whether two consecutive identical
-       * words are caught.
-       *
-       * Luckily, compression rate is the same for both cases, and 
-       * three is always caught.
-       *
-       * (We prefer to miss two-word blocks, anyways; fewer iterations 
-       * of the outer loop, as well as in the decompressor.) */
-      const uint32_t *a_big = (const uint32_t*)a;
-      const uint32_t *b_big = (const uint32_t*)b;
-      
-      while (*a_big != *b_big)
-      {
-         a_big++;
-         b_big++;
-      }
-      a = (const uint16_t*)a_big;
-      b = (const uint16_t*)b_big;
-      
-      if (a != a_org && a[-1] == b[-1])
-      {
-         a--;
-         b--;
-      }
-   }
-   return a - a_org;
-}
-
 struct state_manager
 {
    uint8_t *data;
@@ -175,15 +80,44 @@ struct state_manager
 
    unsigned entries;
    bool thisblock_valid;
+
+   /* Bytes the last push took up in the buffer. */
+   size_t last_entry_size;
+
+   /* Delta encoding time not yet added to the rewind_compress 
+    * counter. Only written by the thread doing the pushes. */
+   retro_perf_tick_t compress_ticks;
+   unsigned compress_calls;
+
+   /* Every this many entries, a full state is stored instead of
+    * a patch, so seeking never has to replay the whole history. */
+   unsigned keyframe_interval;
+   unsigned since_keyframe;
+#ifdef STATE_MANAGER_DISK
+   /* 'data' is a shared mapping of an unlinked file. Everything 
+    * more than 'resident' bytes behind the head is dropped from 
+    * memory and faults back in from disk if rewound to. */
+   bool mapped;
+   size_t resident;
+   size_t spill_pos;
+#endif
 #if STRICT_BUF_SIZE
    size_t debugsize;
    uint8_t *debugblock;
 #endif
 };
 
+enum state_manager_entry_kind
+{
+   STATE_MANAGER_ENTRY_PATCH = 0,
+   STATE_MANAGER_ENTRY_KEYFRAME
+};
+
 /* Format per frame (pseudocode): */
 #if 0
 size nextstart;
+uint16 kind; /* STATE_MANAGER_ENTRY_KEYFRAME is followed by
+              * the raw block instead of the loop below */
 repeat {
    uint16 numchanged; /* everything is counted in units of uint16 */
    if (numchanged)
@@ -201,170 +135,100 @@ repeat {
 size thisstart;
 #endif
 
+#ifdef HAVE_THREADS
+/* Number of captured states that can wait for the worker. */
+#define REWIND_THREAD_SLOTS 3
+
+typedef struct state_manager_thread state_manager_thread_t;
+
+/* Pipelined rewind: the main thread serializes into one of the 
+ * capture slots, the worker swaps it in as 'nextblock' and does 
+ * the delta encoding. */
+struct state_manager_thread
+{
+   volatile bool quit;
+   slock_t *lock;
+   /* Signalled whenever a slot is filled or handed back. */
+   scond_t *cond;
+   sthread_t *thread;
+
+   state_manager_t *state;
+
+   uint8_t *slots[REWIND_THREAD_SLOTS];
+   /* Oldest filled slot, processed next by the worker. */
+   unsigned read_ptr;
+   /* Filled slots, including the one the worker is busy with. */
+   unsigned count;
+
+   unsigned dropped;
+   /* Size of the last entry the worker pushed. */
+   size_t entry_size;
+   /* Delta encoding time the worker has yet to hand over. */
+   retro_perf_tick_t compress_ticks;
+   unsigned compress_calls;
+};
+#endif
+
 struct state_manager_rewind_state
 {
    /* Rewind support. */
    state_manager_t *state;
    size_t size;
+#ifdef HAVE_THREADS
+   state_manager_thread_t *thread;
+#endif
+
+   /* Automatic capture interval, see state_manager_adapt(). */
+   bool adaptive;
+   unsigned granularity;
+   /* Moving averages of the main thread time and of the rewind 
+    * buffer space a single capture costs. */
+   retro_time_t capture_usec;
+   size_t capture_bytes;
+   /* When rewind started, to tell how long a performance counter 
+    * tick is. */
+   retro_perf_tick_t start_ticks;
+   retro_time_t start_usec;
 };
 
+/* Upper bound of the automatic capture interval, in frames. */
+#define REWIND_GRANULARITY_AUTO_MAX 60
+
 static struct state_manager_rewind_state rewind_state;
 static bool frame_is_reversed                         = false;
 
-/* Returns the maximum compressed size of a savestate. 
- * It is very likely to compress to far less. */
-static size_t state_manager_raw_maxsize(size_t uncomp)
-{
-   /* bytes covered by a compressed block */
-   const int maxcblkcover = UINT16_MAX * sizeof(uint16_t);
-   /* uncompressed size, rounded to 16 bits */
-   size_t uncomp16        = (uncomp + sizeof(uint16_t) - 1) & -sizeof(uint16_t);
-   /* number of blocks */
-   size_t maxcblks        = (uncomp + maxcblkcover - 1) / maxcblkcover;
-   return uncomp16 + maxcblks * sizeof(uint16_t) * 2 /* two u16 overhead per block */ + sizeof(uint16_t) *
-      3; /* three u16 to end it */
-}
-
-/*
- * See state_manager_raw_compress for information about this.
- * When you're done with it, send it to free().
- */
-static void *state_manager_raw_alloc(size_t len, uint16_t uniq)
-{
-   size_t  len16 = (len + sizeof(uint16_t) - 1) & -sizeof(uint16_t);
-   uint16_t *ret = (uint16_t*)calloc(len16 + sizeof(uint16_t) * 4 + 16, 1);
-
-   /* Force in a different byte at the end, so we don't need to check 
-    * bounds in the innermost loop (it's expensive).
-    *
-    * There is also a large amount of data that's the same, to stop 
-    * the other scan.
-    *
-    * There is also some padding at the end. This is so we don't 
-    * read outside the buffer end if we're reading in large blocks;
-    *
-    * It doesn't make any difference to us, but sacrificing 16 bytes to get 
-    * Valgrind happy is worth it. */
-   ret[len16/sizeof(uint16_t) + 3] = uniq;
+static void state_manager_serialize(void *data, size_t size)
+{
+   static struct retro_perf_counter rewind_serialize = {0};
+   retro_ctx_serialize_info_t serial_info;
+   bool is_perfcnt_enable = runloop_ctl(RUNLOOP_CTL_IS_PERFCNT_ENABLE, NULL);
 
-   return ret;
-}
+   serial_info.data = data;
+   serial_info.size = size;
 
-/*
- * Takes two savestates and creates a patch that turns 'src' into 'dst'.
- * Both 'src' and 'dst' must be returned from state_manager_raw_alloc(), 
- * with the same 'len', and different 'uniq'.
- *
- * 'patch' must be size 'state_manager_raw_maxsize(len)' or more.
- * Returns the number of bytes actually written to 'patch'.
- */
-static size_t state_manager_raw_compress(const void *src,
-      const void *dst, size_t len, void *patch)
-{
-   const uint16_t  *old16 = (const uint16_t*)src;
-   const uint16_t  *new16 = (const uint16_t*)dst;
-   uint16_t *compressed16 = (uint16_t*)patch;
-   size_t          num16s = (len + sizeof(uint16_t) - 1) 
-      / sizeof(uint16_t);
-   
-   while (num16s)
-   {
-      size_t i, changed;
-      size_t skip = find_change(old16, new16);
-   
-      if (skip >= num16s)
-         break;
-   
-      old16  += skip;
-      new16  += skip;
-      num16s -= skip;
-   
-      if (skip > UINT16_MAX)
-      {
-         if (skip > UINT32_MAX)
-         {
-            /* This will make it scan the entire thing again, 
-             * but it only hits on 8GB unchanged data anyways,
-             * and if you're doing that, you've got bigger problems. */
-            skip = UINT32_MAX;
-         }
-         *compressed16++ = 0;
-         *compressed16++ = skip;
-         *compressed16++ = skip >> 16;
-         continue;
-      }
-   
-      changed = find_same(old16, new16);
-      if (changed > UINT16_MAX)
-         changed = UINT16_MAX;
-   
-      *compressed16++ = changed;
-      *compressed16++ = skip;
-   
-      for (i = 0; i < changed; i++)
-         compressed16[i] = old16[i];
-   
-      old16 += changed;
-      new16 += changed;
-      num16s -= changed;
-      compressed16 += changed;
-   }
-   
-   compressed16[0] = 0;
-   compressed16[1] = 0;
-   compressed16[2] = 0;
-   
-   return (uint8_t*)(compressed16+3) - (uint8_t*)patch;
+   performance_counter_init(rewind_serialize, "rewind_serialize");
+   performance_counter_start_plus(is_perfcnt_enable, rewind_serialize);
+   core_serialize(&serial_info);
+   performance_counter_stop_plus(is_perfcnt_enable, rewind_serialize);
 }
 
-/*
- * Takes 'patch' from a previous call to 'state_manager_raw_compress' 
- * and applies it to 'data' ('src' from that call), 
- * yielding 'dst' in that call.
- *
- * If the given arguments do not match a previous call to 
- * state_manager_raw_compress(), anything at all can happen.
- */
-static void state_manager_raw_decompress(const void *patch,
-      size_t patchlen, void *data, size_t datalen)
+/* Adds delta encoding time measured by whichever thread did the 
+ * pushes to the rewind_compress counter. Performance counters are 
+ * only ever registered and updated on the main thread. */
+static void state_manager_count_compress(retro_perf_tick_t *ticks,
+      unsigned *calls)
 {
-   uint16_t         *out16 = (uint16_t*)data;
-   const uint16_t *patch16 = (const uint16_t*)patch;
-   
-   (void)patchlen;
-   (void)datalen;
-   
-   for (;;)
-   {
-      uint16_t numchanged = *(patch16++);
+   static struct retro_perf_counter rewind_compress = {0};
 
-      if (numchanged)
-      {
-         uint16_t i;
-
-         out16 += *patch16++;
-
-         /* We could do memcpy, but it seems that memcpy has a 
-          * constant-per-call overhead that actually shows up.
-          *
-          * Our average size in here seems to be 8 or something.
-          * Therefore, we do something with lower overhead. */
-         for (i = 0; i < numchanged; i++)
-            out16[i] = patch16[i];
-
-         patch16 += numchanged;
-         out16 += numchanged;
-      }
-      else
-      {
-         uint32_t numunchanged = patch16[0] | (patch16[1] << 16);
-
-         if (!numunchanged)
-            break;
-         patch16 += 2;
-         out16 += numunchanged;
-      }
+   performance_counter_init(rewind_compress, "rewind_compress");
+   if (runloop_ctl(RUNLOOP_CTL_IS_PERFCNT_ENABLE, NULL))
+   {
+      rewind_compress.total    += *ticks;
+      rewind_compress.call_cnt += *calls;
    }
+
+   *ticks = 0;
+   *calls = 0;
 }
 
 /* The start offsets point to 'nextstart' of any given compressed frame.
@@ -403,11 +267,123 @@ static INLINE size_t read_size_t(const void *ptr)
    return ret;
 }
 
+#ifdef STATE_MANAGER_DISK
+/* Keep at least this much of the newest history in memory. */
+#define STATE_MANAGER_DISK_RESIDENT (16 << 20)
+
+static uint8_t *state_manager_disk_map(const char *path, size_t size)
+{
+   void *ptr;
+   int fd;
+   char tmp[PATH_MAX_LENGTH];
+
+   /* A new file of our own, never one that's already there or 
+    * whatever a link with that name points to. */
+   strlcpy(tmp, path, sizeof(tmp));
+   strlcat(tmp, ".XXXXXX", sizeof(tmp));
+   fd = mkstemp(tmp);
+
+   if (fd < 0)
+      return NULL;
+
+   /* Nobody else needs the file, and this way it can't be 
+    * left behind if we crash. */
+   unlink(tmp);
+
+   if (ftruncate(fd, size) != 0)
+   {
+      close(fd);
+      return NULL;
+   }
+
+   ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+   /* The mapping keeps the file alive. */
+   close(fd);
+
+   if (ptr == MAP_FAILED)
+      return NULL;
+   return (uint8_t*)ptr;
+}
+
+static void state_manager_disk_drop(state_manager_t *state,
+      size_t start, size_t end)
+{
+   if (end > start)
+      madvise(state->data + start, end - start, MADV_DONTNEED);
+}
+
+/* The head moved backwards from 'old_head'. Entries in between are 
+ * dead now, drop them right away so that long rewinds don't pull 
+ * the whole file into memory, and restart the resident window 
+ * behind the new head. */
+static void state_manager_disk_rewound(state_manager_t *state,
+      size_t old_head)
+{
+   size_t page    = (size_t)sysconf(_SC_PAGESIZE);
+   size_t headpos = state->head - state->data;
+   size_t dead    = (headpos + page - 1) & ~(page - 1);
+
+   if (!state->mapped)
+      return;
+
+   if (old_head < headpos)
+   {
+      state_manager_disk_drop(state, dead, state->capacity);
+      dead = 0;
+   }
+   state_manager_disk_drop(state, dead, old_head);
+
+   state->spill_pos = (headpos + state->capacity - state->resident) 
+      % state->capacity;
+   state->spill_pos -= state->spill_pos % page;
+}
+
+/* Drops everything between the last spill position and the 
+ * resident window behind the head from memory. Batched, so it 
+ * only costs a syscall every quarter window. */
+static void state_manager_disk_spill(state_manager_t *state)
+{
+   size_t end, behind;
+   size_t page    = (size_t)sysconf(_SC_PAGESIZE);
+   size_t headpos = state->head - state->data;
+
+   if (!state->mapped)
+      return;
+
+   behind = (headpos + state->capacity - state->spill_pos) 
+      % state->capacity;
+
+   if (behind < state->resident + state->resident / 4)
+      return;
+
+   end  = (headpos + state->capacity - state->resident) % state->capacity;
+   end -= end % page;
+
+   if (end < state->spill_pos)
+   {
+      state_manager_disk_drop(state, state->spill_pos, state->capacity);
+      state->spill_pos = 0;
+   }
+
+   state_manager_disk_drop(state, state->spill_pos, end);
+   state->spill_pos = end;
+}
+#endif
+
 static void state_manager_free(state_manager_t *state)
 {
    if (!state)
       return;
 
+#ifdef STATE_MANAGER_DISK
+   if (state->mapped)
+   {
+      if (state->data)
+         munmap(state->data, state->capacity);
+      state->data = NULL;
+   }
+#endif
    if (state->data)
       free(state->data);
    if (state->thisblock)
@@ -424,7 +400,16 @@ static void state_manager_free(state_manager_t *state)
    state->nextblock  = NULL;
 }
 
-static state_manager_t *state_manager_new(size_t state_size, size_t buffer_size)
+/**
+ * state_manager_new:
+ * @state_size           : size of a serialized state.
+ * @buffer_size          : size of the rewind buffer.
+ * @disk_path            : if not NULL, back the rewind buffer with 
+ *                         a new file named after this path and keep 
+ *                         only its newest part in memory.
+ **/
+static state_manager_t *state_manager_new(size_t state_size,
+      size_t buffer_size, const char *disk_path)
 {
    size_t max_comp_size, block_size;
    uint8_t *next_block    = NULL;
@@ -437,9 +422,43 @@ static state_manager_t *state_manager_new(size_t state_size, size_t buffer_size)
 
    block_size         = (state_size + sizeof(uint16_t) - 1) & -sizeof(uint16_t);
 
-   /* the compressed data is surrounded by pointers to the other side */
-   max_comp_size      = state_manager_raw_maxsize(state_size) + sizeof(size_t) * 2;
-   state_data         = (uint8_t*)malloc(buffer_size);
+   /* the compressed data is surrounded by pointers to the other side,
+    * and tagged with its kind */
+   max_comp_size      = state_manager_raw_maxsize(state_size) 
+      + sizeof(size_t) * 2 + sizeof(uint16_t);
+
+#ifdef STATE_MANAGER_DISK
+   if (disk_path)
+   {
+      size_t page     = (size_t)sysconf(_SC_PAGESIZE);
+      size_t resident = STATE_MANAGER_DISK_RESIDENT;
+
+      if (resident < max_comp_size * 4)
+         resident     = max_comp_size * 4;
+      resident        = (resident + page - 1) & ~(page - 1);
+
+      /* Not worth it if most of the buffer stays resident anyways. */
+      if (resident < buffer_size / 2)
+      {
+         state->data  = state_manager_disk_map(disk_path, buffer_size);
+
+         if (state->data)
+         {
+            state->mapped   = true;
+            state->resident = resident;
+         }
+         else
+            RARCH_WARN("Failed to map rewind buffer file \"%s\", keeping rewind buffer in memory.\n",
+                  disk_path);
+      }
+   }
+   state_data         = state->data;
+#else
+   (void)disk_path;
+#endif
+
+   if (!state_data)
+      state_data      = (uint8_t*)malloc(buffer_size);
 
    if (!state_data)
       goto error;
@@ -468,19 +487,46 @@ static state_manager_t *state_manager_new(size_t state_size, size_t buffer_size)
    return state;
 
 error:
-   if (state_data)
-      free(state_data);
+   state->data        = state_data;
+   state->capacity    = buffer_size;
    state_manager_free(state);
    free(state);
 
    return NULL;
 }
 
+/* Turns 'thisblock' into the state stored by the entry at 'start'. 
+ * 'thisblock' must hold the next newer state unless the entry 
+ * is a keyframe. */
+static void state_manager_load_entry(state_manager_t *state, size_t start)
+{
+   const uint8_t *entry = state->data + start + sizeof(size_t);
+   uint16_t kind;
+
+   memcpy(&kind, entry, sizeof(kind));
+   entry += sizeof(uint16_t);
+
+   if (kind == STATE_MANAGER_ENTRY_KEYFRAME)
+      memcpy(state->thisblock, entry, state->blocksize);
+   else
+      state_manager_raw_decompress(entry,
+            state->maxcompsize, state->thisblock, state->blocksize);
+}
+
+static uint16_t state_manager_entry_kind(state_manager_t *state,
+      size_t start)
+{
+   uint16_t kind;
+   memcpy(&kind, state->data + start + sizeof(size_t), sizeof(kind));
+   return kind;
+}
+
 static bool state_manager_pop(state_manager_t *state, const void **data)
 {
    size_t start;
-   uint8_t *out                 = NULL;
-   const uint8_t *compressed    = NULL;
+#ifdef STATE_MANAGER_DISK
+   size_t old_head;
+#endif
 
    *data = NULL;
 
@@ -497,18 +543,98 @@ static bool state_manager_pop(state_manager_t *state, const void **data)
       return false;
 
    start = read_size_t(state->head - sizeof(size_t));
+#ifdef STATE_MANAGER_DISK
+   old_head    = state->head - state->data;
+#endif
    state->head = state->data + start;
 
-   compressed = state->data + start + sizeof(size_t);
-   out = state->thisblock;
+   state_manager_load_entry(state, start);
 
-   state_manager_raw_decompress(compressed,
-         state->maxcompsize, out, state->blocksize);
+#ifdef STATE_MANAGER_DISK
+   state_manager_disk_rewound(state, old_head);
+#endif
 
    state->entries--;
    return true;
 }
 
+/**
+ * state_manager_seek:
+ * @state                : state manager.
+ * @count                : number of entries to step back.
+ * @data                 : receives the resulting state.
+ *
+ * Same as calling state_manager_pop() @count times, but only 
+ * decodes the oldest keyframe among the popped entries and the 
+ * patches behind it, rather than every patch on the way.
+ *
+ * Returns: number of entries actually popped, which is less 
+ * than @count if the history is shorter.
+ **/
+static unsigned state_manager_seek(state_manager_t *state,
+      unsigned count, const void **data)
+{
+   unsigned i, walked;
+   unsigned popped          = 0;
+   unsigned keyframe        = 0;
+   size_t keyframe_start    = 0;
+   size_t pos               = state->head - state->data;
+#ifdef STATE_MANAGER_DISK
+   size_t old_head          = pos;
+#endif
+
+   *data = state->thisblock;
+
+   if (!count)
+      return 0;
+
+   if (state->thisblock_valid)
+   {
+      state->thisblock_valid = false;
+      state->entries--;
+      popped++;
+      count--;
+   }
+
+   /* Walking the links is cheap, only remember where the 
+    * last keyframe we'd pass through is. */
+   for (walked = 0; walked < count 
+         && state->data + pos != state->tail; walked++)
+   {
+      pos = read_size_t(state->data + pos - sizeof(size_t));
+      if (state_manager_entry_kind(state, pos) 
+            == STATE_MANAGER_ENTRY_KEYFRAME)
+      {
+         keyframe       = walked + 1;
+         keyframe_start = pos;
+      }
+   }
+
+   i = 0;
+   if (keyframe)
+   {
+      state->head = state->data + keyframe_start;
+      state_manager_load_entry(state, keyframe_start);
+      i = keyframe;
+   }
+
+   for (; i < walked; i++)
+   {
+      size_t start = read_size_t(state->head - sizeof(size_t));
+      state->head  = state->data + start;
+      state_manager_load_entry(state, start);
+   }
+
+   state->entries -= walked;
+
+#ifdef STATE_MANAGER_DISK
+   if (walked)
+      state_manager_disk_rewound(state, old_head);
+#endif
+
+   return popped + walked;
+}
+
 static void state_manager_push_where(state_manager_t *state, void **data)
 {
    /* We need to ensure we have an uncompressed copy of the last
@@ -543,6 +669,7 @@ static void state_manager_push_do(state_manager_t *state)
    {
       const uint8_t *oldb, *newb;
       uint8_t *compressed;
+      uint16_t kind;
       size_t headpos, tailpos, remaining;
       if (state->capacity < sizeof(size_t) + state->maxcompsize)
          return;
@@ -564,9 +691,35 @@ recheckcapacity:;
       oldb        = state->thisblock;
       newb        = state->nextblock;
       compressed  = state->head + sizeof(size_t);
+      kind        = STATE_MANAGER_ENTRY_PATCH;
+
+      if (state->keyframe_interval && 
+            ++state->since_keyframe >= state->keyframe_interval)
+      {
+         kind                  = STATE_MANAGER_ENTRY_KEYFRAME;
+         state->since_keyframe = 0;
+      }
 
-      compressed += state_manager_raw_compress(oldb, newb,
-            state->blocksize, compressed);
+      memcpy(compressed, &kind, sizeof(kind));
+      compressed += sizeof(uint16_t);
+
+      if (kind == STATE_MANAGER_ENTRY_KEYFRAME)
+      {
+         memcpy(compressed, oldb, state->blocksize);
+         compressed += state->blocksize;
+      }
+      else
+      {
+         /* This may run on the worker, so it can't touch the 
+          * counter itself; see state_manager_count_compress(). */
+         retro_perf_tick_t start = cpu_features_get_perf_counter();
+
+         compressed += state_manager_raw_compress(oldb, newb,
+               state->blocksize, compressed);
+
+         state->compress_ticks += cpu_features_get_perf_counter() - start;
+         state->compress_calls++;
+      }
 
       if (compressed - state->data + state->maxcompsize > state->capacity)
       {
@@ -577,7 +730,12 @@ recheckcapacity:;
       write_size_t(compressed, state->head-state->data);
       compressed += sizeof(size_t);
       write_size_t(state->head, compressed-state->data);
+      state->last_entry_size = compressed - state->head;
       state->head = compressed;
+
+#ifdef STATE_MANAGER_DISK
+      state_manager_disk_spill(state);
+#endif
    }
    else
       state->thisblock_valid = true;
@@ -589,6 +747,261 @@ recheckcapacity:;
    state->entries++;
 }
 
+#ifdef HAVE_THREADS
+/* Blocks travelling through the capture slots lose the alternating 
+ * 'uniq' word state_manager_raw_alloc() put behind them; make sure 
+ * 'nextblock' differs from 'thisblock' again before diffing. */
+static void state_manager_fix_uniq(state_manager_t *state)
+{
+   size_t end = state->blocksize / sizeof(uint16_t) + 3;
+
+   ((uint16_t*)state->nextblock)[end] = 
+      ((const uint16_t*)state->thisblock)[end] ^ 1;
+}
+
+static void state_manager_thread_loop(void *data)
+{
+   state_manager_thread_t *handle = (state_manager_thread_t*)data;
+
+   slock_lock(handle->lock);
+
+   while (!handle->quit)
+   {
+      void *ignored;
+      uint8_t *slot;
+      state_manager_t *state = handle->state;
+
+      if (!handle->count)
+      {
+         scond_wait(handle->cond, handle->lock);
+         continue;
+      }
+
+      slot = handle->slots[handle->read_ptr];
+      slock_unlock(handle->lock);
+
+      /* The slot at read_ptr stays ours until count is decremented, 
+       * the main thread only ever writes to free slots. */
+      state_manager_push_where(state, &ignored);
+
+      handle->slots[handle->read_ptr] = state->nextblock;
+      state->nextblock                = slot;
+      state_manager_fix_uniq(state);
+
+      state_manager_push_do(state);
+
+      slock_lock(handle->lock);
+      handle->entry_size      = state->last_entry_size;
+      handle->compress_ticks += state->compress_ticks;
+      handle->compress_calls += state->compress_calls;
+      state->compress_ticks   = 0;
+      state->compress_calls   = 0;
+      handle->read_ptr = (handle->read_ptr + 1) % REWIND_THREAD_SLOTS;
+      handle->count--;
+      scond_signal(handle->cond);
+   }
+
+   slock_unlock(handle->lock);
+}
+
+static void state_manager_thread_free(state_manager_thread_t *handle)
+{
+   unsigned i;
+
+   if (!handle)
+      return;
+
+   if (handle->thread)
+   {
+      slock_lock(handle->lock);
+      handle->quit = true;
+      scond_signal(handle->cond);
+      slock_unlock(handle->lock);
+      sthread_join(handle->thread);
+   }
+
+   if (handle->dropped)
+      RARCH_WARN("Rewind worker fell behind, %u frames were dropped from the rewind history.\n",
+            handle->dropped);
+
+   if (handle->lock)
+      slock_free(handle->lock);
+   if (handle->cond)
+      scond_free(handle->cond);
+
+   for (i = 0; i < REWIND_THREAD_SLOTS; i++)
+      if (handle->slots[i])
+         free(handle->slots[i]);
+
+   free(handle);
+}
+
+static state_manager_thread_t *state_manager_thread_new(
+      state_manager_t *state, size_t state_size)
+{
+   unsigned i;
+   state_manager_thread_t *handle = (state_manager_thread_t*)
+      calloc(1, sizeof(*handle));
+
+   if (!handle)
+      return NULL;
+
+   handle->state = state;
+
+   for (i = 0; i < REWIND_THREAD_SLOTS; i++)
+   {
+      handle->slots[i] = (uint8_t*)state_manager_raw_alloc(state_size, 1);
+      if (!handle->slots[i])
+         goto error;
+   }
+
+   handle->lock   = slock_new();
+   handle->cond   = scond_new();
+
+   if (!handle->lock || !handle->cond)
+      goto error;
+
+   handle->thread = sthread_create(state_manager_thread_loop, handle);
+
+   if (!handle->thread)
+      goto error;
+
+   return handle;
+
+error:
+   state_manager_thread_free(handle);
+   return NULL;
+}
+
+/* Waits until the worker has consumed every pending capture, 
+ * after which the main thread owns the state manager until it 
+ * queues another capture. */
+static void state_manager_thread_flush(state_manager_thread_t *handle)
+{
+   slock_lock(handle->lock);
+   while (handle->count)
+      scond_wait(handle->cond, handle->lock);
+   slock_unlock(handle->lock);
+}
+
+/**
+ * state_manager_thread_capture:
+ * @handle              : rewind worker.
+ * @size                : size of the serialized state.
+ * @wait                : stall for a free slot instead of dropping.
+ * @entry_size          : receives the size of the last entry the 
+ *                        worker finished.
+ *
+ * Serializes the core into a free capture slot and queues it for
+ * delta encoding on the worker.
+ *
+ * Returns: false if the frame had to be dropped because all slots
+ * were still waiting for the worker.
+ **/
+static bool state_manager_thread_capture(state_manager_thread_t *handle,
+      size_t size, bool wait, size_t *entry_size)
+{
+   retro_perf_tick_t compress_ticks;
+   unsigned compress_calls;
+   uint8_t *slot = NULL;
+
+   slock_lock(handle->lock);
+   while (wait && handle->count == REWIND_THREAD_SLOTS)
+      scond_wait(handle->cond, handle->lock);
+
+   *entry_size            = handle->entry_size;
+   compress_ticks         = handle->compress_ticks;
+   compress_calls         = handle->compress_calls;
+   handle->compress_ticks = 0;
+   handle->compress_calls = 0;
+
+   if (handle->count == REWIND_THREAD_SLOTS)
+   {
+      if (!handle->dropped++)
+         RARCH_WARN("Rewind worker is falling behind, dropping frames from the rewind history.\n");
+      slock_unlock(handle->lock);
+      state_manager_count_compress(&compress_ticks, &compress_calls);
+      return false;
+   }
+
+   slot = handle->slots[(handle->read_ptr + handle->count) 
+      % REWIND_THREAD_SLOTS];
+   slock_unlock(handle->lock);
+
+   state_manager_count_compress(&compress_ticks, &compress_calls);
+
+   state_manager_serialize(slot, size);
+
+   slock_lock(handle->lock);
+   handle->count++;
+   scond_signal(handle->cond);
+   slock_unlock(handle->lock);
+
+   return true;
+}
+#endif
+
+/**
+ * state_manager_adapt:
+ * @ticks                : main thread time the last capture took, 
+ *                         in rewind_capture performance counter ticks.
+ * @bytes                : rewind buffer space the last capture took.
+ *
+ * Picks the smallest capture interval that keeps the average 
+ * rewind cost per frame within rewind_frame_budget and the rewind 
+ * buffer growth within rewind_memory_budget.
+ **/
+static void state_manager_adapt(retro_perf_tick_t ticks, size_t bytes)
+{
+   retro_time_t cost                    = 0;
+   unsigned granularity                 = 1;
+   settings_t *settings                 = config_get_ptr();
+   struct retro_system_av_info *av_info = video_viewport_get_system_av_info();
+   retro_perf_tick_t elapsed_ticks      = cpu_features_get_perf_counter() 
+      - rewind_state.start_ticks;
+   retro_time_t elapsed_usec            = cpu_features_get_time_usec() 
+      - rewind_state.start_usec;
+
+   /* The budget is in microseconds, the counter in whatever ticks 
+    * the platform has. */
+   if (elapsed_ticks && elapsed_usec > 0)
+      cost = (retro_time_t)((double)ticks * elapsed_usec / elapsed_ticks);
+
+   /* Average over roughly the last eight captures. */
+   if (!rewind_state.capture_usec)
+   {
+      rewind_state.capture_usec  = cost;
+      rewind_state.capture_bytes = bytes;
+   }
+   rewind_state.capture_usec  += (cost - rewind_state.capture_usec) / 8;
+   rewind_state.capture_bytes  = (rewind_state.capture_bytes * 7 + bytes) / 8;
+
+   if (settings->rewind_frame_budget)
+      granularity = MAX(granularity, (unsigned)
+            ((rewind_state.capture_usec + settings->rewind_frame_budget - 1)
+            / settings->rewind_frame_budget));
+
+   if (settings->rewind_memory_budget && av_info 
+         && av_info->timing.fps > 0.0)
+   {
+      double bytes_per_sec = rewind_state.capture_bytes 
+         * av_info->timing.fps;
+
+      granularity = MAX(granularity, (unsigned)(bytes_per_sec 
+               / (settings->rewind_memory_budget * 1024.0)) + 1);
+   }
+
+   if (granularity > REWIND_GRANULARITY_AUTO_MAX)
+      granularity = REWIND_GRANULARITY_AUTO_MAX;
+
+   if (granularity != rewind_state.granularity)
+      RARCH_LOG("Rewind: capturing every %u frames (%u usec, %u bytes per capture).\n",
+            granularity, (unsigned)rewind_state.capture_usec,
+            (unsigned)rewind_state.capture_bytes);
+
+   rewind_state.granularity = granularity;
+}
+
 #if 0
 static void state_manager_capacity(state_manager_t *state,
       unsigned *entries, size_t *bytes, bool *full)
@@ -607,11 +1020,15 @@ static void state_manager_capacity(state_manager_t *state,
 }
 #endif
 
-void state_manager_event_init(unsigned rewind_buffer_size)
+void state_manager_event_init(size_t rewind_buffer_size)
 {
    retro_ctx_serialize_info_t serial_info;
    retro_ctx_size_info_t info;
+   char disk_path[PATH_MAX_LENGTH];
    void *state          = NULL;
+   settings_t *settings = config_get_ptr();
+
+   disk_path[0]         = '\0';
 
    if (rewind_state.state)
       return;
@@ -624,6 +1041,8 @@ void state_manager_event_init(unsigned rewind_buffer_size)
 
    core_serialize_size(&info);
 
+   state_manager_raw_init(cpu_features_get());
+
    rewind_state.size = info.size;
 
    if (!rewind_state.size)
@@ -637,11 +1056,32 @@ void state_manager_event_init(unsigned rewind_buffer_size)
          msg_hash_to_str(MSG_REWIND_INIT),
          (unsigned)(rewind_buffer_size / 1000000));
 
+   if (settings->rewind_disk_buffer_enable)
+   {
+      global_t *global = global_get_ptr();
+
+      strlcpy(disk_path, global->name.savestate, sizeof(disk_path));
+      strlcat(disk_path, ".rewind", sizeof(disk_path));
+   }
+
    rewind_state.state = state_manager_new(rewind_state.size,
-         rewind_buffer_size);
+         rewind_buffer_size,
+         string_is_empty(disk_path) ? NULL : disk_path);
 
    if (!rewind_state.state)
+   {
       RARCH_WARN("%s.\n", msg_hash_to_str(MSG_REWIND_INIT_FAILED));
+      return;
+   }
+
+   rewind_state.state->keyframe_interval = settings->rewind_keyframe_interval;
+
+   rewind_state.adaptive      = settings->rewind_granularity_auto;
+   rewind_state.granularity   = 1;
+   rewind_state.capture_usec  = 0;
+   rewind_state.capture_bytes = 0;
+   rewind_state.start_ticks   = cpu_features_get_perf_counter();
+   rewind_state.start_usec    = cpu_features_get_time_usec();
 
    state_manager_push_where(rewind_state.state, &state);
 
@@ -651,6 +1091,19 @@ void state_manager_event_init(unsigned rewind_buffer_size)
    core_serialize(&serial_info);
 
    state_manager_push_do(rewind_state.state);
+
+#ifdef HAVE_THREADS
+   if (settings->rewind_threaded)
+   {
+      rewind_state.thread = state_manager_thread_new(
+            rewind_state.state, rewind_state.size);
+
+      if (!rewind_state.thread)
+         RARCH_WARN("Failed to start rewind worker thread, falling back to synchronous rewind.\n");
+   }
+#else
+   (void)settings;
+#endif
 }
 
 
@@ -666,6 +1119,12 @@ static void state_manager_set_frame_is_reversed(bool value)
 
 void state_manager_event_deinit(void)
 {
+#ifdef HAVE_THREADS
+   /* The worker may still be diffing into the state manager. */
+   state_manager_thread_free(rewind_state.thread);
+   rewind_state.thread = NULL;
+#endif
+
    if (rewind_state.state)
    {
       state_manager_free(rewind_state.state);
@@ -675,6 +1134,47 @@ void state_manager_event_deinit(void)
    rewind_state.size  = 0;
 }
 
+/**
+ * state_manager_rewind_seek:
+ * @entries              : number of rewind steps to go back.
+ *
+ * Jumps back @entries steps in the rewind history in one go and 
+ * loads the result into the core. Newer history is discarded, 
+ * just like holding rewind for that many steps would.
+ *
+ * Returns: true if the core state was changed.
+ **/
+bool state_manager_rewind_seek(unsigned entries)
+{
+   unsigned i, popped;
+   retro_ctx_serialize_info_t serial_info;
+   const void *buf = NULL;
+
+   if (!rewind_state.state)
+      return false;
+
+#ifdef HAVE_THREADS
+   if (rewind_state.thread)
+      state_manager_thread_flush(rewind_state.thread);
+#endif
+
+   popped = state_manager_seek(rewind_state.state, entries, &buf);
+
+   if (!popped)
+      return false;
+
+   serial_info.data_const = buf;
+   serial_info.size       = rewind_state.size;
+
+   core_unserialize(&serial_info);
+
+   if (bsv_movie_ctl(BSV_MOVIE_CTL_IS_INITED, NULL))
+      for (i = 0; i < popped; i++)
+         bsv_movie_ctl(BSV_MOVIE_CTL_FRAME_REWIND, NULL);
+
+   return true;
+}
+
 /**
  * check_rewind:
  * @pressed              : was rewind key pressed or held?
@@ -685,6 +1185,7 @@ bool state_manager_check_rewind(bool pressed,
       unsigned rewind_granularity, bool is_paused,
       char *s, size_t len, unsigned *time)
 {
+   static struct retro_perf_counter rewind_capture = {0};
    bool ret             = false;
    static bool first    = true;
 
@@ -707,6 +1208,11 @@ bool state_manager_check_rewind(bool pressed,
    {
       const void *buf    = NULL;
 
+#ifdef HAVE_THREADS
+      if (rewind_state.thread)
+         state_manager_thread_flush(rewind_state.thread);
+#endif
+
       if (state_manager_pop(rewind_state.state, &buf))
       {
          retro_ctx_serialize_info_t serial_info;
@@ -747,22 +1253,52 @@ bool state_manager_check_rewind(bool pressed,
    {
       static unsigned cnt      = 0;
 
+      if (rewind_state.adaptive)
+         rewind_granularity    = rewind_state.granularity;
+
       cnt = (cnt + 1) % (rewind_granularity ?
             rewind_granularity : 1); /* Avoid possible SIGFPE. */
 
       if ((cnt == 0) || bsv_movie_ctl(BSV_MOVIE_CTL_IS_INITED, NULL))
       {
-         retro_ctx_serialize_info_t serial_info;
-         void *state = NULL;
+         size_t entry_size        = 0;
+         /* Always timed while the capture interval adapts to it */
+         bool is_perfcnt_enable   = rewind_state.adaptive ||
+            runloop_ctl(RUNLOOP_CTL_IS_PERFCNT_ENABLE, NULL);
+         retro_perf_tick_t before = rewind_capture.total;
+
+         performance_counter_init(rewind_capture, "rewind_capture");
+         performance_counter_start_plus(is_perfcnt_enable, rewind_capture);
+
+#ifdef HAVE_THREADS
+         /* Movie rewind expects one history entry per frame, 
+          * so never drop while a movie is active. */
+         if (rewind_state.thread)
+            state_manager_thread_capture(rewind_state.thread,
+                  rewind_state.size,
+                  bsv_movie_ctl(BSV_MOVIE_CTL_IS_INITED, NULL),
+                  &entry_size);
+         else
+#endif
+         {
+            void *state = NULL;
+
+            state_manager_push_where(rewind_state.state, &state);
 
-         state_manager_push_where(rewind_state.state, &state);
+            state_manager_serialize(state, rewind_state.size);
 
-         serial_info.data = state;
-         serial_info.size = rewind_state.size;
+            state_manager_push_do(rewind_state.state);
+            state_manager_count_compress(
+                  &rewind_state.state->compress_ticks,
+                  &rewind_state.state->compress_calls);
+
+            entry_size = rewind_state.state->last_entry_size;
+         }
 
-         core_serialize(&serial_info);
+         performance_counter_stop_plus(is_perfcnt_enable, rewind_capture);
 
-         state_manager_push_do(rewind_state.state);
+         if (rewind_state.adaptive)
+            state_manager_adapt(rewind_capture.total - before, entry_size);
       }
    }
 
@@ -32,7 +32,17 @@ bool state_manager_frame_is_reversed(void);
 
 void state_manager_event_deinit(void);
 
-void state_manager_event_init(unsigned rewind_buffer_size);
+void state_manager_event_init(size_t rewind_buffer_size);
+
+/**
+ * state_manager_rewind_seek:
+ * @entries              : number of rewind steps to go back.
+ *
+ * Jumps back @entries steps in the rewind history at once.
+ *
+ * Returns: true if the core state was changed.
+ **/
+bool state_manager_rewind_seek(unsigned entries);
 
 /**
  * check_rewind:
@@ -44,6 +54,31 @@ bool state_manager_check_rewind(bool pressed,
       unsigned rewind_granularity, bool is_paused,
       char *s, size_t len, unsigned *time);
 
+/* The XOR/RLE delta encoding used for rewind, also used by netplay to
+ * send savestates as a difference from the last one sent. */
+
+/**
+ * state_manager_raw_init:
+ * @cpu                  : CPU features, as from cpu_features_get().
+ *
+ * Picks the widest change scanners @cpu supports. Until this is
+ * called, the generic ones are used. Pass 0 to force those.
+ **/
+void state_manager_raw_init(uint64_t cpu);
+
+size_t state_manager_raw_maxsize(size_t uncomp);
+
+void *state_manager_raw_alloc(size_t len, uint16_t uniq);
+
+size_t state_manager_raw_compress(const void *src,
+      const void *dst, size_t len, void *patch);
+
+void state_manager_raw_decompress(const void *patch,
+      size_t patchlen, void *data, size_t datalen);
+
+bool state_manager_raw_patch_valid(const void *patch,
+      size_t patchlen, size_t datalen);
+
 RETRO_END_DECLS
 
 #endif
@@ -162,6 +162,8 @@ enum msg_hash_enums
    MSG_NETPLAY_CANNOT_PLAY,
    MSG_NETPLAY_PEER_PAUSED,
    MSG_NETPLAY_CHANGED_NICK,
+   MSG_NETPLAY_SENDING_SAVESTATE,
+   MSG_NETPLAY_RECEIVING_SAVESTATE,
    MSG_AUTODETECT,
    MSG_AUDIO_VOLUME,
    MSG_LIBRETRO_FRONTEND,
@@ -288,6 +290,8 @@ enum msg_hash_enums
    MSG_REWIND_INIT,
    MSG_REWIND_INIT_FAILED,
    MSG_REWIND_INIT_FAILED_THREADED_AUDIO,
+   MSG_RUN_AHEAD_CORE_DOES_NOT_SUPPORT_SAVESTATES,
+   MSG_RUN_AHEAD_TOO_SLOW,
    MSG_LIBRETRO_ABI_BREAK,
    MSG_DETECTED_VIEWPORT_OF,
    MSG_RECORDING_TO,
@@ -77,4 +77,16 @@ void deinit_netplay(void);
 
 bool netplay_driver_ctl(enum rarch_netplay_ctl_state state, void *data);
 
+/**
+ * netplay_bisect
+ * @path_a               : one peer's desync recording
+ * @path_b               : the other peer's desync recording
+ *
+ * Replay two recordings of the same session against the loaded content and
+ * find the first frame at which they diverge, dumping both states there.
+ *
+ * Returns: true (1) if the recordings could be compared, otherwise false (0).
+ **/
+bool netplay_bisect(const char *path_a, const char *path_b);
+
 #endif
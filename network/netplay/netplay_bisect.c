@@ -0,0 +1,661 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2016-2017 - Gregor Richards
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Offline desync hunting. Two peers' recordings of the same session are
+ * replayed against the loaded content, each with its own input. The recorded
+ * CRCs narrow down where the peers parted, then replaying both from the last
+ * frame they agreed on to ever closer midpoints finds the exact frame, and
+ * both states there are dumped for diffing. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <compat/strl.h>
+#include <net/net_compat.h>
+
+#include "netplay_private.h"
+
+struct bisect_input
+{
+   uint32_t frame;
+   uint32_t flags;
+   netplay_input_state_t input[MAX_USERS];
+};
+
+/* A CRC or state chunk */
+struct bisect_mark
+{
+   uint32_t frame;
+   uint32_t crc;
+   const uint8_t *data;
+   size_t size;
+};
+
+struct bisect_log
+{
+   const char *path;
+   uint8_t *data;
+
+   struct bisect_input *inputs;
+   size_t inputs_count, inputs_size;
+
+   struct bisect_mark *crcs;
+   size_t crcs_count, crcs_size;
+
+   struct bisect_mark *states;
+   size_t states_count, states_size;
+
+   /* The first and one past the last frame recorded */
+   uint32_t start_frame, end_frame;
+};
+
+/* The input the core sees while we replay */
+static const struct bisect_input *bisect_current = NULL;
+
+static int16_t bisect_input_state(unsigned port, unsigned device,
+      unsigned idx, unsigned id)
+{
+   const uint32_t *curr_input_state;
+
+   if (!bisect_current)
+      return 0;
+
+   if (port <= 1 && (bisect_current->flags & NETPLAY_RECORD_FLIP))
+      port ^= 1;
+   if (port >= MAX_USERS || !(bisect_current->flags & (1<<port)))
+      return 0;
+
+   curr_input_state = bisect_current->input[port];
+
+   switch (device)
+   {
+      case RETRO_DEVICE_JOYPAD:
+         return ((1 << id) & curr_input_state[0]) ? 1 : 0;
+
+      case RETRO_DEVICE_ANALOG:
+      {
+         uint32_t state = curr_input_state[1 + idx];
+         return (int16_t)(uint16_t)(state >> (id * 16));
+      }
+
+      default:
+         return 0;
+   }
+}
+
+/* Make room for one more element in a growing array */
+static bool bisect_grow(void **arr, size_t *size, size_t count,
+   size_t elem_size)
+{
+   size_t new_size;
+   void *new_arr;
+
+   if (count < *size)
+      return true;
+
+   new_size = *size ? *size * 2 : 256;
+   new_arr  = realloc(*arr, new_size * elem_size);
+   if (!new_arr)
+      return false;
+
+   *arr  = new_arr;
+   *size = new_size;
+   return true;
+}
+
+static void bisect_free(struct bisect_log *log)
+{
+   free(log->data);
+   free(log->inputs);
+   free(log->crcs);
+   free(log->states);
+   memset(log, 0, sizeof(*log));
+}
+
+static bool bisect_load(struct bisect_log *log, const char *path,
+   size_t state_size)
+{
+   uint32_t header[4], chunk[3];
+   ssize_t len = 0;
+   size_t pos;
+   void *buf   = NULL;
+   bool have_frame = false;
+
+   memset(log, 0, sizeof(*log));
+   log->path = path;
+
+   if (!filestream_read_file(path, &buf, &len) ||
+       (size_t)len < sizeof(header))
+   {
+      RARCH_ERR("Could not read netplay recording \"%s\".\n", path);
+      free(buf);
+      return false;
+   }
+   log->data = (uint8_t*)buf;
+
+   memcpy(header, log->data, sizeof(header));
+   if (ntohl(header[0]) != NETPLAY_RECORD_MAGIC ||
+       ntohl(header[1]) != NETPLAY_RECORD_VERSION)
+   {
+      RARCH_ERR("\"%s\" is not a netplay recording.\n", path);
+      goto error;
+   }
+
+   pos = sizeof(header);
+   while (pos + sizeof(chunk) <= (size_t)len)
+   {
+      uint32_t type, frame, size;
+
+      memcpy(chunk, log->data + pos, sizeof(chunk));
+      type  = ntohl(chunk[0]);
+      frame = ntohl(chunk[1]);
+      size  = ntohl(chunk[2]);
+      pos  += sizeof(chunk);
+
+      if (size > (size_t)len - pos)
+      {
+         RARCH_WARN("Netplay recording \"%s\" is truncated.\n", path);
+         break;
+      }
+      if (have_frame && frame < log->end_frame - 1)
+      {
+         RARCH_WARN("Netplay recording \"%s\" goes back to frame %u. Ignoring the rest.\n",
+               path, frame);
+         break;
+      }
+      if (!have_frame)
+      {
+         log->start_frame = frame;
+         have_frame       = true;
+      }
+      log->end_frame = frame + 1;
+
+      switch (type)
+      {
+         case NETPLAY_RECORD_INPUT:
+         {
+            struct bisect_input *input;
+            uint32_t words[1 + MAX_USERS * WORDS_PER_INPUT];
+            uint32_t player, word;
+            size_t w = 1;
+
+            if (size < sizeof(uint32_t) || size > sizeof(words))
+               goto corrupt;
+            if (!bisect_grow((void**)&log->inputs, &log->inputs_size,
+                     log->inputs_count, sizeof(*log->inputs)))
+               goto error;
+
+            memcpy(words, log->data + pos, size);
+            input = &log->inputs[log->inputs_count++];
+            memset(input, 0, sizeof(*input));
+            input->frame = frame;
+            input->flags = ntohl(words[0]);
+            for (player = 0; player < MAX_USERS; player++)
+            {
+               if (!(input->flags & (1<<player)))
+                  continue;
+               if ((w + WORDS_PER_INPUT) * sizeof(uint32_t) > size)
+                  goto corrupt;
+               for (word = 0; word < WORDS_PER_INPUT; word++)
+                  input->input[player][word] = ntohl(words[w++]);
+            }
+            break;
+         }
+
+         case NETPLAY_RECORD_CRC:
+         {
+            uint32_t crc;
+            if (size != sizeof(uint32_t))
+               goto corrupt;
+            if (!bisect_grow((void**)&log->crcs, &log->crcs_size,
+                     log->crcs_count, sizeof(*log->crcs)))
+               goto error;
+            memcpy(&crc, log->data + pos, sizeof(crc));
+            log->crcs[log->crcs_count].frame = frame;
+            log->crcs[log->crcs_count].crc   = ntohl(crc);
+            log->crcs_count++;
+            break;
+         }
+
+         case NETPLAY_RECORD_STATE:
+            if (size != state_size)
+            {
+               RARCH_ERR("Netplay recording \"%s\" has a state of %u bytes, but this core's are %u. "
+                     "Is this the same core and content?\n",
+                     path, (unsigned)size, (unsigned)state_size);
+               goto error;
+            }
+            if (!bisect_grow((void**)&log->states, &log->states_size,
+                     log->states_count, sizeof(*log->states)))
+               goto error;
+            log->states[log->states_count].frame = frame;
+            log->states[log->states_count].data  = log->data + pos;
+            log->states[log->states_count].size  = size;
+            log->states_count++;
+            break;
+
+         case NETPLAY_RECORD_END:
+            /* END names the first frame not recorded */
+            log->end_frame = frame;
+            break;
+
+         default:
+            break;
+      }
+
+      pos += size;
+   }
+
+   if (!have_frame)
+   {
+      RARCH_ERR("Netplay recording \"%s\" is empty.\n", path);
+      goto error;
+   }
+
+   if (log->states_count == 0 && log->start_frame != 0)
+   {
+      RARCH_ERR("Netplay recording \"%s\" has no state to start from.\n",
+            path);
+      goto error;
+   }
+
+   RARCH_LOG("Netplay recording \"%s\": frames %u to %u, %u CRCs, %u states.\n",
+         path, log->start_frame, log->end_frame,
+         (unsigned)log->crcs_count, (unsigned)log->states_count);
+   return true;
+
+corrupt:
+   RARCH_ERR("Netplay recording \"%s\" is corrupt.\n", path);
+error:
+   bisect_free(log);
+   return false;
+}
+
+/* The input used to run a frame */
+static const struct bisect_input *bisect_input_at(struct bisect_log *log,
+   uint32_t frame)
+{
+   size_t lo = 0, hi = log->inputs_count;
+
+   /* The last input at or before frame */
+   while (lo < hi)
+   {
+      size_t mid = lo + (hi - lo) / 2;
+      if (log->inputs[mid].frame <= frame)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return lo ? &log->inputs[lo - 1] : NULL;
+}
+
+/* The CRC recorded for a frame, if any */
+static const struct bisect_mark *bisect_crc_at(struct bisect_log *log,
+   uint32_t frame)
+{
+   size_t lo = 0, hi = log->crcs_count;
+
+   while (lo < hi)
+   {
+      size_t mid = lo + (hi - lo) / 2;
+      if (log->crcs[mid].frame < frame)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   if (lo < log->crcs_count && log->crcs[lo].frame == frame)
+      return &log->crcs[lo];
+   return NULL;
+}
+
+static bool bisect_inputs_equal(const struct bisect_input *a,
+   const struct bisect_input *b)
+{
+   uint32_t player;
+
+   if (!a || !b)
+      return a == b;
+   if (a->flags != b->flags)
+      return false;
+
+   for (player = 0; player < MAX_USERS; player++)
+      if ((a->flags & (1<<player)) &&
+          memcmp(a->input[player], b->input[player],
+             sizeof(a->input[player])) != 0)
+         return false;
+
+   return true;
+}
+
+/* Run the core from the state at frame from, in state, to the state at
+ * frame to, using the recording's input and any states it loaded on the way */
+static bool bisect_replay(struct bisect_log *log, uint8_t *state,
+   size_t state_size, uint32_t from, uint32_t to)
+{
+   retro_ctx_serialize_info_t serial_info;
+   size_t next_state = 0;
+   uint32_t frame;
+
+   serial_info.data       = NULL;
+   serial_info.data_const = state;
+   serial_info.size       = state_size;
+   if (!core_unserialize(&serial_info))
+      return false;
+
+   while (next_state < log->states_count &&
+          log->states[next_state].frame <= from)
+      next_state++;
+
+   for (frame = from; frame < to; frame++)
+   {
+      if (next_state < log->states_count &&
+          log->states[next_state].frame == frame)
+      {
+         serial_info.data_const = log->states[next_state].data;
+         if (!core_unserialize(&serial_info))
+            return false;
+         next_state++;
+      }
+
+      bisect_current = bisect_input_at(log, frame);
+      core_run();
+   }
+   bisect_current = NULL;
+
+   serial_info.data       = state;
+   serial_info.data_const = NULL;
+   memset(state, 0, state_size);
+   return core_serialize(&serial_info);
+}
+
+/* Get the state at the start of a frame */
+static bool bisect_state_at(struct bisect_log *log, const uint8_t *initial,
+   uint8_t *state, size_t state_size, uint32_t frame)
+{
+   uint32_t from = 0;
+   size_t i;
+
+   /* Start from the latest state at or before frame, or the content as
+    * loaded if the recording began there */
+   memcpy(state, initial, state_size);
+   for (i = 0; i < log->states_count && log->states[i].frame <= frame; i++)
+   {
+      memcpy(state, log->states[i].data, state_size);
+      from = log->states[i].frame;
+   }
+
+   return bisect_replay(log, state, state_size, from, frame);
+}
+
+static void bisect_dump(struct bisect_log *log, const uint8_t *state,
+   size_t state_size, uint32_t frame)
+{
+   char path[PATH_MAX_LENGTH];
+
+   snprintf(path, sizeof(path), "%s.%u.state", log->path, frame);
+   if (filestream_write_file(path, state, state_size))
+      RARCH_LOG("Netplay bisect: wrote the state of \"%s\" at frame %u to \"%s\".\n",
+            log->path, frame, path);
+   else
+      RARCH_ERR("Netplay bisect: could not write \"%s\".\n", path);
+}
+
+static void bisect_log_input(struct bisect_log *log, uint32_t frame)
+{
+   const struct bisect_input *input = bisect_input_at(log, frame);
+   char buf[256];
+   size_t len = 0;
+   uint32_t player;
+
+   buf[0] = '\0';
+   if (input)
+   {
+      for (player = 0; player < MAX_USERS && len < sizeof(buf); player++)
+      {
+         if (!(input->flags & (1<<player)))
+            continue;
+         len += snprintf(buf + len, sizeof(buf) - len, " P%u:%08X",
+               (unsigned)(player + 1), input->input[player][0]);
+      }
+   }
+
+   RARCH_LOG("Netplay bisect: \"%s\" input for frame %u:%s%s\n",
+         log->path, frame, len ? buf : " none",
+         (input && (input->flags & NETPLAY_RECORD_FLIP)) ? " (flipped)" : "");
+}
+
+/* Which recording does the replayed state at this frame agree with? */
+static void bisect_check_crcs(struct bisect_log *a, struct bisect_log *b,
+   const uint8_t *state, size_t state_size, uint32_t frame)
+{
+   const struct bisect_mark *crc_a = bisect_crc_at(a, frame);
+   const struct bisect_mark *crc_b = bisect_crc_at(b, frame);
+   uint32_t crc = netplay_hash_state(0, state, state_size);
+
+   if (crc_a)
+      RARCH_LOG("Netplay bisect: replay %s \"%s\" at frame %u.\n",
+            crc_a->crc == crc ? "agrees with" : "DISAGREES with",
+            a->path, frame);
+   if (crc_b)
+      RARCH_LOG("Netplay bisect: replay %s \"%s\" at frame %u.\n",
+            crc_b->crc == crc ? "agrees with" : "DISAGREES with",
+            b->path, frame);
+}
+
+/**
+ * netplay_bisect
+ * @path_a               : one peer's desync recording
+ * @path_b               : the other peer's desync recording
+ *
+ * Replay two recordings of the same session against the loaded content and
+ * find the first frame at which they diverge, dumping both states there.
+ *
+ * Returns: true (1) if the recordings could be compared, otherwise false (0).
+ **/
+bool netplay_bisect(const char *path_a, const char *path_b)
+{
+   retro_ctx_size_info_t info;
+   retro_ctx_serialize_info_t serial_info;
+   retro_ctx_input_state_info_t input_info;
+   struct bisect_log a, b;
+   uint8_t *initial = NULL;
+   uint8_t *lo_a    = NULL, *lo_b  = NULL;
+   uint8_t *mid_a   = NULL, *mid_b = NULL;
+   size_t state_size, i;
+   uint32_t start, end, lo, hi, frame;
+   bool ret         = false;
+
+   memset(&a, 0, sizeof(a));
+   memset(&b, 0, sizeof(b));
+
+   core_serialize_size(&info);
+   state_size = info.size;
+   if (!state_size)
+   {
+      RARCH_ERR("Netplay bisect: this core can't save states.\n");
+      return false;
+   }
+
+   initial = (uint8_t*)calloc(1, state_size);
+   lo_a    = (uint8_t*)calloc(1, state_size);
+   lo_b    = (uint8_t*)calloc(1, state_size);
+   mid_a   = (uint8_t*)calloc(1, state_size);
+   mid_b   = (uint8_t*)calloc(1, state_size);
+   if (!initial || !lo_a || !lo_b || !mid_a || !mid_b)
+      goto done;
+
+   /* The content as just loaded is frame 0 */
+   serial_info.data       = initial;
+   serial_info.data_const = NULL;
+   serial_info.size       = state_size;
+   if (!core_serialize(&serial_info))
+   {
+      RARCH_ERR("Netplay bisect: this core can't save states.\n");
+      goto done;
+   }
+
+   if (!bisect_load(&a, path_a, state_size) ||
+       !bisect_load(&b, path_b, state_size))
+      goto done;
+
+   start = (a.start_frame > b.start_frame) ? a.start_frame : b.start_frame;
+   end   = (a.end_frame < b.end_frame) ? a.end_frame : b.end_frame;
+   if (start >= end)
+   {
+      RARCH_ERR("Netplay bisect: the recordings have no frames in common.\n");
+      goto done;
+   }
+
+   input_info.cb = bisect_input_state;
+   core_set_input_state(&input_info);
+
+   /* Both peers should have confirmed the same input. If not, netplay lost or
+    * mangled some, and that alone explains a desync. */
+   for (frame = start; frame < end; frame++)
+   {
+      if (!bisect_inputs_equal(bisect_input_at(&a, frame),
+               bisect_input_at(&b, frame)))
+      {
+         RARCH_WARN("Netplay bisect: the recordings' input first differs at frame %u.\n",
+               frame);
+         bisect_log_input(&a, frame);
+         bisect_log_input(&b, frame);
+         break;
+      }
+   }
+
+   /* Narrow it down with the recorded CRCs */
+   lo = start;
+   hi = end;
+   for (i = 0; i < a.crcs_count; i++)
+   {
+      const struct bisect_mark *crc_b;
+      frame = a.crcs[i].frame;
+      if (frame < start || frame >= end)
+         continue;
+      crc_b = bisect_crc_at(&b, frame);
+      if (!crc_b)
+         continue;
+      if (crc_b->crc != a.crcs[i].crc)
+      {
+         hi = frame;
+         break;
+      }
+      lo = frame;
+   }
+   if (hi < end)
+      RARCH_LOG("Netplay bisect: the recorded CRCs agree at frame %u and disagree at frame %u.\n",
+            lo, hi);
+   else
+      RARCH_LOG("Netplay bisect: the recorded CRCs never disagree. Comparing replays up to frame %u.\n",
+            hi);
+
+   if (!bisect_state_at(&a, initial, lo_a, state_size, lo) ||
+       !bisect_state_at(&b, initial, lo_b, state_size, lo))
+   {
+      RARCH_ERR("Netplay bisect: failed to replay to frame %u.\n", lo);
+      goto done;
+   }
+
+   ret = true;
+
+   if (memcmp(lo_a, lo_b, state_size) != 0)
+   {
+      RARCH_LOG("Netplay bisect: the replays already differ at frame %u, where the recordings start.\n",
+            lo);
+      bisect_dump(&a, lo_a, state_size, lo);
+      bisect_dump(&b, lo_b, state_size, lo);
+      goto done;
+   }
+
+   /* Does replaying reproduce the disagreement at all? */
+   memcpy(mid_a, lo_a, state_size);
+   memcpy(mid_b, lo_b, state_size);
+   if (!bisect_replay(&a, mid_a, state_size, lo, hi) ||
+       !bisect_replay(&b, mid_b, state_size, lo, hi))
+   {
+      RARCH_ERR("Netplay bisect: failed to replay to frame %u.\n", hi);
+      ret = false;
+      goto done;
+   }
+   if (memcmp(mid_a, mid_b, state_size) == 0)
+   {
+      if (hi == end)
+         RARCH_LOG("Netplay bisect: the recordings don't diverge up to frame %u.\n",
+               hi);
+      else
+      {
+         RARCH_LOG("Netplay bisect: both recordings replay to the same state at frame %u, "
+               "so the desync comes from the core or savestates, not the input.\n",
+               hi);
+         bisect_check_crcs(&a, &b, mid_a, state_size, hi);
+      }
+      goto done;
+   }
+
+   /* Bisect between the last frame the replays agree on and the first we know
+    * they don't */
+   while (hi - lo > 1)
+   {
+      uint32_t mid = lo + (hi - lo) / 2;
+
+      memcpy(mid_a, lo_a, state_size);
+      memcpy(mid_b, lo_b, state_size);
+      if (!bisect_replay(&a, mid_a, state_size, lo, mid) ||
+          !bisect_replay(&b, mid_b, state_size, lo, mid))
+      {
+         RARCH_ERR("Netplay bisect: failed to replay to frame %u.\n", mid);
+         ret = false;
+         goto done;
+      }
+
+      if (memcmp(mid_a, mid_b, state_size) == 0)
+      {
+         uint8_t *tmp;
+         lo  = mid;
+         tmp = lo_a; lo_a = mid_a; mid_a = tmp;
+         tmp = lo_b; lo_b = mid_b; mid_b = tmp;
+      }
+      else
+         hi = mid;
+   }
+
+   /* lo is the last frame the replays agree on, so it's frame lo's run that
+    * parts them */
+   memcpy(mid_a, lo_a, state_size);
+   memcpy(mid_b, lo_b, state_size);
+   bisect_replay(&a, mid_a, state_size, lo, hi);
+   bisect_replay(&b, mid_b, state_size, lo, hi);
+
+   RARCH_LOG("Netplay bisect: the replays first differ at the start of frame %u.\n",
+         hi);
+   bisect_log_input(&a, lo);
+   bisect_log_input(&b, lo);
+   bisect_dump(&a, mid_a, state_size, hi);
+   bisect_dump(&b, mid_b, state_size, hi);
+
+done:
+   bisect_free(&a);
+   bisect_free(&b);
+   free(initial);
+   free(lo_a);
+   free(lo_b);
+   free(mid_a);
+   free(mid_b);
+   return ret;
+}
@@ -49,6 +49,53 @@ static size_t buf_remaining(struct socket_buffer *sbuf)
    return sbuf->bufsz - buf_used(sbuf) - 1;
 }
 
+static size_t buf_read(struct socket_buffer *sbuf)
+{
+   if (sbuf->read < sbuf->start)
+      return sbuf->read + sbuf->bufsz - sbuf->start;
+
+   return sbuf->read - sbuf->start;
+}
+
+/* The socket is ours unless the I/O thread has it */
+static ssize_t buf_socket_recv(struct socket_buffer *sbuf, int sockfd,
+   bool *error, void *buf, size_t len)
+{
+   ssize_t recvd;
+
+   if (!sbuf->io)
+      return socket_receive_all_nonblocking(sockfd, error, buf, len);
+
+   recvd = netplay_iothread_recv(sbuf->io, buf, len, false);
+   if (recvd < 0)
+      *error = true;
+   return recvd;
+}
+
+static bool buf_socket_recv_blocking(struct socket_buffer *sbuf, int sockfd,
+   void *buf, size_t len)
+{
+   if (!sbuf->io)
+      return socket_receive_all_blocking(sockfd, buf, len);
+   return netplay_iothread_recv(sbuf->io, buf, len, true) == (ssize_t)len;
+}
+
+static ssize_t buf_socket_send(struct socket_buffer *sbuf, int sockfd,
+   const void *buf, size_t len)
+{
+   if (!sbuf->io)
+      return socket_send_all_nonblocking(sockfd, buf, len, true);
+   return netplay_iothread_send(sbuf->io, buf, len, false);
+}
+
+static bool buf_socket_send_blocking(struct socket_buffer *sbuf, int sockfd,
+   const void *buf, size_t len, bool no_signal)
+{
+   if (!sbuf->io)
+      return socket_send_all_blocking(sockfd, buf, len, no_signal);
+   return netplay_iothread_send(sbuf->io, buf, len, true) == (ssize_t)len;
+}
+
 /**
  * netplay_init_socket_buffer
  *
@@ -61,6 +108,10 @@ bool netplay_init_socket_buffer(struct socket_buffer *sbuf, size_t size)
       return false;
    sbuf->bufsz = size;
    sbuf->start = sbuf->read = sbuf->end = 0;
+   sbuf->total = 0;
+   sbuf->transferred = 0;
+   sbuf->sim = NULL;
+   sbuf->io = NULL;
    return true;
 }
 
@@ -112,6 +163,8 @@ void netplay_deinit_socket_buffer(struct socket_buffer *sbuf)
 {
    if (sbuf->data)
       free(sbuf->data);
+   netplay_sim_stream_free(sbuf->sim);
+   sbuf->sim = NULL;
 }
 
 void netplay_clear_socket_buffer(struct socket_buffer *sbuf)
@@ -126,6 +179,22 @@ void netplay_clear_socket_buffer(struct socket_buffer *sbuf)
  */
 bool netplay_send(struct socket_buffer *sbuf, int sockfd, const void *buf,
    size_t len)
+{
+   if (!netplay_send_queue(sbuf, sockfd, buf, len))
+      return false;
+
+   /* Flush what we can immediately */
+   return netplay_send_flush(sbuf, sockfd, false);
+}
+
+/**
+ * netplay_send_queue
+ *
+ * Queue the given data for sending, without trying to send it yet unless the
+ * buffer is full. Lets many small commands go out in one send.
+ */
+bool netplay_send_queue(struct socket_buffer *sbuf, int sockfd,
+   const void *buf, size_t len)
 {
    if (buf_remaining(sbuf) < len)
    {
@@ -138,8 +207,10 @@ bool netplay_send(struct socket_buffer *sbuf, int sockfd, const void *buf,
    {
       /* Can only be that this is simply too big for our buffer, in which case
        * we just need to do a blocking send */
-      if (!socket_send_all_blocking(sockfd, buf, len, false))
+      if (!buf_socket_send_blocking(sbuf, sockfd, buf, len, false))
          return false;
+      sbuf->total += (uint32_t)len;
+      sbuf->transferred += len;
       return true;
    }
 
@@ -161,9 +232,10 @@ bool netplay_send(struct socket_buffer *sbuf, int sockfd, const void *buf,
       sbuf->end += len;
 
    }
+   sbuf->total += (uint32_t)len;
+   netplay_sim_queued(sbuf);
 
-   /* Flush what we can immediately */
-   return netplay_send_flush(sbuf, sockfd, false);
+   return true;
 }
 
 /**
@@ -177,25 +249,37 @@ bool netplay_send(struct socket_buffer *sbuf, int sockfd, const void *buf,
 bool netplay_send_flush(struct socket_buffer *sbuf, int sockfd, bool block)
 {
    ssize_t sent;
+   size_t ready;
 
    if (buf_used(sbuf) == 0)
       return true;
 
+   /* A simulated network may hold some back. Blocking sends can't wait. */
+   ready = buf_used(sbuf);
+   if (sbuf->sim && !block)
+   {
+      ready = netplay_sim_ready(sbuf, ready);
+      if (ready == 0)
+         return true;
+   }
+
    if (sbuf->end > sbuf->start)
    {
       /* Usual case: Everything's in order */
       if (block)
       {
-         if (!socket_send_all_blocking(sockfd, sbuf->data + sbuf->start, buf_used(sbuf), true))
+         if (!buf_socket_send_blocking(sbuf, sockfd, sbuf->data + sbuf->start, buf_used(sbuf), true))
             return false;
+         sbuf->transferred += buf_used(sbuf);
          sbuf->start = sbuf->end = 0;
 
       }
       else
       {
-         sent = socket_send_all_nonblocking(sockfd, sbuf->data + sbuf->start, buf_used(sbuf), true);
+         sent = buf_socket_send(sbuf, sockfd, sbuf->data + sbuf->start, ready);
          if (sent < 0)
             return false;
+         sbuf->transferred += sent;
          sbuf->start += sent;
 
          if (sbuf->start == sbuf->end)
@@ -209,17 +293,21 @@ bool netplay_send_flush(struct socket_buffer *sbuf, int sockfd, bool block)
       /* Unusual case: Buffer overlaps break */
       if (block)
       {
-         if (!socket_send_all_blocking(sockfd, sbuf->data + sbuf->start, sbuf->bufsz - sbuf->start, true))
+         if (!buf_socket_send_blocking(sbuf, sockfd, sbuf->data + sbuf->start, sbuf->bufsz - sbuf->start, true))
             return false;
+         sbuf->transferred += sbuf->bufsz - sbuf->start;
          sbuf->start = 0;
          return netplay_send_flush(sbuf, sockfd, true);
 
       }
       else
       {
-         sent = socket_send_all_nonblocking(sockfd, sbuf->data + sbuf->start, sbuf->bufsz - sbuf->start, true);
+         if (ready > sbuf->bufsz - sbuf->start)
+            ready = sbuf->bufsz - sbuf->start;
+         sent = buf_socket_send(sbuf, sockfd, sbuf->data + sbuf->start, ready);
          if (sent < 0)
             return false;
+         sbuf->transferred += sent;
          sbuf->start += sent;
 
          if (sbuf->start >= sbuf->bufsz)
@@ -236,6 +324,16 @@ bool netplay_send_flush(struct socket_buffer *sbuf, int sockfd, bool block)
    return true;
 }
 
+/**
+ * netplay_send_room
+ *
+ * How much can be queued for sending without having to block.
+ */
+size_t netplay_send_room(struct socket_buffer *sbuf)
+{
+   return buf_remaining(sbuf);
+}
+
 /**
  * netplay_recv
  *
@@ -253,20 +351,22 @@ ssize_t netplay_recv(struct socket_buffer *sbuf, int sockfd, void *buf,
    if (sbuf->end >= sbuf->start)
    {
       error = false;
-      recvd = socket_receive_all_nonblocking(sockfd, &error,
+      recvd = buf_socket_recv(sbuf, sockfd, &error,
          sbuf->data + sbuf->end, sbuf->bufsz - sbuf->end -
          ((sbuf->start == 0) ? 1 : 0));
       if (recvd < 0 || error)
          return -1;
       sbuf->end += recvd;
+      sbuf->transferred += recvd;
       if (sbuf->end >= sbuf->bufsz)
       {
          sbuf->end = 0;
          error = false;
-         recvd = socket_receive_all_nonblocking(sockfd, &error, sbuf->data, sbuf->start - 1);
+         recvd = buf_socket_recv(sbuf, sockfd, &error, sbuf->data, sbuf->start - 1);
          if (recvd < 0 || error)
             return -1;
          sbuf->end += recvd;
+         sbuf->transferred += recvd;
 
       }
 
@@ -274,10 +374,11 @@ ssize_t netplay_recv(struct socket_buffer *sbuf, int sockfd, void *buf,
    else
    {
       error = false;
-      recvd = socket_receive_all_nonblocking(sockfd, &error, sbuf->data + sbuf->end, sbuf->start - sbuf->end - 1);
+      recvd = buf_socket_recv(sbuf, sockfd, &error, sbuf->data + sbuf->end, sbuf->start - sbuf->end - 1);
       if (recvd < 0 || error)
          return -1;
       sbuf->end += recvd;
+      sbuf->transferred += recvd;
 
    }
 
@@ -321,11 +422,14 @@ ssize_t netplay_recv(struct socket_buffer *sbuf, int sockfd, void *buf,
    /* Perhaps block for more data */
    if (block)
    {
+      sbuf->total += (uint32_t)buf_read(sbuf);
       sbuf->start = sbuf->read;
       if (recvd < 0 || recvd < (ssize_t) len)
       {
-         if (!socket_receive_all_blocking(sockfd, (unsigned char *) buf + recvd, len - recvd))
+         if (!buf_socket_recv_blocking(sbuf, sockfd, (unsigned char *) buf + recvd, len - recvd))
             return -1;
+         sbuf->total += (uint32_t)(len - recvd);
+         sbuf->transferred += len - recvd;
          recvd = len;
 
       }
@@ -334,6 +438,16 @@ ssize_t netplay_recv(struct socket_buffer *sbuf, int sockfd, void *buf,
    return recvd;
 }
 
+/**
+ * netplay_recv_pending
+ *
+ * Is there received data in the buffer that hasn't been consumed yet?
+ */
+bool netplay_recv_pending(struct socket_buffer *sbuf)
+{
+   return buf_unread(sbuf) > 0;
+}
+
 /**
  * netplay_recv_reset
  *
@@ -353,5 +467,6 @@ void netplay_recv_reset(struct socket_buffer *sbuf)
  */
 void netplay_recv_flush(struct socket_buffer *sbuf)
 {
+   sbuf->total += (uint32_t)buf_read(sbuf);
    sbuf->start = sbuf->read;
 }
@@ -16,9 +16,12 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 
 #include <boolean.h>
+#include <retro_inline.h>
+#include <retro_endianness.h>
 #include <encodings/crc32.h>
 
 #include "netplay_private.h"
@@ -44,6 +47,11 @@ bool netplay_delta_frame_ready(netplay_t *netplay, struct delta_frame *delta,
          /* We haven't even replayed this frame yet, so we can't overwrite it! */
          return false;
       }
+      if (netplay->snap_frame_count <= delta->frame)
+      {
+         /* A rollback may still have to replay from here */
+         return false;
+      }
    }
    remember_state = delta->state;
    memset(delta, 0, sizeof(struct delta_frame));
@@ -64,3 +72,151 @@ uint32_t netplay_delta_frame_crc(netplay_t *netplay, struct delta_frame *delta)
       return 0;
    return encoding_crc32(0L, (const unsigned char*)delta->state, netplay->state_size);
 }
+
+/* The fast hash is XXH64, folded to 32 bits. It works through the state in
+ * four independent 64-bit lanes, so it runs at several times the speed of the
+ * bytewise CRC32. */
+#define HASH_PRIME1 UINT64_C(0x9E3779B185EBCA87)
+#define HASH_PRIME2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define HASH_PRIME3 UINT64_C(0x165667B19E3779F9)
+#define HASH_PRIME4 UINT64_C(0x85EBCA77C2B2AE63)
+#define HASH_PRIME5 UINT64_C(0x27D4EB2F165667C5)
+#define HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static INLINE uint64_t hash_read64(const uint8_t *p)
+{
+   uint64_t val;
+   memcpy(&val, p, sizeof(val));
+   return swap_if_big64(val);
+}
+
+static INLINE uint32_t hash_read32(const uint8_t *p)
+{
+   uint32_t val;
+   memcpy(&val, p, sizeof(val));
+   return swap_if_big32(val);
+}
+
+static INLINE uint64_t hash_round(uint64_t acc, uint64_t val)
+{
+   acc += val * HASH_PRIME2;
+   acc  = HASH_ROTL(acc, 31);
+   return acc * HASH_PRIME1;
+}
+
+static INLINE uint64_t hash_merge(uint64_t acc, uint64_t val)
+{
+   acc ^= hash_round(0, val);
+   return acc * HASH_PRIME1 + HASH_PRIME4;
+}
+
+/**
+ * netplay_hash_state
+ * @seed                 : hash to continue from, or 0
+ * @data                 : data to hash
+ * @size                 : size of @data
+ *
+ * Fast, non-cryptographic hash of some state. The same on every platform.
+ */
+uint32_t netplay_hash_state(uint32_t seed, const void *data, size_t size)
+{
+   const uint8_t *p   = (const uint8_t*)data;
+   const uint8_t *end = p + size;
+   uint64_t h;
+
+   if (size >= 32)
+   {
+      const uint8_t *limit = end - 32;
+      uint64_t v1 = seed + HASH_PRIME1 + HASH_PRIME2;
+      uint64_t v2 = seed + HASH_PRIME2;
+      uint64_t v3 = seed;
+      uint64_t v4 = seed - HASH_PRIME1;
+
+      do
+      {
+         v1 = hash_round(v1, hash_read64(p));
+         v2 = hash_round(v2, hash_read64(p + 8));
+         v3 = hash_round(v3, hash_read64(p + 16));
+         v4 = hash_round(v4, hash_read64(p + 24));
+         p += 32;
+      } while (p <= limit);
+
+      h = HASH_ROTL(v1, 1) + HASH_ROTL(v2, 7) +
+          HASH_ROTL(v3, 12) + HASH_ROTL(v4, 18);
+      h = hash_merge(h, v1);
+      h = hash_merge(h, v2);
+      h = hash_merge(h, v3);
+      h = hash_merge(h, v4);
+   }
+   else
+      h = seed + HASH_PRIME5;
+
+   h += size;
+
+   for (; p + 8 <= end; p += 8)
+   {
+      h ^= hash_round(0, hash_read64(p));
+      h  = HASH_ROTL(h, 27) * HASH_PRIME1 + HASH_PRIME4;
+   }
+   if (p + 4 <= end)
+   {
+      h ^= hash_read32(p) * HASH_PRIME1;
+      h  = HASH_ROTL(h, 23) * HASH_PRIME2 + HASH_PRIME3;
+      p += 4;
+   }
+   for (; p < end; p++)
+   {
+      h ^= *p * HASH_PRIME5;
+      h  = HASH_ROTL(h, 11) * HASH_PRIME1;
+   }
+
+   h ^= h >> 33;
+   h *= HASH_PRIME2;
+   h ^= h >> 29;
+   h *= HASH_PRIME3;
+   h ^= h >> 32;
+
+   return (uint32_t)(h ^ (h >> 32));
+}
+
+/**
+ * netplay_delta_frame_hash
+ * @netplay              : pointer to netplay object
+ * @delta                : frame to hash
+ * @fast                 : the fast (possibly sampled) hash, or CRC32?
+ *
+ * Get the hash of this frame's state to check against a peer's.
+ */
+uint32_t netplay_delta_frame_hash(netplay_t *netplay, struct delta_frame *delta,
+   bool fast)
+{
+   const uint8_t *state = (const uint8_t*)delta->state;
+   size_t size          = netplay->state_size;
+   size_t sample        = netplay->hash_sample;
+   size_t blocks, block;
+   uint32_t hash;
+
+   if (!size)
+      return 0;
+   if (!fast)
+      return netplay_delta_frame_crc(netplay, delta);
+   if (sample <= 1 || size <= sample * NETPLAY_HASH_BLOCK)
+      return netplay_hash_state(0, state, size);
+
+   /* Hash one block in every sample, starting from a different one each frame
+    * so that a desync anywhere is caught within a few checks. The start only
+    * depends on the frame, so both peers pick the same blocks. */
+   blocks = (size + NETPLAY_HASH_BLOCK - 1) / NETPLAY_HASH_BLOCK;
+   hash   = (uint32_t)size;
+   for (block = (delta->frame * 2654435761U >> 8) % sample; block < blocks;
+         block += sample)
+   {
+      size_t offset = block * NETPLAY_HASH_BLOCK;
+      size_t len    = size - offset;
+      if (len > NETPLAY_HASH_BLOCK)
+         len = NETPLAY_HASH_BLOCK;
+      hash = netplay_hash_state(hash, state + offset, len);
+   }
+
+   return hash;
+}
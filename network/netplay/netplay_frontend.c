@@ -28,8 +28,10 @@
 #include "../../configuration.h"
 #include "../../input/input_driver.h"
 #include "../../runloop.h"
+#include "../../performance_counters.h"
 
 #include "../../tasks/tasks_internal.h"
+#include "../../managers/state_manager.h"
 #include <file/file_path.h>
 #include "../../file_path_special.h"
 #include "paths.h"
@@ -191,6 +193,8 @@ static bool netplay_poll(void)
    int res;
    uint32_t player;
    size_t i;
+   static struct retro_perf_counter net_input = {0};
+   bool is_perfcnt_enable = runloop_ctl(RUNLOOP_CTL_IS_PERFCNT_ENABLE, NULL);
 
    netplay_data->can_poll = false;
 
@@ -203,12 +207,15 @@ static bool netplay_poll(void)
    /* Read Netplay input, block if we're configured to stall for input every
     * frame */
    netplay_update_unread_ptr(netplay_data);
+   performance_counter_init(net_input, "netplay_net_input");
+   performance_counter_start_plus(is_perfcnt_enable, net_input);
    if (netplay_data->stateless_mode &&
        netplay_data->connected_players &&
        netplay_data->unread_frame_count <= netplay_data->run_frame_count)
       res = netplay_poll_net_input(netplay_data, true);
    else
       res = netplay_poll_net_input(netplay_data, false);
+   performance_counter_stop_plus(is_perfcnt_enable, net_input);
    if (res == -1)
    {
       /* Catastrophe! */
@@ -344,6 +351,7 @@ static bool netplay_poll(void)
       if (netplay_data->unread_frame_count + NETPLAY_MAX_STALL_FRAMES
             <= netplay_data->self_frame_count)
       {
+         netplay_data->stat_stalls++;
          netplay_data->stall      = NETPLAY_STALL_RUNNING_FAST;
          netplay_data->stall_time = cpu_features_get_time_usec();
 
@@ -377,8 +385,11 @@ static bool netplay_poll(void)
    {
       retro_time_t now = cpu_features_get_time_usec();
 
-      /* Don't stall out while they're paused */
-      if (netplay_data->remote_paused)
+      /* Don't stall out while they're paused, or while a savestate that
+       * someone is waiting for is on its way */
+      if (netplay_data->remote_paused ||
+          netplay_transfer_sending(netplay_data) ||
+          netplay_transfer_receiving(netplay_data))
          netplay_data->stall_time = now;
       else if (now - netplay_data->stall_time >=
                (netplay_data->is_server ? MAX_SERVER_STALL_TIME_USEC :
@@ -620,10 +631,13 @@ static void netplay_frontend_paused(netplay_t *netplay, bool paused)
       return;
 
    /* Send our unpaused status. Must send manually because we must immediately
-    * flush the buffer: If we're paused, we won't be polled. */
+    * flush the buffer: If we're paused, we won't be polled. A relay's own
+    * pausing is none of its spectators' business. */
    for (i = 0; i < netplay->connections_size; i++)
    {
       struct netplay_connection *connection = &netplay->connections[i];
+      if (netplay->is_relay && i > 0)
+         break;
       if (connection->active && connection->mode >= NETPLAY_CONNECTION_CONNECTED)
       {
          if (paused)
@@ -651,7 +665,7 @@ static void netplay_frontend_paused(netplay_t *netplay, bool paused)
  **/
 bool netplay_pre_frame(netplay_t *netplay)
 {
-   bool sync_stalled;
+   bool sync_stalled, receiving;
    reannounce ++;
    if (netplay->is_server && (reannounce % 3600 == 0))
       netplay_announce();
@@ -667,6 +681,13 @@ bool netplay_pre_frame(netplay_t *netplay)
       netplay_try_init_serialization(netplay);
    }
 
+   /* Let out anything a simulated network was holding back */
+   netplay_sim_poll(netplay);
+
+   /* And send more of any savestate on its way, even if we're stalled, since
+    * the peer may be stalled waiting for it */
+   netplay_transfer_poll(netplay);
+
    if (netplay->is_server)
    {
       /* Advertise our server */
@@ -692,13 +713,21 @@ bool netplay_pre_frame(netplay_t *netplay)
 
    sync_stalled = !netplay_sync_pre_frame(netplay);
 
-   if (sync_stalled ||
+   receiving    = netplay_transfer_receiving(netplay);
+
+   if (sync_stalled || receiving ||
        (netplay->connected_players &&
         (netplay->stall || netplay->remote_paused)))
    {
+      if (!netplay->remote_paused &&
+          netplay->stall != NETPLAY_STALL_INPUT_LATENCY)
+         netplay->stat_stall_frames++;
+
       /* We may have received data even if we're stalled, so run post-frame
-       * sync */
-      netplay_sync_post_frame(netplay, true);
+       * sync. Not while a savestate is on its way, since everything from its
+       * frame on will be replayed from it anyway. */
+      if (!receiving)
+         netplay_sync_post_frame(netplay, true);
       return false;
    }
    return true;
@@ -714,72 +743,211 @@ bool netplay_pre_frame(netplay_t *netplay)
  **/
 void netplay_post_frame(netplay_t *netplay)
 {
-   size_t i;
+   static struct retro_perf_counter flush = {0};
+   bool is_perfcnt_enable = runloop_ctl(RUNLOOP_CTL_IS_PERFCNT_ENABLE, NULL);
+
    retro_assert(netplay);
    netplay_update_unread_ptr(netplay);
    netplay_sync_post_frame(netplay, false);
 
-   for (i = 0; i < netplay->connections_size; i++)
-   {
-      struct netplay_connection *connection = &netplay->connections[i];
-      if (connection->active &&
-          !netplay_send_flush(&connection->send_packet_buffer, connection->fd,
-            false))
-         netplay_hangup(netplay, &netplay->connections[0]);
-   }
+   /* Send everything queued this frame */
+   performance_counter_init(flush, "netplay_send_flush");
+   performance_counter_start_plus(is_perfcnt_enable, flush);
+   netplay_send_flush_all(netplay);
+   performance_counter_stop_plus(is_perfcnt_enable, flush);
+}
+
+/**
+ * netplay_compress
+ * @netplay              : pointer to netplay object
+ * @z                    : compression backend to use
+ * @data                 : data to compress
+ * @size                 : its size
+ *
+ * Compress the given data into zbuffer.
+ *
+ * Returns the compressed size, or -1 on failure.
+ */
+ssize_t netplay_compress(netplay_t *netplay,
+   struct compression_transcoder *z, const void *data, size_t size)
+{
+   uint32_t rd, wn;
+
+   z->compression_backend->set_in(z->compression_stream,
+      (const uint8_t*)data, (uint32_t)size);
+   z->compression_backend->set_out(z->compression_stream,
+      netplay->zbuffer, (uint32_t)netplay->zbuffer_size);
+   if (!z->compression_backend->trans(z->compression_stream, true, &rd,
+         &wn, NULL))
+      return -1;
+
+   return wn;
 }
 
 /**
  * netplay_send_savestate
  * @netplay              : pointer to netplay object
- * @serial_info          : the savestate being loaded
+ * @serial_info          : the savestate to send
+ * @frame                : the frame it's loaded at
+ * @only                 : send only to this connection, or NULL for all
  * @cx                   : compression type
  * @z                    : compression backend to use
  *
- * Send a loaded savestate to those connected peers using the given compression
- * scheme.
+ * Send a savestate to those connected peers using the given compression
+ * scheme. Peers which support delta savestates and have had a state from us
+ * before are sent a patch against that state instead. A relay never sends
+ * states to its server. Anything bigger than a chunk goes to peers which can
+ * take it in chunks over the next few frames, by netplay_transfer_poll.
  */
 void netplay_send_savestate(netplay_t *netplay,
-   retro_ctx_serialize_info_t *serial_info, uint32_t cx,
+   retro_ctx_serialize_info_t *serial_info, uint32_t frame,
+   struct netplay_connection *only, uint32_t cx,
    struct compression_transcoder *z)
 {
    uint32_t header[4];
-   uint32_t rd, wn;
+   ssize_t wn;
    size_t i;
+   bool can_delta = netplay->delta_state &&
+      serial_info->size == netplay->state_size;
 
-   /* Compress it */
-   z->compression_backend->set_in(z->compression_stream,
-      (const uint8_t*)serial_info->data_const, serial_info->size);
-   z->compression_backend->set_out(z->compression_stream,
-      netplay->zbuffer, netplay->zbuffer_size);
-   if (!z->compression_backend->trans(z->compression_stream, true, &rd,
-         &wn, NULL))
+   header[0] = htonl(NETPLAY_CMD_LOAD_SAVESTATE);
+   header[2] = htonl(frame);
+
+   if (can_delta)
+      memcpy(netplay->delta_state, serial_info->data_const,
+            netplay->state_size);
+
+   /* This supersedes any state still on its way */
+   for (i = 0; i < netplay->connections_size; i++)
    {
-      /* Catastrophe! */
-      for (i = 0; i < netplay->connections_size; i++)
-         netplay_hangup(netplay, &netplay->connections[i]);
-      return;
+      struct netplay_connection *connection = &netplay->connections[i];
+      if (connection->active && connection->send_transfer.active &&
+          (!only || connection == only))
+         netplay_transfer_cancel(connection);
    }
 
-   /* Send it to relevant peers */
-   header[0] = htonl(NETPLAY_CMD_LOAD_SAVESTATE);
-   header[1] = htonl(wn + 2*sizeof(uint32_t));
-   header[2] = htonl(netplay->run_frame_count);
-   header[3] = htonl(serial_info->size);
+   /* First the peers we can send a patch to */
+   for (i = 0; can_delta && i < netplay->connections_size; i++)
+   {
+      size_t patch_size;
+      struct netplay_connection *connection = &netplay->connections[i];
+      if (!connection->active ||
+          connection->mode < NETPLAY_CONNECTION_CONNECTED ||
+          connection->compression_supported != cx ||
+          !connection->delta_send_valid ||
+          (only && connection != only) ||
+          (netplay->is_relay && connection == &netplay->connections[0]))
+         continue;
+
+      patch_size = state_manager_raw_compress(netplay->delta_state,
+            connection->delta_send_base, netplay->state_size,
+            netplay->delta_patch);
 
+      if (connection->chunked_supported && patch_size > NETPLAY_CHUNK_SIZE)
+      {
+         if (!netplay_transfer_start(netplay, connection, frame,
+               netplay->delta_patch, patch_size, true))
+         {
+            netplay_hangup(netplay, connection);
+            continue;
+         }
+      }
+      else
+      {
+         wn = netplay_compress(netplay, z, netplay->delta_patch, patch_size);
+         if (wn < 0)
+            goto error;
+
+         header[1] = htonl(wn + 2*sizeof(uint32_t));
+         header[3] = htonl(NETPLAY_CMD_LOAD_SAVESTATE_BIT_DELTA | patch_size);
+
+         if (!netplay_send(&connection->send_packet_buffer, connection->fd,
+               header, sizeof(header)) ||
+             !netplay_send(&connection->send_packet_buffer, connection->fd,
+               netplay->zbuffer, wn))
+         {
+            netplay_hangup(netplay, connection);
+            continue;
+         }
+      }
+
+      connection->udp_sync = connection->send_packet_buffer.total;
+      memcpy(connection->delta_send_base, netplay->delta_state,
+            netplay->state_size);
+   }
+
+   /* Then everyone else gets the whole state */
+   wn = -1;
    for (i = 0; i < netplay->connections_size; i++)
    {
       struct netplay_connection *connection = &netplay->connections[i];
       if (!connection->active ||
           connection->mode < NETPLAY_CONNECTION_CONNECTED ||
-          connection->compression_supported != cx) continue;
+          connection->compression_supported != cx ||
+          (can_delta && connection->delta_send_valid) ||
+          (only && connection != only) ||
+          (netplay->is_relay && connection == &netplay->connections[0]))
+         continue;
+
+      connection->delta_send_valid = false;
 
-      if (!netplay_send(&connection->send_packet_buffer, connection->fd, header,
-            sizeof(header)) ||
-          !netplay_send(&connection->send_packet_buffer, connection->fd,
-            netplay->zbuffer, wn))
-         netplay_hangup(netplay, connection);
+      if (connection->chunked_supported &&
+          serial_info->size > NETPLAY_CHUNK_SIZE)
+      {
+         if (!netplay_transfer_start(netplay, connection, frame,
+               serial_info->data_const, serial_info->size, false))
+         {
+            netplay_hangup(netplay, connection);
+            continue;
+         }
+      }
+      else
+      {
+         if (wn < 0)
+         {
+            /* Compress it */
+            wn = netplay_compress(netplay, z, serial_info->data_const,
+                  serial_info->size);
+            if (wn < 0)
+               goto error;
+         }
+
+         header[1] = htonl(wn + 2*sizeof(uint32_t));
+         header[3] = htonl(serial_info->size);
+
+         if (!netplay_send(&connection->send_packet_buffer, connection->fd,
+               header, sizeof(header)) ||
+             !netplay_send(&connection->send_packet_buffer, connection->fd,
+               netplay->zbuffer, wn))
+         {
+            netplay_hangup(netplay, connection);
+            continue;
+         }
+      }
+
+      connection->udp_sync = connection->send_packet_buffer.total;
+
+      /* This is now the base for the next one */
+      if (can_delta && connection->delta_supported)
+      {
+         if (!connection->delta_send_base)
+            connection->delta_send_base = state_manager_raw_alloc(
+                  netplay->state_size, 0);
+         if (connection->delta_send_base)
+         {
+            memcpy(connection->delta_send_base, netplay->delta_state,
+                  netplay->state_size);
+            connection->delta_send_valid = true;
+         }
+      }
    }
+
+   return;
+
+error:
+   /* Catastrophe! */
+   for (i = 0; i < netplay->connections_size; i++)
+      netplay_hangup(netplay, &netplay->connections[i]);
 }
 
 /**
@@ -797,6 +965,10 @@ void netplay_load_savestate(netplay_t *netplay,
 {
    retro_ctx_serialize_info_t tmp_serial_info;
 
+   /* A relay only ever shows the server's state */
+   if (netplay->is_relay)
+      return;
+
    /* Wherever we're inputting, that's where we consider our state to be loaded
     * (FIXME: Need to be more careful about saving it?) */
    netplay->run_ptr = netplay->self_ptr;
@@ -825,6 +997,7 @@ void netplay_load_savestate(netplay_t *netplay,
                      serial_info->data_const, serial_info->size);
             }
          }
+         netplay->buffer[netplay->run_ptr].have_state = true;
       }
       else
       {
@@ -860,6 +1033,10 @@ void netplay_load_savestate(netplay_t *netplay,
       netplay->other_ptr = netplay->run_ptr;
       netplay->other_frame_count = netplay->run_frame_count;
    }
+   netplay->snap_ptr = netplay->run_ptr;
+   netplay->snap_frame_count = netplay->run_frame_count;
+   netplay_record_state(netplay, netplay->run_frame_count,
+         netplay->buffer[netplay->run_ptr].state);
 
    /* If we can't send it to the peer, loading a state was a bad idea */
    if (netplay->quirks & (
@@ -869,10 +1046,11 @@ void netplay_load_savestate(netplay_t *netplay,
 
    /* Send this to every peer */
    if (netplay->compress_nil.compression_backend)
-      netplay_send_savestate(netplay, serial_info, 0, &netplay->compress_nil);
+      netplay_send_savestate(netplay, serial_info, netplay->run_frame_count,
+         NULL, 0, &netplay->compress_nil);
    if (netplay->compress_zlib.compression_backend)
-      netplay_send_savestate(netplay, serial_info, NETPLAY_COMPRESSION_ZLIB,
-         &netplay->compress_zlib);
+      netplay_send_savestate(netplay, serial_info, netplay->run_frame_count,
+         NULL, NETPLAY_COMPRESSION_ZLIB, &netplay->compress_zlib);
 }
 
 /**
@@ -882,6 +1060,10 @@ void netplay_load_savestate(netplay_t *netplay,
  */
 static void netplay_toggle_play_spectate(netplay_t *netplay)
 {
+   /* A relay stays a spectator, or its own spectators would wait on it */
+   if (netplay->is_relay)
+      return;
+
    if (netplay->is_server)
    {
       /* FIXME: Duplication */
@@ -1036,12 +1218,29 @@ bool init_netplay(void *direct_host, const char *server, unsigned port)
             : server_address_deferred) : NULL,
          netplay_is_client ? (!netplay_client_deferred ? port   
             : server_port_deferred   ) : (port != 0 ? port : RARCH_DEFAULT_PORT),
-         settings->netplay.stateless_mode, settings->netplay.check_frames, &cbs,
-         settings->netplay.nat_traversal, settings->username,
+         settings->netplay.stateless_mode, settings->netplay.check_frames,
+         settings->netplay.state_interval,
+         settings->netplay.input_predictor, settings->netplay.hash_sample,
+         &cbs,
+         settings->netplay.nat_traversal, settings->netplay.udp_input,
+         (netplay_is_client && settings->netplay.relay) ?
+            (settings->netplay.relay_port ? settings->netplay.relay_port :
+             settings->netplay.port ? settings->netplay.port :
+             RARCH_DEFAULT_PORT) : 0,
+         settings->username,
          quirks);
 
    if (netplay_data)
+   {
+      global_t *global = global_get_ptr();
+      if (!string_is_empty(global->netplay.record_path))
+         netplay_record_init(netplay_data, global->netplay.record_path);
+      netplay_sim_init(netplay_data, settings->netplay.sim_delay,
+            settings->netplay.sim_jitter, settings->netplay.sim_loss);
+      if (settings->netplay.io_thread)
+         netplay_iothread_init(netplay_data);
       return true;
+   }
 
    RARCH_WARN("%s\n", msg_hash_to_str(MSG_NETPLAY_FAILED));
 
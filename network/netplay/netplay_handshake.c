@@ -219,8 +219,10 @@ bool netplay_handshake_init_send(netplay_t *netplay,
 
    header[0] = htonl(netplay_impl_magic());
    header[1] = htonl(netplay_platform_magic());
-   header[2] = htonl(NETPLAY_COMPRESSION_SUPPORTED);
-   if (netplay->is_server &&
+   header[2] = htonl(NETPLAY_COMPRESSION_SUPPORTED | NETPLAY_HASH_FAST |
+      NETPLAY_CHUNKED_SAVESTATES |
+      (netplay->hash_sample << NETPLAY_HASH_SAMPLE_SHIFT));
+   if (NETPLAY_SERVING(netplay, connection) &&
        (settings->netplay.password[0] || settings->netplay.spectate_password[0]))
    {
       /* Demand a password */
@@ -351,6 +353,16 @@ bool netplay_handshake_init(netplay_t *netplay,
 
    /* Check what compression is supported */
    compression = ntohl(header[2]);
+
+   /* Older peers only know CRC32. Whoever serves decides how much is hashed. */
+   connection->fast_hash = !!(compression & NETPLAY_HASH_FAST);
+   if (connection->fast_hash && !NETPLAY_SERVING(netplay, connection))
+      netplay->hash_sample = (compression >> NETPLAY_HASH_SAMPLE_SHIFT) &
+         NETPLAY_HASH_SAMPLE_MAX;
+
+   /* Older peers only take a savestate all at once */
+   connection->chunked_supported = !!(compression & NETPLAY_CHUNKED_SAVESTATES);
+
    compression &= NETPLAY_COMPRESSION_SUPPORTED;
    if (compression & NETPLAY_COMPRESSION_ZLIB)
    {
@@ -374,6 +386,14 @@ bool netplay_handshake_init(netplay_t *netplay,
       }
       connection->compression_supported = 0;
    }
+
+   /* Delta patches are in native byte order */
+   connection->delta_supported =
+      (compression & NETPLAY_COMPRESSION_DELTA) &&
+      !netplay_endian_mismatch(local_pmagic, remote_pmagic);
+   connection->delta_send_valid = false;
+   connection->delta_recv_valid = false;
+
    if (!ctrans->decompression_backend)
       ctrans->decompression_backend = ctrans->compression_backend->reverse;
 
@@ -390,7 +410,8 @@ bool netplay_handshake_init(netplay_t *netplay,
    }
 
    /* If a password is demanded, ask for it */
-   if (!netplay->is_server && (connection->salt = ntohl(header[3])))
+   if (!NETPLAY_SERVING(netplay, connection) &&
+       (connection->salt = ntohl(header[3])))
    {
 #ifdef HAVE_MENU
       menu_input_ctx_line_t line;
@@ -438,12 +459,13 @@ static void netplay_handshake_ready(netplay_t *netplay, struct netplay_connectio
 {
    char msg[512];
 
-   if (netplay->is_server)
+   if (NETPLAY_SERVING(netplay, connection))
    {
       netplay_log_connection(&connection->addr, connection - netplay->connections, connection->nick);
 
-      /* Send them the savestate */
-      if (!(netplay->quirks & (NETPLAY_QUIRK_NO_SAVESTATES|NETPLAY_QUIRK_NO_TRANSMISSION)))
+      /* Send them the savestate. A relay sends its own along with the sync. */
+      if (netplay->is_server &&
+          !(netplay->quirks & (NETPLAY_QUIRK_NO_SAVESTATES|NETPLAY_QUIRK_NO_TRANSMISSION)))
       {
          netplay->force_send_savestate = true;
       }
@@ -511,9 +533,10 @@ bool netplay_handshake_info(netplay_t *netplay, struct netplay_connection *conne
 /**
  * netplay_handshake_sync
  *
- * Send a SYNC command.
+ * Send a SYNC command, starting the connection at the given frame.
  */
-bool netplay_handshake_sync(netplay_t *netplay, struct netplay_connection *connection)
+bool netplay_handshake_sync(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t frame)
 {
    /* If we're the server, now we send sync info */
    uint32_t cmd[5];
@@ -535,11 +558,11 @@ bool netplay_handshake_sync(netplay_t *netplay, struct netplay_connection *conne
    cmd[0] = htonl(NETPLAY_CMD_SYNC);
    cmd[1] = htonl(3*sizeof(uint32_t) + MAX_USERS*sizeof(uint32_t) +
       NETPLAY_NICK_LEN + mem_info.size);
-   cmd[2] = htonl(netplay->self_frame_count);
+   cmd[2] = htonl(frame);
    connected_players = netplay->connected_players;
    if (netplay->self_mode == NETPLAY_CONNECTION_PLAYING)
       connected_players |= 1<<netplay->self_player;
-   if (netplay->local_paused || netplay->remote_paused)
+   if ((netplay->local_paused && !netplay->is_relay) || netplay->remote_paused)
       connected_players |= NETPLAY_CMD_SYNC_BIT_PAUSED;
    cmd[3] = htonl(connected_players);
    if (netplay->flip)
@@ -639,7 +662,7 @@ bool netplay_handshake_pre_nick(netplay_t *netplay,
        ntohl(nick_buf.cmd[0]) != NETPLAY_CMD_NICK ||
        ntohl(nick_buf.cmd[1]) != sizeof(nick_buf.nick))
    {
-      if (netplay->is_server)
+      if (NETPLAY_SERVING(netplay, connection))
          strlcpy(msg, msg_hash_to_str(MSG_FAILED_TO_GET_NICKNAME_FROM_CLIENT),
             sizeof(msg));
       else
@@ -655,7 +678,7 @@ bool netplay_handshake_pre_nick(netplay_t *netplay,
       (sizeof(connection->nick) < sizeof(nick_buf.nick)) ?
       sizeof(connection->nick) : sizeof(nick_buf.nick));
 
-   if (netplay->is_server)
+   if (NETPLAY_SERVING(netplay, connection))
    {
       if (settings->netplay.password[0] || settings->netplay.spectate_password[0])
       {
@@ -708,7 +731,7 @@ bool netplay_handshake_pre_password(netplay_t *netplay,
        ntohl(password_buf.cmd[0]) != NETPLAY_CMD_PASSWORD ||
        ntohl(password_buf.cmd[1]) != sizeof(password_buf.password))
    {
-      if (netplay->is_server)
+      if (NETPLAY_SERVING(netplay, connection))
          strlcpy(msg, msg_hash_to_str(MSG_FAILED_TO_GET_NICKNAME_FROM_CLIENT),
             sizeof(msg));
       else
@@ -828,10 +851,17 @@ bool netplay_handshake_pre_info(netplay_t *netplay,
    /* Now switch to the right mode */
    if (netplay->is_server)
    {
-      if (!netplay_handshake_sync(netplay, connection))
+      if (!netplay_handshake_sync(netplay, connection,
+            netplay->self_frame_count))
          return false;
 
    }
+   else if (NETPLAY_SERVING(netplay, connection))
+   {
+      /* A relay syncs its spectators once it has a state to start them from
+       * (see netplay_relay_sync_pending) */
+      connection->mode = NETPLAY_CONNECTION_RELAY_SYNC;
+   }
    else
    {
       if (!netplay_handshake_info(netplay, connection))
@@ -850,7 +880,7 @@ error:
       runloop_msg_queue_push(dmsg, 1, 180, false);
    }
 
-   if (!netplay->is_server)
+   if (!NETPLAY_SERVING(netplay, connection))
    {
       /* Counter-intuitively, we still want to send our info. This is simply so
        * that the server knows why we disconnected. */
@@ -923,7 +953,8 @@ bool netplay_handshake_pre_sync(netplay_t *netplay,
    /* Set our frame counters as requested */
    netplay->self_frame_count = netplay->run_frame_count =
       netplay->other_frame_count = netplay->unread_frame_count =
-      netplay->server_frame_count = new_frame_count;
+      netplay->server_frame_count = netplay->snap_frame_count =
+      new_frame_count;
    for (i = 0; i < netplay->buffer_size; i++)
    {
       struct delta_frame *ptr = &netplay->buffer[i];
@@ -937,7 +968,7 @@ bool netplay_handshake_pre_sync(netplay_t *netplay,
          ptr->frame = new_frame_count;
          ptr->have_local = true;
          netplay->run_ptr = netplay->other_ptr = netplay->unread_ptr =
-            netplay->server_ptr = i;
+            netplay->server_ptr = netplay->snap_ptr = i;
 
       }
    }
@@ -1021,6 +1052,15 @@ bool netplay_handshake_pre_sync(netplay_t *netplay,
    netplay_handshake_ready(netplay, connection);
    netplay_recv_flush(&connection->recv_packet_buffer);
 
+   /* Offer to exchange input over UDP as well */
+   if (netplay->udp_input &&
+       !netplay_send_raw_cmd(netplay, connection, NETPLAY_CMD_UDP, NULL, 0))
+      return false;
+
+   /* A relay stays a spectator */
+   if (netplay->is_relay)
+      return true;
+
    /* Ask to go to player mode */
    return netplay_cmd_mode(netplay, connection, NETPLAY_CONNECTION_PLAYING);
 }
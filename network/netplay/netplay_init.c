@@ -32,6 +32,7 @@
 
 #include "../../autosave.h"
 #include "../../runloop.h"
+#include "../../managers/state_manager.h"
 
 #if defined(AF_INET6) && !defined(HAVE_SOCKET_LEGACY)
 #define HAVE_INET6 1
@@ -222,9 +223,37 @@ static bool init_socket(netplay_t *netplay, void *direct_host, const char *serve
    if (!init_tcp_socket(netplay, direct_host, server, port))
       return false;
 
+   if (netplay->is_server)
+   {
+      if (!netplay_poller_add(netplay, netplay->listen_fd,
+            NETPLAY_POLLER_LISTEN))
+         return false;
+   }
+   else if (!netplay_poller_add(netplay, netplay->connections[0].fd,
+            NETPLAY_POLLER_CONNECTION))
+      return false;
+
    if (netplay->is_server && netplay->nat_traversal)
       netplay_init_nat_traversal(netplay);
 
+   if (netplay->is_server && netplay->udp_input && !netplay_udp_init(netplay))
+      RARCH_WARN("Failed to set up netplay UDP input socket. Using TCP only.\n");
+
+   return true;
+}
+
+static bool init_relay_socket(netplay_t *netplay, uint16_t port)
+{
+   /* Listen for our own spectators. They're served over TCP only, and we
+    * don't advertise ourselves. */
+   if (!init_tcp_socket(netplay, NULL, NULL, port))
+      return false;
+
+   if (!netplay_poller_add(netplay, netplay->listen_fd, NETPLAY_POLLER_LISTEN))
+      return false;
+
+   RARCH_LOG("Relaying netplay to spectators on port %hu.\n",
+         (unsigned short)port);
    return true;
 }
 
@@ -264,6 +293,13 @@ static bool netplay_init_socket_buffers(netplay_t *netplay)
    return true;
 }
 
+/* The most zlib can turn len bytes into, as compressBound() works it
+ * out for the default settings netplay uses. */
+static size_t netplay_zbuffer_bound(size_t len)
+{
+   return len + (len >> 12) + (len >> 14) + (len >> 25) + 13;
+}
+
 bool netplay_init_serialization(netplay_t *netplay)
 {
    unsigned i;
@@ -290,7 +326,10 @@ bool netplay_init_serialization(netplay_t *netplay)
       }
    }
 
-   netplay->zbuffer_size = netplay->state_size * 2;
+   /* Room for a whole state or a delta patch, which can be half again as
+    * big, after zlib has added its own overhead to incompressible data */
+   netplay->zbuffer_size = netplay_zbuffer_bound(
+         state_manager_raw_maxsize(netplay->state_size));
    netplay->zbuffer = (uint8_t *) calloc(netplay->zbuffer_size, 1);
    if (!netplay->zbuffer)
    {
@@ -299,6 +338,20 @@ bool netplay_init_serialization(netplay_t *netplay)
       return false;
    }
 
+   /* Buffers for delta savestates. Failure here just means we always send
+    * whole states. */
+   netplay->delta_state      = state_manager_raw_alloc(netplay->state_size, 1);
+   netplay->delta_patch_size = state_manager_raw_maxsize(netplay->state_size);
+   netplay->delta_patch      = (uint8_t *) malloc(netplay->delta_patch_size);
+   if (!netplay->delta_state || !netplay->delta_patch)
+   {
+      free(netplay->delta_state);
+      free(netplay->delta_patch);
+      netplay->delta_state      = NULL;
+      netplay->delta_patch      = NULL;
+      netplay->delta_patch_size = 0;
+   }
+
    return true;
 }
 
@@ -398,8 +451,13 @@ static bool netplay_init_buffers(netplay_t *netplay)
  * @port                 : Port of server.
  * @stateless_mode       : Shall we use stateless mode?
  * @check_frames         : Frequency with which to check CRCs.
+ * @state_interval       : Frequency with which to capture states.
+ * @predictor            : How to predict input not yet received.
+ * @hash_sample          : Fraction of each state to hash for CRC checks.
  * @cb                   : Libretro callbacks.
  * @nat_traversal        : If true, attempt NAT traversal.
+ * @udp_input            : If true, offer to exchange input over UDP.
+ * @relay_port           : If nonzero, relay to spectators on this port.
  * @nick                 : Nickname of user.
  * @quirks               : Netplay quirks required for this session.
  *
@@ -409,8 +467,9 @@ static bool netplay_init_buffers(netplay_t *netplay)
  * Returns: new netplay data.
  */
 netplay_t *netplay_new(void *direct_host, const char *server, uint16_t port,
-   bool stateless_mode, int check_frames,
-   const struct retro_callbacks *cb, bool nat_traversal, const char *nick,
+   bool stateless_mode, int check_frames, unsigned state_interval,
+   unsigned predictor, unsigned hash_sample, const struct retro_callbacks *cb,
+   bool nat_traversal, bool udp_input, uint16_t relay_port, const char *nick,
    uint64_t quirks)
 {
    netplay_t *netplay = (netplay_t*)calloc(1, sizeof(*netplay));
@@ -418,17 +477,26 @@ netplay_t *netplay_new(void *direct_host, const char *server, uint16_t port,
       return NULL;
 
    netplay->listen_fd         = -1;
+   netplay->udp_fd            = -1;
    netplay->tcp_port          = port;
    netplay->cbs               = *cb;
    netplay->connected_players = 0;
    netplay->player_max        = 1;
    netplay->is_server         = (direct_host == NULL && server == NULL);
+   netplay->is_relay          = !netplay->is_server && relay_port;
    netplay->nat_traversal     = netplay->is_server ? nat_traversal : false;
+   netplay->udp_input         = udp_input;
    netplay->stateless_mode    = stateless_mode;
    netplay->check_frames      = check_frames;
+   netplay->state_interval    = state_interval;
+   netplay->predictor         = (predictor < NETPLAY_PREDICT_LAST) ?
+      (enum netplay_predictor)predictor : NETPLAY_PREDICT_HOLD;
+   netplay->hash_sample       = (hash_sample < NETPLAY_HASH_SAMPLE_MAX) ?
+      hash_sample : NETPLAY_HASH_SAMPLE_MAX;
    netplay->crc_validity_checked = false;
    netplay->crcs_valid        = true;
    netplay->quirks            = quirks;
+   netplay->stat_start_time   = cpu_features_get_time_usec();
    netplay->self_mode         = netplay->is_server ?
                                 NETPLAY_CONNECTION_PLAYING :
                                 NETPLAY_CONNECTION_NONE;
@@ -438,6 +506,19 @@ netplay_t *netplay_new(void *direct_host, const char *server, uint16_t port,
       netplay->connections = NULL;
       netplay->connections_size = 0;
    }
+   else if (netplay->is_relay)
+   {
+      /* Spectators are added after the server, so this must be growable */
+      netplay->connections = (struct netplay_connection*)
+         calloc(1, sizeof(struct netplay_connection));
+      if (!netplay->connections)
+      {
+         free(netplay);
+         return NULL;
+      }
+      netplay->connections_size = 1;
+      netplay->connections[0].fd = -1;
+   }
    else
    {
       netplay->connections = &netplay->one_connection;
@@ -447,17 +528,22 @@ netplay_t *netplay_new(void *direct_host, const char *server, uint16_t port,
 
    strlcpy(netplay->nick, nick[0] ? nick : RARCH_DEFAULT_NICK, sizeof(netplay->nick));
 
-   if (!init_socket(netplay, direct_host, server, port))
+   if (!netplay_poller_init(netplay))
    {
+      if (netplay->connections != &netplay->one_connection)
+         free(netplay->connections);
       free(netplay);
       return NULL;
    }
 
+   if (!init_socket(netplay, direct_host, server, port))
+      goto error;
+
+   if (netplay->is_relay && !init_relay_socket(netplay, relay_port))
+      goto error;
+
    if (!netplay_init_buffers(netplay))
-   {
-      free(netplay);
-      return NULL;
-   }
+      goto error;
 
    if (!netplay->is_server)
    {
@@ -467,12 +553,12 @@ netplay_t *netplay_new(void *direct_host, const char *server, uint16_t port,
 
    /* FIXME: Not really the right place to do this, socket initialization needs
     * to be fixed in general */
-   if (netplay->is_server)
+   if (netplay->listen_fd >= 0)
    {
       if (!socket_nonblock(netplay->listen_fd))
          goto error;
    }
-   else
+   if (!netplay->is_server)
    {
       if (!socket_nonblock(netplay->connections[0].fd))
          goto error;
@@ -484,9 +570,15 @@ error:
    if (netplay->listen_fd >= 0)
       socket_close(netplay->listen_fd);
 
+   netplay_udp_deinit(netplay);
+
    if (netplay->connections && netplay->connections[0].fd >= 0)
       socket_close(netplay->connections[0].fd);
 
+   netplay_poller_deinit(netplay);
+
+   if (netplay->connections && netplay->connections != &netplay->one_connection)
+      free(netplay->connections);
    free(netplay);
    return NULL;
 }
@@ -504,15 +596,24 @@ void netplay_free(netplay_t *netplay)
    if (netplay->listen_fd >= 0)
       socket_close(netplay->listen_fd);
 
+   netplay_udp_deinit(netplay);
+   netplay_record_deinit(netplay);
+   netplay_iothread_deinit(netplay);
+
    for (i = 0; i < netplay->connections_size; i++)
    {
       struct netplay_connection *connection = &netplay->connections[i];
       if (connection->active)
       {
+         netplay->stat_bytes_sent += connection->send_packet_buffer.transferred;
+         netplay->stat_bytes_recv += connection->recv_packet_buffer.transferred;
          socket_close(connection->fd);
          netplay_deinit_socket_buffer(&connection->send_packet_buffer);
          netplay_deinit_socket_buffer(&connection->recv_packet_buffer);
       }
+      free(connection->delta_send_base);
+      free(connection->delta_recv_base);
+      netplay_transfer_free(connection);
    }
 
    if (netplay->connections && netplay->connections != &netplay->one_connection)
@@ -521,6 +622,48 @@ void netplay_free(netplay_t *netplay)
    if (netplay->nat_traversal)
       natt_free(&netplay->nat_traversal_state);
 
+   if (netplay->stat_frames)
+      RARCH_LOG("Netplay captured %u states over %u frames, %u usec each on average. "
+            "%u rollbacks, averaging %u frames and at most %u.\n",
+            netplay->stat_captures, netplay->stat_frames,
+            netplay->stat_captures ?
+               (unsigned)(netplay->stat_capture_time / netplay->stat_captures) : 0,
+            netplay->stat_rollbacks,
+            netplay->stat_rollbacks ?
+               netplay->stat_rollback_frames / netplay->stat_rollbacks : 0,
+            netplay->stat_rollback_max);
+
+   if (netplay->stat_frames)
+   {
+      retro_time_t elapsed = cpu_features_get_time_usec() -
+         netplay->stat_start_time;
+      unsigned secs        = (unsigned)(elapsed / 1000000);
+      uint32_t *depths     = netplay->stat_rollback_depths;
+
+      RARCH_LOG("Netplay rollback depths: 1: %u, 2-3: %u, 4-7: %u, 8-15: %u, "
+            "16-31: %u, 32+: %u.\n",
+            depths[0], depths[1], depths[2], depths[3], depths[4], depths[5]);
+      RARCH_LOG("Netplay stalled %u times for %u frames, detected %u desyncs "
+            "and loaded %u states.\n",
+            netplay->stat_stalls, netplay->stat_stall_frames,
+            netplay->stat_desyncs, netplay->stat_loads);
+      RARCH_LOG("Netplay sent %llu bytes and received %llu in %u seconds "
+            "(%u and %u bytes/s).\n",
+            (unsigned long long)netplay->stat_bytes_sent,
+            (unsigned long long)netplay->stat_bytes_recv, secs,
+            secs ? (unsigned)(netplay->stat_bytes_sent / secs) : 0,
+            secs ? (unsigned)(netplay->stat_bytes_recv / secs) : 0);
+   }
+
+   for (i = 0; i < MAX_USERS; i++)
+   {
+      struct netplay_predict_stats *stats = &netplay->predict_stats[i];
+      if (stats->predicted)
+         RARCH_LOG("Netplay predicted %u frames of player %u's input, %u%% of them wrongly.\n",
+               stats->predicted, (unsigned)(i + 1),
+               (unsigned)((uint64_t)stats->mispredicted * 100 / stats->predicted));
+   }
+
    if (netplay->buffer)
    {
       for (i = 0; i < netplay->buffer_size; i++)
@@ -532,6 +675,8 @@ void netplay_free(netplay_t *netplay)
 
    if (netplay->zbuffer)
       free(netplay->zbuffer);
+   free(netplay->delta_state);
+   free(netplay->delta_patch);
 
    if (netplay->compress_nil.compression_stream)
    {
@@ -547,5 +692,8 @@ void netplay_free(netplay_t *netplay)
    if (netplay->addr)
       freeaddrinfo_retro(netplay->addr);
 
+   netplay_sim_deinit(netplay);
+   netplay_poller_deinit(netplay);
+
    free(netplay);
 }
@@ -25,6 +25,7 @@
 #include "netplay_private.h"
 
 #include "../../runloop.h"
+#include "../../managers/state_manager.h"
 
 #if 0
 #define DEBUG_NETPLAY_STEPS 1
@@ -76,7 +77,8 @@ static void remote_unpaused(netplay_t *netplay, struct netplay_connection *conne
           break;
        }
     }
-    if (!netplay->remote_paused && !netplay->local_paused)
+    if (!netplay->remote_paused &&
+        (!netplay->local_paused || netplay->is_relay))
        netplay_send_raw_cmd_all(netplay, connection, NETPLAY_CMD_RESUME, NULL, 0);
 }
 
@@ -99,7 +101,7 @@ void netplay_hangup(netplay_t *netplay, struct netplay_connection *connection)
    dmsg = msg;
 
    /* Report this disconnection */
-   if (netplay->is_server)
+   if (NETPLAY_SERVING(netplay, connection))
    {
       if (connection->nick[0])
          snprintf(msg, sizeof(msg)-1, msg_hash_to_str(MSG_NETPLAY_SERVER_NAMED_HANGUP), connection->nick);
@@ -113,17 +115,46 @@ void netplay_hangup(netplay_t *netplay, struct netplay_connection *connection)
    RARCH_LOG("%s\n", dmsg);
    runloop_msg_queue_push(dmsg, 1, 180, false);
 
+   if (connection->udp)
+   {
+      RARCH_LOG("Netplay UDP delivered %u of %u input frames first.\n",
+            connection->udp_frames_first, connection->udp_frames_total);
+      connection->udp = false;
+   }
+
+   netplay->stat_bytes_sent += connection->send_packet_buffer.transferred;
+   netplay->stat_bytes_recv += connection->recv_packet_buffer.transferred;
+
+   netplay_iothread_detach(netplay, connection);
+   netplay_poller_remove(netplay, connection->fd);
    socket_close(connection->fd);
    connection->active = false;
+   connection->ready  = false;
    netplay_deinit_socket_buffer(&connection->send_packet_buffer);
    netplay_deinit_socket_buffer(&connection->recv_packet_buffer);
 
-   if (!netplay->is_server)
+   netplay_transfer_free(connection);
+   free(connection->delta_send_base);
+   free(connection->delta_recv_base);
+   connection->delta_send_base  = NULL;
+   connection->delta_recv_base  = NULL;
+   connection->delta_send_valid = false;
+   connection->delta_recv_valid = false;
+
+   if (!NETPLAY_SERVING(netplay, connection))
    {
       netplay->self_mode = NETPLAY_CONNECTION_NONE;
       netplay->connected_players = 0;
       netplay->stall = NETPLAY_STALL_NONE;
 
+      /* Without a server, a relay has nothing to pass on */
+      if (netplay->is_relay)
+      {
+         size_t i;
+         for (i = 1; i < netplay->connections_size; i++)
+            netplay_hangup(netplay, &netplay->connections[i]);
+      }
+
    }
    else
    {
@@ -165,9 +196,12 @@ static bool send_input_frame(netplay_t *netplay,
    buffer[5] = htonl(state[1]);
    buffer[6] = htonl(state[2]);
 
+   /* Input is only queued here, so that all of a frame's input goes out
+    * together when the connection is next flushed */
    if (only)
    {
-      if (!netplay_send(&only->send_packet_buffer, only->fd, buffer, sizeof(buffer)))
+      if (!netplay_send_queue(&only->send_packet_buffer, only->fd, buffer,
+            sizeof(buffer)))
       {
          netplay_hangup(netplay, only);
          return false;
@@ -184,8 +218,8 @@ static bool send_input_frame(netplay_t *netplay,
              (connection->mode != NETPLAY_CONNECTION_PLAYING ||
               connection->player != player))
          {
-            if (!netplay_send(&connection->send_packet_buffer, connection->fd,
-                  buffer, sizeof(buffer)))
+            if (!netplay_send_queue(&connection->send_packet_buffer,
+                  connection->fd, buffer, sizeof(buffer)))
                netplay_hangup(netplay, connection);
          }
       }
@@ -207,6 +241,11 @@ bool netplay_send_cur_input(netplay_t *netplay,
    struct delta_frame *dframe = &netplay->buffer[netplay->self_ptr];
    uint32_t player;
 
+   /* A relay passes input on as it arrives, and has none of its own */
+   if (netplay->is_relay && NETPLAY_SERVING(netplay, connection))
+      return netplay_send_flush(&connection->send_packet_buffer,
+            connection->fd, false);
+
    if (netplay->is_server)
    {
       /* Send the other players' input data */
@@ -252,6 +291,66 @@ bool netplay_send_cur_input(netplay_t *netplay,
          false))
       return false;
 
+   if (connection->udp)
+      netplay_udp_send_cur_input(netplay, connection);
+
+   return true;
+}
+
+/**
+ * netplay_record_input
+ *
+ * Record input received from a connection as the real input for the given
+ * player's next unread frame, and forward it on if we're the server or a
+ * relay.
+ *
+ * Returns false if the frame isn't ready for input yet.
+ */
+bool netplay_record_input(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t player,
+   bool server_data, const uint32_t *state)
+{
+   uint32_t frame = netplay->read_frame_count[player];
+   struct delta_frame *dframe = &netplay->buffer[netplay->read_ptr[player]];
+
+   if (!netplay_delta_frame_ready(netplay, dframe, frame))
+      return false;
+
+   memcpy(dframe->real_input_state[player], state,
+      WORDS_PER_INPUT*sizeof(uint32_t));
+   dframe->have_real[player] = true;
+   netplay->read_ptr[player] = NEXT_PTR(netplay->read_ptr[player]);
+   netplay->read_frame_count[player]++;
+
+   if (netplay->is_server)
+   {
+      /* Forward it on if it's past data*/
+      if (dframe->frame <= netplay->self_frame_count)
+         send_input_frame(netplay, NULL, connection, frame,
+            player, dframe->real_input_state[player]);
+   }
+   else if (netplay->is_relay)
+   {
+      /* Pass it straight on, however far behind our own core is */
+      netplay_relay_forward_input(netplay, frame, player, server_data,
+         dframe->real_input_state[player]);
+   }
+
+   /* If this was server data, advance our server pointer too */
+   if (server_data)
+   {
+      netplay->server_ptr = netplay->read_ptr[player];
+      netplay->server_frame_count = netplay->read_frame_count[player];
+   }
+
+   if (connection->udp)
+      connection->udp_frames_total++;
+
+#ifdef DEBUG_NETPLAY_STEPS
+   RARCH_LOG("Received input from %u\n", player);
+   print_state(netplay);
+#endif
+
    return true;
 }
 
@@ -279,6 +378,24 @@ bool netplay_send_raw_cmd(netplay_t *netplay,
       if (!netplay_send(&connection->send_packet_buffer, connection->fd, data, size))
          return false;
 
+   /* Input sent over UDP may not overtake anything that changes how it's
+    * interpreted */
+   switch (cmd)
+   {
+      case NETPLAY_CMD_ACK:
+      case NETPLAY_CMD_NOINPUT:
+      case NETPLAY_CMD_CRC:
+      case NETPLAY_CMD_REQUEST_SAVESTATE:
+      case NETPLAY_CMD_PAUSE:
+      case NETPLAY_CMD_RESUME:
+      case NETPLAY_CMD_STALL:
+      case NETPLAY_CMD_UDP:
+         break;
+      default:
+         connection->udp_sync = connection->send_packet_buffer.total;
+         break;
+   }
+
    return true;
 }
 
@@ -306,6 +423,24 @@ void netplay_send_raw_cmd_all(netplay_t *netplay,
    }
 }
 
+/**
+ * netplay_send_flush_all
+ *
+ * Send whatever we can of the data queued for every connection.
+ */
+void netplay_send_flush_all(netplay_t *netplay)
+{
+   size_t i;
+   for (i = 0; i < netplay->connections_size; i++)
+   {
+      struct netplay_connection *connection = &netplay->connections[i];
+      if (connection->active &&
+          !netplay_send_flush(&connection->send_packet_buffer, connection->fd,
+            false))
+         netplay_hangup(netplay, connection);
+   }
+}
+
 static bool netplay_cmd_nak(netplay_t *netplay,
    struct netplay_connection *connection)
 {
@@ -321,16 +456,29 @@ static bool netplay_cmd_nak(netplay_t *netplay,
 bool netplay_cmd_crc(netplay_t *netplay, struct delta_frame *delta)
 {
    uint32_t payload[2];
+   uint32_t hash[2] = {0};
+   bool have_hash[2] = {false};
    bool success = true;
    size_t i;
    payload[0] = htonl(delta->frame);
-   payload[1] = htonl(delta->crc);
    for (i = 0; i < netplay->connections_size; i++)
    {
-      if (netplay->connections[i].active &&
-            netplay->connections[i].mode >= NETPLAY_CONNECTION_CONNECTED)
-         success = netplay_send_raw_cmd(netplay, &netplay->connections[i],
-            NETPLAY_CMD_CRC, payload, sizeof(payload)) && success;
+      struct netplay_connection *connection = &netplay->connections[i];
+      unsigned fast = connection->fast_hash ? 1 : 0;
+
+      if (!connection->active ||
+            connection->mode < NETPLAY_CONNECTION_CONNECTED)
+         continue;
+
+      /* Each kind of hash is only computed if someone wants it */
+      if (!have_hash[fast])
+      {
+         hash[fast]      = netplay_delta_frame_hash(netplay, delta, !!fast);
+         have_hash[fast] = true;
+      }
+      payload[1] = htonl(hash[fast]);
+      success = netplay_send_raw_cmd(netplay, connection,
+         NETPLAY_CMD_CRC, payload, sizeof(payload)) && success;
    }
    return success;
 }
@@ -393,6 +541,198 @@ bool netplay_cmd_stall(netplay_t *netplay,
 }
 
 #undef RECV
+/* Can this peer send us a savestate now? */
+static bool netplay_savestate_allowed(netplay_t *netplay,
+   struct netplay_connection *connection)
+{
+   /* Make sure we're ready for it */
+   if (netplay->quirks & NETPLAY_QUIRK_INITIALIZATION)
+   {
+      if (!netplay->is_replay)
+      {
+         netplay->is_replay = true;
+         netplay->replay_ptr = netplay->run_ptr;
+         netplay->replay_frame_count = netplay->run_frame_count;
+         netplay_wait_and_init_serialization(netplay);
+         netplay->is_replay = false;
+      }
+      else
+      {
+         netplay_wait_and_init_serialization(netplay);
+      }
+   }
+
+   /* Only players may load states */
+   if (connection->mode != NETPLAY_CONNECTION_PLAYING)
+   {
+      RARCH_ERR("Netplay state load from a spectator.\n");
+      return false;
+   }
+
+   /* We only allow players to load state if we're in a simple
+    * two-player situation */
+   if (netplay->is_server && netplay->connections_size > 1)
+   {
+      RARCH_ERR("Netplay state load from a client with other clients connected disallowed.\n");
+      return false;
+   }
+
+   return true;
+}
+
+/* Is a savestate loaded at this frame in order? It must come right after the
+ * last input we have from its sender. */
+static bool netplay_savestate_in_order(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t frame)
+{
+   if ((NETPLAY_SERVING(netplay, connection) &&
+          frame != netplay->read_frame_count[connection->player]) ||
+       (!NETPLAY_SERVING(netplay, connection) &&
+          frame != netplay->server_frame_count))
+   {
+      RARCH_ERR("CMD_LOAD_SAVESTATE loading a state out of order!\n");
+      return false;
+   }
+   return true;
+}
+
+/* Check a savestate's inflated size, and whether it's a delta patch */
+static bool netplay_savestate_size_valid(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t *isize, bool *delta)
+{
+   *delta = false;
+   if (*isize & NETPLAY_CMD_LOAD_SAVESTATE_BIT_DELTA)
+   {
+      *isize &= ~NETPLAY_CMD_LOAD_SAVESTATE_BIT_DELTA;
+      if (!connection->delta_supported ||
+          !connection->delta_recv_valid ||
+          *isize > netplay->delta_patch_size)
+      {
+         RARCH_ERR("CMD_LOAD_SAVESTATE received an unexpected delta savestate.\n");
+         return false;
+      }
+      *delta = true;
+   }
+   else if (*isize != netplay->state_size)
+   {
+      RARCH_ERR("CMD_LOAD_SAVESTATE received an unexpected save state size.\n");
+      return false;
+   }
+   return true;
+}
+
+/* Don't expect data from other clients from before a savestate. Input after
+ * it may come in before the state is all here. */
+static void netplay_savestate_skip_input(netplay_t *netplay, size_t ptr,
+   uint32_t frame)
+{
+   uint32_t player;
+   for (player = 0; player < MAX_USERS; player++)
+   {
+      if (!(netplay->connected_players & (1<<player))) continue;
+      if (frame > netplay->read_frame_count[player])
+      {
+         netplay->read_ptr[player] = ptr;
+         netplay->read_frame_count[player] = frame;
+      }
+   }
+}
+
+/* Load a savestate received from this peer. It's already in the frame at ptr,
+ * unless it came as a patch, which is applied to the last state we exchanged.
+ * Returns false if the patch is corrupt. */
+/* Bring the base for the next delta up to a state the sender has sent:
+ * either the whole state, or a patch against the last one. The sender's base
+ * moves on as soon as it sends, so this has to happen for every state that
+ * arrives, even one we can't load. */
+static bool netplay_delta_recv_update(netplay_t *netplay,
+   struct netplay_connection *connection, const void *state,
+   const uint8_t *patch, uint32_t patch_size)
+{
+   if (patch)
+   {
+      /* Apply the patch to the last state we exchanged */
+      if (!state_manager_raw_patch_valid(patch, patch_size,
+            netplay->state_size))
+      {
+         RARCH_ERR("CMD_LOAD_SAVESTATE received a corrupt delta savestate.\n");
+         return false;
+      }
+      state_manager_raw_decompress(patch, patch_size,
+            connection->delta_recv_base, netplay->state_size);
+   }
+   else if (connection->delta_supported)
+   {
+      /* This is the base for the next delta */
+      if (!connection->delta_recv_base)
+         connection->delta_recv_base = state_manager_raw_alloc(
+               netplay->state_size, 0);
+      if (connection->delta_recv_base)
+      {
+         memcpy(connection->delta_recv_base, state, netplay->state_size);
+         connection->delta_recv_valid = true;
+      }
+   }
+   return true;
+}
+
+static bool netplay_savestate_received(netplay_t *netplay,
+   struct netplay_connection *connection, size_t ptr, uint32_t frame,
+   const uint8_t *patch, uint32_t patch_size)
+{
+   void *state = netplay->buffer[ptr].state;
+
+   if (!netplay_delta_recv_update(netplay, connection, state, patch,
+            patch_size))
+      return false;
+   if (patch)
+      memcpy(state, connection->delta_recv_base, netplay->state_size);
+
+   netplay->buffer[ptr].have_state = true;
+   netplay->stat_loads++;
+   netplay_record_state(netplay, frame, state);
+
+   if (netplay->is_relay)
+   {
+      netplay_relay_event(netplay, frame);
+      netplay_relay_forward_savestate(netplay, frame, state);
+   }
+
+   /* Skip ahead if it's past where we are */
+   if (frame > netplay->run_frame_count)
+   {
+      /* This is squirrely: We need to assure that when we advance the
+       * frame in post_frame, THEN we're referring to the frame to
+       * load into. If we refer directly to read_ptr, then we'll end
+       * up never reading the input for read_frame_count itself, which
+       * will make the other side unhappy. */
+      netplay->run_ptr           = PREV_PTR(ptr);
+      netplay->run_frame_count   = frame - 1;
+      if (frame > netplay->self_frame_count)
+      {
+         netplay->self_ptr         = netplay->run_ptr;
+         netplay->self_frame_count = netplay->run_frame_count;
+      }
+   }
+
+   netplay_savestate_skip_input(netplay, ptr, frame);
+
+   /* And force rewind to it */
+   netplay->force_rewind                  = true;
+   netplay->savestate_request_outstanding = false;
+   netplay->other_ptr                     = ptr;
+   netplay->other_frame_count             = frame;
+   netplay->snap_ptr                      = netplay->other_ptr;
+   netplay->snap_frame_count              = frame;
+
+#ifdef DEBUG_NETPLAY_STEPS
+   RARCH_LOG("Loading state at %u\n", frame);
+   print_state(netplay);
+#endif
+
+   return true;
+}
+
 #define RECV(buf, sz) \
 recvd = netplay_recv(&connection->recv_packet_buffer, connection->fd, (buf), \
 (sz), false); \
@@ -439,7 +779,6 @@ static bool netplay_get_cmd(netplay_t *netplay,
             uint32_t buffer[WORDS_PER_FRAME];
             uint32_t player;
             unsigned i;
-            struct delta_frame *dframe;
 
             if (cmd_size != WORDS_PER_FRAME * sizeof(uint32_t))
             {
@@ -456,7 +795,7 @@ static bool netplay_get_cmd(netplay_t *netplay,
             for (i = 0; i < WORDS_PER_FRAME; i++)
                buffer[i] = ntohl(buffer[i]);
 
-            if (netplay->is_server)
+            if (NETPLAY_SERVING(netplay, connection))
             {
                /* Ignore the claimed player #, must be this client */
                if (connection->mode != NETPLAY_CONNECTION_PLAYING)
@@ -490,37 +829,14 @@ static bool netplay_get_cmd(netplay_t *netplay,
             }
 
             /* The data's good! */
-            dframe = &netplay->buffer[netplay->read_ptr[player]];
-            if (!netplay_delta_frame_ready(netplay, dframe, netplay->read_frame_count[player]))
+            if (!netplay_record_input(netplay, connection, player,
+                  !NETPLAY_SERVING(netplay, connection) &&
+                  (buffer[1] & NETPLAY_CMD_INPUT_BIT_SERVER),
+                  buffer + 2))
             {
                /* Hopefully we'll be ready after another round of input */
                goto shrt;
             }
-            memcpy(dframe->real_input_state[player], buffer + 2,
-               WORDS_PER_INPUT*sizeof(uint32_t));
-            dframe->have_real[player] = true;
-            netplay->read_ptr[player] = NEXT_PTR(netplay->read_ptr[player]);
-            netplay->read_frame_count[player]++;
-
-            if (netplay->is_server)
-            {
-               /* Forward it on if it's past data*/
-               if (dframe->frame <= netplay->self_frame_count)
-                  send_input_frame(netplay, NULL, connection, buffer[0],
-                     player, dframe->real_input_state[player]);
-            }
-
-            /* If this was server data, advance our server pointer too */
-            if (!netplay->is_server && (buffer[1] & NETPLAY_CMD_INPUT_BIT_SERVER))
-            {
-               netplay->server_ptr = netplay->read_ptr[player];
-               netplay->server_frame_count = netplay->read_frame_count[player];
-            }
-
-#ifdef DEBUG_NETPLAY_STEPS
-            RARCH_LOG("Received input from %u\n", player);
-            print_state(netplay);
-#endif
             break;
          }
 
@@ -528,7 +844,7 @@ static bool netplay_get_cmd(netplay_t *netplay,
          {
             uint32_t frame;
 
-            if (netplay->is_server)
+            if (NETPLAY_SERVING(netplay, connection))
             {
                RARCH_ERR("NETPLAY_CMD_NOINPUT from a client.\n");
                return netplay_cmd_nak(netplay, connection);
@@ -541,6 +857,12 @@ static bool netplay_get_cmd(netplay_t *netplay,
             }
             frame = ntohl(frame);
 
+            if (connection->udp && frame < netplay->server_frame_count)
+            {
+               /* Already had it over UDP */
+               break;
+            }
+
             if (frame != netplay->server_frame_count)
             {
                RARCH_ERR("NETPLAY_CMD_NOINPUT for invalid frame.\n");
@@ -549,9 +871,58 @@ static bool netplay_get_cmd(netplay_t *netplay,
 
             netplay->server_ptr = NEXT_PTR(netplay->server_ptr);
             netplay->server_frame_count++;
+
+            if (netplay->is_relay)
+               netplay_relay_forward_noinput(netplay, frame);
             break;
          }
 
+      case NETPLAY_CMD_UDP:
+         if (NETPLAY_SERVING(netplay, connection))
+         {
+            uint32_t payload[2];
+
+            if (cmd_size != 0)
+            {
+               RARCH_ERR("NETPLAY_CMD_UDP request with a payload.\n");
+               return netplay_cmd_nak(netplay, connection);
+            }
+
+            /* If we're not offering UDP, the client just keeps using TCP. A
+             * relay never does. */
+            if (netplay->udp_fd < 0 || netplay->is_relay)
+               break;
+
+            if (!netplay_udp_accept(netplay, connection))
+               break;
+            payload[0] = htonl(connection->udp_token);
+            payload[1] = htonl(netplay->udp_port);
+            if (!netplay_send_raw_cmd(netplay, connection, NETPLAY_CMD_UDP,
+                  payload, sizeof(payload)))
+               return false;
+         }
+         else
+         {
+            uint32_t payload[2];
+
+            if (cmd_size != sizeof(payload))
+            {
+               RARCH_ERR("NETPLAY_CMD_UDP received an unexpected payload size.\n");
+               return netplay_cmd_nak(netplay, connection);
+            }
+
+            RECV(payload, sizeof(payload))
+            {
+               RARCH_ERR("Failed to receive NETPLAY_CMD_UDP payload.\n");
+               return netplay_cmd_nak(netplay, connection);
+            }
+
+            if (!netplay_udp_connect(netplay, connection, ntohl(payload[0]),
+                  (uint16_t)ntohl(payload[1])))
+               RARCH_WARN("Could not set up netplay UDP input. Using TCP only.\n");
+         }
+         break;
+
       case NETPLAY_CMD_FLIP_PLAYERS:
          if (cmd_size != sizeof(uint32_t))
          {
@@ -565,7 +936,7 @@ static bool netplay_get_cmd(netplay_t *netplay,
             return netplay_cmd_nak(netplay, connection);
          }
 
-         if (netplay->is_server)
+         if (NETPLAY_SERVING(netplay, connection))
          {
             RARCH_ERR("NETPLAY_CMD_FLIP_PLAYERS from a client.\n");
             return netplay_cmd_nak(netplay, connection);
@@ -592,13 +963,21 @@ static bool netplay_get_cmd(netplay_t *netplay,
          runloop_msg_queue_push(
                msg_hash_to_str(MSG_NETPLAY_USERS_HAS_FLIPPED), 1, 180, false);
 
+         if (netplay->is_relay)
+         {
+            uint32_t payload = htonl(flip_frame);
+            netplay_relay_event(netplay, flip_frame);
+            netplay_relay_forward_cmd(netplay, NETPLAY_CMD_FLIP_PLAYERS,
+                  &payload, sizeof(payload));
+         }
+
          break;
 
       case NETPLAY_CMD_SPECTATE:
       {
          uint32_t payload[2];
 
-         if (!netplay->is_server)
+         if (!NETPLAY_SERVING(netplay, connection))
          {
             RARCH_ERR("NETPLAY_CMD_SPECTATE from a server.\n");
             return netplay_cmd_nak(netplay, connection);
@@ -640,15 +1019,15 @@ static bool netplay_get_cmd(netplay_t *netplay,
          uint32_t player = 0;
          payload[0] = htonl(netplay->self_frame_count + 1);
 
-         if (!netplay->is_server)
+         if (!NETPLAY_SERVING(netplay, connection))
          {
             RARCH_ERR("NETPLAY_CMD_PLAY from a server.\n");
             return netplay_cmd_nak(netplay, connection);
          }
 
-         if (!connection->can_play)
+         if (!connection->can_play || netplay->is_relay)
          {
-            /* Not allowed to play */
+            /* Not allowed to play. Only the server can seat players. */
             payload[0] = htonl(NETPLAY_CMD_MODE_REFUSED_REASON_UNPRIVILEGED);
             netplay_send_raw_cmd(netplay, connection, NETPLAY_CMD_MODE_REFUSED, payload, sizeof(uint32_t));
             break;
@@ -719,7 +1098,7 @@ static bool netplay_get_cmd(netplay_t *netplay,
          } while(0)
 
          if (cmd_size != sizeof(payload) ||
-             netplay->is_server)
+             NETPLAY_SERVING(netplay, connection))
          {
             RARCH_ERR("Invalid payload size for NETPLAY_CMD_MODE.\n");
             return netplay_cmd_nak(netplay, connection);
@@ -893,6 +1272,13 @@ static bool netplay_get_cmd(netplay_t *netplay,
 
             }
 
+            if (netplay->is_relay)
+            {
+               netplay_relay_event(netplay, frame);
+               netplay_relay_forward_cmd(netplay, NETPLAY_CMD_MODE,
+                     payload, sizeof(payload));
+            }
+
          }
 
          break;
@@ -906,7 +1292,7 @@ static bool netplay_get_cmd(netplay_t *netplay,
             uint32_t reason;
             const char *dmsg = NULL;
 
-            if (netplay->is_server)
+            if (NETPLAY_SERVING(netplay, connection))
             {
                RARCH_ERR("NETPLAY_CMD_MODE_REFUSED from client.\n");
                return netplay_cmd_nak(netplay, connection);
@@ -969,6 +1355,9 @@ static bool netplay_get_cmd(netplay_t *netplay,
                return netplay_cmd_nak(netplay, connection);
             }
 
+            if (netplay->is_relay && !NETPLAY_SERVING(netplay, connection))
+               netplay_relay_forward_crc(netplay, buffer);
+
             buffer[0] = ntohl(buffer[0]);
             buffer[1] = ntohl(buffer[1]);
 
@@ -993,16 +1382,31 @@ static bool netplay_get_cmd(netplay_t *netplay,
                break;
             }
 
+            if (connection->recv_transfer.active &&
+                buffer[0] >= connection->recv_transfer.frame)
+            {
+               /* It's of a state we're still waiting for */
+               break;
+            }
+
+            if (buffer[0] <= netplay->other_frame_count &&
+                !netplay->buffer[tmp_ptr].have_state)
+            {
+               /* We never captured it, so there's nothing to check */
+               break;
+            }
+
             if (buffer[0] <= netplay->other_frame_count)
             {
                /* We've already replayed up to this frame, so we can check it
                 * directly */
-               uint32_t local_crc = netplay_delta_frame_crc(
-                     netplay, &netplay->buffer[tmp_ptr]);
+               uint32_t local_crc = netplay_delta_frame_hash(
+                     netplay, &netplay->buffer[tmp_ptr], connection->fast_hash);
 
                if (buffer[1] != local_crc)
                {
                   /* Problem! */
+                  netplay->stat_desyncs++;
                   netplay_cmd_request_savestate(netplay);
                }
             }
@@ -1016,6 +1420,15 @@ static bool netplay_get_cmd(netplay_t *netplay,
          }
 
       case NETPLAY_CMD_REQUEST_SAVESTATE:
+         if (netplay->is_relay)
+         {
+            /* Only the server's state will do, so ask for it on their behalf.
+             * It's passed on to everyone when it arrives. */
+            if (NETPLAY_SERVING(netplay, connection))
+               netplay_cmd_request_savestate(netplay);
+            break;
+         }
+
          /* Delay until next frame so we don't send the savestate after the
           * input */
          netplay->force_send_savestate = true;
@@ -1026,40 +1439,12 @@ static bool netplay_get_cmd(netplay_t *netplay,
             uint32_t frame;
             uint32_t isize;
             uint32_t rd, wn;
-            uint32_t player;
+            size_t ptr;
+            bool delta;
             struct compression_transcoder *ctrans;
 
-            /* Make sure we're ready for it */
-            if (netplay->quirks & NETPLAY_QUIRK_INITIALIZATION)
-            {
-               if (!netplay->is_replay)
-               {
-                  netplay->is_replay = true;
-                  netplay->replay_ptr = netplay->run_ptr;
-                  netplay->replay_frame_count = netplay->run_frame_count;
-                  netplay_wait_and_init_serialization(netplay);
-                  netplay->is_replay = false;
-               }
-               else
-               {
-                  netplay_wait_and_init_serialization(netplay);
-               }
-            }
-
-            /* Only players may load states */
-            if (connection->mode != NETPLAY_CONNECTION_PLAYING)
-            {
-               RARCH_ERR("Netplay state load from a spectator.\n");
-               return netplay_cmd_nak(netplay, connection);
-            }
-
-            /* We only allow players to load state if we're in a simple
-             * two-player situation */
-            if (netplay->is_server && netplay->connections_size > 1)
-            {
-               RARCH_ERR("Netplay state load from a client with other clients connected disallowed.\n");
+            if (!netplay_savestate_allowed(netplay, connection))
                return netplay_cmd_nak(netplay, connection);
-            }
 
             /* There is a subtlty in whether the load comes before or after the
              * current frame:
@@ -1084,14 +1469,11 @@ static bool netplay_get_cmd(netplay_t *netplay,
             }
             frame = ntohl(frame);
 
-            if ((netplay->is_server && frame != netplay->read_frame_count[connection->player]) ||
-                (!netplay->is_server && frame != netplay->server_frame_count))
-            {
-               RARCH_ERR("CMD_LOAD_SAVESTATE loading a state out of order!\n");
+            if (!netplay_savestate_in_order(netplay, connection, frame))
                return netplay_cmd_nak(netplay, connection);
-            }
 
-            if (!netplay_delta_frame_ready(netplay, &netplay->buffer[netplay->read_ptr[connection->player]], frame))
+            ptr = netplay->read_ptr[connection->player];
+            if (!netplay_delta_frame_ready(netplay, &netplay->buffer[ptr], frame))
             {
                /* Hopefully it will be after another round of input */
                goto shrt;
@@ -1104,11 +1486,9 @@ static bool netplay_get_cmd(netplay_t *netplay,
             }
             isize = ntohl(isize);
 
-            if (isize != netplay->state_size)
-            {
-               RARCH_ERR("CMD_LOAD_SAVESTATE received an unexpected save state size.\n");
+            if (!netplay_savestate_size_valid(netplay, connection, &isize,
+                  &delta))
                return netplay_cmd_nak(netplay, connection);
-            }
 
             RECV(netplay->zbuffer, cmd_size - 2*sizeof(uint32_t))
             {
@@ -1116,6 +1496,9 @@ static bool netplay_get_cmd(netplay_t *netplay,
                return netplay_cmd_nak(netplay, connection);
             }
 
+            /* This supersedes any that was coming in chunks */
+            connection->recv_transfer.active = false;
+
             /* And decompress it */
             switch (connection->compression_supported)
             {
@@ -1127,51 +1510,157 @@ static bool netplay_get_cmd(netplay_t *netplay,
             }
             ctrans->decompression_backend->set_in(ctrans->decompression_stream,
                netplay->zbuffer, cmd_size - 2*sizeof(uint32_t));
-            ctrans->decompression_backend->set_out(ctrans->decompression_stream,
-               (uint8_t*)netplay->buffer[netplay->read_ptr[connection->player]].state,
-               netplay->state_size);
+            if (delta)
+               ctrans->decompression_backend->set_out(ctrans->decompression_stream,
+                  netplay->delta_patch, isize);
+            else
+               ctrans->decompression_backend->set_out(ctrans->decompression_stream,
+                  (uint8_t*)netplay->buffer[ptr].state, netplay->state_size);
             ctrans->decompression_backend->trans(ctrans->decompression_stream,
                true, &rd, &wn, NULL);
 
-            /* Skip ahead if it's past where we are */
-            if (frame > netplay->run_frame_count)
+            if (delta && wn != isize)
             {
-               /* This is squirrely: We need to assure that when we advance the
-                * frame in post_frame, THEN we're referring to the frame to
-                * load into. If we refer directly to read_ptr, then we'll end
-                * up never reading the input for read_frame_count itself, which
-                * will make the other side unhappy. */
-               netplay->run_ptr           = PREV_PTR(netplay->read_ptr[connection->player]);
-               netplay->run_frame_count   = frame - 1;
-               if (frame > netplay->self_frame_count)
-               {
-                  netplay->self_ptr         = netplay->run_ptr;
-                  netplay->self_frame_count = netplay->run_frame_count;
-               }
+               RARCH_ERR("CMD_LOAD_SAVESTATE received a corrupt delta savestate.\n");
+               return netplay_cmd_nak(netplay, connection);
+            }
+
+            if (!netplay_savestate_received(netplay, connection, ptr, frame,
+                  delta ? (const uint8_t*)netplay->delta_patch : NULL, isize))
+               return netplay_cmd_nak(netplay, connection);
+            break;
+         }
+
+      case NETPLAY_CMD_LOAD_SAVESTATE_BEGIN:
+         {
+            uint32_t frame;
+            uint32_t isize;
+            size_t ptr;
+            bool delta;
+
+            if (!netplay_savestate_allowed(netplay, connection))
+               return netplay_cmd_nak(netplay, connection);
+
+            if (cmd_size != 2*sizeof(uint32_t))
+            {
+               RARCH_ERR("CMD_LOAD_SAVESTATE_BEGIN received an unexpected payload size.\n");
+               return netplay_cmd_nak(netplay, connection);
             }
 
-            /* Don't expect earlier data from other clients */
-            for (player = 0; player < MAX_USERS; player++)
+            RECV(&frame, sizeof(frame))
             {
-               if (!(netplay->connected_players & (1<<player))) continue;
-               if (frame > netplay->read_frame_count[player])
-               {
-                  netplay->read_ptr[player] = netplay->read_ptr[connection->player];
-                  netplay->read_frame_count[player] = frame;
-               }
+               RARCH_ERR("CMD_LOAD_SAVESTATE_BEGIN failed to receive savestate frame.\n");
+               return netplay_cmd_nak(netplay, connection);
             }
+            frame = ntohl(frame);
 
-            /* And force rewind to it */
-            netplay->force_rewind                  = true;
-            netplay->savestate_request_outstanding = false;
-            netplay->other_ptr                     = netplay->read_ptr[connection->player];
-            netplay->other_frame_count             = frame;
+            if (!netplay_savestate_in_order(netplay, connection, frame))
+               return netplay_cmd_nak(netplay, connection);
 
-#ifdef DEBUG_NETPLAY_STEPS
-            RARCH_LOG("Loading state at %u\n", frame);
-            print_state(netplay);
+            ptr = netplay->read_ptr[connection->player];
+            if (!netplay_delta_frame_ready(netplay, &netplay->buffer[ptr], frame))
+               goto shrt;
+
+            RECV(&isize, sizeof(isize))
+            {
+               RARCH_ERR("CMD_LOAD_SAVESTATE_BEGIN failed to receive inflated size.\n");
+               return netplay_cmd_nak(netplay, connection);
+            }
+            isize = ntohl(isize);
+
+            if (!netplay_savestate_size_valid(netplay, connection, &isize,
+                  &delta))
+               return netplay_cmd_nak(netplay, connection);
+
+            /* The rest comes over the next few frames, and we wait for it */
+            if (!netplay_transfer_recv_begin(netplay, connection, frame, ptr,
+                  isize, delta))
+            {
+               RARCH_ERR("Failed to allocate room for a netplay savestate.\n");
+               return netplay_cmd_nak(netplay, connection);
+            }
+            netplay_savestate_skip_input(netplay, ptr, frame);
+
+            /* Nothing from it on can be confirmed until we have it */
+            if (netplay->other_frame_count > frame)
+            {
+               netplay->other_ptr         = ptr;
+               netplay->other_frame_count = frame;
+            }
+            break;
+         }
+
+      case NETPLAY_CMD_LOAD_SAVESTATE_CHUNK:
+         {
+            struct netplay_transfer *transfer = &connection->recv_transfer;
+            uint32_t pos;
+            int res;
+            bool late;
+
+            if (cmd_size <= sizeof(pos) ||
+                cmd_size > netplay->zbuffer_size + sizeof(pos))
+            {
+               RARCH_ERR("CMD_LOAD_SAVESTATE_CHUNK received an unexpected payload size.\n");
+               return netplay_cmd_nak(netplay, connection);
+            }
+
+            RECV(&pos, sizeof(pos))
+            {
+               RARCH_ERR("CMD_LOAD_SAVESTATE_CHUNK failed to receive its position.\n");
+               return netplay_cmd_nak(netplay, connection);
+            }
+            pos = ntohl(pos);
+
+            RECV(netplay->zbuffer, cmd_size - sizeof(pos))
+            {
+               RARCH_ERR("CMD_LOAD_SAVESTATE_CHUNK failed to receive savestate.\n");
+               return netplay_cmd_nak(netplay, connection);
+            }
+
+            res = netplay_transfer_recv_chunk(netplay, connection, pos,
+                  netplay->zbuffer, cmd_size - sizeof(pos));
+            if (res < 0)
+            {
+               RARCH_ERR("CMD_LOAD_SAVESTATE_CHUNK received an unexpected or corrupt chunk.\n");
+               return netplay_cmd_nak(netplay, connection);
+            }
+            if (res == 0)
+               break;
+
+            /* That's all of it. Has its frame been and gone while we were
+             * waiting? Then the sender's next delta is still against it. */
+            late = !netplay->buffer[transfer->ptr].used ||
+               netplay->buffer[transfer->ptr].frame != transfer->frame;
+#ifdef DEBUG_NETPLAY_LATE_STATES
+            {
+               /* Take every other one as late, to exercise this path */
+               static bool every_other = false;
+               every_other = !every_other;
+               late       |= every_other;
+            }
 #endif
+            if (late)
+            {
+               RARCH_WARN("Netplay savestate arrived too late to load. Requesting another.\n");
+               if (!netplay_delta_recv_update(netplay, connection,
+                     transfer->data, transfer->delta ? transfer->data : NULL,
+                     (uint32_t)transfer->size))
+                  return netplay_cmd_nak(netplay, connection);
+
+               /* That settled whatever request it answered, so ask again */
+               netplay->savestate_request_outstanding = false;
+               netplay_cmd_request_savestate(netplay);
+               break;
+            }
 
+            if (!transfer->delta)
+               memcpy(netplay->buffer[transfer->ptr].state, transfer->data,
+                     netplay->state_size);
+
+            if (!netplay_savestate_received(netplay, connection, transfer->ptr,
+                  transfer->frame, transfer->delta ? transfer->data : NULL,
+                  (uint32_t)transfer->size))
+               return netplay_cmd_nak(netplay, connection);
             break;
          }
 
@@ -1199,7 +1688,7 @@ static bool netplay_get_cmd(netplay_t *netplay,
 
             connection->paused = true;
             netplay->remote_paused = true;
-            if (netplay->is_server)
+            if (NETPLAY_SERVING(netplay, connection))
             {
                snprintf(msg, sizeof(msg)-1, msg_hash_to_str(MSG_NETPLAY_PEER_PAUSED), connection->nick);
                netplay_send_raw_cmd_all(netplay, connection, NETPLAY_CMD_PAUSE,
@@ -1208,6 +1697,9 @@ static bool netplay_get_cmd(netplay_t *netplay,
             else
             {
                snprintf(msg, sizeof(msg)-1, msg_hash_to_str(MSG_NETPLAY_PEER_PAUSED), nick);
+               if (netplay->is_relay)
+                  netplay_relay_forward_cmd(netplay, NETPLAY_CMD_PAUSE,
+                        nick, sizeof(nick));
             }
             RARCH_LOG("%s\n", msg);
             runloop_msg_queue_push(msg, 1, 180, false);
@@ -1237,7 +1729,7 @@ static bool netplay_get_cmd(netplay_t *netplay,
             if (frames > NETPLAY_MAX_REQ_STALL_TIME)
                frames = NETPLAY_MAX_REQ_STALL_TIME;
 
-            if (netplay->is_server)
+            if (NETPLAY_SERVING(netplay, connection))
             {
                /* Only servers can request a stall! */
                RARCH_ERR("Netplay client requested a stall?\n");
@@ -1247,6 +1739,7 @@ static bool netplay_get_cmd(netplay_t *netplay,
             /* We can only stall for one reason at a time */
             if (!netplay->stall)
             {
+               netplay->stat_stalls++;
                connection->stall = netplay->stall = NETPLAY_STALL_SERVER_REQUESTED;
                netplay->stall_time = 0;
                connection->stall_frame = frames;
@@ -1281,17 +1774,19 @@ shrt:
 int netplay_poll_net_input(netplay_t *netplay, bool block)
 {
    bool had_input = false;
-   int max_fd = 0;
+   bool any_active = false;
    size_t i;
 
    for (i = 0; i < netplay->connections_size; i++)
    {
-      struct netplay_connection *connection = &netplay->connections[i];
-      if (connection->active && connection->fd >= max_fd)
-         max_fd = connection->fd + 1;
+      if (netplay->connections[i].active)
+      {
+         any_active = true;
+         break;
+      }
    }
 
-   if (max_fd == 0)
+   if (!any_active)
       return 0;
 
    netplay->timeout_cnt = 0;
@@ -1302,14 +1797,31 @@ int netplay_poll_net_input(netplay_t *netplay, bool block)
 
       netplay->timeout_cnt++;
 
-      /* Read input from each connection */
+      /* Find out who has something for us */
+      if (netplay_poller_wait(netplay, 0) < 0)
+         return -1;
+      netplay_iothread_poll(netplay);
+
+      /* Read input from each connection with data waiting, either on the
+       * socket or left over in its buffer from last time */
       for (i = 0; i < netplay->connections_size; i++)
       {
          struct netplay_connection *connection = &netplay->connections[i];
-         if (connection->active && !netplay_get_cmd(netplay, connection, &had_input))
+         if (!connection->active ||
+             (!connection->ready &&
+              !netplay_recv_pending(&connection->recv_packet_buffer)))
+            continue;
+
+         /* If there's more on the socket, the next wait will say so */
+         connection->ready = false;
+         if (!netplay_get_cmd(netplay, connection, &had_input))
             netplay_hangup(netplay, connection);
       }
 
+      /* Then any input that arrived over UDP ahead of the command stream */
+      if (netplay->udp_fd >= 0)
+         netplay_udp_poll(netplay, &had_input);
+
       if (block)
       {
          netplay_update_unread_ptr(netplay);
@@ -1321,19 +1833,12 @@ int netplay_poll_net_input(netplay_t *netplay, bool block)
          /* If we're supposed to block but we didn't have enough input, wait for it */
          if (!had_input)
          {
-            fd_set fds;
-            struct timeval tv = {0};
-            tv.tv_usec = RETRY_MS * 1000;
+            /* Anything we're relaying may be what the others are waiting on */
+            netplay_send_flush_all(netplay);
 
-            FD_ZERO(&fds);
-            for (i = 0; i < netplay->connections_size; i++)
-            {
-               struct netplay_connection *connection = &netplay->connections[i];
-               if (connection->active)
-                  FD_SET(connection->fd, &fds);
-            }
-
-            if (socket_select(max_fd, &fds, NULL, NULL, &tv) < 0)
+            if ((netplay->iothread ?
+                  netplay_iothread_wait(netplay, RETRY_MS) :
+                  netplay_poller_wait(netplay, RETRY_MS)) < 0)
                return -1;
 
             RARCH_LOG("Network is stalling at frame %u, count %u of %d ...\n",
@@ -1345,6 +1850,10 @@ int netplay_poll_net_input(netplay_t *netplay, bool block)
       }
    } while (had_input || block);
 
+   /* Pass on whatever a relay received without waiting for its next frame */
+   if (netplay->is_relay)
+      netplay_send_flush_all(netplay);
+
    return 0;
 }
 
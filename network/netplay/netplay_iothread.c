@@ -0,0 +1,535 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2016-2017 - Gregor Richards
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Socket I/O thread. Once a connection is past the handshake, its socket
+ * buffers stop calling send and recv themselves and instead trade bytes with
+ * this thread through a pair of queues, so a slow peer or a big savestate
+ * only ever blocks this thread. Commands are still parsed and acted on by
+ * the emulation thread, which is told a connection is ready whenever the
+ * thread has received something on it. The handshake, the listen socket and
+ * UDP input stay on the emulation thread. The thread waits on its sockets
+ * with a netplay_poller of its own, watching each for reading while there's
+ * room for more input and for writing while it has output. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <net/net_compat.h>
+#include <net/net_socket.h>
+
+#include "netplay_private.h"
+
+#ifdef HAVE_THREADS
+
+static void iothread_stream_free(struct netplay_iothread_stream *stream)
+{
+   if (stream->in)
+      fifo_free(stream->in);
+   if (stream->out)
+      fifo_free(stream->out);
+   free(stream->sending);
+   free(stream);
+}
+
+/* Let go of the streams the emulation thread has taken back. The last round
+ * is over, so nothing of theirs is in use. Called with the lock held. */
+static void iothread_release(struct netplay_iothread *iothread)
+{
+   struct netplay_iothread_stream *stream = iothread->detached;
+
+   if (!stream)
+      return;
+
+   for (; stream; stream = stream->next)
+   {
+      if (stream->watching)
+         netplay_poller_unwatch(&iothread->poller, stream->fd);
+      stream->watching = 0;
+      stream->released = true;
+   }
+   iothread->detached = NULL;
+   scond_broadcast(iothread->cond);
+}
+
+/* Watch each stream for whatever there's something to do for. Called with
+ * the lock held.
+ *
+ * Returns how many streams are being watched. */
+static size_t iothread_gather(struct netplay_iothread *iothread)
+{
+   struct netplay_iothread_stream *stream;
+   size_t count = 0;
+
+   for (stream = iothread->streams; stream; stream = stream->next)
+   {
+      unsigned events = 0;
+
+      if (!stream->failed)
+      {
+         if (fifo_write_avail(stream->in) > 0)
+            events |= NETPLAY_POLLER_IN;
+         if (stream->sending_pos < stream->sending_len ||
+             fifo_read_avail(stream->out) > 0)
+            events |= NETPLAY_POLLER_OUT;
+      }
+
+      if (events != stream->watching)
+      {
+         if (!netplay_poller_watch(&iothread->poller, stream->fd, events,
+                  (size_t)(uintptr_t)stream))
+         {
+            /* We can't wait on it, so it's as good as lost */
+            netplay_poller_unwatch(&iothread->poller, stream->fd);
+            stream->failed = true;
+            scond_broadcast(iothread->cond);
+            events         = 0;
+         }
+         stream->watching = events;
+      }
+
+      if (events)
+         count++;
+   }
+
+   return count;
+}
+
+/* Returns false if the socket failed */
+static bool iothread_read(struct netplay_iothread *iothread,
+   struct netplay_iothread_stream *stream)
+{
+   bool error = false;
+   ssize_t recvd;
+   size_t room;
+
+   slock_lock(iothread->lock);
+   room = fifo_write_avail(stream->in);
+   slock_unlock(iothread->lock);
+
+   if (room > NETPLAY_IOTHREAD_CHUNK)
+      room = NETPLAY_IOTHREAD_CHUNK;
+
+   recvd = socket_receive_all_nonblocking(stream->fd, &error,
+         iothread->scratch, room);
+
+   slock_lock(iothread->lock);
+   if (recvd > 0)
+      fifo_write(stream->in, iothread->scratch, recvd);
+   if (error)
+      stream->failed = true;
+   slock_unlock(iothread->lock);
+
+   return !error;
+}
+
+static void iothread_write(struct netplay_iothread *iothread,
+   struct netplay_iothread_stream *stream)
+{
+   ssize_t sent;
+
+   if (stream->sending_pos == stream->sending_len)
+   {
+      slock_lock(iothread->lock);
+      stream->sending_len = fifo_read_avail(stream->out);
+      if (stream->sending_len > NETPLAY_IOTHREAD_CHUNK)
+         stream->sending_len = NETPLAY_IOTHREAD_CHUNK;
+      fifo_read(stream->out, stream->sending, stream->sending_len);
+      slock_unlock(iothread->lock);
+      stream->sending_pos = 0;
+   }
+
+   sent = socket_send_all_nonblocking(stream->fd,
+         stream->sending + stream->sending_pos,
+         stream->sending_len - stream->sending_pos, true);
+   if (sent < 0)
+   {
+      slock_lock(iothread->lock);
+      stream->failed = true;
+      slock_unlock(iothread->lock);
+      return;
+   }
+   stream->sending_pos += sent;
+}
+
+/* The poller found a stream's socket ready */
+static void iothread_ready(void *data, size_t tag, unsigned events)
+{
+   struct netplay_iothread *iothread      = (struct netplay_iothread*)data;
+   struct netplay_iothread_stream *stream =
+      (struct netplay_iothread_stream*)(uintptr_t)tag;
+
+   if ((events & NETPLAY_POLLER_IN) && !iothread_read(iothread, stream))
+      return;
+   if (events & NETPLAY_POLLER_OUT)
+      iothread_write(iothread, stream);
+}
+
+/* Wait for whichever sockets we can do something with, then do it. Called
+ * and returns with the lock held, but doesn't hold it while waiting. */
+static void iothread_round(struct netplay_iothread *iothread)
+{
+   iothread_release(iothread);
+
+   if (!iothread_gather(iothread))
+   {
+      /* Nothing to do until the emulation thread gives us something */
+      scond_wait(iothread->cond, iothread->lock);
+      return;
+   }
+
+   iothread->busy = true;
+   slock_unlock(iothread->lock);
+
+   netplay_poller_poll(&iothread->poller, NETPLAY_IOTHREAD_WAIT_MS,
+         iothread_ready, iothread);
+
+   slock_lock(iothread->lock);
+   iothread->busy = false;
+   iothread->round++;
+   scond_broadcast(iothread->cond);
+}
+
+static void iothread_loop(void *data)
+{
+   struct netplay_iothread *iothread = (struct netplay_iothread*)data;
+
+   slock_lock(iothread->lock);
+   while (!iothread->quit)
+      iothread_round(iothread);
+   slock_unlock(iothread->lock);
+}
+
+static void iothread_attach(netplay_t *netplay,
+   struct netplay_connection *connection)
+{
+   struct netplay_iothread *iothread = netplay->iothread;
+   struct netplay_iothread_stream *stream =
+      (struct netplay_iothread_stream*)calloc(1, sizeof(*stream));
+
+   if (!stream)
+      return;
+
+   stream->iothread = iothread;
+   stream->fd       = connection->fd;
+   stream->in       = fifo_new(connection->recv_packet_buffer.bufsz);
+   stream->out      = fifo_new(connection->send_packet_buffer.bufsz);
+   stream->sending  = (unsigned char*)malloc(NETPLAY_IOTHREAD_CHUNK);
+   if (!stream->in || !stream->out || !stream->sending)
+   {
+      /* It just stays with us */
+      iothread_stream_free(stream);
+      return;
+   }
+
+   /* Anything already buffered goes before whatever the thread moves */
+   netplay_poller_remove(netplay, connection->fd);
+   connection->send_packet_buffer.io = stream;
+   connection->recv_packet_buffer.io = stream;
+
+   slock_lock(iothread->lock);
+   stream->next      = iothread->streams;
+   iothread->streams = stream;
+   scond_broadcast(iothread->cond);
+   slock_unlock(iothread->lock);
+}
+
+/* Has the thread received anything, or lost a socket? Called with the lock
+ * held. */
+static bool iothread_have_input(struct netplay_iothread *iothread)
+{
+   struct netplay_iothread_stream *stream;
+
+   for (stream = iothread->streams; stream; stream = stream->next)
+      if (stream->failed || fifo_read_avail(stream->in) > 0)
+         return true;
+   return false;
+}
+
+bool netplay_iothread_init(netplay_t *netplay)
+{
+   struct netplay_iothread *iothread = (struct netplay_iothread*)
+      calloc(1, sizeof(*iothread));
+
+   if (!iothread)
+      goto error;
+
+   if (!netplay_poller_open(&iothread->poller))
+   {
+      free(iothread);
+      iothread = NULL;
+      goto error;
+   }
+
+   iothread->lock    = slock_new();
+   iothread->cond    = scond_new();
+   iothread->scratch = (unsigned char*)malloc(NETPLAY_IOTHREAD_CHUNK);
+   if (!iothread->lock || !iothread->cond || !iothread->scratch)
+      goto error;
+
+   iothread->thread = sthread_create(iothread_loop, iothread);
+   if (!iothread->thread)
+      goto error;
+
+   netplay->iothread = iothread;
+   RARCH_LOG("Netplay socket I/O is running on its own thread.\n");
+   return true;
+
+error:
+   if (iothread)
+   {
+      if (iothread->lock)
+         slock_free(iothread->lock);
+      if (iothread->cond)
+         scond_free(iothread->cond);
+      netplay_poller_close(&iothread->poller);
+      free(iothread->scratch);
+      free(iothread);
+   }
+   RARCH_WARN("Could not start the netplay I/O thread.\n");
+   return false;
+}
+
+void netplay_iothread_deinit(netplay_t *netplay)
+{
+   struct netplay_iothread *iothread = netplay->iothread;
+   struct netplay_iothread_stream *stream;
+   size_t i;
+
+   if (!iothread)
+      return;
+
+   slock_lock(iothread->lock);
+   iothread->quit = true;
+   scond_broadcast(iothread->cond);
+   slock_unlock(iothread->lock);
+   sthread_join(iothread->thread);
+
+   for (i = 0; i < netplay->connections_size; i++)
+   {
+      struct netplay_connection *connection = &netplay->connections[i];
+      connection->send_packet_buffer.io = NULL;
+      connection->recv_packet_buffer.io = NULL;
+   }
+
+   stream = iothread->streams;
+   while (stream)
+   {
+      struct netplay_iothread_stream *next = stream->next;
+      iothread_stream_free(stream);
+      stream = next;
+   }
+
+   slock_free(iothread->lock);
+   scond_free(iothread->cond);
+   netplay_poller_close(&iothread->poller);
+   free(iothread->scratch);
+   free(iothread);
+   netplay->iothread = NULL;
+}
+
+void netplay_iothread_poll(netplay_t *netplay)
+{
+   struct netplay_iothread *iothread = netplay->iothread;
+   size_t i;
+
+   if (!iothread)
+      return;
+
+   for (i = 0; i < netplay->connections_size; i++)
+   {
+      struct netplay_connection *connection = &netplay->connections[i];
+      if (connection->active && !connection->recv_packet_buffer.io &&
+          connection->mode >= NETPLAY_CONNECTION_CONNECTED)
+         iothread_attach(netplay, connection);
+   }
+
+   slock_lock(iothread->lock);
+   for (i = 0; i < netplay->connections_size; i++)
+   {
+      struct netplay_connection *connection = &netplay->connections[i];
+      struct netplay_iothread_stream *stream =
+         connection->recv_packet_buffer.io;
+
+      if (connection->active && stream &&
+          (stream->failed || fifo_read_avail(stream->in) > 0))
+         connection->ready = true;
+   }
+   slock_unlock(iothread->lock);
+}
+
+int netplay_iothread_wait(netplay_t *netplay, unsigned timeout_ms)
+{
+   struct netplay_iothread *iothread = netplay->iothread;
+   retro_time_t deadline = cpu_features_get_time_usec() +
+      (retro_time_t)timeout_ms * 1000;
+
+   for (;;)
+   {
+      bool have_input;
+      int ready = netplay_poller_wait(netplay, 0);
+
+      if (ready != 0)
+         return ready;
+
+      slock_lock(iothread->lock);
+      if (!iothread_have_input(iothread))
+         scond_wait_timeout(iothread->cond, iothread->lock,
+               NETPLAY_IOTHREAD_WAIT_MS * 1000);
+      have_input = iothread_have_input(iothread);
+      slock_unlock(iothread->lock);
+
+      if (have_input)
+         return 1;
+      if (cpu_features_get_time_usec() >= deadline)
+         return 0;
+   }
+}
+
+void netplay_iothread_detach(netplay_t *netplay,
+   struct netplay_connection *connection)
+{
+   struct netplay_iothread *iothread        = netplay->iothread;
+   struct netplay_iothread_stream *stream   = connection->recv_packet_buffer.io;
+   struct netplay_iothread_stream **link;
+
+   if (!iothread || !stream)
+      return;
+
+   slock_lock(iothread->lock);
+   for (link = &iothread->streams; *link; link = &(*link)->next)
+   {
+      if (*link == stream)
+      {
+         *link = stream->next;
+         break;
+      }
+   }
+
+   /* The thread may be using it this round. It stops watching the socket
+    * before its next one. */
+   stream->next       = iothread->detached;
+   iothread->detached = stream;
+   scond_broadcast(iothread->cond);
+   while (!stream->released)
+      scond_wait(iothread->cond, iothread->lock);
+   slock_unlock(iothread->lock);
+
+   connection->send_packet_buffer.io = NULL;
+   connection->recv_packet_buffer.io = NULL;
+   iothread_stream_free(stream);
+}
+
+ssize_t netplay_iothread_recv(struct netplay_iothread_stream *stream,
+   void *buf, size_t len, bool block)
+{
+   struct netplay_iothread *iothread = stream->iothread;
+   size_t done = 0;
+   bool failed;
+
+   slock_lock(iothread->lock);
+   for (;;)
+   {
+      size_t take = fifo_read_avail(stream->in);
+      if (take > len - done)
+         take = len - done;
+      if (take)
+      {
+         fifo_read(stream->in, (unsigned char*)buf + done, take);
+         done += take;
+
+         /* There's room for the thread to read more */
+         scond_broadcast(iothread->cond);
+      }
+
+      if (done == len || !block || stream->failed)
+         break;
+      scond_wait(iothread->cond, iothread->lock);
+   }
+   failed = stream->failed;
+   slock_unlock(iothread->lock);
+
+   if (failed && done < len && (block || !done))
+      return -1;
+   return done;
+}
+
+ssize_t netplay_iothread_send(struct netplay_iothread_stream *stream,
+   const void *buf, size_t len, bool block)
+{
+   struct netplay_iothread *iothread = stream->iothread;
+   size_t done = 0;
+
+   slock_lock(iothread->lock);
+   for (;;)
+   {
+      size_t put;
+
+      if (stream->failed)
+      {
+         slock_unlock(iothread->lock);
+         return -1;
+      }
+
+      put = fifo_write_avail(stream->out);
+      if (put > len - done)
+         put = len - done;
+      if (put)
+      {
+         fifo_write(stream->out, (const unsigned char*)buf + done, put);
+         done += put;
+         scond_broadcast(iothread->cond);
+      }
+
+      if (done == len || !block)
+         break;
+      scond_wait(iothread->cond, iothread->lock);
+   }
+   slock_unlock(iothread->lock);
+
+   return done;
+}
+
+#else
+
+bool netplay_iothread_init(netplay_t *netplay)
+{
+   RARCH_WARN("Netplay needs thread support to do its I/O on a thread.\n");
+   return false;
+}
+
+void netplay_iothread_deinit(netplay_t *netplay) { }
+void netplay_iothread_poll(netplay_t *netplay) { }
+
+int netplay_iothread_wait(netplay_t *netplay, unsigned timeout_ms)
+{
+   return netplay_poller_wait(netplay, timeout_ms);
+}
+
+void netplay_iothread_detach(netplay_t *netplay,
+   struct netplay_connection *connection) { }
+
+ssize_t netplay_iothread_recv(struct netplay_iothread_stream *stream,
+   void *buf, size_t len, bool block)
+{
+   return -1;
+}
+
+ssize_t netplay_iothread_send(struct netplay_iothread_stream *stream,
+   const void *buf, size_t len, bool block)
+{
+   return -1;
+}
+
+#endif
@@ -0,0 +1,398 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2016-2017 - Gregor Richards
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Socket readiness for the netplay loop. The listen socket, the UDP input
+ * socket and every connection are registered once, and each wait only
+ * reports the ones with something to read, so the per-frame cost doesn't grow
+ * with the number of idle spectators. Uses epoll on Linux, poll on the BSDs,
+ * and falls back to select elsewhere. The I/O thread keeps a set of its own
+ * for the sockets it has taken over, watched for writing too. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <net/net_compat.h>
+#include <net/net_socket.h>
+
+#include "netplay_private.h"
+
+#if defined(NETPLAY_POLLER_EPOLL)
+#include <sys/epoll.h>
+#include <unistd.h>
+#define NETPLAY_POLLER_EVENTS 64
+#endif
+
+/**
+ * netplay_poller_open
+ *
+ * Set up an empty set of sockets to watch.
+ */
+bool netplay_poller_open(struct netplay_poller *poller)
+{
+   memset(poller, 0, sizeof(*poller));
+#if defined(NETPLAY_POLLER_EPOLL)
+   poller->epoll_fd = epoll_create(NETPLAY_POLLER_EVENTS);
+   if (poller->epoll_fd < 0)
+      return false;
+#endif
+   return true;
+}
+
+/**
+ * netplay_poller_close
+ *
+ * Free a set of sockets. The sockets themselves are not closed.
+ */
+void netplay_poller_close(struct netplay_poller *poller)
+{
+#if defined(NETPLAY_POLLER_EPOLL)
+   if (poller->epoll_fd >= 0)
+      close(poller->epoll_fd);
+   poller->epoll_fd = -1;
+#else
+   free(poller->entries);
+#if defined(NETPLAY_POLLER_POLL)
+   free(poller->fds);
+   poller->fds     = NULL;
+#endif
+   poller->entries = NULL;
+   poller->count   = poller->size = 0;
+#endif
+}
+
+#if !defined(NETPLAY_POLLER_EPOLL)
+static struct netplay_poller_entry *poller_find(
+      struct netplay_poller *poller, int fd)
+{
+   size_t i;
+   for (i = 0; i < poller->count; i++)
+      if (poller->entries[i].fd == fd)
+         return &poller->entries[i];
+   return NULL;
+}
+#endif
+
+/**
+ * netplay_poller_unwatch
+ *
+ * Stop watching a socket. Must be called before it's closed.
+ */
+void netplay_poller_unwatch(struct netplay_poller *poller, int fd)
+{
+#if defined(NETPLAY_POLLER_EPOLL)
+   struct epoll_event ev;
+
+   /* Pre-2.6.9 kernels insist on an event even for a delete */
+   memset(&ev, 0, sizeof(ev));
+   epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+#else
+   struct netplay_poller_entry *entry = poller_find(poller, fd);
+
+   if (entry)
+      *entry = poller->entries[--poller->count];
+#endif
+}
+
+/**
+ * netplay_poller_watch
+ * @poller               : the set
+ * @fd                   : socket to watch
+ * @events               : NETPLAY_POLLER_IN and/or NETPLAY_POLLER_OUT
+ * @tag                  : passed back when the socket is ready
+ *
+ * Start watching a socket, or change what it's watched for. Watching for
+ * nothing stops watching it.
+ */
+bool netplay_poller_watch(struct netplay_poller *poller, int fd,
+      unsigned events, size_t tag)
+{
+#if defined(NETPLAY_POLLER_EPOLL)
+   struct epoll_event ev;
+
+   if (!events)
+   {
+      netplay_poller_unwatch(poller, fd);
+      return true;
+   }
+
+   memset(&ev, 0, sizeof(ev));
+   if (events & NETPLAY_POLLER_IN)
+      ev.events |= EPOLLIN;
+   if (events & NETPLAY_POLLER_OUT)
+      ev.events |= EPOLLOUT;
+   ev.data.u64 = tag;
+   if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+      return true;
+   return errno == EEXIST &&
+      epoll_ctl(poller->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0;
+#else
+   struct netplay_poller_entry *entry;
+
+   if (!events)
+   {
+      netplay_poller_unwatch(poller, fd);
+      return true;
+   }
+
+   entry = poller_find(poller, fd);
+   if (!entry)
+   {
+#if !defined(NETPLAY_POLLER_POLL)
+      /* An fd_set holds FD_SETSIZE sockets on Windows, and sockets numbered
+       * below FD_SETSIZE elsewhere */
+#ifdef _WIN32
+      if (poller->count >= FD_SETSIZE)
+         return false;
+#else
+      if (fd < 0 || fd >= FD_SETSIZE)
+         return false;
+#endif
+#endif
+
+      if (poller->count == poller->size)
+      {
+         size_t new_size = poller->size ? poller->size * 2 : 8;
+         struct netplay_poller_entry *entries = (struct netplay_poller_entry*)
+            realloc(poller->entries, new_size * sizeof(*entries));
+#if defined(NETPLAY_POLLER_POLL)
+         struct pollfd *fds;
+#endif
+
+         if (!entries)
+            return false;
+         poller->entries = entries;
+
+#if defined(NETPLAY_POLLER_POLL)
+         fds = (struct pollfd*)realloc(poller->fds, new_size * sizeof(*fds));
+         if (!fds)
+            return false;
+         poller->fds = fds;
+#endif
+         poller->size = new_size;
+      }
+      entry     = &poller->entries[poller->count++];
+      entry->fd = fd;
+   }
+
+   entry->events = events;
+   entry->tag    = tag;
+   return true;
+#endif
+}
+
+/**
+ * netplay_poller_poll
+ * @poller               : the set
+ * @timeout_ms           : how long to wait if nothing is ready yet
+ * @cb                   : called with the tag and events of each ready socket
+ * @data                 : passed to cb
+ *
+ * Wait for any watched socket to become ready. A socket with an error or a
+ * closed connection is reported as readable, so that reading it finds out.
+ *
+ * Returns the number of ready sockets, or -1 on error.
+ */
+int netplay_poller_poll(struct netplay_poller *poller, unsigned timeout_ms,
+      netplay_poller_cb_t cb, void *data)
+{
+#if defined(NETPLAY_POLLER_EPOLL)
+   struct epoll_event events[NETPLAY_POLLER_EVENTS];
+   int i, ready;
+
+   /* If more are ready than fit, epoll hands the rest out on the next wait */
+   ready = epoll_wait(poller->epoll_fd, events,
+         NETPLAY_POLLER_EVENTS, (int)timeout_ms);
+   if (ready < 0)
+      return (errno == EINTR) ? 0 : -1;
+
+   for (i = 0; i < ready; i++)
+   {
+      unsigned got = 0;
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+         got |= NETPLAY_POLLER_IN;
+      if (events[i].events & EPOLLOUT)
+         got |= NETPLAY_POLLER_OUT;
+      cb(data, (size_t)events[i].data.u64, got);
+   }
+
+   return ready;
+#elif defined(NETPLAY_POLLER_POLL)
+   int ready, left;
+   size_t i;
+
+   if (poller->count == 0)
+      return 0;
+
+   for (i = 0; i < poller->count; i++)
+   {
+      poller->fds[i].fd      = poller->entries[i].fd;
+      poller->fds[i].events  =
+         ((poller->entries[i].events & NETPLAY_POLLER_IN)  ? POLLIN  : 0) |
+         ((poller->entries[i].events & NETPLAY_POLLER_OUT) ? POLLOUT : 0);
+      poller->fds[i].revents = 0;
+   }
+
+   ready = poll(poller->fds, poller->count, (int)timeout_ms);
+   if (ready < 0)
+      return (errno == EINTR) ? 0 : -1;
+
+   for (i = 0, left = ready; i < poller->count && left > 0; i++)
+   {
+      unsigned got = 0;
+      short revents = poller->fds[i].revents;
+
+      if (!revents)
+         continue;
+      if (revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL))
+         got |= NETPLAY_POLLER_IN;
+      if (revents & POLLOUT)
+         got |= NETPLAY_POLLER_OUT;
+      cb(data, poller->entries[i].tag, got);
+      left--;
+   }
+
+   return ready;
+#else
+   fd_set readfds, writefds;
+   struct timeval tv;
+   int max_fd = 0;
+   int ready;
+   size_t i;
+
+   if (poller->count == 0)
+      return 0;
+
+   FD_ZERO(&readfds);
+   FD_ZERO(&writefds);
+   for (i = 0; i < poller->count; i++)
+   {
+      int fd = poller->entries[i].fd;
+      if (poller->entries[i].events & NETPLAY_POLLER_IN)
+         FD_SET(fd, &readfds);
+      if (poller->entries[i].events & NETPLAY_POLLER_OUT)
+         FD_SET(fd, &writefds);
+      if (fd >= max_fd)
+         max_fd = fd + 1;
+   }
+
+   tv.tv_sec  = timeout_ms / 1000;
+   tv.tv_usec = (timeout_ms % 1000) * 1000;
+   ready = socket_select(max_fd, &readfds, &writefds, NULL, &tv);
+   if (ready <= 0)
+      return ready;
+
+   /* The callback may change the set, so take the ready ones first */
+   ready = 0;
+   for (i = 0; i < poller->count; i++)
+   {
+      unsigned got = 0;
+      int fd       = poller->entries[i].fd;
+      if (FD_ISSET(fd, &readfds))
+         got |= NETPLAY_POLLER_IN;
+      if (FD_ISSET(fd, &writefds))
+         got |= NETPLAY_POLLER_OUT;
+      poller->entries[i].ready = got;
+      if (got)
+         ready++;
+   }
+   for (i = 0; i < poller->count; i++)
+      if (poller->entries[i].ready)
+         cb(data, poller->entries[i].tag, poller->entries[i].ready);
+
+   return ready;
+#endif
+}
+
+/* Mark the socket with the given tag as ready */
+static void poller_set_ready(void *data, size_t tag, unsigned events)
+{
+   netplay_t *netplay = (netplay_t*)data;
+
+   switch (tag)
+   {
+      case NETPLAY_POLLER_LISTEN:
+         netplay->poller.listen_ready = true;
+         break;
+      case NETPLAY_POLLER_UDP:
+         netplay->poller.udp_ready = true;
+         break;
+      default:
+         tag -= NETPLAY_POLLER_CONNECTION;
+         if (tag < netplay->connections_size &&
+             netplay->connections[tag].active)
+            netplay->connections[tag].ready = true;
+   }
+}
+
+/**
+ * netplay_poller_init
+ *
+ * Set up the poller. Must be called before any socket is added.
+ */
+bool netplay_poller_init(netplay_t *netplay)
+{
+   return netplay_poller_open(&netplay->poller);
+}
+
+/**
+ * netplay_poller_deinit
+ *
+ * Free the poller. The sockets themselves are not closed.
+ */
+void netplay_poller_deinit(netplay_t *netplay)
+{
+   netplay_poller_close(&netplay->poller);
+}
+
+/**
+ * netplay_poller_add
+ * @netplay              : pointer to netplay object
+ * @fd                   : socket to watch for reading
+ * @tag                  : NETPLAY_POLLER_LISTEN, NETPLAY_POLLER_UDP, or
+ *                         NETPLAY_POLLER_CONNECTION plus the connection index
+ *
+ * Start watching a socket.
+ */
+bool netplay_poller_add(netplay_t *netplay, int fd, size_t tag)
+{
+   return netplay_poller_watch(&netplay->poller, fd, NETPLAY_POLLER_IN, tag);
+}
+
+/**
+ * netplay_poller_remove
+ *
+ * Stop watching a socket. Must be called before it's closed.
+ */
+void netplay_poller_remove(netplay_t *netplay, int fd)
+{
+   netplay_poller_unwatch(&netplay->poller, fd);
+}
+
+/**
+ * netplay_poller_wait
+ * @netplay              : pointer to netplay object
+ * @timeout_ms           : how long to wait if nothing is ready yet
+ *
+ * Wait for any watched socket to become readable, and mark those that are.
+ * Flags are only ever set here; it's up to the reader to clear them.
+ *
+ * Returns the number of ready sockets, or -1 on error.
+ */
+int netplay_poller_wait(netplay_t *netplay, unsigned timeout_ms)
+{
+   return netplay_poller_poll(&netplay->poller, timeout_ms,
+         poller_set_ready, netplay);
+}
@@ -0,0 +1,217 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2016-2017 - Gregor Richards
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Input prediction. Until a player's input for a frame arrives, we run the
+ * frame on a guess and roll back if the guess was wrong, so every wrong guess
+ * costs a rerun of every frame since. Only the joypad word is predicted;
+ * analog axes are always held. */
+
+#include <string.h>
+#include <math.h>
+
+#include "netplay_private.h"
+
+#define PREDICT_DIRECTIONS ((1U<<RETRO_DEVICE_ID_JOYPAD_UP) | \
+                            (1U<<RETRO_DEVICE_ID_JOYPAD_DOWN) | \
+                            (1U<<RETRO_DEVICE_ID_JOYPAD_LEFT) | \
+                            (1U<<RETRO_DEVICE_ID_JOYPAD_RIGHT))
+
+/* Don't trust a button's statistics until we've seen this many frames */
+#define PREDICT_MIN_SEEN 16
+
+/* Halve a button's statistics when they reach this, so they follow the game */
+#define PREDICT_MAX_SEEN 4096
+
+/* Past this many frames, a button's as likely as it'll ever be to be pressed */
+#define PREDICT_MAX_FRAMES 64
+
+/* Guess the joypad word from what we've learned about this player. Each
+ * button is treated as a two-state Markov chain: from how often it stays
+ * pressed and how often it stays released, we get the chance it's pressed
+ * the given number of frames after we last saw it. */
+static uint32_t predict_adaptive(struct netplay_predict_stats *stats,
+   uint32_t last, uint32_t frames)
+{
+   uint32_t out = 0;
+   unsigned bit;
+
+   if (frames > PREDICT_MAX_FRAMES)
+      frames = PREDICT_MAX_FRAMES;
+
+   for (bit = 0; bit < 32; bit++)
+   {
+      unsigned pressed = (last >> bit) & 1;
+      float stay_pressed, stay_released, settle, steady, chance;
+
+      if (stats->seen[0][bit] < PREDICT_MIN_SEEN ||
+          stats->seen[1][bit] < PREDICT_MIN_SEEN)
+      {
+         /* Not enough to go on, so just hold it */
+         out |= pressed << bit;
+         continue;
+      }
+
+      stay_pressed  = (float)stats->kept[1][bit] / stats->seen[1][bit];
+      stay_released = (float)stats->kept[0][bit] / stats->seen[0][bit];
+      settle        = 2.0f - stay_pressed - stay_released;
+      if (settle <= 0.0f)
+      {
+         /* It never changes */
+         out |= pressed << bit;
+         continue;
+      }
+
+      /* How often it's pressed in the long run, and how quickly what we last
+       * saw fades into that */
+      steady = (1.0f - stay_released) / settle;
+      chance = steady + ((pressed ? 1.0f : 0.0f) - steady) *
+         powf(1.0f - settle, (float)frames);
+
+      if (chance >= 0.5f)
+         out |= 1U << bit;
+   }
+
+   return out;
+}
+
+/**
+ * netplay_predict_input
+ * @netplay              : pointer to netplay object
+ * @player               : player whose input to predict
+ * @last                 : the latest real input we have from that player
+ * @frames               : how many frames after @last we're predicting
+ * @resim                : are we resimulating, or predicting this frame for
+ *                         the first time?
+ * @out                  : predicted input. When resimulating, holds the
+ *                         earlier prediction.
+ *
+ * Guess a player's input for a frame we haven't received it for.
+ */
+void netplay_predict_input(netplay_t *netplay, uint32_t player,
+   const uint32_t *last, uint32_t frames, bool resim, uint32_t *out)
+{
+   uint32_t buttons;
+
+   switch (netplay->predictor)
+   {
+      case NETPLAY_PREDICT_DIRECTIONS:
+         buttons = last[0] & PREDICT_DIRECTIONS;
+         break;
+      case NETPLAY_PREDICT_ADAPTIVE:
+         buttons = predict_adaptive(&netplay->predict_stats[player], last[0],
+               frames);
+         break;
+      case NETPLAY_PREDICT_HOLD:
+      default:
+         buttons = last[0];
+         break;
+   }
+
+   if (resim)
+   {
+      /* In resimulation mode, we only replace the buttons. The reason for
+       * this is nonobvious:
+       *
+       * If we resimulated nothing, then the /duration/ with which any input
+       * was pressed would be approximately correct, since the original
+       * simulation came in as the input came in, but the /number of times/
+       * the input was pressed would be wrong, as there would be an
+       * advancing wavefront of real data overtaking the simulated data
+       * (which is really just real data offset by some frames).
+       *
+       * That's acceptable for arrows in most situations, since the amount
+       * you move is tied to the duration, but unacceptable for buttons,
+       * which will seem to jerkily be pressed numerous times with those
+       * wavefronts.
+       */
+      out[0] = (out[0] & PREDICT_DIRECTIONS) | (buttons & ~PREDICT_DIRECTIONS);
+   }
+   else
+   {
+      memcpy(out, last, WORDS_PER_INPUT * sizeof(uint32_t));
+      out[0] = buttons;
+   }
+}
+
+/* Learn how long each of this player's buttons stays as it is */
+static void predict_learn(struct netplay_predict_stats *stats,
+   uint32_t prev, uint32_t cur)
+{
+   unsigned bit;
+
+   for (bit = 0; bit < 32; bit++)
+   {
+      unsigned pressed = (prev >> bit) & 1;
+
+      if (stats->seen[pressed][bit] >= PREDICT_MAX_SEEN)
+      {
+         stats->seen[pressed][bit] /= 2;
+         stats->kept[pressed][bit] /= 2;
+      }
+
+      stats->seen[pressed][bit]++;
+      if (((cur >> bit) & 1) == pressed)
+         stats->kept[pressed][bit]++;
+   }
+}
+
+/**
+ * netplay_predict_confirm
+ * @netplay              : pointer to netplay object
+ * @ptr                  : frame whose input is now all real
+ *
+ * Account for how well we predicted a frame, and learn from its input. Must
+ * be called once for each frame, in order, as it's confirmed.
+ */
+void netplay_predict_confirm(netplay_t *netplay, size_t ptr)
+{
+   struct delta_frame *delta = &netplay->buffer[ptr];
+   struct delta_frame *prev  = &netplay->buffer[PREV_PTR(ptr)];
+   bool have_prev            = prev->used && prev->frame + 1 == delta->frame;
+   uint32_t player;
+
+   if (!delta->used)
+      return;
+
+   for (player = 0; player < MAX_USERS; player++)
+   {
+      struct netplay_predict_stats *stats = &netplay->predict_stats[player];
+
+      if (!(netplay->connected_players & (1<<player)))
+         continue;
+      if (!delta->have_real[player])
+         continue;
+
+      /* We never guess our own input */
+      if (netplay->self_mode == NETPLAY_CONNECTION_PLAYING &&
+          player == netplay->self_player)
+         continue;
+
+      /* Only frames the core actually ran on a guess count */
+      if (!delta->used_real[player])
+      {
+         stats->predicted++;
+         if (memcmp(delta->simulated_input_state[player],
+                  delta->real_input_state[player],
+                  sizeof(delta->real_input_state[player])) != 0)
+            stats->mispredicted++;
+      }
+
+      if (netplay->predictor == NETPLAY_PREDICT_ADAPTIVE &&
+          have_prev && prev->have_real[player])
+         predict_learn(stats, prev->real_input_state[player][0],
+               delta->real_input_state[player][0]);
+   }
+}
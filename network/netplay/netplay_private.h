@@ -24,10 +24,22 @@
 #include <net/net_natt.h>
 #include <features/features_cpu.h>
 #include <streams/trans_stream.h>
+#include <streams/file_stream.h>
+#include <queues/fifo_queue.h>
+#include <rthreads/rthreads.h>
 
 #include "../../msg_hash.h"
 #include "../../verbosity.h"
 
+/* How netplay_poller waits for sockets; select is the fallback */
+#if defined(__linux__)
+#define NETPLAY_POLLER_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+      defined(__OpenBSD__) || defined(__DragonFly__)
+#define NETPLAY_POLLER_POLL
+#include <poll.h>
+#endif
+
 #define WORDS_PER_INPUT 3 /* Buttons, left stick, right stick */
 #define WORDS_PER_FRAME (WORDS_PER_INPUT+2) /* + frameno, playerno */
 
@@ -50,9 +62,30 @@
 #define NETPLAY_MAX_REQ_STALL_TIME     60
 #define NETPLAY_MAX_REQ_STALL_FREQUENCY 120
 
+/* Rollback depths are counted in powers of two: 1, 2-3, 4-7, ..., 32 and up */
+#define NETPLAY_STAT_DEPTHS            6
+
+/* Number of our most recent input frames repeated in each UDP input packet */
+#define NETPLAY_UDP_REDUNDANT_FRAMES   8
+#define NETPLAY_UDP_MAGIC              0x52415544 /* RAUD */
+#define NETPLAY_UDP_WORDS_PER_FRAME    (WORDS_PER_INPUT+3) /* + frameno, sync, playerno */
+#define NETPLAY_UDP_HEADER_WORDS       4 /* magic, token, ack, count */
+#define NETPLAY_UDP_PACKET_WORDS       (NETPLAY_UDP_HEADER_WORDS + \
+   NETPLAY_UDP_REDUNDANT_FRAMES * NETPLAY_UDP_WORDS_PER_FRAME)
+
+/* Player number given in UDP input packets for frames on which the server
+ * has no input of its own (the equivalent of NETPLAY_CMD_NOINPUT) */
+#define NETPLAY_UDP_NOINPUT            0xFFFFFFFF
+
 #define PREV_PTR(x) ((x) == 0 ? netplay->buffer_size - 1 : (x) - 1)
 #define NEXT_PTR(x) ((x + 1) % netplay->buffer_size)
 
+/* Are we acting as the server toward this connection? A relay is a client of
+ * connections[0] and a server to everyone else. */
+#define NETPLAY_SERVING(netplay, connection) \
+   ((netplay)->is_server || ((netplay)->is_relay && \
+    (connection) != &(netplay)->connections[0]))
+
 /* Quirks mandated by how particular cores save states. This is distilled from
  * the larger set of quirks that the quirks environment can communicate. */
 #define NETPLAY_QUIRK_NO_SAVESTATES (1<<0)
@@ -80,14 +113,52 @@
 #define NETPLAY_QUIRK_MAP_PLATFORM_DEPENDENT \
    (RETRO_SERIALIZATION_QUIRK_PLATFORM_DEPENDENT)
 
-/* Compression protocols supported */
+/* Compression protocols supported. DELTA is independent of the others: it
+ * sends savestates as a patch against the previous one sent. */
 #define NETPLAY_COMPRESSION_ZLIB (1<<0)
+#define NETPLAY_COMPRESSION_DELTA (1<<1)
 #if HAVE_ZLIB
-#define NETPLAY_COMPRESSION_SUPPORTED NETPLAY_COMPRESSION_ZLIB
+#define NETPLAY_COMPRESSION_SUPPORTED (NETPLAY_COMPRESSION_ZLIB|NETPLAY_COMPRESSION_DELTA)
 #else
-#define NETPLAY_COMPRESSION_SUPPORTED 0
+#define NETPLAY_COMPRESSION_SUPPORTED NETPLAY_COMPRESSION_DELTA
 #endif
 
+/* Sent in the handshake alongside the compression protocols. With FAST, CRC
+ * commands carry netplay_hash_state rather than CRC32. The server's sample
+ * rate, in the bits above, tells the client how much of each state it hashes;
+ * a state is sampled in blocks of NETPLAY_HASH_BLOCK bytes. */
+#define NETPLAY_HASH_FAST (1<<2)
+#define NETPLAY_HASH_SAMPLE_SHIFT 8
+#define NETPLAY_HASH_SAMPLE_MAX 0xFF
+#define NETPLAY_HASH_BLOCK 4096
+
+/* Also sent in the handshake: savestates may be sent to this peer as
+ * LOAD_SAVESTATE_BEGIN followed by LOAD_SAVESTATE_CHUNKs over several frames,
+ * rather than all at once. */
+#define NETPLAY_CHUNKED_SAVESTATES (1<<3)
+
+/* Savestates (or patches) bigger than a chunk are sent in chunks, each
+ * compressed on its own. At least a chunk goes out each frame, and enough
+ * that no transfer takes more than NETPLAY_CHUNK_FRAMES frames. */
+#define NETPLAY_CHUNK_SIZE   (256*1024)
+#define NETPLAY_CHUNK_FRAMES 30
+
+/* Desync recordings: a header of magic, version, state size and content CRC,
+ * then chunks of type, frame, payload size and payload, all 32-bit network
+ * order. Input applies from its frame until the next INPUT chunk. */
+#define NETPLAY_RECORD_MAGIC   0x52414E52 /* RANR */
+#define NETPLAY_RECORD_VERSION 2
+#define NETPLAY_RECORD_INPUT   1 /* flags, then the input of each player in them */
+#define NETPLAY_RECORD_CRC     2 /* netplay_hash_state of the state at the start of frame */
+#define NETPLAY_RECORD_STATE   3 /* the whole state at the start of frame */
+#define NETPLAY_RECORD_END     4 /* frame is the first one not recorded */
+
+/* Flag in an INPUT chunk for the first two ports being flipped */
+#define NETPLAY_RECORD_FLIP    (1U<<31)
+
+/* How often to record CRCs if we aren't checking them anyway */
+#define NETPLAY_RECORD_CRC_FRAMES 30
+
 enum netplay_cmd
 {
    /* Basic commands */
@@ -133,6 +204,9 @@ enum netplay_cmd
    /* Report player mode refused */
    NETPLAY_CMD_MODE_REFUSED   = 0x0027,
 
+   /* Request (client) or accept (server) the UDP input transport */
+   NETPLAY_CMD_UDP            = 0x0028,
+
    /* Loading and synchronization */
 
    /* Send the CRC hash of a frame's state */
@@ -156,6 +230,14 @@ enum netplay_cmd
    /* Sends over cheats enabled on client (unsupported) */
    NETPLAY_CMD_CHEATS         = 0x0046,
 
+   /* Start sending a savestate in chunks, with the same arguments as
+    * LOAD_SAVESTATE but no data */
+   NETPLAY_CMD_LOAD_SAVESTATE_BEGIN = 0x0047,
+
+   /* The next chunk of that savestate: how much of it came before, then the
+    * chunk, compressed. The state is loaded once it's all arrived. */
+   NETPLAY_CMD_LOAD_SAVESTATE_CHUNK = 0x0048,
+
    /* Misc. commands */
 
    /* Swap inputs between player 1 and player 2 */
@@ -173,6 +255,7 @@ enum netplay_cmd
 
 #define NETPLAY_CMD_INPUT_BIT_SERVER   (1U<<31)
 #define NETPLAY_CMD_SYNC_BIT_PAUSED    (1U<<31)
+#define NETPLAY_CMD_LOAD_SAVESTATE_BIT_DELTA (1U<<31)
 #define NETPLAY_CMD_MODE_BIT_PLAYING   (1U<<17)
 #define NETPLAY_CMD_MODE_BIT_YOU       (1U<<16)
 
@@ -199,6 +282,7 @@ enum rarch_netplay_connection_mode
    NETPLAY_CONNECTION_PRE_PASSWORD, /* Waiting for password */
    NETPLAY_CONNECTION_PRE_INFO, /* Waiting for core/content info */
    NETPLAY_CONNECTION_PRE_SYNC, /* Waiting for sync */
+   NETPLAY_CONNECTION_RELAY_SYNC, /* Waiting for the relay to have a state */
 
    /* Ready: */
    NETPLAY_CONNECTION_CONNECTED, /* Modes above this are connected */
@@ -215,8 +299,52 @@ enum rarch_netplay_stall_reason
    NETPLAY_STALL_NO_CONNECTION
 };
 
+/* How to guess input we haven't received yet */
+enum netplay_predictor
+{
+   /* Assume nothing has changed since the last input we got */
+   NETPLAY_PREDICT_HOLD = 0,
+
+   /* Hold directions but assume buttons are released, since presses in most
+    * action games are brief */
+   NETPLAY_PREDICT_DIRECTIONS,
+
+   /* Learn from each player's input how long each button tends to stay as it
+    * is, and guess from that how it's changed since */
+   NETPLAY_PREDICT_ADAPTIVE,
+
+   NETPLAY_PREDICT_LAST
+};
+
+/* What we've learned about one player's input, and how well we've guessed it */
+struct netplay_predict_stats
+{
+   /* For each button, by whether it was pressed: how many frames we've seen,
+    * and how many of them it stayed that way into the next */
+   uint16_t seen[2][32];
+   uint16_t kept[2][32];
+
+   /* Frames we ran on predicted input, and how many we got wrong */
+   uint32_t predicted, mispredicted;
+};
+
 typedef uint32_t netplay_input_state_t[WORDS_PER_INPUT];
 
+/* Desync recording in progress */
+struct netplay_record
+{
+   RFILE *file;
+
+   /* Have we written a starting point, and which frame is next? */
+   bool started;
+   uint32_t next_frame;
+
+   /* The last input written, so unchanged input isn't written again */
+   bool have_input;
+   uint32_t flags;
+   netplay_input_state_t input[MAX_USERS];
+};
+
 struct delta_frame
 {
    bool used; /* a bit derpy, but this is how we know if the delta's been used at all */
@@ -225,6 +353,10 @@ struct delta_frame
    /* The serialized state of the core at this frame, before input */
    void *state;
 
+   /* Is state actually from this frame? Frames nothing can roll back to
+    * aren't captured unless netplay_state_interval is 1. */
+   bool have_state;
+
    /* The CRC-32 of the serialized state if we've calculated it, else 0 */
    uint32_t crc;
 
@@ -244,12 +376,197 @@ struct delta_frame
    bool used_real[MAX_USERS];
 };
 
+/* Network condition simulator. TCP loses nothing, but a lost segment holds
+ * up everything behind it until it's resent, at least this long after. */
+#define NETPLAY_SIM_RESEND_USEC 200000
+#define NETPLAY_SIM_UDP_QUEUE 256
+
+/* Sent data up to the total is held until due */
+struct netplay_sim_mark
+{
+   uint32_t total;
+   retro_time_t due;
+};
+
+struct netplay_sim_stream
+{
+   struct netplay_sim *sim;
+   struct netplay_sim_mark *marks;
+   size_t head, count, size;
+};
+
+struct netplay_sim_packet
+{
+   retro_time_t due;
+   int fd;
+   struct sockaddr_storage addr;
+   socklen_t addr_len;
+   size_t len;
+   uint32_t data[NETPLAY_UDP_PACKET_WORDS];
+};
+
+struct netplay_sim
+{
+   bool enabled;
+
+   /* One-way delay, plus up to jitter more, and percentage of loss */
+   retro_time_t delay, jitter;
+   unsigned loss;
+   uint32_t rand;
+
+   /* UDP input packets not yet due */
+   struct netplay_sim_packet *udp_queue;
+   size_t udp_count;
+};
+
+/* Poller tags for what a ready socket belongs to */
+#define NETPLAY_POLLER_LISTEN     0
+#define NETPLAY_POLLER_UDP        1
+#define NETPLAY_POLLER_CONNECTION 2 /* + connection index */
+
+/* What a socket is watched for */
+#define NETPLAY_POLLER_IN  1
+#define NETPLAY_POLLER_OUT 2
+
+typedef void (*netplay_poller_cb_t)(void *data, size_t tag, unsigned events);
+
+struct netplay_poller_entry
+{
+   int fd;
+   unsigned events;
+   size_t tag;
+
+   /* Events found by the last select */
+   unsigned ready;
+};
+
+/* A set of sockets to wait on */
+struct netplay_poller
+{
+#if defined(NETPLAY_POLLER_EPOLL)
+   int epoll_fd;
+#else
+   struct netplay_poller_entry *entries;
+#if defined(NETPLAY_POLLER_POLL)
+   struct pollfd *fds; /* Alongside entries */
+#endif
+   size_t count, size;
+#endif
+
+   /* Which of netplay's own sockets have data waiting */
+   bool listen_ready;
+   bool udp_ready;
+};
+
+/* Socket I/O thread. Once a connection is past the handshake, only the
+ * thread touches its socket, and its socket buffers exchange data with the
+ * thread through these queues instead. The thread waits at most this long
+ * for its sockets, so new output waits at most this long to be sent. */
+#define NETPLAY_IOTHREAD_WAIT_MS 1
+#define NETPLAY_IOTHREAD_CHUNK   16384
+
+struct netplay_iothread_stream
+{
+   struct netplay_iothread *iothread;
+   int fd;
+
+   /* Received and not yet taken, and queued and not yet sent */
+   fifo_buffer_t *in, *out;
+
+   /* Taken from out but not all sent yet. Only the thread uses these. */
+   unsigned char *sending;
+   size_t sending_len, sending_pos;
+
+   /* The socket failed or the peer closed it */
+   bool failed;
+
+   /* What the thread's poller watches the socket for. Only the thread uses
+    * this. */
+   unsigned watching;
+
+   /* The thread is done with a detached stream */
+   bool released;
+
+   struct netplay_iothread_stream *next;
+};
+
+struct netplay_iothread
+{
+   sthread_t *thread;
+   slock_t *lock;
+
+   /* Broadcast whenever either side has made progress */
+   scond_t *cond;
+
+   struct netplay_iothread_stream *streams;
+
+   /* Streams taken back, waiting for the thread to let go of them */
+   struct netplay_iothread_stream *detached;
+
+   /* The thread's sockets. Only the thread uses it. */
+   struct netplay_poller poller;
+   unsigned char *scratch;
+
+   unsigned round;
+   bool busy, quit;
+};
+
 struct socket_buffer
 {
    unsigned char *data;
    size_t bufsz;
    size_t start, end;
    size_t read;
+
+   /* Total bytes ever queued (send buffers) or flushed (receive buffers),
+    * modulo 2^32. Used to order UDP input against the command stream. */
+   uint32_t total;
+
+   /* Bytes that have actually crossed the socket */
+   uint64_t transferred;
+
+   /* If simulating network conditions, what's held back (send buffers) */
+   struct netplay_sim_stream *sim;
+
+   /* If the I/O thread has the socket, our side of the exchange with it */
+   struct netplay_iothread_stream *io;
+};
+
+/* One of our own input frames, kept for repetition over UDP */
+struct netplay_udp_frame
+{
+   bool valid;
+   uint32_t frame;
+
+   /* send_packet_buffer.total as of the last command the receiver must have
+    * processed before using this frame */
+   uint32_t sync;
+
+   /* Player number with NETPLAY_CMD_INPUT_BIT_SERVER, or NETPLAY_UDP_NOINPUT */
+   uint32_t player;
+
+   netplay_input_state_t state;
+};
+
+/* A savestate being sent or received a chunk at a time */
+struct netplay_transfer
+{
+   bool active;
+
+   /* The frame it's loaded at, and when receiving, where that frame is */
+   uint32_t frame;
+   size_t ptr;
+
+   /* The state, or a delta patch against the last one */
+   bool delta;
+   uint8_t *data;
+   size_t size, alloc;
+
+   /* How much has been sent or received */
+   size_t pos;
+
+   /* The last progress reported, in percent */
+   unsigned progress;
 };
 
 /* Each connection gets a connection struct */
@@ -261,6 +578,9 @@ struct netplay_connection
    /* fd associated with this connection */
    int fd;
 
+   /* Has the poller seen data waiting on fd? */
+   bool ready;
+
    /* Address of peer */
    struct sockaddr_storage addr;
 
@@ -285,6 +605,23 @@ struct netplay_connection
    /* What compression does this peer support? */
    uint32_t compression_supported;
 
+   /* Can savestates be sent as deltas, and if so the last state sent and
+    * received, which each side keeps as the base for the next in that
+    * direction. TCP delivers in order, so the last state we sent is the one
+    * the peer will have loaded. */
+   bool delta_supported;
+   bool delta_send_valid;
+   bool delta_recv_valid;
+   void *delta_send_base;
+   void *delta_recv_base;
+
+   /* Do we exchange fast hashes, rather than CRC32, with this peer? */
+   bool fast_hash;
+
+   /* Can savestates be sent to this peer in chunks, and those on the way */
+   bool chunked_supported;
+   struct netplay_transfer send_transfer, recv_transfer;
+
    /* Is this player paused? */
    bool paused;
 
@@ -295,6 +632,32 @@ struct netplay_connection
    /* For the server: When was the last time we requested this client to stall?
     * For the client: How many frames of stall do we have left? */
    uint32_t stall_frame;
+
+   /* Is input also being exchanged over UDP with this peer? */
+   bool udp;
+
+   /* Token identifying this connection in UDP packets */
+   uint32_t udp_token;
+
+   /* The peer's UDP address. Until the client's first packet tells the
+    * server its port, the server only has its TCP address here. */
+   bool udp_have_addr;
+   struct sockaddr_storage udp_addr;
+   socklen_t udp_addr_len;
+
+   /* send_packet_buffer.total after the last command that UDP input may not
+    * overtake */
+   uint32_t udp_sync;
+
+   /* The first of our frames the peer has not yet received */
+   uint32_t udp_ack;
+
+   /* Our most recent input frames, and the frame after the newest */
+   struct netplay_udp_frame udp_frames[NETPLAY_UDP_REDUNDANT_FRAMES];
+   uint32_t udp_frame_count;
+
+   /* How many input frames arrived over UDP before TCP, for the log */
+   uint32_t udp_frames_first, udp_frames_total;
 };
 
 /* Compression transcoder */
@@ -311,10 +674,13 @@ struct netplay
    /* Are we the server? */
    bool is_server;
 
+   /* Are we a client passing the server's stream on to our own spectators? */
+   bool is_relay;
+
    /* Our nickname */
    char nick[NETPLAY_NICK_LEN];
 
-   /* TCP connection for listening (server only) */
+   /* TCP connection for listening (server or relay only) */
    int listen_fd;
 
    /* Our player number */
@@ -340,6 +706,18 @@ struct netplay
    /* TCP port (only set if serving) */
    uint16_t tcp_port;
 
+   /* Are we willing to exchange input over UDP? */
+   bool udp_input;
+
+   /* UDP socket for input. The server's is bound to the port after tcp_port,
+    * since LAN discovery listens on the default port itself, and is shared by
+    * all connections. */
+   int udp_fd;
+   uint16_t udp_port;
+
+   /* Readiness of the listen, UDP and connection sockets */
+   struct netplay_poller poller;
+
    /* NAT traversal info (if NAT traversal is used and serving) */
    bool nat_traversal;
    struct natt_status nat_traversal_state;
@@ -355,6 +733,12 @@ struct netplay
    uint8_t *zbuffer;
    size_t zbuffer_size;
 
+   /* Scratch space for delta savestates: the state being sent, padded as
+    * the delta encoder requires, and the uncompressed patch */
+   void *delta_state;
+   uint8_t *delta_patch;
+   size_t delta_patch_size;
+
    /* The size of our packet buffers */
    size_t packet_buffer_size;
 
@@ -413,6 +797,11 @@ struct netplay
    /* Have we requested a savestate as a sync point? */
    bool savestate_request_outstanding;
 
+   /* Relay only: the latest frame at which the server changed players, flipped
+    * or loaded a state. Spectators of a relay can't be synced from an earlier
+    * frame, since the relay has already passed the change on. */
+   uint32_t relay_event_frame;
+
    /* A buffer for outgoing input packets. */
    uint32_t input_packet_buffer[2 + WORDS_PER_FRAME];
 
@@ -458,6 +847,46 @@ struct netplay
    /* Frequency with which to check CRCs */
    int check_frames;
 
+   /* Fast hashes cover one block in every this many (0 or 1 for all of them).
+    * A client takes the server's. */
+   unsigned hash_sample;
+
+   /* Capture the core's state every this many frames, and on the first frame
+    * we run on predicted input. 1 captures every frame, 0 only where
+    * prediction starts (or when the buffer would otherwise fill). */
+   unsigned state_interval;
+
+   /* The latest captured frame at or before other. A rollback to a frame we
+    * didn't capture restores this one and replays forward, so nothing from
+    * here on may be overwritten. */
+   size_t snap_ptr;
+   uint32_t snap_frame_count;
+
+   /* How we predict input we haven't received yet */
+   enum netplay_predictor predictor;
+   struct netplay_predict_stats predict_stats[MAX_USERS];
+
+   /* State capture and rollback statistics, logged when netplay ends */
+   uint32_t stat_frames, stat_captures;
+   retro_time_t stat_capture_time;
+   uint32_t stat_rollbacks, stat_rollback_frames, stat_rollback_max;
+   uint32_t stat_rollback_depths[NETPLAY_STAT_DEPTHS];
+
+   /* Network statistics, logged alongside */
+   retro_time_t stat_start_time;
+   uint32_t stat_stalls, stat_stall_frames;
+   uint32_t stat_desyncs, stat_loads;
+   uint64_t stat_bytes_sent, stat_bytes_recv;
+
+   /* Simulated network conditions, for testing */
+   struct netplay_sim sim;
+
+   /* The thread doing our connections' socket I/O, if any */
+   struct netplay_iothread *iothread;
+
+   /* Desync recording, if enabled */
+   struct netplay_record record;
+
    /* Have we checked whether CRCs are valid at all? */
    bool crc_validity_checked;
 
@@ -499,6 +928,15 @@ void netplay_deinit_socket_buffer(struct socket_buffer *sbuf);
 bool netplay_send(struct socket_buffer *sbuf, int sockfd, const void *buf,
    size_t len);
 
+/**
+ * netplay_send_queue
+ *
+ * Queue the given data for sending, without trying to send it yet unless the
+ * buffer is full.
+ */
+bool netplay_send_queue(struct socket_buffer *sbuf, int sockfd,
+   const void *buf, size_t len);
+
 /**
  * netplay_send_flush
  *
@@ -509,6 +947,13 @@ bool netplay_send(struct socket_buffer *sbuf, int sockfd, const void *buf,
  */
 bool netplay_send_flush(struct socket_buffer *sbuf, int sockfd, bool block);
 
+/**
+ * netplay_send_room
+ *
+ * How much can be queued for sending without having to block.
+ */
+size_t netplay_send_room(struct socket_buffer *sbuf);
+
 /**
  * netplay_recv
  *
@@ -519,6 +964,13 @@ bool netplay_send_flush(struct socket_buffer *sbuf, int sockfd, bool block);
 ssize_t netplay_recv(struct socket_buffer *sbuf, int sockfd, void *buf,
    size_t len, bool block);
 
+/**
+ * netplay_recv_pending
+ *
+ * Is there received data in the buffer that hasn't been consumed yet?
+ */
+bool netplay_recv_pending(struct socket_buffer *sbuf);
+
 /**
  * netplay_recv_reset
  *
@@ -559,6 +1011,27 @@ bool netplay_delta_frame_ready(netplay_t *netplay, struct delta_frame *delta,
  */
 uint32_t netplay_delta_frame_crc(netplay_t *netplay, struct delta_frame *delta);
 
+/**
+ * netplay_hash_state
+ * @seed                 : hash to continue from, or 0
+ * @data                 : data to hash
+ * @size                 : size of @data
+ *
+ * Fast, non-cryptographic hash of some state. The same on every platform.
+ */
+uint32_t netplay_hash_state(uint32_t seed, const void *data, size_t size);
+
+/**
+ * netplay_delta_frame_hash
+ * @netplay              : pointer to netplay object
+ * @delta                : frame to hash
+ * @fast                 : the fast (possibly sampled) hash, or CRC32?
+ *
+ * Get the hash of this frame's state to check against a peer's.
+ */
+uint32_t netplay_delta_frame_hash(netplay_t *netplay, struct delta_frame *delta,
+   bool fast);
+
 
 /***************************************************************
  * NETPLAY-DISCOVERY.C
@@ -589,6 +1062,36 @@ bool netplay_lan_ad_server(netplay_t *netplay);
 void netplay_load_savestate(netplay_t *netplay,
       retro_ctx_serialize_info_t *serial_info, bool save);
 
+/**
+ * netplay_send_savestate
+ * @netplay              : pointer to netplay object
+ * @serial_info          : the savestate to send
+ * @frame                : the frame it's loaded at
+ * @only                 : send only to this connection, or NULL for all
+ * @cx                   : compression type
+ * @z                    : compression backend to use
+ *
+ * Send a savestate to connected peers using the given compression scheme.
+ */
+void netplay_send_savestate(netplay_t *netplay,
+   retro_ctx_serialize_info_t *serial_info, uint32_t frame,
+   struct netplay_connection *only, uint32_t cx,
+   struct compression_transcoder *z);
+
+/**
+ * netplay_compress
+ * @netplay              : pointer to netplay object
+ * @z                    : compression backend to use
+ * @data                 : data to compress
+ * @size                 : its size
+ *
+ * Compress the given data into zbuffer.
+ *
+ * Returns the compressed size, or -1 on failure.
+ */
+ssize_t netplay_compress(netplay_t *netplay,
+   struct compression_transcoder *z, const void *data, size_t size);
+
 /**
  * input_poll_net
  *
@@ -616,6 +1119,14 @@ bool netplay_handshake_init_send(netplay_t *netplay,
 bool netplay_handshake(netplay_t *netplay,
    struct netplay_connection *connection, bool *had_input);
 
+/**
+ * netplay_handshake_sync
+ *
+ * Send a SYNC command, starting the connection at the given frame.
+ */
+bool netplay_handshake_sync(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t frame);
+
 
 /***************************************************************
  * NETPLAY-INIT.C
@@ -647,8 +1158,13 @@ bool netplay_wait_and_init_serialization(netplay_t *netplay);
  * @port                 : Port of server.
  * @stateless_mode       : Shall we run in stateless mode?
  * @check_frames         : Frequency with which to check CRCs.
+ * @state_interval       : Frequency with which to capture states.
+ * @predictor            : How to predict input not yet received.
+ * @hash_sample          : Fraction of each state to hash for CRC checks.
  * @cb                   : Libretro callbacks.
  * @nat_traversal        : If true, attempt NAT traversal.
+ * @udp_input            : If true, offer to exchange input over UDP.
+ * @relay_port           : If nonzero, relay to spectators on this port.
  * @nick                 : Nickname of user.
  * @quirks               : Netplay quirks required for this session.
  *
@@ -658,8 +1174,9 @@ bool netplay_wait_and_init_serialization(netplay_t *netplay);
  * Returns: new netplay data.
  */
 netplay_t *netplay_new(void *direct_host, const char *server, uint16_t port,
-   bool stateless_mode, int check_frames,
-   const struct retro_callbacks *cb, bool nat_traversal, const char *nick,
+   bool stateless_mode, int check_frames, unsigned state_interval,
+   unsigned predictor, unsigned hash_sample, const struct retro_callbacks *cb,
+   bool nat_traversal, bool udp_input, uint16_t relay_port, const char *nick,
    uint64_t quirks);
 
 /**
@@ -692,6 +1209,18 @@ void netplay_hangup(netplay_t *netplay, struct netplay_connection *connection);
 bool netplay_send_cur_input(netplay_t *netplay,
    struct netplay_connection *connection);
 
+/**
+ * netplay_record_input
+ *
+ * Record input received from a connection as the real input for the given
+ * player's next unread frame, and forward it on if we're the server.
+ *
+ * Returns false if the frame isn't ready for input yet.
+ */
+bool netplay_record_input(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t player,
+   bool server_data, const uint32_t *state);
+
 /**
  * netplay_send_raw_cmd
  *
@@ -713,6 +1242,13 @@ void netplay_send_raw_cmd_all(netplay_t *netplay,
    struct netplay_connection *except, uint32_t cmd, const void *data,
    size_t size);
 
+/**
+ * netplay_send_flush_all
+ *
+ * Send whatever we can of the data queued for every connection.
+ */
+void netplay_send_flush_all(netplay_t *netplay);
+
 /**
  * netplay_cmd_crc
  *
@@ -815,4 +1351,520 @@ bool netplay_sync_pre_frame(netplay_t *netplay);
  */
 void netplay_sync_post_frame(netplay_t *netplay, bool stalled);
 
+
+/***************************************************************
+ * NETPLAY-UDP.C
+ **************************************************************/
+
+/**
+ * netplay_udp_init
+ *
+ * Open the server's UDP input socket on the TCP port.
+ */
+bool netplay_udp_init(netplay_t *netplay);
+
+/**
+ * netplay_udp_connect
+ *
+ * Start exchanging input over UDP with the server, after it accepted our
+ * NETPLAY_CMD_UDP with the given token and port.
+ */
+bool netplay_udp_connect(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t token, uint16_t port);
+
+/**
+ * netplay_udp_accept
+ *
+ * Start exchanging input over UDP with a client (server only). The client's
+ * port is learned from its first packet, which has to come from the host
+ * its TCP connection comes from.
+ *
+ * Returns false if the client can't be offered UDP.
+ */
+bool netplay_udp_accept(netplay_t *netplay,
+   struct netplay_connection *connection);
+
+/**
+ * netplay_udp_send_cur_input
+ *
+ * Record the current input frame for the given connection and send it,
+ * along with any earlier frames the peer hasn't acknowledged.
+ */
+void netplay_udp_send_cur_input(netplay_t *netplay,
+   struct netplay_connection *connection);
+
+/**
+ * netplay_udp_poll
+ *
+ * Read and apply all pending UDP input packets.
+ */
+void netplay_udp_poll(netplay_t *netplay, bool *had_input);
+
+/**
+ * netplay_udp_deinit
+ *
+ * Close the UDP input socket.
+ */
+void netplay_udp_deinit(netplay_t *netplay);
+
+/***************************************************************
+ * NETPLAY-RELAY.C
+ **************************************************************/
+
+/**
+ * netplay_relay_forward_input
+ *
+ * Pass input from the server on to our spectators.
+ */
+void netplay_relay_forward_input(netplay_t *netplay, uint32_t frame,
+   uint32_t player, bool server_data, const uint32_t *state);
+
+/**
+ * netplay_relay_forward_noinput
+ *
+ * Pass a frame without server input on to our spectators.
+ */
+void netplay_relay_forward_noinput(netplay_t *netplay, uint32_t frame);
+
+/**
+ * netplay_relay_forward_cmd
+ *
+ * Pass a command from the server on to our spectators unchanged.
+ */
+void netplay_relay_forward_cmd(netplay_t *netplay, uint32_t cmd,
+   const void *data, size_t size);
+
+/**
+ * netplay_relay_forward_crc
+ *
+ * Pass a CRC command from the server on to those spectators that hash the
+ * same way.
+ */
+void netplay_relay_forward_crc(netplay_t *netplay, const uint32_t *payload);
+
+/**
+ * netplay_relay_forward_savestate
+ *
+ * Pass a savestate loaded by the server on to our spectators.
+ */
+void netplay_relay_forward_savestate(netplay_t *netplay, uint32_t frame,
+   const void *state);
+
+/**
+ * netplay_relay_event
+ *
+ * Note that the server changed players, flipped or loaded a state at the
+ * given frame.
+ */
+void netplay_relay_event(netplay_t *netplay, uint32_t frame);
+
+/**
+ * netplay_relay_sync_pending
+ *
+ * Sync any spectators waiting for us to have a state to start them from.
+ */
+void netplay_relay_sync_pending(netplay_t *netplay);
+
+/***************************************************************
+ * NETPLAY-IOTHREAD.C
+ **************************************************************/
+
+/**
+ * netplay_iothread_init
+ * @netplay              : pointer to netplay object
+ *
+ * Start a thread to do the socket I/O of every connection past the
+ * handshake.
+ */
+bool netplay_iothread_init(netplay_t *netplay);
+
+/**
+ * netplay_iothread_deinit
+ *
+ * Stop the I/O thread, dropping anything it hadn't sent.
+ */
+void netplay_iothread_deinit(netplay_t *netplay);
+
+/**
+ * netplay_iothread_poll
+ *
+ * Hand connections that are past the handshake to the I/O thread, and mark
+ * those the thread has received something on as ready.
+ */
+void netplay_iothread_poll(netplay_t *netplay);
+
+/**
+ * netplay_iothread_wait
+ * @netplay              : pointer to netplay object
+ * @timeout_ms           : how long to wait at most
+ *
+ * Wait for the I/O thread to receive something, or for any socket we still
+ * watch ourselves to become readable.
+ *
+ * Returns -1 on error, 0 on timeout and a positive number otherwise.
+ */
+int netplay_iothread_wait(netplay_t *netplay, unsigned timeout_ms);
+
+/**
+ * netplay_iothread_detach
+ *
+ * Take a connection back from the I/O thread, before its socket is closed.
+ */
+void netplay_iothread_detach(netplay_t *netplay,
+   struct netplay_connection *connection);
+
+/**
+ * netplay_iothread_recv
+ * @stream               : the connection's stream
+ * @buf                  : where to put it
+ * @len                  : how much to take
+ * @block                : wait for all of it?
+ *
+ * Take what the I/O thread has received.
+ *
+ * Returns the number of bytes taken, or -1 if the socket failed and nothing
+ * is left.
+ */
+ssize_t netplay_iothread_recv(struct netplay_iothread_stream *stream,
+   void *buf, size_t len, bool block);
+
+/**
+ * netplay_iothread_send
+ * @stream               : the connection's stream
+ * @buf                  : what to send
+ * @len                  : how much
+ * @block                : wait for room for all of it?
+ *
+ * Hand data to the I/O thread to send.
+ *
+ * Returns the number of bytes handed over, or -1 if the socket failed.
+ */
+ssize_t netplay_iothread_send(struct netplay_iothread_stream *stream,
+   const void *buf, size_t len, bool block);
+
+/***************************************************************
+ * NETPLAY-TRANSFER.C
+ **************************************************************/
+
+/**
+ * netplay_transfer_start
+ * @netplay              : pointer to netplay object
+ * @connection           : connection to send to
+ * @frame                : the frame it's loaded at
+ * @data                 : the state, or a delta patch
+ * @size                 : its size
+ * @delta                : is it a patch?
+ *
+ * Start sending a savestate in chunks. Any state still on its way to this
+ * peer is abandoned.
+ */
+bool netplay_transfer_start(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t frame,
+   const void *data, size_t size, bool delta);
+
+/**
+ * netplay_transfer_cancel
+ *
+ * Stop sending a savestate to this peer. A delta against it would be against
+ * a state they never got, so the next is sent whole.
+ */
+void netplay_transfer_cancel(struct netplay_connection *connection);
+
+/**
+ * netplay_transfer_poll
+ *
+ * Compress and send this frame's chunks of every savestate on its way.
+ */
+void netplay_transfer_poll(netplay_t *netplay);
+
+/**
+ * netplay_transfer_recv_begin
+ * @netplay              : pointer to netplay object
+ * @connection           : connection it's coming from
+ * @frame                : the frame it's loaded at
+ * @ptr                  : where that frame is in the buffer
+ * @size                 : size of the state or patch
+ * @delta                : is it a patch?
+ *
+ * Start receiving a savestate in chunks. Any partly received one is dropped.
+ */
+bool netplay_transfer_recv_begin(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t frame, size_t ptr,
+   size_t size, bool delta);
+
+/**
+ * netplay_transfer_recv_chunk
+ * @netplay              : pointer to netplay object
+ * @connection           : connection it came from
+ * @pos                  : how much of the state came before it
+ * @data                 : the compressed chunk
+ * @size                 : its size
+ *
+ * Take the next chunk of a savestate.
+ *
+ * Returns -1 if it's not the chunk we expected, 1 if the state is now
+ * complete and 0 otherwise.
+ */
+int netplay_transfer_recv_chunk(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t pos,
+   const void *data, size_t size);
+
+/**
+ * netplay_transfer_sending
+ *
+ * Is a savestate still on its way to any peer?
+ */
+bool netplay_transfer_sending(netplay_t *netplay);
+
+/**
+ * netplay_transfer_receiving
+ *
+ * Are we waiting for the rest of a savestate?
+ */
+bool netplay_transfer_receiving(netplay_t *netplay);
+
+/**
+ * netplay_transfer_free
+ *
+ * Free a connection's transfers.
+ */
+void netplay_transfer_free(struct netplay_connection *connection);
+
+/***************************************************************
+ * NETPLAY-POLLER.C
+ **************************************************************/
+
+/**
+ * netplay_poller_open
+ *
+ * Set up an empty set of sockets to watch.
+ */
+bool netplay_poller_open(struct netplay_poller *poller);
+
+/**
+ * netplay_poller_close
+ *
+ * Free a set of sockets. The sockets themselves are not closed.
+ */
+void netplay_poller_close(struct netplay_poller *poller);
+
+/**
+ * netplay_poller_watch
+ * @poller               : the set
+ * @fd                   : socket to watch
+ * @events               : NETPLAY_POLLER_IN and/or NETPLAY_POLLER_OUT
+ * @tag                  : passed back when the socket is ready
+ *
+ * Start watching a socket, or change what it's watched for. Watching for
+ * nothing stops watching it.
+ */
+bool netplay_poller_watch(struct netplay_poller *poller, int fd,
+      unsigned events, size_t tag);
+
+/**
+ * netplay_poller_unwatch
+ *
+ * Stop watching a socket. Must be called before it's closed.
+ */
+void netplay_poller_unwatch(struct netplay_poller *poller, int fd);
+
+/**
+ * netplay_poller_poll
+ * @poller               : the set
+ * @timeout_ms           : how long to wait if nothing is ready yet
+ * @cb                   : called with the tag and events of each ready socket
+ * @data                 : passed to cb
+ *
+ * Wait for any watched socket to become ready. A socket with an error or a
+ * closed connection is reported as readable, so that reading it finds out.
+ *
+ * Returns the number of ready sockets, or -1 on error.
+ */
+int netplay_poller_poll(struct netplay_poller *poller, unsigned timeout_ms,
+      netplay_poller_cb_t cb, void *data);
+
+/**
+ * netplay_poller_init
+ *
+ * Set up the poller. Must be called before any socket is added.
+ */
+bool netplay_poller_init(netplay_t *netplay);
+
+/**
+ * netplay_poller_deinit
+ *
+ * Free the poller. The sockets themselves are not closed.
+ */
+void netplay_poller_deinit(netplay_t *netplay);
+
+/**
+ * netplay_poller_add
+ * @netplay              : pointer to netplay object
+ * @fd                   : socket to watch for reading
+ * @tag                  : NETPLAY_POLLER_LISTEN, NETPLAY_POLLER_UDP, or
+ *                         NETPLAY_POLLER_CONNECTION plus the connection index
+ *
+ * Start watching a socket.
+ */
+bool netplay_poller_add(netplay_t *netplay, int fd, size_t tag);
+
+/**
+ * netplay_poller_remove
+ *
+ * Stop watching a socket. Must be called before it's closed.
+ */
+void netplay_poller_remove(netplay_t *netplay, int fd);
+
+/**
+ * netplay_poller_wait
+ * @netplay              : pointer to netplay object
+ * @timeout_ms           : how long to wait if nothing is ready yet
+ *
+ * Wait for any watched socket to become readable, and mark those that are.
+ * Flags are only ever set here; it's up to the reader to clear them.
+ *
+ * Returns the number of ready sockets, or -1 on error.
+ */
+int netplay_poller_wait(netplay_t *netplay, unsigned timeout_ms);
+
+/***************************************************************
+ * NETPLAY-SIM.C
+ **************************************************************/
+
+/**
+ * netplay_sim_init
+ * @netplay              : pointer to netplay object
+ * @delay_ms             : one-way delay to add
+ * @jitter_ms            : up to how much more delay to add at random
+ * @loss                 : percentage of packets to lose
+ *
+ * Simulate a poor network on everything we send.
+ */
+bool netplay_sim_init(netplay_t *netplay, unsigned delay_ms,
+   unsigned jitter_ms, unsigned loss);
+
+/**
+ * netplay_sim_deinit
+ *
+ * Stop simulating, dropping anything held back.
+ */
+void netplay_sim_deinit(netplay_t *netplay);
+
+/**
+ * netplay_sim_poll
+ *
+ * Send whatever we've held back that's now due.
+ */
+void netplay_sim_poll(netplay_t *netplay);
+
+/**
+ * netplay_sim_queued
+ *
+ * Note that data was just added to a send buffer, and decide when it's due.
+ */
+void netplay_sim_queued(struct socket_buffer *sbuf);
+
+/**
+ * netplay_sim_ready
+ * @sbuf                 : send buffer
+ * @unsent               : bytes in the buffer not yet sent
+ *
+ * Returns how many of the unsent bytes are due to be sent.
+ */
+size_t netplay_sim_ready(struct socket_buffer *sbuf, size_t unsent);
+
+/**
+ * netplay_sim_stream_free
+ *
+ * Free a send buffer's simulation state.
+ */
+void netplay_sim_stream_free(struct netplay_sim_stream *stream);
+
+/**
+ * netplay_sim_sendto
+ *
+ * Send a UDP packet, or lose it or hold it back as simulated. Unlike TCP,
+ * packets may arrive out of order.
+ */
+void netplay_sim_sendto(netplay_t *netplay, int fd, const void *data,
+   size_t len, const struct sockaddr_storage *addr, socklen_t addr_len);
+
+/***************************************************************
+ * NETPLAY-PREDICT.C
+ **************************************************************/
+
+/**
+ * netplay_predict_input
+ * @netplay              : pointer to netplay object
+ * @player               : player whose input to predict
+ * @last                 : the latest real input we have from that player
+ * @frames               : how many frames after @last we're predicting
+ * @resim                : are we resimulating, or predicting this frame for
+ *                         the first time?
+ * @out                  : predicted input. When resimulating, holds the
+ *                         earlier prediction.
+ *
+ * Guess a player's input for a frame we haven't received it for.
+ */
+void netplay_predict_input(netplay_t *netplay, uint32_t player,
+   const uint32_t *last, uint32_t frames, bool resim, uint32_t *out);
+
+/**
+ * netplay_predict_confirm
+ * @netplay              : pointer to netplay object
+ * @ptr                  : frame whose input is now all real
+ *
+ * Account for how well we predicted a frame, and learn from its input. Must
+ * be called once for each frame, in order, as it's confirmed.
+ */
+void netplay_predict_confirm(netplay_t *netplay, size_t ptr);
+
+/***************************************************************
+ * NETPLAY-RECORD.C
+ **************************************************************/
+
+/**
+ * netplay_record_init
+ * @netplay              : pointer to netplay object
+ * @path                 : file to record to
+ *
+ * Start recording every confirmed frame's input, and periodic CRCs, for
+ * finding desyncs offline.
+ */
+bool netplay_record_init(netplay_t *netplay, const char *path);
+
+/**
+ * netplay_record_deinit
+ *
+ * Finish and close the recording, if any.
+ */
+void netplay_record_deinit(netplay_t *netplay);
+
+/**
+ * netplay_record_period
+ *
+ * How often CRCs are recorded. Those frames are always captured.
+ */
+uint32_t netplay_record_period(netplay_t *netplay);
+
+/**
+ * netplay_record_frame
+ * @netplay              : pointer to netplay object
+ * @delta                : frame whose input is now all real
+ *
+ * Record a confirmed frame. Must be called once for each frame, in order.
+ */
+void netplay_record_frame(netplay_t *netplay, struct delta_frame *delta);
+
+/**
+ * netplay_record_state
+ * @netplay              : pointer to netplay object
+ * @frame                : frame at the start of which the state was loaded
+ * @state                : the state
+ *
+ * Record a savestate load, which the recording continues from.
+ */
+void netplay_record_state(netplay_t *netplay, uint32_t frame,
+   const void *state);
+
 #endif
@@ -0,0 +1,236 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2016-2017 - Gregor Richards
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Desync recording. Each peer writes the input of every frame as it's
+ * confirmed, a CRC of the state every so often, and any state it loads, so
+ * that netplay_bisect can replay the two recordings and find where they part.
+ * Input is only written when it changes. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <net/net_compat.h>
+
+#include "netplay_private.h"
+
+#include "../../content.h"
+
+static void record_write(netplay_t *netplay, uint32_t type, uint32_t frame,
+   const void *payload, size_t size)
+{
+   uint32_t header[3];
+
+   header[0] = htonl(type);
+   header[1] = htonl(frame);
+   header[2] = htonl((uint32_t)size);
+
+   if (filestream_write(netplay->record.file, header, sizeof(header))
+         != sizeof(header) ||
+       (size && filestream_write(netplay->record.file, payload, size)
+         != (ssize_t)size))
+   {
+      RARCH_ERR("Failed to write netplay recording. Recording stopped.\n");
+      filestream_close(netplay->record.file);
+      netplay->record.file = NULL;
+   }
+}
+
+/**
+ * netplay_record_init
+ * @netplay              : pointer to netplay object
+ * @path                 : file to record to
+ *
+ * Start recording every confirmed frame's input, and periodic CRCs, for
+ * finding desyncs offline.
+ */
+bool netplay_record_init(netplay_t *netplay, const char *path)
+{
+   uint32_t header[4];
+   uint32_t *content_crc_ptr = NULL;
+
+   memset(&netplay->record, 0, sizeof(netplay->record));
+
+   netplay->record.file = filestream_open(path, RFILE_MODE_WRITE, -1);
+   if (!netplay->record.file)
+   {
+      RARCH_ERR("Could not open netplay recording \"%s\".\n", path);
+      return false;
+   }
+
+   content_get_crc(&content_crc_ptr);
+
+   header[0] = htonl(NETPLAY_RECORD_MAGIC);
+   header[1] = htonl(NETPLAY_RECORD_VERSION);
+   header[2] = htonl((uint32_t)netplay->state_size);
+   header[3] = htonl(content_crc_ptr ? *content_crc_ptr : 0);
+
+   if (filestream_write(netplay->record.file, header, sizeof(header))
+         != sizeof(header))
+   {
+      RARCH_ERR("Failed to write netplay recording \"%s\".\n", path);
+      filestream_close(netplay->record.file);
+      netplay->record.file = NULL;
+      return false;
+   }
+
+   RARCH_LOG("Recording netplay to \"%s\".\n", path);
+   return true;
+}
+
+/**
+ * netplay_record_deinit
+ *
+ * Finish and close the recording, if any.
+ */
+void netplay_record_deinit(netplay_t *netplay)
+{
+   if (!netplay->record.file)
+      return;
+
+   if (netplay->record.started)
+      record_write(netplay, NETPLAY_RECORD_END, netplay->record.next_frame,
+            NULL, 0);
+
+   if (netplay->record.file)
+      filestream_close(netplay->record.file);
+   netplay->record.file = NULL;
+}
+
+/**
+ * netplay_record_period
+ *
+ * How often CRCs are recorded. Those frames are always captured.
+ */
+uint32_t netplay_record_period(netplay_t *netplay)
+{
+   if (netplay->check_frames)
+      return abs(netplay->check_frames);
+   return NETPLAY_RECORD_CRC_FRAMES;
+}
+
+/* Is this frame's state really from the core? Until the core can serialize,
+ * frames are given a blank state instead. */
+static bool record_real_state(netplay_t *netplay, struct delta_frame *delta)
+{
+   return delta->have_state && delta->frame > 0 &&
+      !(netplay->quirks & NETPLAY_QUIRK_INITIALIZATION);
+}
+
+/**
+ * netplay_record_frame
+ * @netplay              : pointer to netplay object
+ * @delta                : frame whose input is now all real
+ *
+ * Record a confirmed frame. Must be called once for each frame, in order.
+ */
+void netplay_record_frame(netplay_t *netplay, struct delta_frame *delta)
+{
+   struct netplay_record *record = &netplay->record;
+   uint32_t payload[1 + MAX_USERS * WORDS_PER_INPUT];
+   size_t words = 1;
+   uint32_t flags = 0;
+   uint32_t player;
+
+   if (!record->file)
+      return;
+
+   if (!record->started || delta->frame != record->next_frame)
+   {
+      /* We can only start from freshly loaded content or a real state */
+      if (record_real_state(netplay, delta))
+         netplay_record_state(netplay, delta->frame, delta->state);
+      else if (delta->frame == 0)
+      {
+         record->started    = true;
+         record->next_frame = 0;
+         record->have_input = false;
+      }
+      else
+      {
+         record->started = false;
+         return;
+      }
+      if (!record->file)
+         return;
+   }
+
+   /* The input, if it's changed */
+   for (player = 0; player < MAX_USERS; player++)
+   {
+      if (!(netplay->connected_players & (1<<player)) ||
+          !delta->have_real[player])
+         continue;
+      flags |= 1<<player;
+   }
+   if (netplay_flip_port(netplay))
+      flags |= NETPLAY_RECORD_FLIP;
+
+   if (!record->have_input || flags != record->flags ||
+       memcmp(record->input, delta->real_input_state,
+          sizeof(record->input)) != 0)
+   {
+      payload[0] = htonl(flags);
+      for (player = 0; player < MAX_USERS; player++)
+      {
+         uint32_t word;
+         if (!(flags & (1<<player)))
+            continue;
+         for (word = 0; word < WORDS_PER_INPUT; word++)
+            payload[words++] = htonl(delta->real_input_state[player][word]);
+      }
+      record_write(netplay, NETPLAY_RECORD_INPUT, delta->frame, payload,
+            words * sizeof(uint32_t));
+
+      record->have_input = true;
+      record->flags      = flags;
+      memcpy(record->input, delta->real_input_state, sizeof(record->input));
+   }
+
+   /* And every so often, the CRC */
+   if (record->file && record_real_state(netplay, delta) &&
+       delta->frame % netplay_record_period(netplay) == 0)
+   {
+      payload[0] = htonl(netplay_hash_state(0, delta->state,
+            netplay->state_size));
+      record_write(netplay, NETPLAY_RECORD_CRC, delta->frame, payload,
+            sizeof(uint32_t));
+   }
+
+   record->next_frame = delta->frame + 1;
+}
+
+/**
+ * netplay_record_state
+ * @netplay              : pointer to netplay object
+ * @frame                : frame at the start of which the state was loaded
+ * @state                : the state
+ *
+ * Record a savestate load, which the recording continues from.
+ */
+void netplay_record_state(netplay_t *netplay, uint32_t frame,
+   const void *state)
+{
+   struct netplay_record *record = &netplay->record;
+
+   if (!record->file)
+      return;
+
+   record_write(netplay, NETPLAY_RECORD_STATE, frame, state,
+         netplay->state_size);
+
+   record->started    = true;
+   record->next_frame = frame;
+   record->have_input = false;
+}
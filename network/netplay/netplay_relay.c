@@ -0,0 +1,275 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2016-2017 - Gregor Richards
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Relaying: a client of the server (connections[0]) which also accepts its own
+ * spectators and passes the server's stream on to them. Everything from the
+ * server is forwarded as soon as it's read, so the relay's own emulation only
+ * matters when a new spectator joins, which is synced from the relay's latest
+ * confirmed frame and then sent the input it has buffered since. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <net/net_compat.h>
+#include <net/net_socket.h>
+
+#include "netplay_private.h"
+
+/* Queue a prebuilt command for one or all of our spectators */
+static void relay_queue(netplay_t *netplay, struct netplay_connection *only,
+   const void *buf, size_t len)
+{
+   size_t i;
+
+   for (i = 1; i < netplay->connections_size; i++)
+   {
+      struct netplay_connection *connection = &netplay->connections[i];
+      if (only && connection != only)
+         continue;
+      if (!connection->active ||
+          connection->mode < NETPLAY_CONNECTION_CONNECTED)
+         continue;
+
+      /* A spectator that can't keep up is dropped rather than waited on */
+      if (!netplay_send_queue(&connection->send_packet_buffer, connection->fd,
+            buf, len))
+         netplay_hangup(netplay, connection);
+   }
+}
+
+static void relay_send_input(netplay_t *netplay,
+   struct netplay_connection *only, uint32_t frame, uint32_t player,
+   const uint32_t *state)
+{
+   uint32_t buffer[2 + WORDS_PER_FRAME];
+
+   buffer[0] = htonl(NETPLAY_CMD_INPUT);
+   buffer[1] = htonl(WORDS_PER_FRAME * sizeof(uint32_t));
+   buffer[2] = htonl(frame);
+   buffer[3] = htonl(player);
+   buffer[4] = htonl(state[0]);
+   buffer[5] = htonl(state[1]);
+   buffer[6] = htonl(state[2]);
+
+   relay_queue(netplay, only, buffer, sizeof(buffer));
+}
+
+static void relay_send_noinput(netplay_t *netplay,
+   struct netplay_connection *only, uint32_t frame)
+{
+   uint32_t buffer[3];
+
+   buffer[0] = htonl(NETPLAY_CMD_NOINPUT);
+   buffer[1] = htonl(sizeof(uint32_t));
+   buffer[2] = htonl(frame);
+
+   relay_queue(netplay, only, buffer, sizeof(buffer));
+}
+
+static void relay_send_savestate(netplay_t *netplay,
+   struct netplay_connection *only, uint32_t frame, const void *state)
+{
+   retro_ctx_serialize_info_t serial_info;
+
+   serial_info.data       = NULL;
+   serial_info.data_const = state;
+   serial_info.size       = netplay->state_size;
+
+   if (netplay->compress_nil.compression_backend)
+      netplay_send_savestate(netplay, &serial_info, frame, only, 0,
+         &netplay->compress_nil);
+   if (netplay->compress_zlib.compression_backend)
+      netplay_send_savestate(netplay, &serial_info, frame, only,
+         NETPLAY_COMPRESSION_ZLIB, &netplay->compress_zlib);
+}
+
+/**
+ * netplay_relay_forward_input
+ *
+ * Pass input from the server on to our spectators. Our spectators only have
+ * us as a server, so the server's own input is sent as an ordinary player's
+ * followed by a NOINPUT to advance their server frame.
+ */
+void netplay_relay_forward_input(netplay_t *netplay, uint32_t frame,
+   uint32_t player, bool server_data, const uint32_t *state)
+{
+   relay_send_input(netplay, NULL, frame, player, state);
+   if (server_data)
+      relay_send_noinput(netplay, NULL, frame);
+}
+
+/**
+ * netplay_relay_forward_noinput
+ *
+ * Pass a frame without server input on to our spectators.
+ */
+void netplay_relay_forward_noinput(netplay_t *netplay, uint32_t frame)
+{
+   relay_send_noinput(netplay, NULL, frame);
+}
+
+/**
+ * netplay_relay_forward_cmd
+ *
+ * Pass a command from the server on to our spectators unchanged.
+ */
+void netplay_relay_forward_cmd(netplay_t *netplay, uint32_t cmd,
+   const void *data, size_t size)
+{
+   size_t i;
+
+   for (i = 1; i < netplay->connections_size; i++)
+   {
+      struct netplay_connection *connection = &netplay->connections[i];
+      if (connection->active &&
+          connection->mode >= NETPLAY_CONNECTION_CONNECTED &&
+          !netplay_send_raw_cmd(netplay, connection, cmd, data, size))
+         netplay_hangup(netplay, connection);
+   }
+}
+
+/**
+ * netplay_relay_forward_crc
+ *
+ * Pass a CRC command from the server on to those spectators that hash the
+ * same way. The rest go unchecked rather than be told of false desyncs.
+ */
+void netplay_relay_forward_crc(netplay_t *netplay, const uint32_t *payload)
+{
+   size_t i;
+
+   for (i = 1; i < netplay->connections_size; i++)
+   {
+      struct netplay_connection *connection = &netplay->connections[i];
+      if (connection->active &&
+          connection->mode >= NETPLAY_CONNECTION_CONNECTED &&
+          connection->fast_hash == netplay->connections[0].fast_hash &&
+          !netplay_send_raw_cmd(netplay, connection, NETPLAY_CMD_CRC,
+             payload, 2 * sizeof(uint32_t)))
+         netplay_hangup(netplay, connection);
+   }
+}
+
+/**
+ * netplay_relay_forward_savestate
+ *
+ * Pass a savestate loaded by the server on to our spectators.
+ */
+void netplay_relay_forward_savestate(netplay_t *netplay, uint32_t frame,
+   const void *state)
+{
+   relay_send_savestate(netplay, NULL, frame, state);
+}
+
+/**
+ * netplay_relay_event
+ *
+ * Note that the server changed players, flipped or loaded a state at the
+ * given frame.
+ */
+void netplay_relay_event(netplay_t *netplay, uint32_t frame)
+{
+   if (frame > netplay->relay_event_frame)
+      netplay->relay_event_frame = frame;
+}
+
+/* Start a spectator at the given frame: sync, the state at that frame, then
+ * all the input we've had since */
+static bool relay_sync(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t frame)
+{
+   uint32_t player, frame_count;
+   size_t ptr;
+
+   if (!netplay_handshake_sync(netplay, connection, frame))
+      return false;
+
+   relay_send_savestate(netplay, connection, frame,
+      netplay->buffer[netplay->other_ptr].state);
+   if (!connection->active)
+      return true;
+
+   for (player = 0; player < MAX_USERS; player++)
+   {
+      if (!(netplay->connected_players & (1<<player)))
+         continue;
+
+      ptr = netplay->other_ptr;
+      for (frame_count = frame;
+            frame_count < netplay->read_frame_count[player];
+            frame_count++)
+      {
+         struct delta_frame *dframe = &netplay->buffer[ptr];
+         if (!dframe->used || dframe->frame != frame_count ||
+             !dframe->have_real[player])
+         {
+            RARCH_ERR("Netplay relay lost input for frame %u.\n", frame_count);
+            return false;
+         }
+         relay_send_input(netplay, connection, frame_count, player,
+            dframe->real_input_state[player]);
+         ptr = NEXT_PTR(ptr);
+      }
+   }
+
+   for (frame_count = frame; frame_count < netplay->server_frame_count;
+         frame_count++)
+      relay_send_noinput(netplay, connection, frame_count);
+
+   if (!connection->active)
+      return true;
+   return netplay_send_flush(&connection->send_packet_buffer, connection->fd,
+      false);
+}
+
+/**
+ * netplay_relay_sync_pending
+ *
+ * Sync any spectators waiting for us to have a state to start them from.
+ */
+void netplay_relay_sync_pending(netplay_t *netplay)
+{
+   uint32_t frame             = netplay->other_frame_count;
+   struct delta_frame *dframe = &netplay->buffer[netplay->other_ptr];
+   bool ready;
+   size_t i;
+
+   /* The state at other_frame_count is the latest we know to be right. We
+    * can't start anyone before a change we've already passed on. */
+   ready = netplay->self_mode >= NETPLAY_CONNECTION_CONNECTED &&
+      !(netplay->quirks & NETPLAY_QUIRK_INITIALIZATION) &&
+      frame > 0 && frame >= netplay->relay_event_frame &&
+      dframe->used && dframe->frame == frame && dframe->have_state;
+
+   for (i = 1; i < netplay->connections_size; i++)
+   {
+      struct netplay_connection *connection = &netplay->connections[i];
+      if (!connection->active ||
+          connection->mode != NETPLAY_CONNECTION_RELAY_SYNC)
+         continue;
+
+      if (!netplay->connections[0].active ||
+          (netplay->quirks &
+            (NETPLAY_QUIRK_NO_SAVESTATES|NETPLAY_QUIRK_NO_TRANSMISSION)))
+      {
+         RARCH_WARN("Netplay relay can't sync a spectator without the server's state.\n");
+         netplay_hangup(netplay, connection);
+         continue;
+      }
+
+      if (ready && !relay_sync(netplay, connection, frame))
+         netplay_hangup(netplay, connection);
+   }
+}
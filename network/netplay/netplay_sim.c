@@ -0,0 +1,300 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2016-2017 - Gregor Richards
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network condition simulator, for testing netplay over loopback. Everything
+ * we send is held back for the configured delay plus some jitter. A lost TCP
+ * segment is modelled as a resend, holding up everything queued behind it; a
+ * lost UDP packet is simply dropped, and the rest may arrive out of order.
+ * Only sending is affected, so with every peer simulating, each direction
+ * gets the conditions configured at its sender. The handshake isn't. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <net/net_compat.h>
+#include <net/net_socket.h>
+
+#include "netplay_private.h"
+
+/* Deterministic, so that a run can be repeated */
+static uint32_t sim_rand(struct netplay_sim *sim)
+{
+   sim->rand ^= sim->rand << 13;
+   sim->rand ^= sim->rand >> 17;
+   sim->rand ^= sim->rand << 5;
+   return sim->rand;
+}
+
+static bool sim_lost(struct netplay_sim *sim)
+{
+   return sim->loss && (sim_rand(sim) % 100) < sim->loss;
+}
+
+static retro_time_t sim_due(struct netplay_sim *sim, retro_time_t now)
+{
+   retro_time_t due = now + sim->delay;
+   if (sim->jitter)
+      due += sim_rand(sim) % (uint32_t)(sim->jitter + 1);
+   return due;
+}
+
+/**
+ * netplay_sim_init
+ * @netplay              : pointer to netplay object
+ * @delay_ms             : one-way delay to add
+ * @jitter_ms            : up to how much more delay to add at random
+ * @loss                 : percentage of packets to lose
+ *
+ * Simulate a poor network on everything we send.
+ */
+bool netplay_sim_init(netplay_t *netplay, unsigned delay_ms,
+   unsigned jitter_ms, unsigned loss)
+{
+   struct netplay_sim *sim = &netplay->sim;
+
+   memset(sim, 0, sizeof(*sim));
+   if (!delay_ms && !jitter_ms && !loss)
+      return true;
+
+   sim->udp_queue = (struct netplay_sim_packet*)
+      calloc(NETPLAY_SIM_UDP_QUEUE, sizeof(struct netplay_sim_packet));
+   if (!sim->udp_queue)
+      return false;
+
+   sim->enabled = true;
+   sim->delay   = (retro_time_t)delay_ms * 1000;
+   sim->jitter  = (retro_time_t)jitter_ms * 1000;
+   sim->loss    = (loss < 100) ? loss : 99;
+   sim->rand    = 0x2545F491;
+
+   RARCH_LOG("Simulating a network with %ums delay, %ums jitter and %u%% loss.\n",
+         delay_ms, jitter_ms, sim->loss);
+   return true;
+}
+
+/**
+ * netplay_sim_deinit
+ *
+ * Stop simulating, dropping anything held back.
+ */
+void netplay_sim_deinit(netplay_t *netplay)
+{
+   free(netplay->sim.udp_queue);
+   memset(&netplay->sim, 0, sizeof(netplay->sim));
+}
+
+/**
+ * netplay_sim_stream_free
+ *
+ * Free a send buffer's simulation state.
+ */
+void netplay_sim_stream_free(struct netplay_sim_stream *stream)
+{
+   if (!stream)
+      return;
+   free(stream->marks);
+   free(stream);
+}
+
+/**
+ * netplay_sim_queued
+ *
+ * Note that data was just added to a send buffer, and decide when it's due.
+ */
+void netplay_sim_queued(struct socket_buffer *sbuf)
+{
+   struct netplay_sim_stream *stream = sbuf->sim;
+   struct netplay_sim_mark *last;
+   retro_time_t due;
+
+   if (!stream)
+      return;
+
+   due = sim_due(stream->sim, cpu_features_get_time_usec());
+   if (sim_lost(stream->sim))
+   {
+      retro_time_t resend = 2 * (stream->sim->delay + stream->sim->jitter);
+      due += (resend > NETPLAY_SIM_RESEND_USEC) ?
+         resend : NETPLAY_SIM_RESEND_USEC;
+   }
+
+   /* TCP delivers in order, so nothing is due before what came before it */
+   last = stream->count ? &stream->marks[stream->head + stream->count - 1] :
+      NULL;
+   if (last && due <= last->due)
+   {
+      last->total = sbuf->total;
+      return;
+   }
+
+   if (stream->head + stream->count == stream->size)
+   {
+      if (stream->head)
+      {
+         memmove(stream->marks, stream->marks + stream->head,
+               stream->count * sizeof(struct netplay_sim_mark));
+         stream->head = 0;
+      }
+      else
+      {
+         size_t new_size = stream->size ? stream->size * 2 : 64;
+         struct netplay_sim_mark *marks = (struct netplay_sim_mark*)
+            realloc(stream->marks, new_size * sizeof(struct netplay_sim_mark));
+         if (!marks)
+         {
+            /* Send it with what's already held */
+            if (last)
+               last->total = sbuf->total;
+            return;
+         }
+         stream->marks = marks;
+         stream->size  = new_size;
+      }
+   }
+
+   stream->marks[stream->head + stream->count].total = sbuf->total;
+   stream->marks[stream->head + stream->count].due   = due;
+   stream->count++;
+}
+
+/**
+ * netplay_sim_ready
+ * @sbuf                 : send buffer
+ * @unsent               : bytes in the buffer not yet sent
+ *
+ * Returns how many of the unsent bytes are due to be sent.
+ */
+size_t netplay_sim_ready(struct socket_buffer *sbuf, size_t unsent)
+{
+   struct netplay_sim_stream *stream = sbuf->sim;
+   uint32_t sent_total               = sbuf->total - (uint32_t)unsent;
+   uint32_t ready_total              = sent_total;
+   retro_time_t now;
+   size_t i;
+
+   if (!stream)
+      return unsent;
+
+   /* Forget whatever has gone out already */
+   while (stream->count &&
+          (int32_t)(stream->marks[stream->head].total - sent_total) <= 0)
+   {
+      stream->head++;
+      stream->count--;
+   }
+   if (!stream->count)
+   {
+      /* Anything left was queued before we started simulating */
+      stream->head = 0;
+      return unsent;
+   }
+
+   now = cpu_features_get_time_usec();
+   for (i = stream->head; i < stream->head + stream->count; i++)
+   {
+      if (stream->marks[i].due > now)
+         break;
+      ready_total = stream->marks[i].total;
+   }
+
+   return ready_total - sent_total;
+}
+
+static void sim_udp_flush(struct netplay_sim *sim)
+{
+   retro_time_t now = cpu_features_get_time_usec();
+   size_t i         = 0;
+
+   while (i < sim->udp_count)
+   {
+      struct netplay_sim_packet *packet = &sim->udp_queue[i];
+      if (packet->due > now)
+      {
+         i++;
+         continue;
+      }
+
+      sendto(packet->fd, (const char*)packet->data, packet->len, 0,
+            (const struct sockaddr*)&packet->addr, packet->addr_len);
+      *packet = sim->udp_queue[--sim->udp_count];
+   }
+}
+
+/**
+ * netplay_sim_sendto
+ *
+ * Send a UDP packet, or lose it or hold it back as simulated. Unlike TCP,
+ * packets may arrive out of order.
+ */
+void netplay_sim_sendto(netplay_t *netplay, int fd, const void *data,
+   size_t len, const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+   struct netplay_sim *sim = &netplay->sim;
+   struct netplay_sim_packet *packet;
+
+   sim_udp_flush(sim);
+
+   if (sim_lost(sim) || sim->udp_count == NETPLAY_SIM_UDP_QUEUE ||
+       len > sizeof(packet->data))
+      return;
+
+   packet           = &sim->udp_queue[sim->udp_count++];
+   packet->due      = sim_due(sim, cpu_features_get_time_usec());
+   packet->fd       = fd;
+   packet->addr     = *addr;
+   packet->addr_len = addr_len;
+   packet->len      = len;
+   memcpy(packet->data, data, len);
+}
+
+/**
+ * netplay_sim_poll
+ *
+ * Send whatever we've held back that's now due.
+ */
+void netplay_sim_poll(netplay_t *netplay)
+{
+   struct netplay_sim *sim = &netplay->sim;
+   size_t i;
+
+   if (!sim->enabled)
+      return;
+
+   for (i = 0; i < netplay->connections_size; i++)
+   {
+      struct netplay_connection *connection = &netplay->connections[i];
+      struct socket_buffer *sbuf            = &connection->send_packet_buffer;
+
+      if (!connection->active || !sbuf->data ||
+          connection->mode < NETPLAY_CONNECTION_CONNECTED)
+         continue;
+
+      /* Only connections past the handshake are simulated, since parts of
+       * it wait for replies */
+      if (!sbuf->sim)
+      {
+         sbuf->sim = (struct netplay_sim_stream*)
+            calloc(1, sizeof(struct netplay_sim_stream));
+         if (!sbuf->sim)
+            continue;
+         sbuf->sim->sim = sim;
+      }
+
+      if (!netplay_send_flush(sbuf, connection->fd, false))
+         netplay_hangup(netplay, connection);
+   }
+
+   sim_udp_flush(sim);
+}
@@ -80,7 +80,7 @@ void netplay_update_unread_ptr(netplay_t *netplay)
  * @resim               : are we resimulating, or simulating this frame for the
  *                        first time?
  *
- * "Simulate" input by assuming it hasn't changed since the last read input.
+ * "Simulate" input by predicting it from the last read input.
  */
 void netplay_simulate_input(netplay_t *netplay, size_t sim_ptr, bool resim)
 {
@@ -98,57 +98,111 @@ void netplay_simulate_input(netplay_t *netplay, size_t sim_ptr, bool resim)
       prev = PREV_PTR(netplay->read_ptr[player]);
       pframe = &netplay->buffer[prev];
 
-      if (resim)
-      {
-         /* In resimulation mode, we only copy the buttons. The reason for this
-          * is nonobvious:
-          *
-          * If we resimulated nothing, then the /duration/ with which any input
-          * was pressed would be approximately correct, since the original
-          * simulation came in as the input came in, but the /number of times/
-          * the input was pressed would be wrong, as there would be an
-          * advancing wavefront of real data overtaking the simulated data
-          * (which is really just real data offset by some frames).
-          *
-          * That's acceptable for arrows in most situations, since the amount
-          * you move is tied to the duration, but unacceptable for buttons,
-          * which will seem to jerkily be pressed numerous times with those
-          * wavefronts.
-          */
-         const uint32_t keep = (1U<<RETRO_DEVICE_ID_JOYPAD_UP) |
-                               (1U<<RETRO_DEVICE_ID_JOYPAD_DOWN) |
-                               (1U<<RETRO_DEVICE_ID_JOYPAD_LEFT) |
-                               (1U<<RETRO_DEVICE_ID_JOYPAD_RIGHT);
-         uint32_t sim_state = simframe->simulated_input_state[player][0] & keep;
-         sim_state |= pframe->real_input_state[player][0] & ~keep;
-         simframe->simulated_input_state[player][0] = sim_state;
-      }
-      else
+      netplay_predict_input(netplay, player,
+            pframe->real_input_state[player],
+            simframe->frame - netplay->read_frame_count[player] + 1,
+            resim, simframe->simulated_input_state[player]);
+   }
+}
+
+/* Should we capture the core's state before running this frame? */
+static bool netplay_want_state(netplay_t *netplay, struct delta_frame *delta)
+{
+   if (netplay->state_interval == 1)
+      return true;
+
+   /* The first frame we predict is where the next rollback will start */
+   if (delta->frame == netplay->unread_frame_count &&
+       !(netplay->is_server && !netplay->connected_players))
+      return true;
+
+   /* Otherwise rollbacks replay from the last capture, so keep one often
+    * enough that replaying from it stays cheap and fits in the buffer */
+   if ((netplay->state_interval &&
+        delta->frame % netplay->state_interval == 0) ||
+       delta->frame - netplay->snap_frame_count >= netplay->buffer_size / 2)
+      return true;
+
+   /* Or somebody else needs this state */
+   return netplay->force_send_savestate || delta->crc ||
+      (netplay->check_frames &&
+       delta->frame % abs(netplay->check_frames) == 0) ||
+      (netplay->record.file &&
+       delta->frame % netplay_record_period(netplay) == 0);
+}
+
+/* Capture the core's state into this frame */
+static bool netplay_capture_state(netplay_t *netplay, struct delta_frame *delta)
+{
+   retro_ctx_serialize_info_t serial_info;
+   retro_time_t start = cpu_features_get_time_usec();
+
+   serial_info.data_const = NULL;
+   serial_info.data       = delta->state;
+   serial_info.size       = netplay->state_size;
+
+   memset(serial_info.data, 0, serial_info.size);
+   delta->have_state = core_serialize(&serial_info);
+
+   netplay->stat_captures++;
+   netplay->stat_capture_time += cpu_features_get_time_usec() - start;
+   return delta->have_state;
+}
+
+/* Move snap up to the latest captured frame at or before other */
+static void netplay_update_snap(netplay_t *netplay)
+{
+   size_t ptr;
+   uint32_t frame_count;
+
+   if (netplay->state_interval == 1 ||
+       netplay->snap_frame_count > netplay->other_frame_count)
+   {
+      netplay->snap_ptr         = netplay->other_ptr;
+      netplay->snap_frame_count = netplay->other_frame_count;
+      return;
+   }
+
+   ptr         = netplay->other_ptr;
+   frame_count = netplay->other_frame_count;
+   while (frame_count > netplay->snap_frame_count)
+   {
+      struct delta_frame *delta = &netplay->buffer[ptr];
+      if (delta->used && delta->frame == frame_count && delta->have_state)
       {
-         memcpy(simframe->simulated_input_state[player],
-                pframe->real_input_state[player],
-                WORDS_PER_INPUT * sizeof(uint32_t));
+         netplay->snap_ptr         = ptr;
+         netplay->snap_frame_count = frame_count;
+         return;
       }
+      ptr = PREV_PTR(ptr);
+      frame_count--;
    }
 }
 
 static void netplay_handle_frame_hash(netplay_t *netplay, struct delta_frame *delta)
 {
+   /* This frame's input is final, so it can be recorded */
+   if (netplay->record.file)
+      netplay_record_frame(netplay, delta);
+
+   /* Only a captured state can be hashed */
+   if (!delta->have_state)
+      return;
+
    if (netplay->is_server)
    {
       if (netplay->check_frames &&
           delta->frame % abs(netplay->check_frames) == 0)
-      {
-         delta->crc = netplay_delta_frame_crc(netplay, delta);
          netplay_cmd_crc(netplay, delta);
-      }
    }
    else if (delta->crc && netplay->crcs_valid)
    {
       /* We have a remote CRC, so check it */
-      uint32_t local_crc = netplay_delta_frame_crc(netplay, delta);
+      uint32_t local_crc = netplay_delta_frame_hash(netplay, delta,
+            netplay->connections[0].fast_hash);
       if (local_crc != delta->crc)
       {
+         netplay->stat_desyncs++;
          if (!netplay->crc_validity_checked)
          {
             /* If the very first check frame is wrong, they probably just don't
@@ -188,16 +242,22 @@ bool netplay_sync_pre_frame(netplay_t *netplay)
 
    if (netplay_delta_frame_ready(netplay, &netplay->buffer[netplay->run_ptr], netplay->run_frame_count))
    {
-      serial_info.data_const = NULL;
-      serial_info.data = netplay->buffer[netplay->run_ptr].state;
-      serial_info.size = netplay->state_size;
+      struct delta_frame *delta = &netplay->buffer[netplay->run_ptr];
 
-      memset(serial_info.data, 0, serial_info.size);
       if ((netplay->quirks & NETPLAY_QUIRK_INITIALIZATION) || netplay->run_frame_count == 0)
       {
          /* Don't serialize until it's safe */
+         memset(delta->state, 0, netplay->state_size);
+         delta->have_state = true;
       }
-      else if (!(netplay->quirks & NETPLAY_QUIRK_NO_SAVESTATES) && core_serialize(&serial_info))
+      else if (!(netplay->quirks & NETPLAY_QUIRK_NO_SAVESTATES) &&
+               !netplay_want_state(netplay, delta))
+      {
+         /* Nothing will roll back to this frame, so don't pay to capture it */
+         delta->have_state = false;
+      }
+      else if (!(netplay->quirks & NETPLAY_QUIRK_NO_SAVESTATES) &&
+               netplay_capture_state(netplay, delta))
       {
          if (netplay->force_send_savestate && !netplay->stall && !netplay->remote_paused)
          {
@@ -208,12 +268,15 @@ bool netplay_sync_pre_frame(netplay_t *netplay)
                memcpy(netplay->buffer[netplay->self_ptr].state,
                   netplay->buffer[netplay->run_ptr].state,
                   netplay->state_size);
+               netplay->buffer[netplay->self_ptr].have_state = true;
                netplay->run_ptr = netplay->self_ptr;
                netplay->run_frame_count = netplay->self_frame_count;
             }
 
             /* Send this along to the other side */
             serial_info.data_const = netplay->buffer[netplay->run_ptr].state;
+            serial_info.data       = NULL;
+            serial_info.size       = netplay->state_size;
             netplay_load_savestate(netplay, &serial_info, false);
             netplay->force_send_savestate = false;
          }
@@ -222,6 +285,7 @@ bool netplay_sync_pre_frame(netplay_t *netplay)
       {
          /* If the core can't serialize properly, we must stall for the
           * remote input on EVERY frame, because we can't recover */
+         delta->have_state = false;
          netplay->quirks |= NETPLAY_QUIRK_NO_SAVESTATES;
          netplay->stateless_mode = true;
       }
@@ -234,10 +298,8 @@ bool netplay_sync_pre_frame(netplay_t *netplay)
          netplay->stall = NETPLAY_STALL_NO_CONNECTION;
    }
 
-   if (netplay->is_server)
+   if (netplay->listen_fd >= 0)
    {
-      fd_set fds;
-      struct timeval tmp_tv = {0};
       int new_fd;
       struct sockaddr_storage their_addr;
       socklen_t addr_size;
@@ -245,11 +307,10 @@ bool netplay_sync_pre_frame(netplay_t *netplay)
       size_t connection_num;
 
       /* Check for a connection */
-      FD_ZERO(&fds);
-      FD_SET(netplay->listen_fd, &fds);
-      if (socket_select(netplay->listen_fd + 1, &fds, NULL, NULL, &tmp_tv) > 0 &&
-          FD_ISSET(netplay->listen_fd, &fds))
+      netplay_poller_wait(netplay, 0);
+      if (netplay->poller.listen_ready)
       {
+         netplay->poller.listen_ready = false;
          addr_size = sizeof(their_addr);
          new_fd = accept(netplay->listen_fd, (struct sockaddr*)&their_addr, &addr_size);
          if (new_fd < 0)
@@ -287,8 +348,9 @@ bool netplay_sync_pre_frame(netplay_t *netplay)
             RARCH_WARN("Cannot set Netplay port to close-on-exec. It may fail to reopen if the client disconnects.\n");
 #endif
 
-         /* Allocate a connection */
-         for (connection_num = 0; connection_num < netplay->connections_size; connection_num++)
+         /* Allocate a connection. A relay's first is its server. */
+         for (connection_num = netplay->is_relay ? 1 : 0;
+               connection_num < netplay->connections_size; connection_num++)
             if (!netplay->connections[connection_num].active) break;
          if (connection_num == netplay->connections_size)
          {
@@ -333,10 +395,14 @@ bool netplay_sync_pre_frame(netplay_t *netplay)
          if (!netplay_init_socket_buffer(&connection->send_packet_buffer,
                netplay->packet_buffer_size) ||
              !netplay_init_socket_buffer(&connection->recv_packet_buffer,
-               netplay->packet_buffer_size))
+               netplay->packet_buffer_size) ||
+             !netplay_poller_add(netplay, new_fd,
+               NETPLAY_POLLER_CONNECTION + connection_num))
          {
             if (connection->send_packet_buffer.data)
                netplay_deinit_socket_buffer(&connection->send_packet_buffer);
+            if (connection->recv_packet_buffer.data)
+               netplay_deinit_socket_buffer(&connection->recv_packet_buffer);
             connection->active = false;
             socket_close(new_fd);
             goto process;
@@ -348,6 +414,9 @@ bool netplay_sync_pre_frame(netplay_t *netplay)
    }
 
 process:
+   if (netplay->is_relay)
+      netplay_relay_sync_pending(netplay);
+
    netplay->can_poll = true;
    input_poll_net();
 
@@ -364,12 +433,15 @@ process:
 void netplay_sync_post_frame(netplay_t *netplay, bool stalled)
 {
    uint32_t lo_frame_count, hi_frame_count;
+   uint32_t confirm_frame_count;
+   size_t confirm_ptr;
 
    /* Unless we're stalling, we've just finished running a frame */
    if (!stalled)
    {
       netplay->run_ptr = NEXT_PTR(netplay->run_ptr);
       netplay->run_frame_count++;
+      netplay->stat_frames++;
    }
 
    /* We've finished an input frame even if we're stalling */
@@ -386,6 +458,7 @@ void netplay_sync_post_frame(netplay_t *netplay, bool stalled)
    {
       netplay->other_frame_count = netplay->self_frame_count;
       netplay->other_ptr = netplay->self_ptr;
+      netplay_update_snap(netplay);
       /* FIXME: Duplication */
       if (netplay->catch_up)
       {
@@ -396,6 +469,18 @@ void netplay_sync_post_frame(netplay_t *netplay, bool stalled)
       return;
    }
 
+   /* Everything from other to unread is newly confirmed, so see how well we
+    * predicted it before any replay */
+   confirm_ptr = netplay->other_ptr;
+   for (confirm_frame_count = netplay->other_frame_count;
+        confirm_frame_count < netplay->unread_frame_count &&
+        confirm_frame_count < netplay->run_frame_count;
+        confirm_frame_count++)
+   {
+      netplay_predict_confirm(netplay, confirm_ptr);
+      confirm_ptr = NEXT_PTR(confirm_ptr);
+   }
+
 #ifndef DEBUG_NONDETERMINISTIC_CORES
    if (!netplay->force_rewind)
    {
@@ -428,12 +513,33 @@ void netplay_sync_post_frame(netplay_t *netplay, bool stalled)
         netplay->other_frame_count < netplay->run_frame_count))
    {
       retro_ctx_serialize_info_t serial_info;
+      uint32_t confirmed_frame_count = netplay->other_frame_count;
+      uint32_t depth, bucket;
 
       /* Replay frames. */
       netplay->is_replay = true;
       netplay->replay_ptr = netplay->other_ptr;
       netplay->replay_frame_count = netplay->other_frame_count;
 
+      /* If we didn't capture the first frame to replay, start from the
+       * nearest earlier one we did */
+      if (!netplay->buffer[netplay->replay_ptr].have_state &&
+          netplay->snap_frame_count < netplay->replay_frame_count)
+      {
+         netplay->replay_ptr = netplay->snap_ptr;
+         netplay->replay_frame_count = netplay->snap_frame_count;
+      }
+
+      depth = netplay->run_frame_count - netplay->replay_frame_count;
+      netplay->stat_rollbacks++;
+      netplay->stat_rollback_frames += depth;
+      if (depth > netplay->stat_rollback_max)
+         netplay->stat_rollback_max = depth;
+      bucket = 0;
+      while (bucket < NETPLAY_STAT_DEPTHS - 1 && (depth >> (bucket + 1)))
+         bucket++;
+      netplay->stat_rollback_depths[bucket]++;
+
       if (netplay->quirks & NETPLAY_QUIRK_INITIALIZATION)
          /* Make sure we're initialized before we start loading things */
          netplay_wait_and_init_serialization(netplay);
@@ -458,11 +564,17 @@ void netplay_sync_post_frame(netplay_t *netplay, bool stalled)
 
          start = cpu_features_get_time_usec();
 
-         /* Remember the current state */
-         memset(serial_info.data, 0, serial_info.size);
-         core_serialize(&serial_info);
-         if (netplay->replay_frame_count < netplay->unread_frame_count)
-            netplay_handle_frame_hash(netplay, ptr);
+         /* Remember the current state. Frames before the confirmed one were
+          * right the first time, so whatever we captured of them stands. */
+         if (netplay->replay_frame_count >= confirmed_frame_count)
+         {
+            if (netplay_want_state(netplay, ptr))
+               netplay_capture_state(netplay, ptr);
+            else
+               ptr->have_state = false;
+            if (netplay->replay_frame_count < netplay->unread_frame_count)
+               netplay_handle_frame_hash(netplay, ptr);
+         }
 
          /* Re-simulate this frame's input */
          netplay_simulate_input(netplay, netplay->replay_ptr, true);
@@ -516,6 +628,8 @@ void netplay_sync_post_frame(netplay_t *netplay, bool stalled)
       netplay->force_rewind = false;
    }
 
+   netplay_update_snap(netplay);
+
    if (netplay->is_server)
    {
       uint32_t player;
@@ -0,0 +1,314 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2016-2017 - Gregor Richards
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Chunked savestate transfers. Rather than compressing and sending a big
+ * state all at once, inside a single frame, the sender announces it with
+ * LOAD_SAVESTATE_BEGIN at the point in the stream where LOAD_SAVESTATE would
+ * have gone, then compresses and sends a share of it each frame. Each chunk is
+ * compressed on its own, so the receiver can decompress it as it arrives. The
+ * receiver stalls until the last chunk is in, then loads it like any other. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <net/net_compat.h>
+
+#include "netplay_private.h"
+
+#include "../../msg_hash.h"
+#include "../../runloop.h"
+
+static struct compression_transcoder *transfer_transcoder(netplay_t *netplay,
+   struct netplay_connection *connection)
+{
+   switch (connection->compression_supported)
+   {
+      case NETPLAY_COMPRESSION_ZLIB:
+         return &netplay->compress_zlib;
+      default:
+         return &netplay->compress_nil;
+   }
+}
+
+static bool transfer_reserve(struct netplay_transfer *transfer, size_t size)
+{
+   uint8_t *data;
+
+   if (transfer->alloc >= size)
+      return true;
+
+   data = (uint8_t*)realloc(transfer->data, size);
+   if (!data)
+      return false;
+   transfer->data  = data;
+   transfer->alloc = size;
+   return true;
+}
+
+/* Show how far along a transfer is, whenever that changes */
+static void transfer_progress(struct netplay_transfer *transfer,
+   enum msg_hash_enums msg_id, const char *nick)
+{
+   char msg[512];
+   unsigned progress = (unsigned)((uint64_t)transfer->pos * 100 /
+         transfer->size);
+
+   if (progress == transfer->progress)
+      return;
+   transfer->progress = progress;
+
+   msg[sizeof(msg)-1] = '\0';
+   snprintf(msg, sizeof(msg)-1, msg_hash_to_str(msg_id), nick, progress);
+   runloop_msg_queue_push(msg, 1, 60, true);
+}
+
+/**
+ * netplay_transfer_start
+ * @netplay              : pointer to netplay object
+ * @connection           : connection to send to
+ * @frame                : the frame it's loaded at
+ * @data                 : the state, or a delta patch
+ * @size                 : its size
+ * @delta                : is it a patch?
+ *
+ * Start sending a savestate in chunks. Any state still on its way to this
+ * peer is abandoned.
+ */
+bool netplay_transfer_start(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t frame,
+   const void *data, size_t size, bool delta)
+{
+   struct netplay_transfer *transfer = &connection->send_transfer;
+   uint32_t header[4];
+
+   if (!transfer_reserve(transfer, size))
+      return false;
+
+   memcpy(transfer->data, data, size);
+   transfer->active   = true;
+   transfer->frame    = frame;
+   transfer->delta    = delta;
+   transfer->size     = size;
+   transfer->pos      = 0;
+   transfer->progress = 0;
+
+   header[0] = htonl(NETPLAY_CMD_LOAD_SAVESTATE_BEGIN);
+   header[1] = htonl(2*sizeof(uint32_t));
+   header[2] = htonl(frame);
+   header[3] = htonl((delta ? NETPLAY_CMD_LOAD_SAVESTATE_BIT_DELTA : 0) |
+         (uint32_t)size);
+
+   return netplay_send(&connection->send_packet_buffer, connection->fd,
+         header, sizeof(header));
+}
+
+/**
+ * netplay_transfer_cancel
+ *
+ * Stop sending a savestate to this peer. A delta against it would be against
+ * a state they never got, so the next is sent whole.
+ */
+void netplay_transfer_cancel(struct netplay_connection *connection)
+{
+   connection->send_transfer.active = false;
+   connection->delta_send_valid     = false;
+}
+
+/**
+ * netplay_transfer_poll
+ *
+ * Compress and send this frame's chunks of every savestate on its way.
+ */
+void netplay_transfer_poll(netplay_t *netplay)
+{
+   size_t i;
+
+   for (i = 0; i < netplay->connections_size; i++)
+   {
+      struct netplay_connection *connection = &netplay->connections[i];
+      struct netplay_transfer *transfer     = &connection->send_transfer;
+      struct socket_buffer *sbuf            = &connection->send_packet_buffer;
+      struct compression_transcoder *z;
+      size_t budget;
+
+      if (!connection->active || !transfer->active)
+         continue;
+
+      z      = transfer_transcoder(netplay, connection);
+      budget = transfer->size / NETPLAY_CHUNK_FRAMES;
+      if (budget < NETPLAY_CHUNK_SIZE)
+         budget = NETPLAY_CHUNK_SIZE;
+
+      while (transfer->pos < transfer->size && budget)
+      {
+         uint32_t header[3];
+         ssize_t wn;
+         size_t len = transfer->size - transfer->pos;
+         if (len > NETPLAY_CHUNK_SIZE)
+            len = NETPLAY_CHUNK_SIZE;
+
+         /* Never block on it. If the link can't keep up, it takes longer. */
+         if (netplay_send_room(sbuf) < sizeof(header) + len + len/16 + 64)
+            break;
+
+         wn = netplay_compress(netplay, z, transfer->data + transfer->pos, len);
+         if (wn < 0)
+         {
+            RARCH_ERR("Failed to compress a netplay savestate chunk.\n");
+            netplay_hangup(netplay, connection);
+            break;
+         }
+
+         header[0] = htonl(NETPLAY_CMD_LOAD_SAVESTATE_CHUNK);
+         header[1] = htonl(wn + sizeof(uint32_t));
+         header[2] = htonl((uint32_t)transfer->pos);
+         if (!netplay_send(sbuf, connection->fd, header, sizeof(header)) ||
+             !netplay_send(sbuf, connection->fd, netplay->zbuffer, wn))
+         {
+            netplay_hangup(netplay, connection);
+            break;
+         }
+
+         transfer->pos += len;
+         budget         = (budget > len) ? budget - len : 0;
+      }
+
+      if (!connection->active)
+         continue;
+
+      transfer_progress(transfer, MSG_NETPLAY_SENDING_SAVESTATE,
+            connection->nick);
+      if (transfer->pos == transfer->size)
+         transfer->active = false;
+   }
+}
+
+/**
+ * netplay_transfer_recv_begin
+ * @netplay              : pointer to netplay object
+ * @connection           : connection it's coming from
+ * @frame                : the frame it's loaded at
+ * @ptr                  : where that frame is in the buffer
+ * @size                 : size of the state or patch
+ * @delta                : is it a patch?
+ *
+ * Start receiving a savestate in chunks. Any partly received one is dropped.
+ */
+bool netplay_transfer_recv_begin(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t frame, size_t ptr,
+   size_t size, bool delta)
+{
+   struct netplay_transfer *transfer = &connection->recv_transfer;
+
+   transfer->active = false;
+   if (!size || !transfer_reserve(transfer, size))
+      return false;
+
+   transfer->active   = true;
+   transfer->frame    = frame;
+   transfer->ptr      = ptr;
+   transfer->delta    = delta;
+   transfer->size     = size;
+   transfer->pos      = 0;
+   transfer->progress = 0;
+   return true;
+}
+
+/**
+ * netplay_transfer_recv_chunk
+ * @netplay              : pointer to netplay object
+ * @connection           : connection it came from
+ * @pos                  : how much of the state came before it
+ * @data                 : the compressed chunk
+ * @size                 : its size
+ *
+ * Take the next chunk of a savestate.
+ *
+ * Returns -1 if it's not the chunk we expected, 1 if the state is now
+ * complete and 0 otherwise.
+ */
+int netplay_transfer_recv_chunk(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t pos,
+   const void *data, size_t size)
+{
+   struct netplay_transfer *transfer = &connection->recv_transfer;
+   struct compression_transcoder *ctrans;
+   uint32_t rd, wn;
+
+   if (!transfer->active || pos != transfer->pos)
+      return -1;
+
+   ctrans = transfer_transcoder(netplay, connection);
+   ctrans->decompression_backend->set_in(ctrans->decompression_stream,
+      (const uint8_t*)data, (uint32_t)size);
+   ctrans->decompression_backend->set_out(ctrans->decompression_stream,
+      transfer->data + transfer->pos, (uint32_t)(transfer->size - transfer->pos));
+   if (!ctrans->decompression_backend->trans(ctrans->decompression_stream,
+         true, &rd, &wn, NULL) || !wn)
+      return -1;
+
+   transfer->pos += wn;
+   transfer_progress(transfer, MSG_NETPLAY_RECEIVING_SAVESTATE,
+         connection->nick);
+   if (transfer->pos < transfer->size)
+      return 0;
+
+   transfer->active = false;
+   return 1;
+}
+
+/**
+ * netplay_transfer_sending
+ *
+ * Is a savestate still on its way to any peer?
+ */
+bool netplay_transfer_sending(netplay_t *netplay)
+{
+   size_t i;
+   for (i = 0; i < netplay->connections_size; i++)
+      if (netplay->connections[i].active &&
+          netplay->connections[i].send_transfer.active)
+         return true;
+   return false;
+}
+
+/**
+ * netplay_transfer_receiving
+ *
+ * Are we waiting for the rest of a savestate?
+ */
+bool netplay_transfer_receiving(netplay_t *netplay)
+{
+   size_t i;
+   for (i = 0; i < netplay->connections_size; i++)
+      if (netplay->connections[i].active &&
+          netplay->connections[i].recv_transfer.active)
+         return true;
+   return false;
+}
+
+/**
+ * netplay_transfer_free
+ *
+ * Free a connection's transfers.
+ */
+void netplay_transfer_free(struct netplay_connection *connection)
+{
+   free(connection->send_transfer.data);
+   free(connection->recv_transfer.data);
+   memset(&connection->send_transfer, 0, sizeof(connection->send_transfer));
+   memset(&connection->recv_transfer, 0, sizeof(connection->recv_transfer));
+}
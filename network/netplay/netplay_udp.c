@@ -0,0 +1,551 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2016-2017 - Gregor Richards
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* UDP input transport. Input is still sent over TCP, and TCP remains the
+ * authority on ordering; UDP just lets input skip past a stalled TCP stream.
+ * Every packet repeats our newest input frames that the peer hasn't
+ * acknowledged, so a lost packet is covered by the next one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32) && !defined(_XBOX)
+#include <windows.h>
+#include <wincrypt.h>
+#endif
+
+#include <net/net_compat.h>
+#include <net/net_socket.h>
+
+#include "netplay_private.h"
+
+#if defined(AF_INET6) && !defined(HAVE_SOCKET_LEGACY)
+#define HAVE_INET6 1
+#endif
+
+static void udp_sendto(int fd, const void *data, size_t len,
+      const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+   /* Failures are of no concern, since TCP carries the same input */
+   sendto(fd, (const char*)data, len, 0,
+         (const struct sockaddr*)addr, addr_len);
+}
+
+/* Fill in a connection token that can't be guessed from off the path.
+ * Returns false if the OS has no random source to offer. */
+static bool udp_random_token(uint32_t *token)
+{
+#if defined(_WIN32) && !defined(_XBOX)
+   HCRYPTPROV prov;
+   bool ret;
+
+   if (!CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_FULL,
+            CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
+      return false;
+   ret = CryptGenRandom(prov, sizeof(*token), (BYTE*)token) != 0;
+   CryptReleaseContext(prov, 0);
+   return ret;
+#elif defined(__unix__) || defined(__APPLE__)
+   bool ret;
+   FILE *file = fopen("/dev/urandom", "rb");
+
+   if (!file)
+      return false;
+   ret = fread(token, sizeof(*token), 1, file) == 1;
+   fclose(file);
+   return ret;
+#else
+   return false;
+#endif
+}
+
+/* Get the host part of an address, with IPv4-mapped IPv6 addresses as
+ * IPv4, so the TCP and UDP sockets' views of a peer compare equal.
+ * Returns the length written to host, or 0 for other families. */
+static size_t udp_addr_host(const struct sockaddr_storage *addr,
+      uint8_t host[16])
+{
+   switch (addr->ss_family)
+   {
+      case AF_INET:
+         memcpy(host, &((const struct sockaddr_in*)addr)->sin_addr, 4);
+         return 4;
+#ifdef HAVE_INET6
+      case AF_INET6:
+         {
+            static const uint8_t mapped[12] =
+               {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+            const uint8_t *a6 = (const uint8_t*)
+               &((const struct sockaddr_in6*)addr)->sin6_addr;
+
+            if (!memcmp(a6, mapped, sizeof(mapped)))
+            {
+               memcpy(host, a6 + 12, 4);
+               return 4;
+            }
+            memcpy(host, a6, 16);
+            return 16;
+         }
+#endif
+      default:
+         break;
+   }
+   return 0;
+}
+
+static uint16_t udp_addr_port(const struct sockaddr_storage *addr)
+{
+   switch (addr->ss_family)
+   {
+      case AF_INET:
+         return ntohs(((const struct sockaddr_in*)addr)->sin_port);
+#ifdef HAVE_INET6
+      case AF_INET6:
+         return ntohs(((const struct sockaddr_in6*)addr)->sin6_port);
+#endif
+      default:
+         break;
+   }
+   return 0;
+}
+
+/* Is a packet from addr allowed to speak for this connection? The server
+ * takes packets from the host the client's TCP connection comes from, on
+ * any port, since NAT may map UDP to a port of its own. The client only
+ * takes them from where it sends its own. */
+static bool udp_addr_allowed(netplay_t *netplay,
+   struct netplay_connection *connection,
+   const struct sockaddr_storage *addr)
+{
+   uint8_t host[16], expected[16];
+   size_t len = udp_addr_host(addr, host);
+
+   if (!len || udp_addr_host(&connection->udp_addr, expected) != len ||
+         memcmp(host, expected, len))
+      return false;
+
+   return netplay->is_server ||
+      udp_addr_port(addr) == udp_addr_port(&connection->udp_addr);
+}
+
+/**
+ * netplay_udp_init
+ *
+ * Open the server's UDP input socket on the port after the TCP port, or
+ * the one after that if LAN discovery is listening there.
+ */
+bool netplay_udp_init(netplay_t *netplay)
+{
+   char port_buf[16];
+   int fd                 = -1;
+   uint16_t port          = netplay->tcp_port + 1;
+   struct addrinfo *res   = NULL;
+   struct addrinfo hints  = {0};
+
+#ifdef HAVE_INET6
+   /* Serve IPv6 and IPv4, like the TCP socket */
+   hints.ai_family   = AF_INET6;
+#endif
+   hints.ai_socktype = SOCK_DGRAM;
+   hints.ai_flags    = AI_PASSIVE;
+
+   if (port == RARCH_DEFAULT_PORT)
+      port++;
+   snprintf(port_buf, sizeof(port_buf), "%hu", (unsigned short)port);
+   if (getaddrinfo_retro(NULL, port_buf, &hints, &res) < 0)
+   {
+#ifdef HAVE_INET6
+      hints.ai_family = 0;
+      if (getaddrinfo_retro(NULL, port_buf, &hints, &res) < 0)
+#endif
+         return false;
+   }
+
+   if (!res)
+      return false;
+
+   fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+   if (fd < 0)
+      goto error;
+
+#if defined(HAVE_INET6) && defined(IPPROTO_IPV6) && defined(IPV6_V6ONLY)
+   if (res->ai_family == AF_INET6)
+   {
+      int on = 0;
+      if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (void*)&on, sizeof(on)) < 0)
+         RARCH_WARN("Failed to listen on both IPv6 and IPv4\n");
+   }
+#endif
+
+   if (!socket_bind(fd, (void*)res) || !socket_nonblock(fd))
+      goto error;
+
+   if (!netplay_poller_add(netplay, fd, NETPLAY_POLLER_UDP))
+      goto error;
+
+   freeaddrinfo_retro(res);
+   netplay->udp_fd   = fd;
+   netplay->udp_port = port;
+   return true;
+
+error:
+   if (fd >= 0)
+      socket_close(fd);
+   freeaddrinfo_retro(res);
+   return false;
+}
+
+/**
+ * netplay_udp_connect
+ *
+ * Start exchanging input over UDP with the server, after it accepted our
+ * NETPLAY_CMD_UDP with the given token and port.
+ */
+bool netplay_udp_connect(netplay_t *netplay,
+   struct netplay_connection *connection, uint32_t token, uint16_t port)
+{
+   struct sockaddr_storage addr;
+   socklen_t addr_len = sizeof(addr);
+
+   /* The server is listening at the address we're connected to */
+   memset(&addr, 0, sizeof(addr));
+   if (getpeername(connection->fd, (struct sockaddr*)&addr, &addr_len) < 0)
+      return false;
+
+   switch (addr.ss_family)
+   {
+      case AF_INET:
+         ((struct sockaddr_in*)&addr)->sin_port = htons(port);
+         break;
+#ifdef HAVE_INET6
+      case AF_INET6:
+         ((struct sockaddr_in6*)&addr)->sin6_port = htons(port);
+         break;
+#endif
+      default:
+         return false;
+   }
+
+   if (netplay->udp_fd < 0)
+   {
+      int fd = socket(addr.ss_family, SOCK_DGRAM, 0);
+      if (fd < 0)
+         return false;
+      if (!socket_nonblock(fd) ||
+          !netplay_poller_add(netplay, fd, NETPLAY_POLLER_UDP))
+      {
+         socket_close(fd);
+         return false;
+      }
+      netplay->udp_fd = fd;
+   }
+
+   connection->udp_addr      = addr;
+   connection->udp_addr_len  = addr_len;
+   connection->udp_have_addr = true;
+   connection->udp_token     = token;
+   connection->udp_sync      = connection->send_packet_buffer.total;
+   connection->udp           = true;
+
+   RARCH_LOG("Netplay input is also being sent over UDP.\n");
+   return true;
+}
+
+/**
+ * netplay_udp_accept
+ *
+ * Start exchanging input over UDP with a client (server only). The client's
+ * port is learned from its first packet, which has to come from the host
+ * its TCP connection comes from.
+ *
+ * Returns false if the client can't be offered UDP.
+ */
+bool netplay_udp_accept(netplay_t *netplay,
+   struct netplay_connection *connection)
+{
+   size_t i;
+   socklen_t addr_len = sizeof(connection->udp_addr);
+
+   if (connection->udp)
+      return true;
+
+   memset(&connection->udp_addr, 0, sizeof(connection->udp_addr));
+   if (getpeername(connection->fd, (struct sockaddr*)&connection->udp_addr,
+            &addr_len) < 0)
+      return false;
+   connection->udp_addr_len = addr_len;
+
+   /* The token, along with the address check, keeps anyone off the path
+    * from taking over the connection's input */
+   do
+   {
+      if (!udp_random_token(&connection->udp_token))
+      {
+         RARCH_WARN("No random source for a netplay UDP token. "
+               "Using TCP only.\n");
+         return false;
+      }
+      for (i = 0; i < netplay->connections_size; i++)
+      {
+         struct netplay_connection *other = &netplay->connections[i];
+         if (other != connection && other->active && other->udp &&
+               other->udp_token == connection->udp_token)
+            break;
+      }
+   } while (i < netplay->connections_size);
+
+   connection->udp_have_addr = false;
+   connection->udp_sync      = connection->send_packet_buffer.total;
+   connection->udp           = true;
+   return true;
+}
+
+/* The next frame we need from the peer, to let it trim what it repeats */
+static uint32_t udp_ack(netplay_t *netplay,
+   struct netplay_connection *connection)
+{
+   if (!netplay->is_server)
+      return netplay->server_frame_count;
+   if (connection->mode == NETPLAY_CONNECTION_PLAYING)
+      return netplay->read_frame_count[connection->player];
+   return 0;
+}
+
+/**
+ * netplay_udp_send_cur_input
+ *
+ * Record the current input frame for the given connection and send it,
+ * along with any earlier frames the peer hasn't acknowledged.
+ */
+void netplay_udp_send_cur_input(netplay_t *netplay,
+   struct netplay_connection *connection)
+{
+   uint32_t packet[NETPLAY_UDP_PACKET_WORDS];
+   struct delta_frame *dframe = &netplay->buffer[netplay->self_ptr];
+   struct netplay_udp_frame *uframe = &connection->udp_frames[
+      netplay->self_frame_count % NETPLAY_UDP_REDUNDANT_FRAMES];
+   uint32_t frame, start, end;
+   uint32_t count = 0;
+   size_t len;
+
+   /* Record this frame the way we sent it over TCP */
+   uframe->frame = netplay->self_frame_count;
+   uframe->sync  = connection->udp_sync;
+   uframe->valid = true;
+   if (netplay->self_mode == NETPLAY_CONNECTION_PLAYING)
+   {
+      uframe->player = (netplay->is_server ? NETPLAY_CMD_INPUT_BIT_SERVER : 0) |
+         netplay->self_player;
+      memcpy(uframe->state, dframe->self_state, sizeof(uframe->state));
+   }
+   else if (netplay->is_server)
+      uframe->player = NETPLAY_UDP_NOINPUT;
+   else
+      uframe->valid = false;
+   connection->udp_frame_count = netplay->self_frame_count + 1;
+
+   if (!connection->udp_have_addr)
+      return;
+
+   /* Send everything the peer hasn't acknowledged, oldest first */
+   end   = connection->udp_frame_count;
+   start = end - NETPLAY_UDP_REDUNDANT_FRAMES;
+   if (end < NETPLAY_UDP_REDUNDANT_FRAMES)
+      start = 0;
+   if ((int32_t)(connection->udp_ack - start) > 0)
+      start = connection->udp_ack;
+
+   for (frame = start; (int32_t)(end - frame) > 0; frame++)
+   {
+      uint32_t *out;
+      uframe = &connection->udp_frames[frame % NETPLAY_UDP_REDUNDANT_FRAMES];
+      if (!uframe->valid || uframe->frame != frame)
+         continue;
+
+      out    = packet + NETPLAY_UDP_HEADER_WORDS +
+         count * NETPLAY_UDP_WORDS_PER_FRAME;
+      out[0] = htonl(uframe->frame);
+      out[1] = htonl(uframe->sync);
+      out[2] = htonl(uframe->player);
+      out[3] = htonl(uframe->state[0]);
+      out[4] = htonl(uframe->state[1]);
+      out[5] = htonl(uframe->state[2]);
+      count++;
+   }
+
+   packet[0] = htonl(NETPLAY_UDP_MAGIC);
+   packet[1] = htonl(connection->udp_token);
+   packet[2] = htonl(udp_ack(netplay, connection));
+   packet[3] = htonl(count);
+
+   len = (NETPLAY_UDP_HEADER_WORDS + count * NETPLAY_UDP_WORDS_PER_FRAME) *
+      sizeof(uint32_t);
+   netplay->stat_bytes_sent += len;
+   if (netplay->sim.enabled)
+      netplay_sim_sendto(netplay, netplay->udp_fd, packet, len,
+            &connection->udp_addr, connection->udp_addr_len);
+   else
+      udp_sendto(netplay->udp_fd, packet, len,
+            &connection->udp_addr, connection->udp_addr_len);
+}
+
+/* Apply the frames of one packet. Frames are applied strictly in order, and
+ * only once everything on the command stream that preceded them has been
+ * processed. Anything skipped will be repeated, or arrive over TCP. */
+static void udp_apply(netplay_t *netplay,
+   struct netplay_connection *connection, const uint32_t *frames,
+   uint32_t count, bool *had_input)
+{
+   uint32_t i;
+
+   for (i = 0; i < count; i++)
+   {
+      uint32_t state[WORDS_PER_INPUT];
+      uint32_t player;
+      const uint32_t *in = frames + i * NETPLAY_UDP_WORDS_PER_FRAME;
+      uint32_t frame     = ntohl(in[0]);
+      uint32_t sync      = ntohl(in[1]);
+      uint32_t pword     = ntohl(in[2]);
+
+      if ((int32_t)(connection->recv_packet_buffer.total - sync) < 0)
+         break;
+
+      if (netplay->is_server)
+      {
+         if (pword == NETPLAY_UDP_NOINPUT ||
+               connection->mode != NETPLAY_CONNECTION_PLAYING)
+            break;
+         player = connection->player;
+      }
+      else if (pword == NETPLAY_UDP_NOINPUT)
+      {
+         if (frame < netplay->server_frame_count)
+            continue;
+         if (frame > netplay->server_frame_count)
+            break;
+         netplay->server_ptr = NEXT_PTR(netplay->server_ptr);
+         netplay->server_frame_count++;
+         if (netplay->is_relay)
+            netplay_relay_forward_noinput(netplay, frame);
+         *had_input = true;
+         continue;
+      }
+      else if (!(pword & NETPLAY_CMD_INPUT_BIT_SERVER))
+         break;
+      else
+         player = pword & ~NETPLAY_CMD_INPUT_BIT_SERVER;
+
+      if (player >= MAX_USERS || !(netplay->connected_players & (1<<player)))
+         break;
+      if (frame < netplay->read_frame_count[player])
+         continue;
+      if (frame > netplay->read_frame_count[player])
+         break;
+
+      state[0] = ntohl(in[3]);
+      state[1] = ntohl(in[4]);
+      state[2] = ntohl(in[5]);
+      if (!netplay_record_input(netplay, connection, player,
+            !netplay->is_server, state))
+         break;
+
+      connection->udp_frames_first++;
+      *had_input = true;
+   }
+}
+
+/**
+ * netplay_udp_poll
+ *
+ * Read and apply all pending UDP input packets.
+ */
+void netplay_udp_poll(netplay_t *netplay, bool *had_input)
+{
+   uint32_t packet[NETPLAY_UDP_PACKET_WORDS];
+
+   if (!netplay->poller.udp_ready)
+      return;
+   netplay->poller.udp_ready = false;
+
+   for (;;)
+   {
+      struct sockaddr_storage addr;
+      socklen_t addr_len = sizeof(addr);
+      struct netplay_connection *connection = NULL;
+      uint32_t token, ack, count;
+      size_t i;
+      ssize_t len = recvfrom(netplay->udp_fd, (char*)packet, sizeof(packet),
+            0, (struct sockaddr*)&addr, &addr_len);
+
+      if (len < 0)
+         break;
+      netplay->stat_bytes_recv += len;
+
+      if (len < (ssize_t)(NETPLAY_UDP_HEADER_WORDS * sizeof(uint32_t)) ||
+            ntohl(packet[0]) != NETPLAY_UDP_MAGIC)
+         continue;
+
+      token = ntohl(packet[1]);
+      ack   = ntohl(packet[2]);
+      count = ntohl(packet[3]);
+      if (count > NETPLAY_UDP_REDUNDANT_FRAMES ||
+            (size_t)len != (NETPLAY_UDP_HEADER_WORDS +
+               count * NETPLAY_UDP_WORDS_PER_FRAME) * sizeof(uint32_t))
+         continue;
+
+      for (i = 0; i < netplay->connections_size; i++)
+      {
+         struct netplay_connection *c = &netplay->connections[i];
+         if (c->active && c->udp && c->udp_token == token &&
+               c->mode >= NETPLAY_CONNECTION_CONNECTED)
+         {
+            connection = c;
+            break;
+         }
+      }
+      if (!connection || !udp_addr_allowed(netplay, connection, &addr))
+         continue;
+
+      /* Reply to whichever port the client's packets come from */
+      if (netplay->is_server)
+      {
+         connection->udp_addr      = addr;
+         connection->udp_addr_len  = addr_len;
+         connection->udp_have_addr = true;
+      }
+
+      if ((int32_t)(ack - connection->udp_ack) > 0)
+         connection->udp_ack = ack;
+
+      udp_apply(netplay, connection, packet + NETPLAY_UDP_HEADER_WORDS,
+            count, had_input);
+   }
+}
+
+/**
+ * netplay_udp_deinit
+ *
+ * Close the UDP input socket.
+ */
+void netplay_udp_deinit(netplay_t *netplay)
+{
+   if (netplay->udp_fd >= 0)
+   {
+      netplay_poller_remove(netplay, netplay->udp_fd);
+      socket_close(netplay->udp_fd);
+   }
+   netplay->udp_fd = -1;
+}
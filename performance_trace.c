@@ -0,0 +1,335 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2017 - The RetroArch team
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include <compat/strl.h>
+#include <features/features_cpu.h>
+#include <retro_miscellaneous.h>
+
+#ifdef HAVE_THREADS
+#include <rthreads/rthreads.h>
+#endif
+
+#include "performance_trace.h"
+
+#include "verbosity.h"
+
+/* Events kept per thread. Must be a power of two. At around twenty
+ * events a frame, this is the last minute or so. */
+#define TRACE_RING_SIZE    65536
+#define TRACE_RING_MASK    (TRACE_RING_SIZE - 1)
+#define TRACE_MAX_THREADS  16
+
+#if defined(__GNUC__)
+#define TRACE_BARRIER() __sync_synchronize()
+#elif defined(_MSC_VER)
+#define TRACE_BARRIER() _ReadWriteBarrier()
+#else
+#define TRACE_BARRIER()
+#endif
+
+typedef struct trace_event
+{
+   const char *name;
+   retro_time_t ts;
+   char phase;
+} trace_event_t;
+
+/* Only the thread that owns a ring writes to it. Readers copy it
+ * without stopping the writer, and drop whatever it may have
+ * overwritten in the meantime. */
+typedef struct trace_ring
+{
+   trace_event_t events[TRACE_RING_SIZE];
+   volatile unsigned head;
+   unsigned tid;
+   char name[32];
+} trace_ring_t;
+
+bool performance_trace_enabled;
+
+static trace_ring_t *trace_rings[TRACE_MAX_THREADS];
+static volatile unsigned trace_rings_count;
+static retro_time_t trace_start;
+static char trace_path[PATH_MAX_LENGTH];
+
+#ifdef HAVE_THREADS
+static slock_t *trace_lock;
+#ifdef HAVE_THREAD_STORAGE
+static sthread_tls_t trace_tls;
+#endif
+#endif
+
+static trace_ring_t *performance_trace_ring_new(void)
+{
+   trace_ring_t *ring = NULL;
+
+   if (trace_rings_count >= TRACE_MAX_THREADS)
+      return NULL;
+
+   ring = (trace_ring_t*)calloc(1, sizeof(*ring));
+   if (!ring)
+      return NULL;
+
+   ring->tid = trace_rings_count + 1;
+   snprintf(ring->name, sizeof(ring->name), "thread %u", ring->tid);
+
+   trace_rings[trace_rings_count] = ring;
+   TRACE_BARRIER();
+   trace_rings_count++;
+   return ring;
+}
+
+static trace_ring_t *performance_trace_ring(void)
+{
+#if defined(HAVE_THREADS) && defined(HAVE_THREAD_STORAGE)
+   trace_ring_t *ring = (trace_ring_t*)sthread_tls_get(&trace_tls);
+
+   if (ring)
+      return ring;
+
+   slock_lock(trace_lock);
+   ring = performance_trace_ring_new();
+   slock_unlock(trace_lock);
+
+   /* Don't try again on every event once we're out of rings. */
+   sthread_tls_set(&trace_tls, ring);
+   return ring;
+#else
+   /* Without thread local storage, every thread shares one ring,
+    * and performance_trace_event() serializes them. */
+   if (!trace_rings_count)
+      return performance_trace_ring_new();
+   return trace_rings[0];
+#endif
+}
+
+void performance_trace_event(const char *name, char phase)
+{
+   trace_event_t *event = NULL;
+   trace_ring_t *ring   = NULL;
+   unsigned head;
+
+#if defined(HAVE_THREADS) && !defined(HAVE_THREAD_STORAGE)
+   slock_lock(trace_lock);
+#endif
+
+   ring = performance_trace_ring();
+   if (!ring)
+      goto end;
+
+   head          = ring->head;
+   event         = &ring->events[head & TRACE_RING_MASK];
+   event->name   = name;
+   event->ts     = cpu_features_get_time_usec();
+   event->phase  = phase;
+
+   /* Publish the event only once it's all there. */
+   TRACE_BARRIER();
+   ring->head    = head + 1;
+
+end:
+#if defined(HAVE_THREADS) && !defined(HAVE_THREAD_STORAGE)
+   slock_unlock(trace_lock);
+#endif
+   return;
+}
+
+void performance_trace_thread_name(const char *name)
+{
+   trace_ring_t *ring = NULL;
+
+   if (!performance_trace_enabled)
+      return;
+
+#if defined(HAVE_THREADS) && !defined(HAVE_THREAD_STORAGE)
+   /* The ring isn't this thread's alone, so it keeps its first name. */
+   slock_lock(trace_lock);
+   if (!trace_rings_count && (ring = performance_trace_ring()))
+      strlcpy(ring->name, name, sizeof(ring->name));
+   slock_unlock(trace_lock);
+#else
+   ring = performance_trace_ring();
+   if (ring)
+      strlcpy(ring->name, name, sizeof(ring->name));
+#endif
+}
+
+/**
+ * performance_trace_copy:
+ * @ring               : ring to copy.
+ * @events             : TRACE_RING_SIZE events to copy into.
+ *
+ * Copies the events in @ring that are still there once the copy is
+ * done, oldest first.
+ *
+ * Returns: the number of events copied.
+ **/
+static unsigned performance_trace_copy(trace_ring_t *ring,
+      trace_event_t *events)
+{
+   unsigned i, first, last, valid;
+   unsigned head = ring->head;
+
+   TRACE_BARRIER();
+
+   first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+   for (i = first; i != head; i++)
+      events[i - first] = ring->events[i & TRACE_RING_MASK];
+
+   TRACE_BARRIER();
+
+   /* The writer may have gone on to write up to and including event
+    * 'last', each overwriting the event TRACE_RING_SIZE before it. */
+   last  = ring->head;
+   valid = last >= TRACE_RING_SIZE ? last - TRACE_RING_SIZE + 1 : 0;
+
+   if (valid <= first)
+      return head - first;
+   if (valid >= head)
+      return 0;
+
+   memmove(events, events + (valid - first),
+         (head - valid) * sizeof(*events));
+   return head - valid;
+}
+
+bool performance_trace_dump(const char *path)
+{
+   unsigned i, j;
+   unsigned count       = 0;
+   unsigned total       = 0;
+   bool first           = true;
+   trace_event_t *events = NULL;
+   FILE *file           = NULL;
+
+   if (!trace_rings_count || !path || !*path)
+      return false;
+
+   events = (trace_event_t*)malloc(TRACE_RING_SIZE * sizeof(*events));
+   if (!events)
+      return false;
+
+   file = fopen(path, "w");
+   if (!file)
+   {
+      RARCH_ERR("[TRACE]: Failed to open \"%s\" for writing.\n", path);
+      free(events);
+      return false;
+   }
+
+   count = trace_rings_count;
+   TRACE_BARRIER();
+
+   fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+
+   for (i = 0; i < count; i++)
+   {
+      trace_ring_t *ring = trace_rings[i];
+      unsigned size      = performance_trace_copy(ring, events);
+
+      fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", ring->tid, ring->name);
+      first = false;
+
+      for (j = 0; j < size; j++)
+      {
+         trace_event_t *event = &events[j];
+         retro_time_t ts      = event->ts - trace_start;
+
+         if (ts < 0)
+            continue;
+
+         fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,"
+               "\"tid\":%u,\"ts\":%llu}",
+               event->name, event->phase, ring->tid,
+               (unsigned long long)ts);
+      }
+
+      total += size;
+   }
+
+   fputs("\n]}\n", file);
+   fclose(file);
+   free(events);
+
+   RARCH_LOG("[TRACE]: Wrote %u events from %u threads to \"%s\".\n",
+         total, count, path);
+   return true;
+}
+
+void performance_trace_init(const char *path)
+{
+   if (performance_trace_enabled || !path || !*path)
+      return;
+
+#ifdef HAVE_THREADS
+   trace_lock = slock_new();
+   if (!trace_lock)
+      return;
+#ifdef HAVE_THREAD_STORAGE
+   if (!sthread_tls_create(&trace_tls))
+   {
+      slock_free(trace_lock);
+      trace_lock = NULL;
+      return;
+   }
+#endif
+#endif
+
+   strlcpy(trace_path, path, sizeof(trace_path));
+   trace_start               = cpu_features_get_time_usec();
+   performance_trace_enabled = true;
+
+   performance_trace_thread_name("main");
+
+   RARCH_LOG("[TRACE]: Tracing to \"%s\".\n", trace_path);
+}
+
+void performance_trace_deinit(void)
+{
+   unsigned i;
+
+   if (!performance_trace_enabled)
+      return;
+
+   performance_trace_dump(trace_path);
+   performance_trace_enabled = false;
+
+   for (i = 0; i < trace_rings_count; i++)
+   {
+      free(trace_rings[i]);
+      trace_rings[i] = NULL;
+   }
+   trace_rings_count = 0;
+
+#ifdef HAVE_THREADS
+#ifdef HAVE_THREAD_STORAGE
+   sthread_tls_delete(&trace_tls);
+#endif
+   slock_free(trace_lock);
+   trace_lock = NULL;
+#endif
+
+   trace_path[0] = '\0';
+}
@@ -0,0 +1,87 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2017 - The RetroArch team
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PERFORMANCE_TRACE_H
+#define _PERFORMANCE_TRACE_H
+
+#include <boolean.h>
+
+#include <retro_common_api.h>
+
+RETRO_BEGIN_DECLS
+
+extern bool performance_trace_enabled;
+
+/**
+ * performance_trace_init:
+ * @path               : where to write the trace at exit.
+ *
+ * Starts tracing, if @path is set.
+ **/
+void performance_trace_init(const char *path);
+
+/**
+ * performance_trace_deinit:
+ *
+ * Writes the trace to the path given to performance_trace_init(),
+ * and stops tracing.
+ **/
+void performance_trace_deinit(void);
+
+/**
+ * performance_trace_dump:
+ * @path               : file to write.
+ *
+ * Writes what has been traced so far as Chrome trace event JSON,
+ * which chrome://tracing and Perfetto can open.
+ *
+ * Returns: true on success, otherwise false.
+ **/
+bool performance_trace_dump(const char *path);
+
+/**
+ * performance_trace_thread_name:
+ * @name               : name to show for the calling thread.
+ **/
+void performance_trace_thread_name(const char *name);
+
+void performance_trace_event(const char *name, char phase);
+
+/**
+ * performance_trace_begin:
+ * @name               : static string naming the stage.
+ *
+ * Marks the start of a stage on the calling thread. Stages nest, and
+ * each must be closed by performance_trace_end() with the same name.
+ **/
+#define performance_trace_begin(name) do { \
+   if (performance_trace_enabled) \
+      performance_trace_event(name, 'B'); \
+} while (0)
+
+/**
+ * performance_trace_end:
+ * @name               : static string naming the stage.
+ *
+ * Marks the end of a stage on the calling thread.
+ **/
+#define performance_trace_end(name) do { \
+   if (performance_trace_enabled) \
+      performance_trace_event(name, 'E'); \
+} while (0)
+
+RETRO_END_DECLS
+
+#endif
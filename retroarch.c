@@ -62,6 +62,7 @@
 #endif
 
 #include "config.features.h"
+#include "benchmark.h"
 #include "content.h"
 #include "core_type.h"
 #include "core_info.h"
@@ -73,6 +74,7 @@
 #include "dirs.h"
 #include "paths.h"
 #include "file_path_special.h"
+#include "performance_trace.h"
 #include "verbosity.h"
 
 #include "frontend/frontend_driver.h"
@@ -122,7 +124,10 @@ enum
    RA_OPT_VERSION,
    RA_OPT_EOF_EXIT,
    RA_OPT_LOG_FILE,
-   RA_OPT_MAX_FRAMES
+   RA_OPT_MAX_FRAMES,
+   RA_OPT_BENCHMARK,
+   RA_OPT_NETPLAY_RECORD,
+   RA_OPT_NETPLAY_BISECT
 };
 
 static jmp_buf error_sjlj_context;
@@ -345,6 +350,14 @@ static void retroarch_print_help(const char *arg0)
    puts("                        (requires a very fast network).");
    puts("      --check-frames=NUMBER\n"
         "                        Check frames when using netplay.");
+   puts("      --netplay-record=FILE\n"
+        "                        Record netplay input and CRCs to FILE, "
+        "for finding desyncs.");
+   puts("      --netplay-bisect=FILE1|FILE2\n"
+        "                        Replay two peers' netplay recordings "
+        "against the content,\n"
+        "                        report the first frame where they "
+        "diverge, and exit.");
 #if defined(HAVE_NETWORK_CMD)
    puts("      --command         Sends a command over UDP to an already "
          "running program process.");
@@ -371,7 +384,13 @@ static void retroarch_print_help(const char *arg0)
          "Not relevant for all platforms.");
    puts("      --max-frames=NUMBER\n"
         "                        Runs for the specified number of frames, "
-        "then exits.\n");
+        "then exits.");
+   printf("      --benchmark=FILE  Runs without video, audio or input as fast as "
+        "possible\n"
+        "                        for --max-frames frames (default %u), then "
+        "writes\n"
+        "                        a JSON report of the timings to FILE.\n\n",
+        BENCHMARK_DEFAULT_FRAMES);
 }
 
 #define FFMPEG_RECORD_ARG "r:"
@@ -402,6 +421,7 @@ static void retroarch_parse_input(int argc, char *argv[])
 {
    const char *optstring = NULL;
    bool explicit_menu    = false;
+   bool has_max_frames   = false;
    global_t  *global     = global_get_ptr();
 
    const struct option opts[] = {
@@ -431,6 +451,8 @@ static void retroarch_parse_input(int argc, char *argv[])
       { "stateless",    0, NULL, RA_OPT_STATELESS },
       { "check-frames", 1, NULL, RA_OPT_CHECK_FRAMES },
       { "port",         1, NULL, RA_OPT_PORT },
+      { "netplay-record", 1, NULL, RA_OPT_NETPLAY_RECORD },
+      { "netplay-bisect", 1, NULL, RA_OPT_NETPLAY_BISECT },
 #if defined(HAVE_NETWORK_CMD)
       { "command",      1, NULL, RA_OPT_COMMAND },
 #endif
@@ -444,6 +466,7 @@ static void retroarch_parse_input(int argc, char *argv[])
       { "features",     0, NULL, RA_OPT_FEATURES },
       { "subsystem",    1, NULL, RA_OPT_SUBSYSTEM },
       { "max-frames",   1, NULL, RA_OPT_MAX_FRAMES },
+      { "benchmark",    1, NULL, RA_OPT_BENCHMARK },
       { "eof-exit",     0, NULL, RA_OPT_EOF_EXIT },
       { "version",      0, NULL, RA_OPT_VERSION },
 #ifdef HAVE_FILE_LOGGER
@@ -740,6 +763,16 @@ static void retroarch_parse_input(int argc, char *argv[])
             }
             break;
 
+         case RA_OPT_NETPLAY_RECORD:
+            strlcpy(global->netplay.record_path, optarg,
+                  sizeof(global->netplay.record_path));
+            break;
+
+         case RA_OPT_NETPLAY_BISECT:
+            strlcpy(global->netplay.bisect_paths, optarg,
+                  sizeof(global->netplay.bisect_paths));
+            break;
+
 #if defined(HAVE_NETWORK_CMD)
          case RA_OPT_COMMAND:
 #ifdef HAVE_COMMAND
@@ -819,9 +852,14 @@ static void retroarch_parse_input(int argc, char *argv[])
             {
                unsigned max_frames = strtoul(optarg, NULL, 10);
                runloop_ctl(RUNLOOP_CTL_SET_MAX_FRAMES, &max_frames);
+               has_max_frames = true;
             }
             break;
 
+         case RA_OPT_BENCHMARK:
+            benchmark_init(optarg);
+            break;
+
          case RA_OPT_SUBSYSTEM:
             path_set(RARCH_PATH_SUBSYSTEM, optarg);
             break;
@@ -878,6 +916,12 @@ static void retroarch_parse_input(int argc, char *argv[])
 #endif
    }
 
+   if (benchmark_is_enabled() && !has_max_frames)
+   {
+      unsigned max_frames = BENCHMARK_DEFAULT_FRAMES;
+      runloop_ctl(RUNLOOP_CTL_SET_MAX_FRAMES, &max_frames);
+   }
+
    if (path_is_empty(RARCH_PATH_SUBSYSTEM) && optind < argc)
    {
       /* We requested explicit ROM, so use PLAIN core type. */
@@ -1061,6 +1105,9 @@ bool retroarch_main_init(int argc, char *argv[])
    retroarch_validate_cpu_features();
    config_load();
 
+   benchmark_override_settings();
+   performance_trace_init(config_get_ptr()->path.perf_trace);
+
    runloop_ctl(RUNLOOP_CTL_TASK_INIT, NULL);
 
    retroarch_main_init_media();
@@ -1112,6 +1159,27 @@ bool retroarch_main_init(int argc, char *argv[])
    rarch_ctl(RARCH_CTL_UNSET_ERROR_ON_INIT, NULL);
    rarch_ctl(RARCH_CTL_SET_INITED, NULL);
 
+#ifdef HAVE_NETWORKING
+   {
+      global_t *global = global_get_ptr();
+      if (!string_is_empty(global->netplay.bisect_paths))
+      {
+         /* Replay the recordings against the content just loaded, then quit */
+         char *path_b = strchr(global->netplay.bisect_paths, '|');
+         bool ret     = false;
+
+         if (path_b)
+         {
+            *path_b++ = '\0';
+            ret = netplay_bisect(global->netplay.bisect_paths, path_b);
+         }
+         else
+            RARCH_ERR("--netplay-bisect needs two recordings, separated by '|'.\n");
+         exit(ret ? 0 : 1);
+      }
+   }
+#endif
+
    return true;
 
 error:
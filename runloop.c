@@ -18,8 +18,15 @@
  */
 
 #include <stdarg.h>
+#include <stdlib.h>
 #include <math.h>
 
+#if defined(__linux__) || defined(__FreeBSD__)
+#include <time.h>
+#include <errno.h>
+#define HAVE_CLOCK_NANOSLEEP
+#endif
+
 #include <compat/strl.h>
 #include <retro_assert.h>
 #include <file/file_path.h>
@@ -56,6 +63,7 @@
 #endif
 
 #include "autosave.h"
+#include "benchmark.h"
 #include "configuration.h"
 #include "driver.h"
 #include "movie.h"
@@ -67,6 +75,10 @@
 #include "managers/core_option_manager.h"
 #include "managers/cheat_manager.h"
 #include "managers/state_manager.h"
+#include "managers/runahead.h"
+#ifdef HAVE_THREADS
+#include "managers/core_thread.h"
+#endif
 #include "list_special.h"
 #include "audio/audio_driver.h"
 #include "camera/camera_driver.h"
@@ -79,6 +91,7 @@
 
 #include "input/input_keyboard.h"
 #include "tasks/tasks_internal.h"
+#include "performance_trace.h"
 #include "verbosity.h"
 
 #ifdef HAVE_ZLIB
@@ -108,6 +121,66 @@ typedef struct runloop_ctx_msg_info
    bool flush;
 } runloop_ctx_msg_info_t;
 
+/* Automatic frame delay. Frames are timed from just before the core runs
+ * until the frame is handed to the video driver, plus the least time the
+ * video driver took over a frame lately (the rest is waiting on VSync).
+ * The delay is whatever leaves the 95th percentile of that time, and a
+ * little spare, inside a refresh. */
+#define FRAME_DELAY_SAMPLES         128
+#define FRAME_DELAY_UPDATE_INTERVAL 16
+/* Kept spare for the scheduler waking us late, in usec */
+#define FRAME_DELAY_MARGIN          1000
+/* At most one more ms of delay per this many frames */
+#define FRAME_DELAY_RAISE_FRAMES    60
+/* After a missed frame, the delay stays below where it was until this many
+ * frames went by without another */
+#define FRAME_DELAY_RECOVER_FRAMES  600
+
+typedef struct runloop_frame_delay
+{
+   bool inited;
+   unsigned delay;
+   unsigned ceiling;
+   unsigned misses;
+   unsigned since_raise;
+   unsigned since_miss;
+   unsigned count;
+   retro_time_t last_start;
+   retro_time_t work[FRAME_DELAY_SAMPLES];
+   retro_time_t submit[FRAME_DELAY_SAMPLES];
+} runloop_frame_delay_t;
+
+/* Precise frame limiter. Sleeps until a little before each deadline, by
+ * as much as the sleeps lately overslept, and spins the rest of the way.
+ * Deadlines are kept as an exact multiple of the frame period from where
+ * the limiter started, so nothing is lost to rounding from frame to frame. */
+#define FRAME_LIMITER_SPIN_MIN    50
+#define FRAME_LIMITER_SPIN_MAX    2000
+#define FRAME_LIMITER_REPORT_USEC 10000000
+
+typedef struct runloop_frame_limiter
+{
+   retro_time_t start;
+   uint64_t frame;
+   retro_time_t spin;
+
+   /* Since the last report */
+   retro_time_t report_start;
+   uint64_t report_frame;
+   retro_time_t overshoot_sum;
+   retro_time_t overshoot_max;
+   unsigned late;
+} runloop_frame_limiter_t;
+
+/* Frameskip while fast forwarding. Frames are shown either every
+ * fastforward_frameskip_interval frames, or, when that's 0, once per
+ * display refresh. */
+typedef struct runloop_frameskip
+{
+   unsigned frame;
+   retro_time_t next_present;
+} runloop_frameskip_t;
+
 static rarch_system_info_t runloop_system;
 static struct retro_frame_time_callback runloop_frame_time;
 static retro_keyboard_event_t runloop_key_event            = NULL;
@@ -133,6 +206,10 @@ static bool runloop_game_options_active                    = false;
 static bool runloop_missing_bios                           = false;
 static retro_time_t frame_limit_minimum_time               = 0.0;
 static retro_time_t frame_limit_last_time                  = 0.0;
+static double frame_limit_period                           = 0.0;
+static runloop_frame_delay_t runloop_frame_delay;
+static runloop_frame_limiter_t runloop_frame_limiter;
+static runloop_frameskip_t runloop_frameskip;
 
 global_t *global_get_ptr(void)
 {
@@ -177,6 +254,360 @@ void runloop_msg_queue_push(const char *msg,
 #endif
 }
 
+static int runloop_frame_delay_compare(const void *a, const void *b)
+{
+   retro_time_t x = *(const retro_time_t*)a;
+   retro_time_t y = *(const retro_time_t*)b;
+   return (x > y) - (x < y);
+}
+
+static unsigned runloop_frame_delay_max(settings_t *settings)
+{
+   /* A fixed delay, if there is one, is as far as it goes */
+   return settings->video.frame_delay ? settings->video.frame_delay : 15;
+}
+
+/* The delay that fits what recent frames took */
+static unsigned runloop_frame_delay_target(retro_time_t period)
+{
+   unsigned i;
+   retro_time_t sorted[FRAME_DELAY_SAMPLES];
+   retro_time_t submit = runloop_frame_delay.submit[0];
+   retro_time_t spare;
+
+   memcpy(sorted, runloop_frame_delay.work, sizeof(sorted));
+   qsort(sorted, FRAME_DELAY_SAMPLES, sizeof(*sorted),
+         runloop_frame_delay_compare);
+
+   for (i = 1; i < FRAME_DELAY_SAMPLES; i++)
+      if (runloop_frame_delay.submit[i] < submit)
+         submit = runloop_frame_delay.submit[i];
+
+   spare = period - sorted[FRAME_DELAY_SAMPLES * 95 / 100]
+      - submit - FRAME_DELAY_MARGIN;
+   return spare > 0 ? (unsigned)(spare / 1000) : 0;
+}
+
+static void runloop_frame_delay_set(unsigned delay)
+{
+   runloop_frame_delay.delay       = delay;
+   runloop_frame_delay.since_raise = 0;
+   RARCH_LOG("Frame delay: %u ms (%u missed frames).\n",
+         delay, runloop_frame_delay.misses);
+}
+
+/**
+ * runloop_frame_delay_update:
+ * @start                : when the frame began, before any delay.
+ * @run_start            : when the core began running.
+ * @run_end              : when the core was done.
+ *
+ * Learns from a frame, and picks the delay for the coming ones.
+ **/
+static void runloop_frame_delay_update(settings_t *settings,
+      retro_time_t start, retro_time_t run_start, retro_time_t run_end)
+{
+   retro_time_t video_start, video_end;
+   retro_time_t period;
+   unsigned max    = runloop_frame_delay_max(settings);
+   unsigned i      = runloop_frame_delay.count++ % FRAME_DELAY_SAMPLES;
+
+   if (settings->video.refresh_rate <= 0.0f)
+      return;
+   period = (retro_time_t)(1000000.0f / settings->video.refresh_rate);
+
+   if (!runloop_frame_delay.inited)
+   {
+      runloop_frame_delay.ceiling = max;
+      runloop_frame_delay.inited  = true;
+   }
+
+   video_driver_get_frame_times(&video_start, &video_end);
+   if (video_start >= run_start && video_start <= run_end)
+   {
+      runloop_frame_delay.work[i]   = video_start - run_start;
+      runloop_frame_delay.submit[i] = video_end   - video_start;
+   }
+   else
+   {
+      /* Nothing was shown */
+      runloop_frame_delay.work[i]   = run_end - run_start;
+      runloop_frame_delay.submit[i] = 0;
+   }
+
+   /* A frame that took half a refresh too long missed its deadline.
+    * Much longer, and we were paused or in the menu. */
+   if (runloop_frame_delay.last_start)
+   {
+      retro_time_t interval = start - runloop_frame_delay.last_start;
+
+      if (interval > period * 3 / 2 && interval < 250000)
+      {
+         runloop_frame_delay.misses++;
+         runloop_frame_delay.since_miss = 0;
+         if (runloop_frame_delay.delay)
+         {
+            runloop_frame_delay.ceiling = runloop_frame_delay.delay - 1;
+            runloop_frame_delay_set(runloop_frame_delay.ceiling);
+         }
+      }
+   }
+   runloop_frame_delay.last_start = start;
+
+   runloop_frame_delay.since_raise++;
+   if (++runloop_frame_delay.since_miss >= FRAME_DELAY_RECOVER_FRAMES)
+   {
+      if (runloop_frame_delay.ceiling < max)
+         runloop_frame_delay.ceiling++;
+      runloop_frame_delay.since_miss = 0;
+   }
+   if (runloop_frame_delay.ceiling > max)
+      runloop_frame_delay.ceiling = max;
+
+   if (runloop_frame_delay.count < FRAME_DELAY_SAMPLES ||
+         runloop_frame_delay.count % FRAME_DELAY_UPDATE_INTERVAL)
+      return;
+
+   {
+      unsigned target = runloop_frame_delay_target(period);
+      if (target > runloop_frame_delay.ceiling)
+         target = runloop_frame_delay.ceiling;
+
+      /* Back off at once, but creep up */
+      if (target < runloop_frame_delay.delay)
+         runloop_frame_delay_set(target);
+      else if (target > runloop_frame_delay.delay &&
+            runloop_frame_delay.since_raise >= FRAME_DELAY_RAISE_FRAMES)
+         runloop_frame_delay_set(runloop_frame_delay.delay + 1);
+   }
+}
+
+/* Sleep until the given time, or just before it */
+static void runloop_sleep_until(retro_time_t until)
+{
+#ifdef HAVE_CLOCK_NANOSLEEP
+   /* cpu_features_get_time_usec() is CLOCK_MONOTONIC here */
+   struct timespec ts;
+   ts.tv_sec  = (time_t)(until / 1000000);
+   ts.tv_nsec = (long)(until % 1000000) * 1000;
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#else
+   retro_time_t now = cpu_features_get_time_usec();
+   if (until - now >= 1000)
+      retro_sleep((unsigned)((until - now) / 1000));
+#endif
+}
+
+static void runloop_frame_limiter_report(retro_time_t now)
+{
+   runloop_frame_limiter_t *limiter = &runloop_frame_limiter;
+   uint64_t frames  = limiter->frame - limiter->report_frame;
+   retro_time_t elapsed = now - limiter->report_start;
+   double target, actual;
+
+   if (!frames || !elapsed)
+      return;
+
+   target = 1000000.0 / frame_limit_period;
+   actual = frames * 1000000.0 / elapsed;
+
+   RARCH_LOG("Frame limiter: %.4f Hz (target %.4f Hz, drift %+.0f ppm), "
+         "overshoot %u usec avg, %u usec max, %u late frames, spinning %u usec.\n",
+         actual, target, (actual / target - 1.0) * 1000000.0,
+         (unsigned)(limiter->overshoot_sum / frames),
+         (unsigned)limiter->overshoot_max, limiter->late,
+         (unsigned)limiter->spin);
+
+   limiter->report_start  = now;
+   limiter->report_frame  = limiter->frame;
+   limiter->overshoot_sum = 0;
+   limiter->overshoot_max = 0;
+   limiter->late          = 0;
+}
+
+/**
+ * runloop_frame_limiter_restart:
+ *
+ * Starts counting frames, and the report, afresh from @now.
+ **/
+static void runloop_frame_limiter_restart(retro_time_t now)
+{
+   runloop_frame_limiter_t *limiter = &runloop_frame_limiter;
+
+   limiter->start         = now;
+   limiter->frame         = 0;
+   limiter->report_start  = now;
+   limiter->report_frame  = 0;
+   limiter->overshoot_sum = 0;
+   limiter->overshoot_max = 0;
+   limiter->late          = 0;
+}
+
+/**
+ * runloop_frame_limiter_wait:
+ *
+ * Waits for the end of the current frame's time slot.
+ **/
+static void runloop_frame_limiter_wait(void)
+{
+   runloop_frame_limiter_t *limiter = &runloop_frame_limiter;
+   retro_time_t now = cpu_features_get_time_usec();
+   retro_time_t deadline, wake, woke, overshoot;
+
+   if (frame_limit_period <= 0.0)
+      return;
+
+   if (!limiter->start)
+   {
+      runloop_frame_limiter_restart(now);
+      if (!limiter->spin)
+         limiter->spin      = FRAME_LIMITER_SPIN_MIN;
+   }
+
+   limiter->frame++;
+   deadline = limiter->start +
+      (retro_time_t)(limiter->frame * frame_limit_period);
+
+   if (now >= deadline)
+   {
+      limiter->late++;
+      /* More than a frame behind, e.g. after loading. Don't rush to catch
+       * up; start counting from here. */
+      if (now - deadline > frame_limit_period)
+      {
+         runloop_frame_limiter_report(now);
+         runloop_frame_limiter_restart(now);
+      }
+      return;
+   }
+
+   wake = deadline - limiter->spin;
+   if (wake > now)
+   {
+      runloop_sleep_until(wake);
+      woke = cpu_features_get_time_usec();
+
+      /* Spin for at least as long as sleeps overshoot, and slowly less
+       * when they stop overshooting that much */
+      if (woke > wake + limiter->spin / 2)
+         limiter->spin = (woke - wake) * 2;
+      else
+         limiter->spin -= limiter->spin / 64;
+      if (limiter->spin < FRAME_LIMITER_SPIN_MIN)
+         limiter->spin = FRAME_LIMITER_SPIN_MIN;
+      if (limiter->spin > FRAME_LIMITER_SPIN_MAX)
+         limiter->spin = FRAME_LIMITER_SPIN_MAX;
+   }
+
+   do
+   {
+      now = cpu_features_get_time_usec();
+   } while (now < deadline);
+
+   overshoot = now - deadline;
+   limiter->overshoot_sum += overshoot;
+   if (overshoot > limiter->overshoot_max)
+      limiter->overshoot_max = overshoot;
+
+   if (now - limiter->report_start >= FRAME_LIMITER_REPORT_USEC)
+      runloop_frame_limiter_report(now);
+}
+
+/**
+ * runloop_frameskip_skip:
+ *
+ * Decides whether the frame about to be run while fast forwarding
+ * goes unseen and unheard.
+ *
+ * Returns: true if the frame should be skipped.
+ **/
+static bool runloop_frameskip_skip(settings_t *settings)
+{
+   retro_time_t now, period;
+   runloop_frameskip_t *skip = &runloop_frameskip;
+
+   /* Every frame is needed for these */
+   if (recording_data || state_manager_frame_is_reversed())
+      return false;
+#ifdef HAVE_NETWORKING
+   if (netplay_driver_ctl(RARCH_NETPLAY_CTL_IS_DATA_INITED, NULL))
+      return false;
+#endif
+
+   if (settings->fastforward_frameskip_interval)
+      return (skip->frame++ % settings->fastforward_frameskip_interval) != 0;
+
+   if (settings->video.refresh_rate <= 0.0f)
+      return false;
+
+   now = cpu_features_get_time_usec();
+   if (now < skip->next_present)
+      return true;
+
+   /* Keep in step with the display, unless we've fallen behind it */
+   period             = (retro_time_t)(1000000.0f / settings->video.refresh_rate);
+   skip->next_present += period;
+   if (skip->next_present <= now)
+      skip->next_present = now + period;
+   return false;
+}
+
+/**
+ * runloop_core_run:
+ *
+ * Runs the core for a frame, on its own thread if that's enabled,
+ * otherwise with run-ahead (which does nothing extra when disabled).
+ **/
+static void runloop_core_run(void)
+{
+#ifdef HAVE_THREADS
+   if (core_thread_run())
+      return;
+#endif
+   runahead_run();
+}
+
+/**
+ * runloop_frameskip_run:
+ *
+ * Runs the core for a frame without passing its video or audio on,
+ * so none of it gets filtered, converted, resampled or uploaded.
+ **/
+static void runloop_frameskip_run(void)
+{
+   core_set_output_callbacks(false, false);
+   core_run();
+   core_set_output_callbacks(true, true);
+
+   /* A second run-ahead instance didn't see this frame */
+   runahead_invalidate();
+}
+
+/**
+ * runloop_get_frame_delay:
+ * @delay                : milliseconds waited after VSync before
+ *                         running the core.
+ * @misses               : frames that missed their deadline since
+ *                         the content was loaded.
+ *
+ * Returns: true if the frame delay is chosen automatically.
+ **/
+bool runloop_get_frame_delay(unsigned *delay, unsigned *misses)
+{
+   settings_t *settings = config_get_ptr();
+
+   if (!settings->video.frame_delay_auto)
+   {
+      *delay  = settings->video.frame_delay;
+      *misses = 0;
+      return false;
+   }
+
+   *delay  = runloop_frame_delay.delay;
+   *misses = runloop_frame_delay.misses;
+   return true;
+}
+
 /**
  * rarch_game_specific_options:
  *
@@ -330,6 +761,9 @@ bool runloop_ctl(enum runloop_ctl_state state, void *data)
             frame_limit_last_time    = cpu_features_get_time_usec();
             frame_limit_minimum_time = (retro_time_t)roundf(1000000.0f
                   / (av_info->timing.fps * fastforward_ratio));
+            frame_limit_period       = 1000000.0
+                  / (av_info->timing.fps * fastforward_ratio);
+            runloop_frame_limiter.start = 0;
          }
          break;
       case RUNLOOP_CTL_GET_PERFCNT:
@@ -399,6 +833,7 @@ bool runloop_ctl(enum runloop_ctl_state state, void *data)
          runloop_paused                    = false;
          runloop_slowmotion                = false;
          runloop_overrides_active          = false;
+         memset(&runloop_frame_delay, 0, sizeof(runloop_frame_delay));
          runloop_ctl(RUNLOOP_CTL_FRAME_TIME_FREE, NULL);
          break;
       case RUNLOOP_CTL_GLOBAL_FREE:
@@ -1114,6 +1549,7 @@ int runloop_iterate(unsigned *sleep_ms)
    {
       case RUNLOOP_STATE_QUIT:
          frame_limit_last_time = 0.0;
+         runloop_frame_limiter.start = 0;
          command_event(CMD_EVENT_QUIT, NULL);
          return -1;
       case RUNLOOP_STATE_SLEEP:
@@ -1154,10 +1590,39 @@ int runloop_iterate(unsigned *sleep_ms)
       input_push_analog_dpad(auto_binds,    dpad_mode);
    }
 
-   if ((settings->video.frame_delay > 0) && !input_driver_is_nonblock)
-      retro_sleep(settings->video.frame_delay);
+   if (settings->video.frame_delay_auto && !input_driver_is_nonblock)
+   {
+      retro_time_t start = cpu_features_get_time_usec();
+      retro_time_t run_start;
 
-   core_run();
+      if (runloop_frame_delay.delay > 0)
+         retro_sleep(runloop_frame_delay.delay);
+
+      run_start = cpu_features_get_time_usec();
+      runloop_core_run();
+      runloop_frame_delay_update(settings, start, run_start,
+            cpu_features_get_time_usec());
+   }
+   else
+   {
+      /* Fast-forwarding leaves nothing to learn from */
+      runloop_frame_delay.last_start = 0;
+
+      if ((settings->video.frame_delay > 0) && !input_driver_is_nonblock)
+         retro_sleep(settings->video.frame_delay);
+
+      if (!input_driver_is_nonblock || !settings->fastforward_frameskip)
+      {
+         memset(&runloop_frameskip, 0, sizeof(runloop_frameskip));
+         runloop_core_run();
+      }
+      else if (runloop_frameskip_skip(settings))
+         runloop_frameskip_run();
+      else
+         runloop_core_run();
+   }
+
+   benchmark_frame();
 
 #ifdef HAVE_CHEEVOS
    if (runloop_check_cheevos())
@@ -1186,6 +1651,14 @@ int runloop_iterate(unsigned *sleep_ms)
 
 end:
 
+   if (settings->frame_limiter_precise)
+   {
+      performance_trace_begin("frame_limiter");
+      runloop_frame_limiter_wait();
+      performance_trace_end("frame_limiter");
+      return 0;
+   }
+
    current                        = cpu_features_get_time_usec();
    target                         = frame_limit_last_time +
       frame_limit_minimum_time;
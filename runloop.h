@@ -152,6 +152,13 @@ typedef struct global
       bool use_output_dir;
    } record;
 
+   /* Netplay desync recording and bisection. */
+   struct
+   {
+      char record_path[4096];
+      char bisect_paths[4096];
+   } netplay;
+
    /* Settings and/or global state that is specific to 
     * a console-style implementation. */
    struct
@@ -199,6 +206,8 @@ global_t *global_get_ptr(void);
  **/
 int runloop_iterate(unsigned *sleep_ms);
 
+bool runloop_get_frame_delay(unsigned *delay, unsigned *misses);
+
 void runloop_msg_queue_push(const char *msg, unsigned prio,
       unsigned duration, bool flush);
 
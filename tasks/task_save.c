@@ -22,18 +22,29 @@
 
 #ifdef _WIN32
 #include <direct.h>
+#include <io.h>
+#ifndef _XBOX
+#include <windows.h>
+#endif
 #else
 #include <unistd.h>
+#include <fcntl.h>
 #endif
 #include <errno.h>
 
 #include <compat/strl.h>
 #include <retro_assert.h>
 #include <lists/string_list.h>
+#include <string/stdstring.h>
 #include <streams/file_stream.h>
 #include <rthreads/rthreads.h>
 #include <file/file_path.h>
 #include <retro_miscellaneous.h>
+#include <retro_endianness.h>
+
+#ifdef HAVE_ZLIB
+#include <streams/trans_stream.h>
+#endif
 
 #ifdef HAVE_CONFIG_H
 #include "../core.h"
@@ -46,6 +57,7 @@
 #include "../core.h"
 #include "../file_path_special.h"
 #include "../configuration.h"
+#include "../content.h"
 #include "../msg_hash.h"
 #include "../retroarch.h"
 #include "../runloop.h"
@@ -54,6 +66,24 @@
 
 #define SAVE_STATE_CHUNK 4096
 
+#ifdef HAVE_ZLIB
+#define SAVE_STATE_ZLIB_MAGIC   "RASTATEZ"
+#define SAVE_STATE_ZLIB_VERSION 1
+#define SAVE_STATE_ZLIB_LEVEL   6
+
+/* Header of a compressed savestate. Integer fields are
+ * little endian. It is followed by a single zlib stream
+ * holding the serialized state. */
+struct save_state_zlib_header
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t content_crc;
+   uint32_t size;
+   char core_name[64];
+};
+#endif
+
 static struct string_list *task_save_files = NULL;
 
 struct ram_type
@@ -93,6 +123,16 @@ typedef struct
    bool mute;
    int state_slot;
    bool thumbnail_enable;
+#ifdef HAVE_ZLIB
+   /* Set when the file uses the compressed container. */
+   bool compress;
+   const struct trans_stream_backend *backend;
+   void *stream;
+   uint8_t *stream_buf;
+   ssize_t file_size;
+   ssize_t file_read;
+   struct save_state_zlib_header header;
+#endif
 } save_task_state_t;
 
 typedef save_task_state_t load_task_data_t;
@@ -115,6 +155,14 @@ struct autosave_st
    unsigned num;
 };
 
+/* SRAM is compared and copied in blocks of this size,
+ * so the main thread never waits on more than one block. */
+#define AUTOSAVE_BLOCK_SIZE 4096
+
+/* Block by block scans that may be retried because the core ran
+ * in between, before settling for what was copied. */
+#define AUTOSAVE_SCAN_TRIES 4
+
 struct autosave
 {
    volatile bool quit;
@@ -129,10 +177,183 @@ struct autosave
    const char *path;
    size_t bufsize;
    unsigned interval;
+
+   /* One flag per block changed since the last successful write. */
+   uint8_t *dirty;
+   size_t num_blocks;
+
+   /* Bumped under 'lock' each time the core may have written SRAM. */
+   unsigned generation;
 };
 
 static struct autosave_st autosave_state;
 
+/* Copies SRAM block @i into the autosave buffer if it changed.
+ * The caller holds the lock. */
+static void autosave_scan_block(autosave_t *save, size_t i)
+{
+   size_t offset      = i * AUTOSAVE_BLOCK_SIZE;
+   size_t len         = MIN(AUTOSAVE_BLOCK_SIZE, save->bufsize - offset);
+   uint8_t *dst       = (uint8_t*)save->buffer + offset;
+   const uint8_t *src = (const uint8_t*)save->retro_buffer + offset;
+
+   if (memcmp(dst, src, len) != 0)
+   {
+      memcpy(dst, src, len);
+      save->dirty[i] = 1;
+   }
+}
+
+/**
+ * autosave_scan:
+ * @save            : pointer to autosave object
+ *
+ * Copies changed SRAM blocks into the autosave buffer and
+ * marks them dirty. The lock is only held for one block at
+ * a time, so autosave_lock() on the main thread stays cheap.
+ *
+ * If the core ran during the scan, the buffer could hold blocks
+ * from different frames, so the scan is repeated; only blocks
+ * that changed again get copied. If the core keeps getting in
+ * the way, what was copied is written anyway, and whatever it
+ * changed meanwhile is picked up by the next interval's scan.
+ * The core is never held off for more than one block.
+ *
+ * Returns: number of dirty blocks.
+ **/
+static size_t autosave_scan(autosave_t *save)
+{
+   size_t i;
+   unsigned tries;
+   size_t dirty = 0;
+
+   for (tries = 0; tries < AUTOSAVE_SCAN_TRIES; tries++)
+   {
+      unsigned generation;
+      bool consistent;
+
+      slock_lock(save->lock);
+      generation = save->generation;
+      slock_unlock(save->lock);
+
+      for (i = 0; i < save->num_blocks; i++)
+      {
+         slock_lock(save->lock);
+         autosave_scan_block(save, i);
+         slock_unlock(save->lock);
+      }
+
+      slock_lock(save->lock);
+      consistent = save->generation == generation;
+      slock_unlock(save->lock);
+
+      if (consistent)
+         break;
+   }
+
+   for (i = 0; i < save->num_blocks; i++)
+      if (save->dirty[i])
+         dirty++;
+
+   return dirty;
+}
+
+/**
+ * autosave_sync:
+ * @file            : file to flush
+ *
+ * Flushes @file and asks the OS to commit it to storage.
+ *
+ * Returns: true if successful, otherwise false.
+ **/
+static bool autosave_sync(FILE *file)
+{
+   if (fflush(file) != 0)
+      return false;
+#if defined(_WIN32) && !defined(_XBOX)
+   return _commit(_fileno(file)) == 0;
+#elif defined(__unix__) || defined(__APPLE__)
+   return fsync(fileno(file)) == 0;
+#else
+   return true;
+#endif
+}
+
+/**
+ * autosave_write:
+ * @save            : pointer to autosave object
+ *
+ * Writes the autosave buffer to a temporary file next to
+ * the save file and renames it over the save file, so a
+ * crash or power loss leaves either the old or the new
+ * save on disk.
+ *
+ * Returns: true if successful, otherwise false.
+ **/
+static bool autosave_write(autosave_t *save)
+{
+   char tmp_path[PATH_MAX_LENGTH];
+   bool failed = false;
+   FILE *file  = NULL;
+
+   snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", save->path);
+
+   file = fopen(tmp_path, "wb");
+   if (!file)
+      return false;
+
+   failed |= fwrite(save->buffer, 1, save->bufsize, file)
+      != save->bufsize;
+   failed |= !autosave_sync(file);
+   failed |= fclose(file) != 0;
+
+   if (!failed)
+   {
+#if defined(_WIN32) && !defined(_XBOX)
+      /* rename() does not replace existing files here, and removing
+       * the old save first would leave none if we crashed meanwhile. */
+      if (!MoveFileExA(tmp_path, save->path,
+               MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+      {
+         errno  = EIO;
+         failed = true;
+      }
+#else
+#ifdef _XBOX
+      /* rename() does not replace existing files here. */
+      remove(save->path);
+#endif
+      failed = rename(tmp_path, save->path) != 0;
+#endif
+   }
+
+   if (failed)
+   {
+      int err = errno;
+      remove(tmp_path);
+      errno   = err;
+      return false;
+   }
+
+#if defined(__unix__) || defined(__APPLE__)
+   {
+      /* Make the rename itself durable. */
+      char dir[PATH_MAX_LENGTH];
+      int fd;
+
+      fill_pathname_basedir(dir, save->path, sizeof(dir));
+      fd = open(string_is_empty(dir) ? "." : dir, O_RDONLY);
+      if (fd >= 0)
+      {
+         fsync(fd);
+         close(fd);
+      }
+   }
+#endif
+
+   return true;
+}
+
 /**
  * autosave_thread:
  * @data            : pointer to autosave object
@@ -146,41 +367,27 @@ static void autosave_thread(void *data)
 
    while (!save->quit)
    {
-      bool differ;
-
-      slock_lock(save->lock);
-      differ = memcmp(save->buffer, save->retro_buffer,
-            save->bufsize) != 0;
-      if (differ)
-         memcpy(save->buffer, save->retro_buffer, save->bufsize);
-      slock_unlock(save->lock);
+      size_t dirty = autosave_scan(save);
 
-      if (differ)
+      if (dirty)
       {
-         /* Should probably deal with this more elegantly. */
-         FILE *file = fopen(save->path, "wb");
+         /* Avoid spamming down stderr ... */
+         if (first_log)
+         {
+            RARCH_LOG("Autosaving SRAM to \"%s\", will continue to check every %u seconds ...\n",
+                  save->path, save->interval);
+            first_log = false;
+         }
 
-         if (file)
+         if (autosave_write(save))
          {
-            bool failed = false;
-
-            /* Avoid spamming down stderr ... */
-            if (first_log)
-            {
-               RARCH_LOG("Autosaving SRAM to \"%s\", will continue to check every %u seconds ...\n",
-                     save->path, save->interval);
-               first_log = false;
-            }
-            else
-               RARCH_LOG("SRAM changed ... autosaving ...\n");
-
-            failed |= fwrite(save->buffer, 1, save->bufsize, file)
-               != save->bufsize;
-            failed |= fflush(file) != 0;
-            failed |= fclose(file) != 0;
-            if (failed)
-               RARCH_WARN("Failed to autosave SRAM. Disk might be full.\n");
+            RARCH_LOG("Autosaved SRAM, %u of %u blocks changed.\n",
+                  (unsigned)dirty, (unsigned)save->num_blocks);
+            memset(save->dirty, 0, save->num_blocks);
          }
+         else
+            RARCH_WARN("Failed to autosave SRAM to \"%s\": %s. Will retry.\n",
+                  save->path, strerror(errno));
       }
 
       slock_lock(save->cond_lock);
@@ -218,8 +425,11 @@ static autosave_t *autosave_new(const char *path,
    handle->path         = path;
    handle->buffer       = malloc(size);
    handle->retro_buffer = data;
+   handle->num_blocks   = (size + AUTOSAVE_BLOCK_SIZE - 1)
+      / AUTOSAVE_BLOCK_SIZE;
+   handle->dirty        = (uint8_t*)calloc(handle->num_blocks, 1);
 
-   if (!handle->buffer)
+   if (!handle->buffer || !handle->dirty)
       goto error;
 
    memcpy(handle->buffer, handle->retro_buffer, handle->bufsize);
@@ -234,7 +444,11 @@ static autosave_t *autosave_new(const char *path,
 
 error:
    if (handle)
+   {
+      free(handle->buffer);
+      free(handle->dirty);
       free(handle);
+   }
    return NULL;
 }
 
@@ -259,6 +473,9 @@ static void autosave_free(autosave_t *handle)
    if (handle->buffer)
       free(handle->buffer);
    handle->buffer = NULL;
+
+   free(handle->dirty);
+   handle->dirty  = NULL;
 }
 
 
@@ -346,7 +563,7 @@ void autosave_lock(void)
 /**
  * autosave_unlock:
  *
- * Unlocks autosave.
+ * Unlocks autosave. SRAM may have changed while it was locked.
  **/
 void autosave_unlock(void)
 {
@@ -356,8 +573,10 @@ void autosave_unlock(void)
    for (i = 0; i < autosave_state.num; i++)
    {
       autosave_t *handle = autosave_state.list[i];
-      if (handle)
-         slock_unlock(handle->lock);
+      if (!handle)
+         continue;
+      handle->generation++;
+      slock_unlock(handle->lock);
    }
 #endif
 }
@@ -503,6 +722,226 @@ static void undo_save_state_cb(void *task_data,
    }
 }
 
+#ifdef HAVE_ZLIB
+/**
+ * task_save_zlib_header_init:
+ * @header : the header to fill in
+ * @size : the uncompressed size of the save state
+ *
+ * Describe the running core and content in a compressed
+ * save state header. Must be called from the main thread.
+ **/
+static void task_save_zlib_header_init(
+      struct save_state_zlib_header *header, size_t size)
+{
+   uint32_t *content_crc        = NULL;
+   rarch_system_info_t *system  = NULL;
+
+   memset(header, 0, sizeof(*header));
+   memcpy(header->magic, SAVE_STATE_ZLIB_MAGIC, sizeof(header->magic));
+   header->version = swap_if_big32(SAVE_STATE_ZLIB_VERSION);
+   header->size    = swap_if_big32((uint32_t)size);
+
+   if (content_get_crc(&content_crc) && content_crc)
+      header->content_crc = swap_if_big32(*content_crc);
+
+   runloop_ctl(RUNLOOP_CTL_SYSTEM_INFO_GET, &system);
+   if (system && system->info.library_name)
+      strlcpy(header->core_name, system->info.library_name,
+            sizeof(header->core_name));
+}
+
+/**
+ * task_save_zlib_free:
+ * @state : the state associated with this task
+ *
+ * Release the (de)compression stream of a task.
+ **/
+static void task_save_zlib_free(save_task_state_t *state)
+{
+   if (state->stream)
+      state->backend->stream_free(state->stream);
+   if (state->stream_buf)
+      free(state->stream_buf);
+
+   state->stream     = NULL;
+   state->stream_buf = NULL;
+}
+
+/**
+ * task_save_zlib_write:
+ * @state : the state associated with this task
+ * @in : the uncompressed data to write
+ * @in_size : size of @in
+ * @flush : true for the last chunk of the save state
+ *
+ * Deflate a chunk of the save state into the file,
+ * writing the header first if the stream is not open yet.
+ *
+ * Returns: true if successful, false otherwise.
+ **/
+static bool task_save_zlib_write(save_task_state_t *state,
+      const uint8_t *in, uint32_t in_size, bool flush)
+{
+   uint32_t in_left = in_size;
+
+   if (!state->stream)
+   {
+      state->backend    = trans_stream_get_zlib_deflate_backend();
+      state->stream     = state->backend->stream_new();
+      state->stream_buf = (uint8_t*)malloc(SAVE_STATE_CHUNK);
+
+      if (!state->stream || !state->stream_buf)
+         return false;
+
+      state->backend->define(state->stream, "level", SAVE_STATE_ZLIB_LEVEL);
+
+      if (filestream_write(state->file, &state->header,
+               sizeof(state->header)) != sizeof(state->header))
+         return false;
+   }
+
+   state->backend->set_in(state->stream, in, in_size);
+
+   for (;;)
+   {
+      uint32_t rd                 = 0;
+      uint32_t wn                 = 0;
+      enum trans_stream_error err = TRANS_STREAM_ERROR_NONE;
+
+      state->backend->set_out(state->stream,
+            state->stream_buf, SAVE_STATE_CHUNK);
+
+      if (!state->backend->trans(state->stream, flush, &rd, &wn, &err)
+            && err != TRANS_STREAM_ERROR_BUFFER_FULL)
+      {
+         /* zlib reports a buffer error when a previous call
+          * exactly filled the output and nothing was left. */
+         return !flush && in_left == 0;
+      }
+
+      if (wn && filestream_write(state->file, state->stream_buf, wn) != wn)
+         return false;
+
+      in_left -= rd;
+
+      if (flush)
+      {
+         if (err == TRANS_STREAM_ERROR_NONE)
+            return true;
+      }
+      else if (in_left == 0 && wn < SAVE_STATE_CHUNK)
+         return true;
+   }
+}
+
+/**
+ * task_load_zlib_begin:
+ * @state : the state associated with this task
+ *
+ * Check whether the opened file is a compressed save state.
+ * If so, set up the inflate stream and replace @state->size
+ * with the uncompressed size. Otherwise rewind the file so
+ * it is read as a raw save state.
+ *
+ * Returns: false if the file is a compressed save state
+ * that cannot be read, otherwise true.
+ **/
+static bool task_load_zlib_begin(save_task_state_t *state)
+{
+   struct save_state_zlib_header *header = &state->header;
+
+   if (state->size < (ssize_t)sizeof(*header))
+      return true;
+
+   if (filestream_read(state->file, header, sizeof(*header))
+         != sizeof(*header)
+         || memcmp(header->magic, SAVE_STATE_ZLIB_MAGIC,
+            sizeof(header->magic)))
+   {
+      filestream_rewind(state->file);
+      return true;
+   }
+
+   if (swap_if_big32(header->version) > SAVE_STATE_ZLIB_VERSION)
+   {
+      RARCH_ERR("Compressed save state \"%s\" has unsupported version %u.\n",
+            state->path, (unsigned)swap_if_big32(header->version));
+      return false;
+   }
+
+   header->core_name[sizeof(header->core_name) - 1] = '\0';
+
+   state->compress   = true;
+   state->file_size  = state->size;
+   state->file_read  = sizeof(*header);
+   state->size       = swap_if_big32(header->size);
+   state->backend    = trans_stream_get_zlib_inflate_backend();
+   state->stream     = state->backend->stream_new();
+   state->stream_buf = (uint8_t*)malloc(SAVE_STATE_CHUNK);
+
+   return state->stream && state->stream_buf;
+}
+
+/**
+ * task_load_zlib_read:
+ * @state : the state associated with this task
+ *
+ * Read a chunk of a compressed save state file and inflate
+ * it. Once the output is complete, keeps reading until the
+ * end of the zlib stream so its checksum gets verified.
+ *
+ * Returns: true if successful, false otherwise.
+ **/
+static bool task_load_zlib_read(save_task_state_t *state)
+{
+   do
+   {
+      const uint8_t *in = state->stream_buf;
+      uint32_t in_left;
+      ssize_t chunk     = MIN(state->file_size - state->file_read,
+            SAVE_STATE_CHUNK);
+
+      /* Ran out of file before the end of the stream. */
+      if (chunk <= 0)
+         return false;
+
+      if (filestream_read(state->file, state->stream_buf, chunk) != chunk)
+         return false;
+
+      state->file_read += chunk;
+      in_left           = (uint32_t)chunk;
+
+      while (in_left > 0)
+      {
+         uint32_t rd                 = 0;
+         uint32_t wn                 = 0;
+         enum trans_stream_error err = TRANS_STREAM_ERROR_NONE;
+
+         state->backend->set_in(state->stream, in, in_left);
+         state->backend->set_out(state->stream,
+               (uint8_t*)state->data + state->bytes_read,
+               (uint32_t)(state->size - state->bytes_read));
+
+         if (!state->backend->trans(state->stream, false, &rd, &wn, &err))
+            return false;
+
+         state->bytes_read += wn;
+         in                += rd;
+         in_left           -= rd;
+
+         if (err == TRANS_STREAM_ERROR_NONE)
+            return state->bytes_read == state->size;
+
+         if (!rd && !wn)
+            return false;
+      }
+   } while (state->bytes_read == state->size);
+
+   return true;
+}
+#endif
+
 /**
  * task_save_handler_finished:
  * @task : the task to finish
@@ -519,6 +958,10 @@ static void task_save_handler_finished(retro_task_t *task,
 
    filestream_close(state->file);
 
+#ifdef HAVE_ZLIB
+   task_save_zlib_free(state);
+#endif
+
    if (!task_get_error(task) && task_get_cancelled(task))
       task_set_error(task, strdup("Task canceled"));
 
@@ -559,8 +1002,15 @@ static void task_save_handler(retro_task_t *task)
    }
 
    remaining       = MIN(state->size - state->written, SAVE_STATE_CHUNK);
-   written         = filestream_write(state->file,
-         (uint8_t*)state->data + state->written, remaining);
+#ifdef HAVE_ZLIB
+   if (state->compress)
+      written      = task_save_zlib_write(state,
+            (uint8_t*)state->data + state->written, (uint32_t)remaining,
+            state->written + remaining == state->size) ? remaining : -1;
+   else
+#endif
+      written      = filestream_write(state->file,
+            (uint8_t*)state->data + state->written, remaining);
 
    state->written += written;
 
@@ -641,6 +1091,11 @@ static bool task_push_undo_save_state(const char *path, void *data, size_t size)
    state->size       = size;
    state->undo_save  = true;
    state->state_slot = settings->state_slot;
+#ifdef HAVE_ZLIB
+   state->compress   = settings->savestate_file_compression;
+   if (state->compress)
+      task_save_zlib_header_init(&state->header, size);
+#endif
 
    task->type        = TASK_TYPE_BLOCKING;
    task->state       = state;
@@ -693,6 +1148,10 @@ static void task_load_handler_finished(retro_task_t *task,
    if (state->file)
       filestream_close(state->file);
 
+#ifdef HAVE_ZLIB
+   task_save_zlib_free(state);
+#endif
+
    if (!task_get_error(task) && task_get_cancelled(task))
       task_set_error(task, strdup("Task canceled"));
 
@@ -712,7 +1171,7 @@ static void task_load_handler_finished(retro_task_t *task,
  **/
 static void task_load_handler(retro_task_t *task)
 {
-   ssize_t remaining, bytes_read;
+   bool failed;
    save_task_state_t *state = (save_task_state_t*)task->state;
 
    if (!state->file)
@@ -732,21 +1191,42 @@ static void task_load_handler(retro_task_t *task)
 
       filestream_rewind(state->file);
 
+#ifdef HAVE_ZLIB
+      if (!task_load_zlib_begin(state))
+         goto error;
+#endif
+
       state->data = malloc(state->size + 1);
 
       if (!state->data)
          goto error;
    }
 
-   remaining          = MIN(state->size - state->bytes_read, SAVE_STATE_CHUNK);
-   bytes_read         = filestream_read(state->file,
-         (uint8_t*)state->data + state->bytes_read, remaining);
-   state->bytes_read += bytes_read;
+#ifdef HAVE_ZLIB
+   if (state->compress)
+   {
+      failed = !task_load_zlib_read(state);
 
-   if (state->size > 0)
-      task_set_progress(task, (state->bytes_read / (float)state->size) * 100);
+      if (state->file_size > 0)
+         task_set_progress(task,
+               (state->file_read / (float)state->file_size) * 100);
+   }
+   else
+#endif
+   {
+      ssize_t remaining  = MIN(state->size - state->bytes_read,
+            SAVE_STATE_CHUNK);
+      ssize_t bytes_read = filestream_read(state->file,
+            (uint8_t*)state->data + state->bytes_read, remaining);
+      state->bytes_read += bytes_read;
+      failed             = bytes_read != remaining;
+
+      if (state->size > 0)
+         task_set_progress(task,
+               (state->bytes_read / (float)state->size) * 100);
+   }
 
-   if (task_get_cancelled(task) || bytes_read != remaining)
+   if (task_get_cancelled(task) || failed)
    {
       if (state->autoload)
       {
@@ -863,6 +1343,22 @@ static void content_load_state_cb(void *task_data,
       return;
    }
 
+#ifdef HAVE_ZLIB
+   if (load_data->compress)
+   {
+      struct save_state_zlib_header expected;
+
+      task_save_zlib_header_init(&expected, size);
+
+      if (!string_is_equal(expected.core_name, load_data->header.core_name))
+         RARCH_WARN("Save state was made with core \"%s\", loading it anyway.\n",
+               load_data->header.core_name);
+      if (expected.content_crc != load_data->header.content_crc)
+         RARCH_WARN("Save state was made for different content (CRC32 %08x), loading it anyway.\n",
+               (unsigned)swap_if_big32(load_data->header.content_crc));
+   }
+#endif
+
    if (settings->block_sram_overwrite && task_save_files
          && task_save_files->size)
    {
@@ -998,6 +1494,11 @@ static void task_push_save_state(const char *path, void *data, size_t size, bool
    state->autosave         = autosave;
    state->mute             = autosave; /* don't show OSD messages if we are auto-saving */
    state->thumbnail_enable = settings->savestate_thumbnail_enable;
+#ifdef HAVE_ZLIB
+   state->compress         = settings->savestate_file_compression;
+   if (state->compress)
+      task_save_zlib_header_init(&state->header, size);
+#endif
 
    task->type              = TASK_TYPE_BLOCKING;
    task->state             = state;
@@ -0,0 +1,195 @@
+#!/bin/sh
+# Load test for a netplay server: runs a headless host and many headless
+# spectators on this machine over loopback, then prints what the host's
+# per-frame network work cost (the netplay_net_input and netplay_send_flush
+# performance counters, in CPU ticks) and whether every spectator kept up.
+#
+# The core must be deterministic and either support running without content
+# or be given some. Exits nonzero if the host or any spectator fails to
+# finish the session, or any peer rejects a savestate.
+#
+# With -R, the spectators watch through a relay (see netplay_relay in
+# retroarch.cfg) instead of connecting to the host themselves. The relay
+# listens two ports above the host, clear of the host's UDP port.
+#
+# -d, -j and -l simulate latency on every peer (see netplay_sim_* in
+# config.def.h). A savestate bigger than 256 KiB goes out in chunks, and one
+# that finishes after its frame has passed is dropped; to test that path with
+# a core that has such states, build with -DDEBUG_NETPLAY_LATE_STATES, which
+# drops every other one, and check that the spectators still finish in sync:
+#   make clean && make CPPFLAGS=-DDEBUG_NETPLAY_LATE_STATES
+#   tools/netplay-load.sh -s 4 -d 100 -j 20 CORE CONTENT
+
+usage()
+{
+   cat <<EOF
+Usage: $0 [options] CORE [CONTENT]
+  -r RETROARCH   RetroArch binary (default: ./retroarch)
+  -s SPECTATORS  number of spectators (default: 32)
+  -f FRAMES      frames the host runs (default: 1800)
+  -p PORT        TCP port (default: 55435)
+  -d MS          one-way delay every peer simulates (default: 0)
+  -j MS          jitter (default: 0)
+  -l PERCENT     loss (default: 0)
+  -R             serve the spectators through a relay
+  -t             do socket I/O on a thread
+  -k             keep the logs and configs
+EOF
+   exit 1
+}
+
+retroarch=./retroarch
+spectators=32
+frames=1800
+port=55435
+delay=0
+jitter=0
+loss=0
+relay=false
+iothread=false
+keep=false
+
+while getopts "r:s:f:p:d:j:l:Rtk" opt; do
+   case "$opt" in
+      r) retroarch="$OPTARG" ;;
+      s) spectators="$OPTARG" ;;
+      f) frames="$OPTARG" ;;
+      p) port="$OPTARG" ;;
+      d) delay="$OPTARG" ;;
+      j) jitter="$OPTARG" ;;
+      l) loss="$OPTARG" ;;
+      R) relay=true ;;
+      t) iothread=true ;;
+      k) keep=true ;;
+      *) usage ;;
+   esac
+done
+shift $((OPTIND - 1))
+
+[ $# -ge 1 ] || usage
+core="$1"
+content="$2"
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/netplay-load.XXXXXX") || exit 1
+
+# Peer 0 is the host, and peer "relay" the relay if there is one
+relay_port=$((port + 2))
+if $relay; then
+   peer_list="0 relay"
+else
+   peer_list=0
+fi
+peer=1
+while [ $peer -le "$spectators" ]; do
+   peer_list="$peer_list $peer"
+   peer=$((peer + 1))
+done
+
+pids=
+for peer in $peer_list; do
+   mkdir -p "$dir/$peer"
+   peer_port=$port
+   peer_relay=false
+   case $peer in
+      0)
+         role="--host"
+         spectate=false
+         peer_frames=$frames
+         ;;
+      relay)
+         role="--connect=127.0.0.1"
+         spectate=true
+         peer_relay=true
+         peer_frames=$((frames + 300))
+         ;;
+      *)
+         role="--connect=127.0.0.1"
+         spectate=true
+         $relay && peer_port=$relay_port
+         # Spectators run a little longer, so that the host's end is what
+         # ends them
+         peer_frames=$((frames + 600))
+         ;;
+   esac
+
+   cat > "$dir/$peer/retroarch.cfg" <<EOF
+video_driver = "null"
+audio_driver = "null"
+input_driver = "null"
+fastforward_ratio = "1.000000"
+config_save_on_exit = "false"
+perfcnt_enable = "true"
+savefile_directory = "$dir/$peer"
+savestate_directory = "$dir/$peer"
+netplay_nickname = "peer$peer"
+netplay_ip_port = "$peer_port"
+netplay_spectator_mode_enable = "$spectate"
+netplay_relay = "$peer_relay"
+netplay_relay_port = "$relay_port"
+netplay_io_thread = "$iothread"
+netplay_sim_delay = "$delay"
+netplay_sim_jitter = "$jitter"
+netplay_sim_loss = "$loss"
+EOF
+
+   "$retroarch" -v -c "$dir/$peer/retroarch.cfg" -L "$core" $role \
+      --max-frames=$peer_frames $content \
+      > "$dir/$peer/log" 2>&1 &
+   pids="$pids $!"
+
+   # Give the host and relay time to listen
+   case $peer in
+      0|relay) sleep 1 ;;
+   esac
+done
+
+status=0
+for pid in $pids; do
+   wait "$pid" || status=1
+done
+
+for peer in $peer_list; do
+   if grep -q "CMD_LOAD_SAVESTATE.*received an unexpected\|corrupt" \
+         "$dir/$peer/log"; then
+      echo "Peer $peer rejected a savestate"
+      status=1
+   fi
+done
+
+echo "$spectators spectators, $frames frames, ${delay}ms delay, ${jitter}ms jitter, ${loss}% loss, relay $relay, I/O thread $iothread"
+servers=0
+$relay && servers="0 relay"
+for peer in $servers; do
+   if [ $peer = 0 ]; then
+      echo "Host:"
+   else
+      echo "Relay:"
+   fi
+   if grep -q "Netplay rollback depths" "$dir/$peer/log"; then
+      grep -E "Netplay (stalled|sent)|\[PERF\]: Avg \(netplay_" \
+         "$dir/$peer/log" | sed 's/^.*:: /   /'
+   else
+      echo "   did not finish a netplay session"
+      status=1
+   fi
+done
+
+failed=0
+peer=1
+while [ $peer -le "$spectators" ]; do
+   if ! grep -q "Netplay rollback depths" "$dir/$peer/log" ||
+      grep -q "detected [1-9][0-9]* desyncs" "$dir/$peer/log"; then
+      failed=$((failed + 1))
+   fi
+   peer=$((peer + 1))
+done
+echo "Spectators: $((spectators - failed)) of $spectators finished in sync"
+[ $failed -eq 0 ] || status=1
+
+if $keep || [ $status -ne 0 ]; then
+   echo "Logs are in $dir"
+else
+   rm -rf "$dir"
+fi
+
+exit $status
@@ -0,0 +1,125 @@
+#!/bin/sh
+# Soak test for netplay: runs a host and one or more clients on this machine,
+# headless, with every peer simulating the given network conditions on what it
+# sends (see netplay_sim_* in config.def.h), then prints each peer's netplay
+# statistics: rollback depths, stalls, desyncs, states loaded and bandwidth.
+#
+# The core must be deterministic and either support running without content
+# or be given some. Exits nonzero if any peer fails to finish the session.
+
+usage()
+{
+   cat <<EOF
+Usage: $0 [options] CORE [CONTENT]
+  -r RETROARCH   RetroArch binary (default: ./retroarch)
+  -n PEERS       number of peers, including the host (default: 2)
+  -f FRAMES      frames each peer runs (default: 3600)
+  -d MS          one-way delay (default: 50)
+  -j MS          jitter (default: 10)
+  -l PERCENT     loss (default: 1)
+  -p PORT        TCP port (default: 55435)
+  -u             exchange input over UDP too
+  -t             do socket I/O on a thread
+  -k             keep the logs and configs
+EOF
+   exit 1
+}
+
+retroarch=./retroarch
+peers=2
+frames=3600
+delay=50
+jitter=10
+loss=1
+port=55435
+udp=false
+iothread=false
+keep=false
+
+while getopts "r:n:f:d:j:l:p:utk" opt; do
+   case "$opt" in
+      r) retroarch="$OPTARG" ;;
+      n) peers="$OPTARG" ;;
+      f) frames="$OPTARG" ;;
+      d) delay="$OPTARG" ;;
+      j) jitter="$OPTARG" ;;
+      l) loss="$OPTARG" ;;
+      p) port="$OPTARG" ;;
+      u) udp=true ;;
+      t) iothread=true ;;
+      k) keep=true ;;
+      *) usage ;;
+   esac
+done
+shift $((OPTIND - 1))
+
+[ $# -ge 1 ] || usage
+core="$1"
+content="$2"
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/netplay-soak.XXXXXX") || exit 1
+
+peer=0
+pids=
+while [ $peer -lt "$peers" ]; do
+   mkdir -p "$dir/$peer"
+   cat > "$dir/$peer/retroarch.cfg" <<EOF
+video_driver = "null"
+audio_driver = "null"
+input_driver = "null"
+fastforward_ratio = "1.000000"
+config_save_on_exit = "false"
+savefile_directory = "$dir/$peer"
+savestate_directory = "$dir/$peer"
+netplay_nickname = "peer$peer"
+netplay_ip_port = "$port"
+netplay_udp_input = "$udp"
+netplay_io_thread = "$iothread"
+netplay_sim_delay = "$delay"
+netplay_sim_jitter = "$jitter"
+netplay_sim_loss = "$loss"
+EOF
+
+   if [ $peer -eq 0 ]; then
+      role="--host"
+   else
+      role="--connect=127.0.0.1"
+   fi
+
+   # Clients run a little longer, so that the host's end is what ends them
+   "$retroarch" -v -c "$dir/$peer/retroarch.cfg" -L "$core" $role \
+      --max-frames=$((frames + peer * 60)) $content \
+      > "$dir/$peer/log" 2>&1 &
+   pids="$pids $!"
+
+   # Give the host time to listen
+   [ $peer -eq 0 ] && sleep 1
+   peer=$((peer + 1))
+done
+
+status=0
+for pid in $pids; do
+   wait "$pid" || status=1
+done
+
+echo "$peers peers, $frames frames, ${delay}ms delay, ${jitter}ms jitter, ${loss}% loss, UDP $udp, I/O thread $iothread"
+peer=0
+while [ $peer -lt "$peers" ]; do
+   echo "Peer $peer:"
+   if grep -q "Netplay rollback depths" "$dir/$peer/log"; then
+      grep -E "Netplay (captured|rollback depths|stalled|sent|predicted)" \
+         "$dir/$peer/log" | sed 's/^.*:: /   /'
+   else
+      echo "   did not finish a netplay session"
+      status=1
+   fi
+   peer=$((peer + 1))
+done
+
+if $keep || [ $status -ne 0 ]; then
+   echo "Logs are in $dir"
+else
+   rm -rf "$dir"
+fi
+
+exit $status